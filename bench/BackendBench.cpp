@@ -0,0 +1,57 @@
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <thread>
+
+#include "BenchUtils.h"
+#include "MsgCounter.h"
+#include "WorkerPool.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+const size_t kClientThreads = 2;
+const size_t kFramesPerBlock = 256;
+const uint16_t kDeviceCount = 1024;
+
+/**
+ * One worker with the backend state.range(0) (see Backend), loaded over
+ * loopback by state.range(1) connections in total.
+ */
+void BM_BackendLoopback(benchmark::State &state) {
+  auto backend = static_cast<Backend>(state.range(0));
+  if (backend == Backend::IoUring && !UringServer::isSupported()) {
+    state.SkipWithError("io_uring is not supported");
+    return;
+  }
+  MsgCounter counter;
+  WorkerPoolOptions options;
+  options.backend = backend;
+  WorkerPool pool(counter, options);
+  pool.listen();
+  pool.start();
+
+  auto block = Bench::makeFrames(kFramesPerBlock, kDeviceCount, 1);
+  Bench::TcpBlaster clients(pool.port(), kClientThreads,
+                            state.range(1) / kClientThreads, block);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  const uint64_t countBefore = counter.getTotalCount();
+  for (auto _ : state)
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  const uint64_t received = counter.getTotalCount() - countBefore;
+
+  state.counters["msgs_per_second"] =
+      benchmark::Counter(received, benchmark::Counter::kIsRate);
+}
+
+}  // namespace
+
+BENCHMARK(BM_BackendLoopback)
+    ->ArgNames({"backend", "connections"})
+    ->ArgsProduct({{static_cast<int>(Backend::Asio),
+                    static_cast<int>(Backend::IoUring)},
+                   {16, 256, 1024}})
+    ->Iterations(20)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,259 @@
+#ifndef BenchUtils_H
+#define BenchUtils_H
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RfcTransport.h"
+
+namespace DeviceListener {
+namespace Bench {
+
+/**
+ * \brief connects a blocking TCP socket to the listener on loopback
+ * \return socket descriptor, throws std::runtime_error on failure
+ */
+inline int connectToLoopback(uint16_t port) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    if (fd >= 0) close(fd);
+    throw std::runtime_error("failed to connect to the listener");
+  }
+  return fd;
+}
+
+/**
+ * \brief connects a blocking Unix domain stream socket to the listener
+ * \return socket descriptor, throws std::runtime_error on failure
+ */
+inline int connectToUnix(const std::string &path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    if (fd >= 0) close(fd);
+    throw std::runtime_error("failed to connect to the listener");
+  }
+  return fd;
+}
+
+/**
+ * \brief sends the whole buffer over a blocking socket
+ * \return false if the connection is broken
+ */
+inline bool sendAll(int fd, const uint8_t *data, size_t length) {
+  size_t sent = 0;
+  while (sent < length) {
+    ssize_t res = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+    if (res <= 0) return false;
+    sent += res;
+  }
+  return true;
+}
+
+/**
+ * \brief builds a block of back-to-back valid frames like the ones dsimulator
+ * sends: payload header plus 0..64 bytes of data
+ * \param count number of frames in the block
+ * \param deviceCount device IDs are spread over [0, deviceCount)
+ * \param seed seed of the size/device mix, the same seed gives the same block
+ */
+inline std::vector<uint8_t> makeFrames(size_t count, uint32_t deviceCount,
+                                       uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<uint8_t> block;
+  for (size_t i = 0; i < count; i++) {
+    const size_t dataLength = rng() % 65;
+    RfcMessage::Rfc1006Header header = {
+        RfcMessage::kProtocolVersion, 0,
+        static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) + dataLength)};
+    RfcMessage::PayloadHeader payload = {};
+    payload.deviceId = static_cast<uint16_t>(rng() % deviceCount);
+    payload.dataLength = static_cast<uint16_t>(dataLength);
+
+    const size_t offset = block.size();
+    block.resize(offset + sizeof(header) + header.length);
+    std::memcpy(&block[offset], &header, sizeof(header));
+    std::memcpy(&block[offset + sizeof(header)], &payload, sizeof(payload));
+  }
+  return block;
+}
+
+enum class DeviceMix { Single, Uniform16, UniformAll, Zipf };
+
+/**
+ * \brief generates device IDs of incoming messages with a given distribution
+ * \param mix Single - all from one device, Uniform16/UniformAll - uniformly
+ * spread over 16/65536 devices, Zipf - few devices send most of the traffic
+ * (s = 1.1 over 65536 devices)
+ * \param count number of IDs to generate
+ * \param seed the same seed gives the same IDs
+ */
+inline std::vector<uint16_t> makeDeviceIds(DeviceMix mix, size_t count,
+                                           uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<uint16_t> ids(count);
+  switch (mix) {
+    case DeviceMix::Single:
+      std::fill(ids.begin(), ids.end(), 42);
+      break;
+    case DeviceMix::Uniform16:
+      for (auto &id : ids) id = rng() % 16;
+      break;
+    case DeviceMix::UniformAll:
+      for (auto &id : ids) id = static_cast<uint16_t>(rng());
+      break;
+    case DeviceMix::Zipf: {
+      std::vector<double> weights(65536);
+      for (size_t rank = 0; rank < weights.size(); rank++)
+        weights[rank] = 1.0 / std::pow(rank + 1, 1.1);
+      std::discrete_distribution<uint32_t> zipf(weights.begin(),
+                                                weights.end());
+      // scatter ranks over the ID space, busy devices aren't neighbours
+      for (auto &id : ids) id = static_cast<uint16_t>(zipf(rng) * 40503u);
+      break;
+    }
+  }
+  return ids;
+}
+
+/**
+ * Client side of the loopback benchmarks: a few threads, each of them writes
+ * the same block of frames to its sockets round-robin as fast as the listener
+ * accepts them. The sockets are TCP ones, or Unix domain ones if the
+ * listener is given by a path.
+ */
+class TcpBlaster {
+ public:
+  TcpBlaster(uint16_t port, size_t threads, size_t connectionsPerThread,
+             const std::vector<uint8_t> &block)
+      : block_(block), stop_(false) {
+    start(threads, connectionsPerThread,
+          [port]() { return connectToLoopback(port); });
+  }
+
+  TcpBlaster(const std::string &path, size_t threads,
+             size_t connectionsPerThread, const std::vector<uint8_t> &block)
+      : block_(block), stop_(false) {
+    start(threads, connectionsPerThread,
+          [&path]() { return connectToUnix(path); });
+  }
+
+  ~TcpBlaster() {
+    stop_ = true;
+    // wakes up the threads blocked in send()
+    for (int fd : fds_) shutdown(fd, SHUT_RDWR);
+    for (auto &thread : threads_) thread.join();
+    for (int fd : fds_) close(fd);
+  }
+
+  TcpBlaster(const TcpBlaster &) = delete;
+  TcpBlaster &operator=(TcpBlaster const &) = delete;
+
+ private:
+  const std::vector<uint8_t> &block_;
+  std::atomic<bool> stop_;
+  std::vector<int> fds_;
+  std::vector<std::thread> threads_;
+
+  template <typename Connect>
+  void start(size_t threads, size_t connectionsPerThread, Connect &&connect) {
+    for (size_t t = 0; t < threads; t++) {
+      std::vector<int> fds;
+      for (size_t c = 0; c < connectionsPerThread; c++) {
+        int fd = connect();
+        fds.push_back(fd);
+        fds_.push_back(fd);
+      }
+      threads_.emplace_back(&TcpBlaster::run, this, fds);
+    }
+  }
+
+  void run(std::vector<int> fds) {
+    while (!stop_) {
+      for (int fd : fds)
+        if (!sendAll(fd, block_.data(), block_.size())) return;
+    }
+  }
+};
+
+/**
+ * Datagram counterpart of TcpBlaster: every thread sends the same block of
+ * frames as one datagram over and over, in batches of sendmmsg.
+ */
+class UdpBlaster {
+ public:
+  static const unsigned kBatchSize = 32;
+
+  UdpBlaster(uint16_t port, size_t threads, const std::vector<uint8_t> &block)
+      : block_(block), stop_(false), sent_(0) {
+    addr_.sin_family = AF_INET;
+    addr_.sin_port = htons(port);
+    addr_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (size_t t = 0; t < threads; t++)
+      threads_.emplace_back(&UdpBlaster::run, this);
+  }
+
+  ~UdpBlaster() {
+    stop_ = true;
+    for (auto &thread : threads_) thread.join();
+  }
+
+  UdpBlaster(const UdpBlaster &) = delete;
+  UdpBlaster &operator=(UdpBlaster const &) = delete;
+
+  /**
+   * \brief datagrams handed to the kernel so far
+   */
+  uint64_t sent() const { return sent_.load(std::memory_order_relaxed); }
+
+ private:
+  const std::vector<uint8_t> &block_;
+  sockaddr_in addr_ = {};
+  std::atomic<bool> stop_;
+  std::atomic<uint64_t> sent_;
+  std::vector<std::thread> threads_;
+
+  void run() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return;
+    iovec iov = {const_cast<uint8_t *>(block_.data()), block_.size()};
+    mmsghdr messages[kBatchSize] = {};
+    for (auto &message : messages) {
+      message.msg_hdr.msg_name = &addr_;
+      message.msg_hdr.msg_namelen = sizeof(addr_);
+      message.msg_hdr.msg_iov = &iov;
+      message.msg_hdr.msg_iovlen = 1;
+    }
+    while (!stop_) {
+      int res = sendmmsg(fd, messages, kBatchSize, 0);
+      if (res > 0) sent_ += res;
+    }
+    close(fd);
+  }
+};
+
+}  // namespace Bench
+}  // namespace DeviceListener
+
+#endif
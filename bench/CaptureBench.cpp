@@ -0,0 +1,129 @@
+#include <benchmark/benchmark.h>
+#include <glob.h>
+#include <unistd.h>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "BenchUtils.h"
+#include "Capture.h"
+#include "MsgCounter.h"
+#include "Replay.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+const uint16_t kDeviceCount = 1024;
+
+/**
+ * Temporary directory for a capture, removed with its segments.
+ */
+class CaptureDirectory {
+ public:
+  CaptureDirectory() {
+    char path[] = "/tmp/captureXXXXXX";
+    directory_ = mkdtemp(path);
+  }
+  ~CaptureDirectory() {
+    glob_t found;
+    if (!glob((getPrefix() + ".*").c_str(), 0, nullptr, &found))
+      for (size_t i = 0; i < found.gl_pathc; i++)
+        std::remove(found.gl_pathv[i]);
+    globfree(&found);
+    rmdir(directory_.c_str());
+  }
+
+  std::string getPrefix() const { return directory_ + "/capture"; }
+
+ private:
+  std::string directory_;
+};
+
+/**
+ * What capturing adds to the read of the given size on the ingestion
+ * thread: the clock read and the copy into the ring. The ring is written
+ * out with the timer paused whenever it is full, the capture thread does
+ * that on another core in the listener.
+ */
+void BM_CaptureReads(benchmark::State &state) {
+  const size_t readSize = state.range(0);
+  auto stream = Bench::makeFrames(readSize / 40 + 1, kDeviceCount, 1);
+  stream.resize(readSize);
+  CaptureDirectory directory;
+  Capture capture(directory.getPrefix(), 1);
+  CaptureShard &shard = capture.getShard(0);
+  const uint32_t connection = shard.addOpen("127.0.0.1");
+  const size_t readsPerRing = CaptureShard::kRingSize / (readSize + 64);
+  uint64_t offset = 0;
+  size_t reads = 0;
+
+  for (auto _ : state) {
+    shard.addData(connection, offset, stream.data(), stream.size());
+    offset += stream.size();
+    if (++reads % readsPerRing == 0) {
+      state.PauseTiming();
+      capture.stop();
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * readSize);
+  capture.stop();
+  state.counters["dropped"] = capture.getDroppedCount();
+}
+
+/**
+ * Replaying a capture as fast as possible: the given number of connections,
+ * 2 MiB of frames in all, read in chunks of up to 16 KiB cutting the frames
+ * anywhere, like the reads of a loaded listener.
+ */
+void BM_ReplayCapture(benchmark::State &state) {
+  const size_t connections = state.range(0);
+  std::vector<std::vector<uint8_t>> streams;
+  for (size_t i = 0; i < connections; i++)
+    streams.push_back(Bench::makeFrames(2 * 1024 * 1024 / 40 / connections,
+                                        kDeviceCount,
+                                        static_cast<uint32_t>(i)));
+  CaptureDirectory directory;
+  {
+    Capture capture(directory.getPrefix(), 1);
+    capture.start();
+    CaptureShard &shard = capture.getShard(0);
+    std::vector<uint32_t> ids;
+    for (size_t i = 0; i < connections; i++)
+      ids.push_back(shard.addOpen("127.0.0.1"));
+    std::mt19937 rng(7);
+    std::vector<size_t> offsets(connections);
+    for (bool left = true; left;) {
+      left = false;
+      for (size_t i = 0; i < connections; i++) {
+        const size_t length =
+            std::min<size_t>(1 + rng() % 16384, streams[i].size() - offsets[i]);
+        if (!length) continue;
+        shard.addData(ids[i], offsets[i], &streams[i][offsets[i]], length);
+        offsets[i] += length;
+        left = true;
+      }
+      // the ring is not meant to hold it all at once
+      if (left) usleep(100);
+    }
+    for (size_t i = 0; i < connections; i++)
+      shard.addClose(ids[i], offsets[i]);
+  }
+
+  Replay replay(directory.getPrefix());
+  std::unique_ptr<MsgCounter> counter(new MsgCounter());
+  Replay::Stats stats;
+  for (auto _ : state) stats = replay.run(counter->getShard(0));
+  state.SetItemsProcessed(state.iterations() * stats.frames);
+  state.SetBytesProcessed(state.iterations() * stats.bytes);
+  state.counters["gaps"] = stats.gaps;
+}
+
+}  // namespace
+
+BENCHMARK(BM_CaptureReads)->Arg(512)->Arg(16384);
+BENCHMARK(BM_ReplayCapture)->Arg(1)->Arg(64);
@@ -0,0 +1,259 @@
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "BenchUtils.h"
+#include "FrameBatch.h"
+#include "FrameParser.h"
+#include "Journal.h"
+#include "MeasurementStats.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TagSketches.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+const uint16_t kDeviceCount = 1024;
+
+/**
+ * The pre-batch way: validate and extract every frame one by one with the
+ * RfcMessage helpers.
+ */
+void BM_PerFrameValidation(benchmark::State &state) {
+  auto stream = Bench::makeFrames(FrameBatch::kCapacity, kDeviceCount, 1);
+  const size_t kHeaderLength = sizeof(RfcMessage::Rfc1006Header);
+
+  for (auto _ : state) {
+    size_t offset = 0;
+    while (offset < stream.size()) {
+      RfcMessage::Rfc1006Header header;
+      std::memcpy(&header, &stream[offset], kHeaderLength);
+      auto length = RfcMessage::validateHeaderAndGetLength(header);
+      auto devId = RfcMessage::getDevIdFromBuffer(
+          &stream[offset + kHeaderLength], length.get());
+      benchmark::DoNotOptimize(devId);
+      offset += kHeaderLength + length.get();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * FrameBatch::kCapacity);
+  state.SetBytesProcessed(state.iterations() * stream.size());
+}
+
+/**
+ * FrameBatch::validate() alone with the given implementation, frames are
+ * already located.
+ */
+void BM_BatchValidate(benchmark::State &state) {
+  auto level = static_cast<FrameBatch::SimdLevel>(state.range(0));
+  if (static_cast<int>(level) > static_cast<int>(FrameBatch::getSimdLevel())) {
+    state.SkipWithError("not supported by the CPU");
+    return;
+  }
+  auto stream = Bench::makeFrames(FrameBatch::kCapacity, kDeviceCount, 1);
+  FrameBatch batch;
+  batch.locate(stream.data(), stream.size());
+
+  for (auto _ : state) {
+    batch.validate(stream.data(), level);
+    benchmark::DoNotOptimize(batch.deviceIds);
+  }
+  state.SetItemsProcessed(state.iterations() * batch.count);
+}
+
+/**
+ * Full parsing of a chunk with the best implementation: locate, validate and
+ * hand the device IDs over in batches.
+ */
+void BM_ParseBatches(benchmark::State &state) {
+  auto stream = Bench::makeFrames(FrameBatch::kCapacity * 4, kDeviceCount, 1);
+  FrameBatch batch;
+  uint64_t sum = 0;
+
+  for (auto _ : state) {
+    FrameParser::parseBatches(stream.data(), stream.size(), batch,
+                              [&sum](const uint16_t *devIds, const uint16_t *,
+                                     size_t count) {
+                                sum += devIds[count - 1];
+                              });
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * FrameBatch::kCapacity * 4);
+  state.SetBytesProcessed(state.iterations() * stream.size());
+}
+
+/**
+ * What a transport does with a chunk: parse it and count the frames, with
+ * the measurement aggregates on top if the first argument is 1. The second
+ * argument is the number of devices the frames are spread over; with one
+ * device the frames form a single run, like on one connection.
+ */
+void BM_CountBatches(benchmark::State &state) {
+  const bool aggregate = state.range(0);
+  const auto devices = static_cast<uint16_t>(state.range(1));
+  auto stream = Bench::makeFrames(FrameBatch::kCapacity * 4, devices, 1);
+  std::unique_ptr<MsgCounter> counter(new MsgCounter());
+  CounterShard &shard = counter->getShard(0);
+  MeasurementStats stats(1);
+  MeasurementShard *measurements = aggregate ? &stats.getShard(0) : nullptr;
+  FrameBatch batch;
+  batch.withMetadata = aggregate;
+
+  for (auto _ : state) {
+    FrameParser::parseBatches(
+        stream.data(), stream.size(), batch,
+        [&shard, measurements, &batch](const uint16_t *devIds,
+                                       const uint16_t *frameLengths,
+                                       size_t count) {
+          shard.incrementCounters(devIds, frameLengths, count);
+          if (measurements) measurements->add(batch, count);
+        });
+  }
+  state.SetItemsProcessed(state.iterations() * FrameBatch::kCapacity * 4);
+  state.SetBytesProcessed(state.iterations() * stream.size());
+}
+
+/**
+ * Counting with and without the journal; the journal thread writes to a
+ * temporary file meanwhile. Rows the writer couldn't keep up with are
+ * reported as dropped.
+ */
+void BM_JournalBatches(benchmark::State &state) {
+  const bool journaled = state.range(0);
+  auto stream = Bench::makeFrames(FrameBatch::kCapacity * 4, kDeviceCount, 1);
+  std::unique_ptr<MsgCounter> counter(new MsgCounter());
+  CounterShard &shard = counter->getShard(0);
+  char path[] = "/tmp/journalXXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  std::unique_ptr<Journal> journal;
+  if (journaled) {
+    journal.reset(new Journal(path, 1));
+    journal->start();
+  }
+  JournalShard *rows = journaled ? &journal->getShard(0) : nullptr;
+  FrameBatch batch;
+  batch.withMetadata = journaled;
+
+  for (auto _ : state) {
+    FrameParser::parseBatches(
+        stream.data(), stream.size(), batch,
+        [&shard, rows, &batch](const uint16_t *devIds,
+                               const uint16_t *frameLengths, size_t count) {
+          shard.incrementCounters(devIds, frameLengths, count);
+          if (rows) rows->add(batch, count);
+        });
+  }
+  state.SetItemsProcessed(state.iterations() * FrameBatch::kCapacity * 4);
+  state.SetBytesProcessed(state.iterations() * stream.size());
+  if (journal) {
+    journal->stop();
+    state.counters["dropped"] = journal->getDroppedCount();
+    state.counters["journal_bytes"] = journal->getBytesWritten();
+  }
+  unlink(path);
+}
+
+/**
+ * Counting with and without the sketches by device and tag, over 1024
+ * devices. With the second argument 1 every frame carries a random tag, the
+ * worst case: no runs, and the heavy hitters list replaces an entry for
+ * almost every frame.
+ */
+void BM_SketchBatches(benchmark::State &state) {
+  const bool sketched = state.range(0);
+  auto stream = Bench::makeFrames(FrameBatch::kCapacity * 4, kDeviceCount, 1);
+  if (state.range(1)) {
+    std::mt19937 rng(2);
+    for (size_t offset = 0; offset < stream.size();) {
+      RfcMessage::Rfc1006Header header;
+      std::memcpy(&header, &stream[offset], sizeof(header));
+      const auto tag = static_cast<uint16_t>(rng());
+      std::memcpy(&stream[offset + sizeof(header) +
+                          offsetof(RfcMessage::PayloadHeader, measurementTag)],
+                  &tag, sizeof(tag));
+      offset += sizeof(header) + header.length;
+    }
+  }
+  std::unique_ptr<MsgCounter> counter(new MsgCounter());
+  CounterShard &shard = counter->getShard(0);
+  TagSketches sketches(1);
+  TagSketchShard *tags = sketched ? &sketches.getShard(0) : nullptr;
+  FrameBatch batch;
+  batch.withMetadata = sketched;
+
+  for (auto _ : state) {
+    FrameParser::parseBatches(
+        stream.data(), stream.size(), batch,
+        [&shard, tags, &batch](const uint16_t *devIds,
+                               const uint16_t *frameLengths, size_t count) {
+          shard.incrementCounters(devIds, frameLengths, count);
+          if (tags) tags->add(batch, count);
+        });
+  }
+  state.SetItemsProcessed(state.iterations() * FrameBatch::kCapacity * 4);
+  state.SetBytesProcessed(state.iterations() * stream.size());
+}
+
+/**
+ * Full parsing of a chunk with metadata, in the native byte order and, with
+ * the argument 1, in the other one: what a device of the other endianness
+ * costs compared to the native codec.
+ */
+void BM_ParseByteOrder(benchmark::State &state) {
+  using Swapped = FrameCodec<0, kNativeByteOrder == ByteOrder::Little
+                                    ? ByteOrder::Big
+                                    : ByteOrder::Little>;
+  using Layout = NativeFrameCodec::Layout;
+  const bool swapped = state.range(0);
+  auto stream = Bench::makeFrames(FrameBatch::kCapacity * 4, kDeviceCount, 1);
+  if (swapped) {
+    for (size_t offset = 0; offset < stream.size();) {
+      uint8_t *frame = &stream[offset];
+      const uint16_t length = NativeFrameCodec::getLength(frame);
+      for (size_t field : {Layout::kLengthOffset, Layout::kDeviceIdOffset,
+                           Layout::kTagOffset, Layout::kTypeOffset,
+                           Layout::kDataLengthOffset})
+        Swapped::store(frame + field,
+                       NativeFrameCodec::load<uint16_t>(frame + field));
+      Swapped::store(frame + Layout::kTimestampOffset,
+                     NativeFrameCodec::getTimestamp(frame));
+      offset += Layout::kHeaderLength + length;
+    }
+  }
+  FrameBatch batch;
+  batch.withMetadata = true;
+  uint64_t sum = 0;
+  auto onBatch = [&sum, &batch](const uint16_t *devIds, const uint16_t *,
+                                size_t count) {
+    sum += devIds[count - 1] + batch.timestamps[count - 1];
+  };
+
+  for (auto _ : state) {
+    if (swapped)
+      FrameParser::parseBatches<Swapped>(stream.data(), stream.size(), batch,
+                                         onBatch);
+    else
+      FrameParser::parseBatches(stream.data(), stream.size(), batch, onBatch);
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * FrameBatch::kCapacity * 4);
+  state.SetBytesProcessed(state.iterations() * stream.size());
+}
+
+}  // namespace
+
+BENCHMARK(BM_PerFrameValidation);
+BENCHMARK(BM_BatchValidate)
+    ->Arg(static_cast<int>(FrameBatch::SimdLevel::Scalar))
+    ->Arg(static_cast<int>(FrameBatch::SimdLevel::Sse2))
+    ->Arg(static_cast<int>(FrameBatch::SimdLevel::Avx2));
+BENCHMARK(BM_ParseBatches);
+BENCHMARK(BM_CountBatches)->ArgsProduct({{0, 1}, {1, kDeviceCount}});
+BENCHMARK(BM_JournalBatches)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_SketchBatches)->ArgsProduct({{0, 1}, {0, 1}});
+BENCHMARK(BM_ParseByteOrder)->Arg(0)->Arg(1);
@@ -0,0 +1,151 @@
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "BenchUtils.h"
+#include "Journal.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const size_t kFramesPerChunk = 256;
+const uint32_t kDeviceCount = 1024;
+// the last frame of every chunk comes from this device, so the monitor can
+// see when the chunk has been counted without summing all the counters
+const uint16_t kMarkerDevice = 65535;
+
+std::vector<uint8_t> makeChunk() {
+  auto chunk = Bench::makeFrames(kFramesPerChunk, kDeviceCount, 1);
+  auto marker = Bench::makeFrames(1, 1, 2);
+  const size_t kDevIdOffset = sizeof(RfcMessage::Rfc1006Header) +
+                              offsetof(RfcMessage::PayloadHeader, deviceId);
+  std::memcpy(&marker[kDevIdOffset], &kMarkerDevice, sizeof(kMarkerDevice));
+  chunk.insert(chunk.end(), marker.begin(), marker.end());
+  return chunk;
+}
+
+double percentile(std::vector<double> &samples, double p) {
+  if (samples.empty()) return 0;
+  size_t idx = static_cast<size_t>(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+  return samples[idx];
+}
+
+/**
+ * In-process end-to-end run: TcpServer + RfcTransport on an ephemeral port
+ * in their own thread, one client streams state.range(0) million frames.
+ * Latency is measured per chunk of kFramesPerChunk + 1 frames, from the
+ * moment the client starts writing the chunk to the moment its last frame is
+ * counted. With state.range(1) set every frame is written to a journal in
+ * a temporary file as well.
+ */
+void BM_LoopbackIngest(benchmark::State &state) {
+  const size_t chunks = state.range(0) * 1000000 / (kFramesPerChunk + 1);
+  const auto chunk = makeChunk();
+
+  char journalPath[] = "/tmp/journalXXXXXX";
+  close(mkstemp(journalPath));
+  std::unique_ptr<Journal> journal;
+  if (state.range(1)) {
+    journal.reset(new Journal(journalPath, 1));
+    journal->start();
+  }
+
+  MsgCounter counter;
+  boost::asio::io_service ioService;
+  WorkerContext context(counter.getShard(0));
+  if (journal) context.journal = &journal->getShard(0);
+  RfcTransport transport(ioService, context);
+  TcpServer server(0, ioService, transport);
+  ClosingGuard closing(ioService, server, transport);
+  server.listen();
+  std::thread serverThread([&ioService]() { ioService.run(); });
+
+  int fd = Bench::connectToLoopback(server.port());
+  std::vector<Clock::time_point> sendTimes(chunks);
+  std::vector<double> latencies;
+  latencies.reserve(chunks);
+
+  for (auto _ : state) {
+    const uint64_t markersBefore =
+        counter.getStatForDevice(kMarkerDevice).first;
+    std::atomic<size_t> chunksSent(0);
+    // set if the client gives up, the markers left won't come
+    std::atomic<bool> stopped(false);
+    std::thread monitor([&]() {
+      size_t seen = 0;
+      while (seen < chunks && !stopped.load(std::memory_order_relaxed)) {
+        size_t counted =
+            counter.getStatForDevice(kMarkerDevice).first - markersBefore;
+        if (counted == seen) {
+          std::this_thread::yield();
+          continue;
+        }
+        auto now = Clock::now();
+        // the client publishes sendTimes[i] before chunksSent passes i
+        while (chunksSent.load(std::memory_order_acquire) < counted)
+          std::this_thread::yield();
+        for (; seen < counted; seen++)
+          latencies.push_back(
+              std::chrono::duration<double, std::micro>(now - sendTimes[seen])
+                  .count());
+      }
+    });
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < chunks; i++) {
+      sendTimes[i] = Clock::now();
+      chunksSent.store(i + 1, std::memory_order_release);
+      if (!Bench::sendAll(fd, chunk.data(), chunk.size())) {
+        state.SkipWithError("connection is broken");
+        stopped.store(true, std::memory_order_relaxed);
+        break;
+      }
+    }
+    monitor.join();
+    state.SetIterationTime(
+        std::chrono::duration<double>(Clock::now() - start).count());
+  }
+
+  close(fd);
+  ioService.stop();
+  serverThread.join();
+
+  const double frames =
+      static_cast<double>(chunks) * (kFramesPerChunk + 1) * state.iterations();
+  state.counters["msgs_per_second"] =
+      benchmark::Counter(frames, benchmark::Counter::kIsRate);
+  state.counters["bytes_per_second"] = benchmark::Counter(
+      static_cast<double>(chunks) * chunk.size() * state.iterations(),
+      benchmark::Counter::kIsRate);
+  state.counters["p50_latency_us"] = percentile(latencies, 0.5);
+  state.counters["p99_latency_us"] = percentile(latencies, 0.99);
+  if (journal) {
+    journal->stop();
+    state.counters["journal_dropped"] = journal->getDroppedCount();
+  }
+  unlink(journalPath);
+}
+
+}  // namespace
+
+BENCHMARK(BM_LoopbackIngest)
+    ->ArgNames({"million_frames", "journal"})
+    ->Args({2, 0})
+    ->Args({2, 1})
+    ->Iterations(1)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,267 @@
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "BenchUtils.h"
+#include "DeviceRegistry.h"
+#include "Logger.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "StatsRenderer.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+const size_t kSamples = 64 * 1024;
+
+/**
+ * RfcMessage::validateHeaderAndGetLength() over a set of valid headers.
+ */
+void BM_ValidateHeader(benchmark::State &state) {
+  auto ids = Bench::makeDeviceIds(Bench::DeviceMix::UniformAll, kSamples, 1);
+  std::vector<RfcMessage::Rfc1006Header> headers(kSamples);
+  for (size_t i = 0; i < kSamples; i++)
+    headers[i] = {RfcMessage::kProtocolVersion, 0,
+                  static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) +
+                                        ids[i] % 65)};
+
+  size_t i = 0;
+  for (auto _ : state) {
+    auto length = RfcMessage::validateHeaderAndGetLength(headers[i]);
+    benchmark::DoNotOptimize(length);
+    i = (i + 1) % kSamples;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+/**
+ * RfcMessage::getDevIdFromBuffer() over a set of payloads.
+ */
+void BM_GetDevIdFromBuffer(benchmark::State &state) {
+  const size_t kPayloadLength = sizeof(RfcMessage::PayloadHeader);
+  auto ids = Bench::makeDeviceIds(Bench::DeviceMix::UniformAll, kSamples, 1);
+  std::vector<uint8_t> payloads(kSamples * kPayloadLength);
+  for (size_t i = 0; i < kSamples; i++)
+    std::memcpy(&payloads[i * kPayloadLength], &ids[i], sizeof(ids[i]));
+
+  size_t i = 0;
+  for (auto _ : state) {
+    auto devId = RfcMessage::getDevIdFromBuffer(
+        &payloads[i * kPayloadLength], kPayloadLength);
+    benchmark::DoNotOptimize(devId);
+    i = (i + 1) % kSamples;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+/**
+ * MsgCounter::incrementCounter() with device IDs drawn from
+ * Bench::DeviceMix state.range(0).
+ */
+void BM_IncrementCounter(benchmark::State &state) {
+  auto mix = static_cast<Bench::DeviceMix>(state.range(0));
+  auto ids = Bench::makeDeviceIds(mix, kSamples, 1);
+  MsgCounter counter;
+
+  size_t i = 0;
+  for (auto _ : state) {
+    counter.incrementCounter(ids[i]);
+    i = (i + 1) % kSamples;
+  }
+  benchmark::DoNotOptimize(counter.getStatForDevice(ids[0]));
+  state.SetItemsProcessed(state.iterations());
+}
+
+/**
+ * CounterShard::incrementCounters() with batches of FrameBatch size, the way
+ * RfcTransport counts.
+ */
+void BM_IncrementCounters(benchmark::State &state) {
+  const size_t kBatch = 256;
+  auto mix = static_cast<Bench::DeviceMix>(state.range(0));
+  auto ids = Bench::makeDeviceIds(mix, kSamples, 1);
+  std::vector<uint16_t> frameLengths(kSamples, 16);
+  MsgCounter counter;
+  CounterShard &shard = counter.getShard(0);
+
+  size_t i = 0;
+  for (auto _ : state) {
+    shard.incrementCounters(&ids[i], &frameLengths[i], kBatch);
+    i = (i + kBatch) % kSamples;
+  }
+  benchmark::DoNotOptimize(counter.getStatForDevice(ids[0]));
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+
+std::string makeDevicesText() {
+  std::string text;
+  for (size_t id = 0; id < DeviceRegistry::kDeviceCount; id++)
+    text += std::to_string(id) + ":Device-" + std::to_string(id) + "\n";
+  return text;
+}
+
+/**
+ * DeviceRegistry::parse() of a text file describing all the 65536 devices.
+ */
+void BM_ParseRegistry(benchmark::State &state) {
+  auto text = makeDevicesText();
+  for (auto _ : state) {
+    auto registry = DeviceRegistry::parse(text.data(), text.size());
+    benchmark::DoNotOptimize(registry);
+  }
+  state.SetItemsProcessed(state.iterations() * DeviceRegistry::kDeviceCount);
+}
+
+/**
+ * DeviceRegistry::load() of a precompiled registry of all the 65536 devices.
+ */
+void BM_LoadCompiledRegistry(benchmark::State &state) {
+  auto text = makeDevicesText();
+  char path[] = "/tmp/registryXXXXXX";
+  close(mkstemp(path));
+  DeviceRegistry::parse(text.data(), text.size())->save(path);
+  for (auto _ : state) {
+    auto registry = DeviceRegistry::load(path);
+    benchmark::DoNotOptimize(registry);
+  }
+  unlink(path);
+  state.SetItemsProcessed(state.iterations() * DeviceRegistry::kDeviceCount);
+}
+
+/**
+ * Logging a connection from the ingestion thread, with `async` 0 as it used
+ * to be done (formatted and flushed with std::endl on the spot) and 1 queued
+ * to the Logger. Both write to /dev/null, a terminal is only slower.
+ */
+void BM_LogConnection(benchmark::State &state) {
+  std::ofstream sink("/dev/null");
+  Logger logger(sink, sink);
+  logger.start();
+  const auto address = boost::asio::ip::address_v4(0x7F000001);
+  for (auto _ : state) {
+    if (state.range(0))
+      logger.log(Logger::Event::DeviceConnected, address);
+    else
+      sink << "Device connected: " << address.to_string() << std::endl;
+  }
+  logger.stop();
+  state.counters["dropped"] = logger.getDroppedCount();
+}
+
+/**
+ * Counters of 4 workers with every device counted, as the statistics of a
+ * large fleet see them.
+ */
+std::unique_ptr<MsgCounter> makeFleetCounter() {
+  std::unique_ptr<MsgCounter> counter(new MsgCounter(4));
+  for (size_t i = 0; i < counter->getShardCount(); i++)
+    for (uint32_t devId = 0; devId < CounterShard::kDeviceCount; devId++)
+      counter->getShard(i).incrementCounter(devId);
+  return counter;
+}
+
+/**
+ * The statistics as the event loop used to print them every interval, kept
+ * as the baseline of StatsRenderer: a line per device through std::cout and
+ * std::endl.
+ */
+void printStatistics(const MsgCounter &counter) {
+  std::cout << "\033[32m-----------------------------------------------------"
+            << std::endl;
+  std::cout << "Current statistics of received messages from devices:"
+            << std::endl;
+  std::cout << "[device id] - [number of valid messages]" << std::endl;
+  auto registry = counter.getRegistry();
+  for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+    uint64_t counterValue;
+    bool overflow;
+    std::tie(counterValue, overflow) = counter.getStatForDevice(devId);
+    if (!counterValue && !overflow && !registry->isKnown(devId)) continue;
+    std::cout << registry->getName(devId) << " - " << (overflow ? ">" : "")
+              << counterValue << std::endl;
+  }
+
+  // only shown once the admission limits have been hit or a stream resynced
+  uint64_t rejected = 0, throttled = 0, pauses = 0, resyncs = 0, skipped = 0;
+  for (size_t i = 0; i < counter.getShardCount(); i++) {
+    const TransportStats &stats = counter.getShard(i).transport;
+    rejected += stats.connectionsRejected.load(std::memory_order_relaxed);
+    throttled += stats.connectionsThrottled.load(std::memory_order_relaxed);
+    pauses += stats.throttlePauses.load(std::memory_order_relaxed);
+    resyncs += stats.resyncs.load(std::memory_order_relaxed);
+    skipped += stats.bytesSkipped.load(std::memory_order_relaxed);
+  }
+  if (rejected || pauses)
+    std::cout << "Rejected connections: " << rejected
+              << ", throttled connections: " << throttled << " (paused "
+              << pauses << " times)" << std::endl;
+  if (resyncs || skipped)
+    std::cout << "Resynchronized streams: " << resyncs << " times, "
+              << skipped << " bytes skipped" << std::endl;
+  std::cout << "-----------------------------------------------------\033[0m"
+            << std::endl;
+}
+
+/**
+ * printStatistics() of a large fleet, written to /dev/null.
+ */
+void BM_PrintStatistics(benchmark::State &state) {
+  auto counter = makeFleetCounter();
+  std::ofstream sink("/dev/null");
+  auto *original = std::cout.rdbuf(sink.rdbuf());
+  for (auto _ : state) printStatistics(*counter);
+  std::cout.rdbuf(original);
+  state.SetItemsProcessed(state.iterations() * CounterShard::kDeviceCount);
+}
+
+/**
+ * StatsRenderer::render() of the same fleet in the given view (0 all, 1
+ * top, 2 changed), on the renderer's thread in the listener: one snapshot,
+ * one buffer, one write() to /dev/null.
+ */
+void BM_RenderStatistics(benchmark::State &state) {
+  auto counter = makeFleetCounter();
+  StatsOptions options;
+  options.view = static_cast<StatsView>(state.range(0));
+  const int fd = open("/dev/null", O_WRONLY);
+  StatsRenderer renderer(*counter, options, fd);
+  uint16_t devId = 0;
+  for (auto _ : state) {
+    // a few devices change from one render to the next
+    for (int i = 0; i < 64; i++)
+      counter->getShard(0).incrementCounter(devId += 1021);
+    benchmark::DoNotOptimize(renderer.render().size());
+  }
+  close(fd);
+  state.SetItemsProcessed(state.iterations() * CounterShard::kDeviceCount);
+}
+
+void deviceMixes(benchmark::internal::Benchmark *bench) {
+  bench->ArgName("mix");
+  for (auto mix : {Bench::DeviceMix::Single, Bench::DeviceMix::Uniform16,
+                   Bench::DeviceMix::UniformAll, Bench::DeviceMix::Zipf})
+    bench->Arg(static_cast<int>(mix));
+}
+
+}  // namespace
+
+BENCHMARK(BM_ValidateHeader);
+BENCHMARK(BM_GetDevIdFromBuffer);
+BENCHMARK(BM_IncrementCounter)->Apply(deviceMixes);
+BENCHMARK(BM_IncrementCounters)->Apply(deviceMixes);
+BENCHMARK(BM_ParseRegistry)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoadCompiledRegistry)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_LogConnection)->ArgName("async")->Arg(0)->Arg(1);
+BENCHMARK(BM_PrintStatistics)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_RenderStatistics)
+    ->ArgName("view")
+    ->DenseRange(0, 2)
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,57 @@
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <thread>
+
+#include "BenchUtils.h"
+#include "MsgCounter.h"
+#include "WorkerPool.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+const size_t kConnectionsPerClient = 4;
+const size_t kFramesPerBlock = 4096;
+const uint16_t kDeviceCount = 64;
+
+/**
+ * Listener throughput with state.range(0) workers, loaded by the same number
+ * of client threads over loopback.
+ */
+void BM_ListenerScaling(benchmark::State &state) {
+  const size_t threads = state.range(0);
+  MsgCounter counter(threads);
+  WorkerPoolOptions options;
+  options.threads = threads;
+  WorkerPool pool(counter, options);
+  pool.listen();
+  pool.start();
+
+  auto block = Bench::makeFrames(kFramesPerBlock, kDeviceCount, 1);
+  Bench::TcpBlaster clients(pool.port(), threads, kConnectionsPerClient, block);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  const uint64_t countBefore = counter.getTotalCount();
+  for (auto _ : state)
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  const uint64_t received = counter.getTotalCount() - countBefore;
+
+  state.counters["msgs_per_second"] =
+      benchmark::Counter(received, benchmark::Counter::kIsRate);
+  state.counters["msgs_per_second_per_thread"] = benchmark::Counter(
+      static_cast<double>(received) / threads, benchmark::Counter::kIsRate);
+}
+
+void scalingArgs(benchmark::internal::Benchmark *bench) {
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  for (int threads = 1; threads <= cores; threads *= 2) bench->Arg(threads);
+  if (cores & (cores - 1)) bench->Arg(cores);
+}
+
+}  // namespace
+
+BENCHMARK(BM_ListenerScaling)
+    ->Apply(scalingArgs)
+    ->Iterations(20)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,117 @@
+#include <benchmark/benchmark.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "BenchUtils.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+#include "UdpServer.h"
+#include "UnixServer.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+enum class Transport { Tcp, Udp, Unix };
+
+const size_t kClientThreads = 2;
+// what a sensor would put in one datagram
+const size_t kFramesPerDatagram = 16;
+const uint32_t kDeviceCount = 1024;
+
+uint64_t getCpuTimeNs(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * One server thread receiving over TCP, UDP or a Unix domain socket
+ * (state.range(0), see Transport) from kClientThreads local clients, each of
+ * them sending the same block of kFramesPerDatagram frames: as a stream over
+ * one connection, or as one datagram per block. Reports the receive rate and
+ * CPU time the server thread spends per message; for UDP also the share of
+ * datagrams lost because the server didn't keep up. The same frame reader
+ * serves TCP and the Unix socket, so the difference between the two is what
+ * the loopback TCP/IP stack costs.
+ */
+void BM_TransportLoopback(benchmark::State &state) {
+  const auto transport = static_cast<Transport>(state.range(0));
+  const auto block = Bench::makeFrames(kFramesPerDatagram, kDeviceCount, 1);
+
+  MsgCounter counter;
+  boost::asio::io_service ioService;
+  RfcTransport rfcTransport(ioService, counter.getShard(0));
+  TcpServer tcpServer(0, ioService, rfcTransport);
+  UdpServer udpServer(0, ioService, counter.getShard(0));
+  UnixTransport unixTransport(ioService, counter.getShard(0));
+  const std::string path =
+      "/tmp/device_listener_bench." + std::to_string(getpid()) + ".sock";
+  UnixServer unixServer(path, ioService, unixTransport);
+  ClosingGuard closing(ioService, tcpServer, udpServer, unixServer,
+                       rfcTransport, unixTransport);
+  if (transport == Transport::Tcp)
+    tcpServer.listen();
+  else if (transport == Transport::Udp)
+    udpServer.listen();
+  else
+    unixServer.listen();
+  std::thread serverThread([&ioService]() { ioService.run(); });
+  clockid_t serverClock;
+  pthread_getcpuclockid(serverThread.native_handle(), &serverClock);
+
+  std::unique_ptr<Bench::TcpBlaster> tcpClients;
+  std::unique_ptr<Bench::UdpBlaster> udpClients;
+  if (transport == Transport::Tcp)
+    tcpClients.reset(
+        new Bench::TcpBlaster(tcpServer.port(), kClientThreads, 1, block));
+  else if (transport == Transport::Unix)
+    tcpClients.reset(new Bench::TcpBlaster(path, kClientThreads, 1, block));
+  else
+    udpClients.reset(
+        new Bench::UdpBlaster(udpServer.port(), kClientThreads, block));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  const auto &stats = counter.getShard(0).transport;
+  const uint64_t countBefore = counter.getTotalCount();
+  const uint64_t cpuBefore = getCpuTimeNs(serverClock);
+  const uint64_t datagramsBefore = stats.datagramsReceived.load();
+  const uint64_t sentBefore = udpClients ? udpClients->sent() : 0;
+  for (auto _ : state)
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  const uint64_t received = counter.getTotalCount() - countBefore;
+  const uint64_t cpuNs = getCpuTimeNs(serverClock) - cpuBefore;
+  const uint64_t datagrams = stats.datagramsReceived.load() - datagramsBefore;
+  const uint64_t sent = udpClients ? udpClients->sent() - sentBefore : 0;
+
+  tcpClients.reset();
+  udpClients.reset();
+  ioService.stop();
+  serverThread.join();
+
+  state.counters["msgs_per_second"] =
+      benchmark::Counter(received, benchmark::Counter::kIsRate);
+  state.counters["cpu_ns_per_msg"] =
+      received ? static_cast<double>(cpuNs) / received : 0;
+  if (transport == Transport::Udp)
+    state.counters["datagram_loss"] =
+        sent > datagrams ? static_cast<double>(sent - datagrams) / sent : 0;
+}
+
+}  // namespace
+
+BENCHMARK(BM_TransportLoopback)
+    ->ArgName("transport")
+    ->Arg(static_cast<int>(Transport::Tcp))
+    ->Arg(static_cast<int>(Transport::Udp))
+    ->Arg(static_cast<int>(Transport::Unix))
+    ->Iterations(20)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
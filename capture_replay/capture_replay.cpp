@@ -0,0 +1,132 @@
+#include <getopt.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "MsgCounter.h"
+#include "Replay.h"
+
+using DeviceListener::CounterShard;
+using DeviceListener::MsgCounter;
+using DeviceListener::Replay;
+
+/**
+ * \brief prints usage information to stdout
+ */
+void printUsage() {
+  std::cout << "Usage: capture_replay -c <prefix> [options]" << std::endl;
+  std::cout << "Replays a device listener capture through its frame parser "
+               "and counters, without sockets, and counts the messages by "
+               "device."
+            << std::endl;
+  std::cout << "-c <prefix> - prefix the capture was written with (`-C` of "
+               "the listener)"
+            << std::endl;
+  std::cout << "-s <speed> - replay this many times faster than captured, 1 "
+               "for the original pacing; as fast as possible if not set"
+            << std::endl;
+  std::cout << "-n <rounds> - replay the capture this many times, each round "
+               "is timed on its own; 1 if not set"
+            << std::endl;
+  std::cout << "-e <little|big|detect> - byte order of the devices' frames, "
+               "as the listener was told (`-e`); the order of this machine "
+               "if not set"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  static struct option longOpts[] = {{"capture", required_argument, NULL, 'c'},
+                                     {"speed", required_argument, NULL, 's'},
+                                     {"rounds", required_argument, NULL, 'n'},
+                                     {"byte-order", required_argument, NULL,
+                                      'e'},
+                                     {NULL, no_argument, NULL, 0}};
+  static char const *optString = "?c:s:n:e:";
+
+  std::string prefix;
+  double speed = 0;
+  long rounds = 1;
+  auto byteOrder = DeviceListener::ByteOrderMode::Native;
+  char *end = nullptr;
+  int opt;
+  while ((opt = getopt_long(argc, argv, optString, longOpts, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        prefix = optarg;
+        break;
+      case 's':
+        speed = std::strtod(optarg, &end);
+        if (end == optarg || *end || speed <= 0) {
+          std::cerr << "Incorrect speed in `-s`" << std::endl;
+          return 1;
+        }
+        break;
+      case 'n':
+        rounds = std::strtol(optarg, &end, 10);
+        if (end == optarg || *end || rounds <= 0) {
+          std::cerr << "Incorrect number of rounds in `-n`" << std::endl;
+          return 1;
+        }
+        break;
+      case 'e':
+        if (std::string(optarg) == "little") {
+          byteOrder = DeviceListener::ByteOrderMode::Little;
+        } else if (std::string(optarg) == "big") {
+          byteOrder = DeviceListener::ByteOrderMode::Big;
+        } else if (std::string(optarg) == "detect") {
+          byteOrder = DeviceListener::ByteOrderMode::Detect;
+        } else {
+          std::cerr << "Incorrect byte order in `-e`" << std::endl;
+          return 1;
+        }
+        break;
+      default:
+        printUsage();
+        return 0;
+    }
+  }
+  if (prefix.empty()) {
+    printUsage();
+    return 1;
+  }
+
+  try {
+    Replay replay(prefix);
+    std::cerr << "Replaying " << replay.getSegmentCount() << " segments of "
+              << prefix << std::endl;
+    std::unique_ptr<MsgCounter> counter;
+    Replay::Stats stats;
+    for (long round = 0; round < rounds; round++) {
+      // every round counts from zero, the counts printed are of one replay
+      counter.reset(new MsgCounter());
+      const auto start = std::chrono::steady_clock::now();
+      stats = replay.run(counter->getShard(0), speed, byteOrder);
+      const double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+      std::cerr << "Round " << round + 1 << ": " << seconds * 1000 << " ms, "
+                << static_cast<uint64_t>(stats.frames / seconds)
+                << " messages/s, " << stats.bytes / seconds / 1e6 << " MB/s"
+                << std::endl;
+    }
+
+    for (uint32_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+      const auto count = counter->getStatForDevice(devId).first;
+      if (count) std::cout << "device " << devId << ": " << count << std::endl;
+    }
+    std::cout << "Total: " << stats.frames << " messages, " << stats.bytes
+              << " bytes" << std::endl;
+    std::cerr << "Records: " << stats.records
+              << ", connections: " << stats.connections
+              << ", captured over: " << stats.span / 1000000 << " ms"
+              << ", invalid headers: " << stats.invalidHeaders
+              << ", gaps: " << stats.gaps << std::endl;
+  } catch (std::exception &e) {
+    std::cerr << "Failed to replay the capture: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
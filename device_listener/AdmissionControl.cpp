@@ -0,0 +1,39 @@
+#include "AdmissionControl.h"
+
+using namespace DeviceListener;
+
+bool AdmissionControl::tryAdmit(const boost::asio::ip::address &source) {
+  return tryAdmitSource(&source);
+}
+
+void AdmissionControl::release(const boost::asio::ip::address &source) {
+  releaseSource(&source);
+}
+
+bool AdmissionControl::tryAdmitSource(
+    const boost::asio::ip::address *source) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (limits_.maxConnections && connections_ >= limits_.maxConnections)
+    return false;
+  if (source && limits_.maxConnectionsPerSource) {
+    size_t &count = sources_[*source];
+    if (count >= limits_.maxConnectionsPerSource) return false;
+    count++;
+  }
+  connections_++;
+  return true;
+}
+
+void AdmissionControl::releaseSource(
+    const boost::asio::ip::address *source) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  connections_--;
+  if (!source || !limits_.maxConnectionsPerSource) return;
+  auto it = sources_.find(*source);
+  if (it != sources_.end() && !--it->second) sources_.erase(it);
+}
+
+size_t AdmissionControl::getConnectionCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return connections_;
+}
@@ -0,0 +1,89 @@
+#ifndef AdmissionControl_H
+#define AdmissionControl_H
+#include <boost/asio/ip/address.hpp>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+namespace DeviceListener {
+
+/**
+ * Limits of what a device may take from the listener, so one that
+ * reconnects in a loop or sends at line rate can't starve the others.
+ *
+ * The connection limits are enforced at accept time across all the workers.
+ * The rate limits are per connection: a connection over its budget is not
+ * read until the budget refills, the kernel buffers fill up and TCP flow
+ * control slows the sender down; no frame is dropped. 0 means unlimited.
+ */
+struct AdmissionLimits {
+  size_t maxConnections = 0;
+  size_t maxConnectionsPerSource = 0;
+  uint64_t bytesPerSecond = 0;
+  uint64_t framesPerSecond = 0;
+
+  bool limitsConnections() const {
+    return maxConnections || maxConnectionsPerSource;
+  }
+  bool limitsRate() const { return bytesPerSecond || framesPerSecond; }
+};
+
+/**
+ * Connections admitted by all the workers, per source address. Local
+ * connections have none, they are limited in total only.
+ *
+ * Only accepting and closing connections touch it, so a mutex shared by
+ * the workers costs nothing for the traffic itself.
+ */
+class AdmissionControl {
+ public:
+  explicit AdmissionControl(const AdmissionLimits &limits)
+      : limits_(limits), connections_(0) {}
+  AdmissionControl(const AdmissionControl &) = delete;
+  AdmissionControl &operator=(AdmissionControl const &) = delete;
+
+  const AdmissionLimits &getLimits() const { return limits_; }
+
+  /**
+   * \brief takes a place for a new connection from source
+   * \return false if that would exceed the limits, nothing is taken then
+   */
+  bool tryAdmit(const boost::asio::ip::address &source);
+
+  /**
+   * \brief gives back the place of a connection admitted by tryAdmit()
+   */
+  void release(const boost::asio::ip::address &source);
+
+  /**
+   * \brief takes a place for a new connection without a source address, a
+   * Unix domain socket or a serial line: it counts against maxConnections
+   * only
+   * \return false if that would exceed the limit, nothing is taken then
+   */
+  bool tryAdmitLocal() { return tryAdmitSource(nullptr); }
+
+  /**
+   * \brief gives back the place of a connection admitted by tryAdmitLocal()
+   */
+  void releaseLocal() { releaseSource(nullptr); }
+
+  /**
+   * \brief returns the number of connections admitted and not released
+   */
+  size_t getConnectionCount() const;
+
+ protected:
+  const AdmissionLimits limits_;
+  mutable std::mutex mutex_;
+  size_t connections_;
+  std::map<boost::asio::ip::address, size_t> sources_;
+
+  // nullptr for a connection without a source
+  bool tryAdmitSource(const boost::asio::ip::address *source);
+  void releaseSource(const boost::asio::ip::address *source);
+};
+
+}  // namespace DeviceListener
+
+#endif
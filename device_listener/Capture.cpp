@@ -0,0 +1,306 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/system/system_error.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "Capture.h"
+#include "SystemUtils.h"
+
+using namespace DeviceListener;
+
+const uint64_t CaptureFormat::kMagic;
+const uint32_t CaptureFormat::kFormatVersion;
+const size_t CaptureFormat::kAlignment;
+const size_t CaptureShard::kRingSize;
+const uint64_t Capture::kDefaultSegmentSize;
+
+namespace {
+
+// how long the writing thread sleeps once there is nothing to write
+const std::chrono::milliseconds kPollInterval(10);
+
+static_assert(sizeof(CaptureFormat::FileHeader) %
+                      CaptureFormat::kAlignment ==
+                  0,
+              "the first record must be aligned");
+static_assert(sizeof(CaptureFormat::RecordHeader) %
+                      CaptureFormat::kAlignment ==
+                  0,
+              "the data must start right after the record header");
+static_assert((CaptureShard::kRingSize & (CaptureShard::kRingSize - 1)) == 0,
+              "the ring size must be a power of two");
+
+uint64_t getTime() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * \brief writes all the bytes, retrying short writes
+ * \return false on failure, errno tells why
+ */
+bool writeAll(int fd, const uint8_t *data, size_t length) {
+  while (length) {
+    const ssize_t written = ::write(fd, data, length);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+}  // namespace
+
+std::string CaptureFormat::getSegmentPath(const std::string &prefix,
+                                          size_t worker, uint64_t sequence) {
+  // zero-padded, so the segments of a worker sort in their order
+  char suffix[48];
+  std::snprintf(suffix, sizeof(suffix), ".%zu.%06llu", worker,
+                static_cast<unsigned long long>(sequence));
+  return prefix + suffix;
+}
+
+CaptureShard::CaptureShard()
+    : ring_(new uint8_t[kRingSize]),
+      head_(0),
+      tail_(0),
+      dropped_(0),
+      nextConnection_(0) {}
+
+uint32_t CaptureShard::addOpen(const std::string &peer) {
+  const uint32_t connection = nextConnection_++;
+  add(CaptureFormat::kOpen, connection, 0, peer.data(), peer.size());
+  return connection;
+}
+
+void CaptureShard::add(CaptureFormat::RecordType type, uint32_t connection,
+                       uint64_t offset, const void *data, size_t length) {
+  static const uint8_t kZeros[CaptureFormat::kAlignment] = {};
+  const CaptureFormat::RecordHeader header = {
+      getTime(), offset, connection, type, static_cast<uint32_t>(length), 0};
+  const size_t recordLength = CaptureFormat::getRecordLength(header);
+  const uint64_t head = head_.load(std::memory_order_relaxed);
+  if (head + recordLength - tail_.load(std::memory_order_acquire) >
+      kRingSize) {
+    addRelaxed(dropped_, 1);
+    return;
+  }
+
+  copyIn(head, &header, sizeof(header));
+  copyIn(head + sizeof(header), data, length);
+  copyIn(head + sizeof(header) + length, kZeros,
+         recordLength - sizeof(header) - length);
+  head_.store(head + recordLength, std::memory_order_release);
+}
+
+void CaptureShard::copyIn(uint64_t pos, const void *data, size_t length) {
+  const size_t offset = pos & (kRingSize - 1);
+  const size_t first = std::min(length, kRingSize - offset);
+  std::memcpy(&ring_[offset], data, first);
+  std::memcpy(&ring_[0], static_cast<const uint8_t *>(data) + first,
+              length - first);
+}
+
+void CaptureShard::copyOut(uint64_t pos, void *data, size_t length) const {
+  const size_t offset = pos & (kRingSize - 1);
+  const size_t first = std::min(length, kRingSize - offset);
+  std::memcpy(data, &ring_[offset], first);
+  std::memcpy(static_cast<uint8_t *>(data) + first, &ring_[0],
+              length - first);
+}
+
+Capture::Capture(const std::string &prefix, size_t shardCount,
+                 uint64_t segmentSize)
+    : prefix_(prefix),
+      segmentSize_(segmentSize),
+      failed_(false),
+      stopping_(false),
+      bytes_(0),
+      lost_(0) {
+  for (size_t i = 0; i < (shardCount ? shardCount : 1); i++) {
+    shards_.emplace_back(new CaptureShard());
+    try {
+      segments_.push_back(
+          {create(i, 0), 0, sizeof(CaptureFormat::FileHeader)});
+    } catch (...) {
+      for (auto &segment : segments_) close(segment.fd);
+      throw;
+    }
+  }
+}
+
+Capture::~Capture() {
+  stop();
+  for (auto &segment : segments_)
+    if (segment.fd >= 0) close(segment.fd);
+}
+
+void Capture::start() {
+  if (thread_.joinable()) return;
+  stopping_ = false;
+  thread_ = std::thread(&Capture::run, this);
+}
+
+void Capture::stop() {
+  if (thread_.joinable()) {
+    stopping_ = true;
+    thread_.join();
+  }
+  drain();
+}
+
+uint64_t Capture::getDroppedCount() const {
+  uint64_t dropped = lost_.load(std::memory_order_relaxed);
+  for (auto &shard : shards_) dropped += shard->getDroppedCount();
+  return dropped;
+}
+
+void Capture::run() {
+  while (!stopping_.load(std::memory_order_relaxed))
+    if (!drain()) std::this_thread::sleep_for(kPollInterval);
+}
+
+bool Capture::drain() {
+  bool drained = false;
+  for (size_t worker = 0; worker < shards_.size(); worker++) {
+    CaptureShard &shard = *shards_[worker];
+    const uint64_t head = shard.head_.load(std::memory_order_acquire);
+    uint64_t from = shard.tail_.load(std::memory_order_relaxed);
+    if (from == head) continue;
+    drained = true;
+
+    // a record never spans two segments, a segment holds at least one
+    for (uint64_t pos = from; pos < head;) {
+      CaptureFormat::RecordHeader header;
+      shard.copyOut(pos, &header, sizeof(header));
+      const uint64_t length = segments_[worker].length + (pos - from);
+      if (length > sizeof(CaptureFormat::FileHeader) &&
+          length + CaptureFormat::getRecordLength(header) > segmentSize_) {
+        write(worker, from, pos);
+        rotate(worker);
+        from = pos;
+      }
+      pos += CaptureFormat::getRecordLength(header);
+    }
+    write(worker, from, head);
+    shard.tail_.store(head, std::memory_order_release);
+  }
+  return drained;
+}
+
+void Capture::write(size_t worker, uint64_t from, uint64_t to) {
+  const CaptureShard &shard = *shards_[worker];
+  Segment &segment = segments_[worker];
+  if (!failed_) {
+    const size_t offset = from & (CaptureShard::kRingSize - 1);
+    const size_t first = std::min<uint64_t>(to - from,
+                                            CaptureShard::kRingSize - offset);
+    failed_ = !writeAll(segment.fd, &shard.ring_[offset], first) ||
+              !writeAll(segment.fd, &shard.ring_[0], to - from - first);
+    if (failed_)
+      std::cerr << "Failed to write the capture: " << std::strerror(errno)
+                << ", its records are dropped from now on" << std::endl;
+  }
+  if (!failed_) {
+    segment.length += to - from;
+    addRelaxed(bytes_, to - from);
+    return;
+  }
+
+  uint64_t records = 0;
+  for (uint64_t pos = from; pos < to; records++) {
+    CaptureFormat::RecordHeader header;
+    shard.copyOut(pos, &header, sizeof(header));
+    pos += CaptureFormat::getRecordLength(header);
+  }
+  addRelaxed(lost_, records);
+}
+
+void Capture::rotate(size_t worker) {
+  Segment &segment = segments_[worker];
+  close(segment.fd);
+  segment.fd = -1;
+  segment.sequence++;
+  segment.length = 0;
+  if (failed_) return;
+  try {
+    segment.fd = create(worker, segment.sequence);
+    segment.length = sizeof(CaptureFormat::FileHeader);
+  } catch (const boost::system::system_error &e) {
+    std::cerr << "Failed to start a capture segment: " << e.what()
+              << ", its records are dropped from now on" << std::endl;
+    failed_ = true;
+  }
+}
+
+int Capture::create(size_t worker, uint64_t sequence) {
+  const std::string path =
+      CaptureFormat::getSegmentPath(prefix_, worker, sequence);
+  // an earlier capture is never overwritten
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) throwSystemError("open(capture)");
+  const CaptureFormat::FileHeader header = {
+      CaptureFormat::kMagic, CaptureFormat::kFormatVersion,
+      static_cast<uint32_t>(worker), sequence, 0};
+  if (!writeAll(fd, reinterpret_cast<const uint8_t *>(&header),
+                sizeof(header))) {
+    int err = errno;
+    close(fd);
+    throwSystemError("write(capture)", err);
+  }
+  addRelaxed(bytes_, sizeof(header));
+  return fd;
+}
+
+CaptureReader::CaptureReader(const std::string &path)
+    : memory_(nullptr), size_(0) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) throwSystemError("open(capture)");
+  struct stat info;
+  if (fstat(fd, &info)) {
+    int err = errno;
+    close(fd);
+    throwSystemError("fstat(capture)", err);
+  }
+  if (static_cast<size_t>(info.st_size) < sizeof(header_)) {
+    close(fd);
+    throw std::invalid_argument(path + " is not a capture segment");
+  }
+  size_ = info.st_size;
+  void *memory = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  int err = errno;
+  close(fd);
+  if (memory == MAP_FAILED) throwSystemError("mmap(capture)", err);
+  memory_ = static_cast<const uint8_t *>(memory);
+
+  std::memcpy(&header_, memory_, sizeof(header_));
+  if (header_.magic != CaptureFormat::kMagic ||
+      header_.formatVersion != CaptureFormat::kFormatVersion) {
+    munmap(memory, size_);
+    throw std::invalid_argument(path + " is not a capture segment");
+  }
+  // it is read front to back, once
+  madvise(memory, size_, MADV_SEQUENTIAL);
+}
+
+CaptureReader::~CaptureReader() {
+  munmap(const_cast<uint8_t *>(memory_), size_);
+}
+
+const CaptureFormat::RecordHeader *CaptureReader::getRecord(size_t pos) const {
+  if (size_ - pos < sizeof(CaptureFormat::RecordHeader)) return nullptr;
+  const auto *header =
+      reinterpret_cast<const CaptureFormat::RecordHeader *>(memory_ + pos);
+  // a capture that wasn't stopped may end in the middle of a record
+  if (size_ - pos < CaptureFormat::getRecordLength(*header)) return nullptr;
+  return header;
+}
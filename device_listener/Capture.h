@@ -0,0 +1,280 @@
+#ifndef Capture_H
+#define Capture_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MsgCounter.h"
+
+namespace DeviceListener {
+
+/**
+ * Layout of the capture segments, shared by the writer and the reader.
+ *
+ * A capture is a set of segment files `<prefix>.<worker>.<sequence>`, the
+ * records of every worker in the order they happened. A segment is a
+ * FileHeader followed by records: a RecordHeader and `length` bytes, padded
+ * with zeros to a multiple of 8. A record never spans two segments.
+ */
+struct CaptureFormat {
+  static const uint64_t kMagic = 0x3154504143564544;  // "DEVCAPT1"
+  static const uint32_t kFormatVersion = 1;
+  // records start at multiples of it, so their headers can be read in place
+  static const size_t kAlignment = 8;
+
+  enum RecordType : uint32_t {
+    // a connection was accepted, the data is the address of the peer
+    kOpen = 1,
+    // bytes read from the connection
+    kData = 2,
+    // the listener closed the connection, there is no data
+    kClose = 3
+  };
+
+  struct FileHeader {
+    uint64_t magic;
+    uint32_t formatVersion;
+    uint32_t worker;
+    uint64_t sequence;
+    uint64_t reserved;
+  };
+
+  struct RecordHeader {
+    // nanoseconds since the Unix epoch the record was taken at
+    uint64_t time;
+    // bytes of the connection's stream before the data of the record
+    uint64_t offset;
+    // unique among the connections of the worker
+    uint32_t connection;
+    uint32_t type;
+    uint32_t length;
+    uint32_t reserved;
+  };
+
+  static size_t getRecordLength(const RecordHeader &header) {
+    return sizeof(RecordHeader) +
+           ((header.length + kAlignment - 1) & ~(kAlignment - 1));
+  }
+
+  /**
+   * \brief name of a segment file
+   */
+  static std::string getSegmentPath(const std::string &prefix, size_t worker,
+                                    uint64_t sequence);
+};
+
+/**
+ * Records of one ingestion thread waiting to be written to the capture.
+ *
+ * The owner thread copies every record into a ring of bytes allocated at
+ * start; the capture thread writes them out and hands the space back. The
+ * owner never waits for the disk and never allocates: a record that doesn't
+ * fit the ring is dropped and counted, and the stream offsets of the records
+ * after it tell the replay about the gap.
+ */
+class CaptureShard {
+ public:
+  // bytes of the ring, a power of two
+  static const size_t kRingSize = 4 << 20;
+
+  CaptureShard();
+  CaptureShard(const CaptureShard &) = delete;
+  CaptureShard &operator=(CaptureShard const &) = delete;
+
+  /**
+   * \brief records a new connection, must be called from the owner thread
+   * only, like the other add*()
+   * \param peer address of the peer, for the humans reading the capture
+   * \return ID of the connection for its further records
+   */
+  uint32_t addOpen(const std::string &peer);
+
+  /**
+   * \brief records bytes read from the connection
+   * \param offset bytes of the connection recorded before these
+   */
+  void addData(uint32_t connection, uint64_t offset, const uint8_t *data,
+               size_t length) {
+    add(CaptureFormat::kData, connection, offset, data, length);
+  }
+
+  /**
+   * \brief records that the connection was closed
+   * \param offset bytes of the connection recorded
+   */
+  void addClose(uint32_t connection, uint64_t offset) {
+    add(CaptureFormat::kClose, connection, offset, nullptr, 0);
+  }
+
+  /**
+   * \brief returns the number of records lost because the capture thread
+   * was behind
+   */
+  uint64_t getDroppedCount() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+ protected:
+  friend class Capture;
+
+  std::unique_ptr<uint8_t[]> ring_;
+  // bytes ever added by the owner thread, and ever written by the capture
+  // thread; the ones between them are waiting
+  std::atomic<uint64_t> head_;
+  std::atomic<uint64_t> tail_;
+  std::atomic<uint64_t> dropped_;
+  uint32_t nextConnection_;
+
+  void add(CaptureFormat::RecordType type, uint32_t connection,
+           uint64_t offset, const void *data, size_t length);
+  void copyIn(uint64_t pos, const void *data, size_t length);
+  void copyOut(uint64_t pos, void *data, size_t length) const;
+};
+
+/**
+ * Raw byte streams of all the connections, with the time every read
+ * happened, for replaying them later without any sockets (see Replay).
+ *
+ * The ingestion threads fill their CaptureShards; a background thread
+ * appends what they hold to the current segment of each worker and starts
+ * a new one once it reaches the segment size. The segments are not synced:
+ * a capture is a benchmark input, not a record that must survive a crash,
+ * and a torn last record is ignored by the reader.
+ */
+class Capture {
+ public:
+  static const uint64_t kDefaultSegmentSize = 64 << 20;
+
+  /**
+   * \brief creates the first segment of every worker
+   * \param prefix path the segment names start with
+   * \param shardCount number of ingestion threads, each of them gets its own
+   * CaptureShard via getShard()
+   * \param segmentSize bytes after which a worker starts a new segment
+   * \throws boost::system::system_error if a segment can't be created, also
+   * if it exists already
+   * \note doesn't start the background thread, records wait in the shards
+   * until start() or stop()
+   */
+  Capture(const std::string &prefix, size_t shardCount,
+          uint64_t segmentSize = kDefaultSegmentSize);
+
+  /**
+   * \brief stop()s and closes the segments
+   */
+  ~Capture();
+  Capture(const Capture &) = delete;
+  Capture &operator=(Capture const &) = delete;
+
+  CaptureShard &getShard(size_t idx) { return *shards_[idx]; }
+  size_t getShardCount() const { return shards_.size(); }
+
+  /**
+   * \brief starts writing the records in a background thread
+   */
+  void start();
+
+  /**
+   * \brief writes out everything and stops the background thread if it was
+   * started; the ingestion threads must be stopped by then
+   */
+  void stop();
+
+  /**
+   * \brief returns the number of bytes written to the segments, headers
+   * included
+   */
+  uint64_t getBytesWritten() const {
+    return bytes_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief sums up CaptureShard::getDroppedCount() of all the threads and
+   * the records lost to write errors
+   */
+  uint64_t getDroppedCount() const;
+
+ protected:
+  struct Segment {
+    int fd;
+    uint64_t sequence;
+    uint64_t length;
+  };
+
+  std::string prefix_;
+  uint64_t segmentSize_;
+  std::vector<std::unique_ptr<CaptureShard>> shards_;
+  // owned by the thread writing the records
+  std::vector<Segment> segments_;
+  bool failed_;
+  std::atomic<bool> stopping_;
+  std::atomic<uint64_t> bytes_;
+  std::atomic<uint64_t> lost_;
+  std::thread thread_;
+
+  void run();
+
+  /**
+   * \brief writes the records added so far
+   * \return false if there were none
+   */
+  bool drain();
+
+  /**
+   * \brief writes the bytes [from, to) of the shard's ring to its segment
+   */
+  void write(size_t worker, uint64_t from, uint64_t to);
+
+  /**
+   * \brief closes the worker's segment and creates the next one
+   */
+  void rotate(size_t worker);
+
+  /**
+   * \brief creates the segment with the header
+   * \throws boost::system::system_error on failure
+   */
+  int create(size_t worker, uint64_t sequence);
+};
+
+/**
+ * Read-only view of one capture segment, mapped into memory.
+ */
+class CaptureReader {
+ public:
+  /**
+   * \brief maps the segment
+   * \throws boost::system::system_error if the file can't be mapped
+   * \throws std::invalid_argument if it is not a capture segment
+   */
+  explicit CaptureReader(const std::string &path);
+  ~CaptureReader();
+  CaptureReader(const CaptureReader &) = delete;
+  CaptureReader &operator=(CaptureReader const &) = delete;
+
+  uint32_t getWorker() const { return header_.worker; }
+  uint64_t getSequence() const { return header_.sequence; }
+
+  static size_t getFirstRecord() { return sizeof(CaptureFormat::FileHeader); }
+
+  /**
+   * \brief header of the record at pos, nullptr past the last complete one
+   */
+  const CaptureFormat::RecordHeader *getRecord(size_t pos) const;
+  const uint8_t *getData(size_t pos) const {
+    return memory_ + pos + sizeof(CaptureFormat::RecordHeader);
+  }
+
+ protected:
+  const uint8_t *memory_;
+  size_t size_;
+  CaptureFormat::FileHeader header_;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef Connection_H
+#define Connection_H
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <string>
+
+#include "FrameCodec.h"
+#include "HandlerAllocator.h"
+#include "Logger.h"
+#include "TokenBucket.h"
+
+namespace DeviceListener {
+
+struct FrameBlock;
+
+// a Unix domain stream socket, for the protocol bridges on the same host
+using UnixSocket = boost::asio::local::stream_protocol::socket;
+// an open serial line; boost::asio::serial_port can't wait for readability,
+// so SerialLine configures the line with it and hands the descriptor over
+using SerialStream = boost::asio::posix::stream_descriptor;
+
+/**
+ * What the frame reader needs to know about a stream type beyond reading and
+ * waiting on it: which source a connection is logged and admitted as, and
+ * what it is called in a capture.
+ */
+template <typename Stream>
+struct StreamTraits;
+
+template <>
+struct StreamTraits<boost::asio::ip::tcp::socket> {
+  // a connection has a source address to be admitted by
+  static constexpr bool kHasAddress = true;
+
+  /**
+   * \return the address of the peer, boost::none if it isn't connected
+   */
+  static boost::optional<boost::asio::ip::address> getPeer(
+      const boost::asio::ip::tcp::socket &socket) {
+    boost::system::error_code err;
+    auto endpoint = socket.remote_endpoint(err);
+    if (err) return boost::none;
+    return endpoint.address();
+  }
+
+  static std::string getName(boost::asio::ip::tcp::socket &socket) {
+    return getPeer(socket).value_or(boost::asio::ip::address()).to_string();
+  }
+};
+
+/**
+ * Local peers have no address: they are logged as the unspecified one and
+ * admitted without a source, see AdmissionControl::tryAdmitLocal().
+ */
+template <>
+struct StreamTraits<UnixSocket> {
+  static constexpr bool kHasAddress = false;
+
+  static boost::optional<boost::asio::ip::address> getPeer(
+      const UnixSocket &socket) {
+    boost::system::error_code err;
+    socket.remote_endpoint(err);
+    if (err) return boost::none;
+    return boost::asio::ip::address();
+  }
+
+  /**
+   * \return the path the connection was accepted on
+   */
+  static std::string getName(UnixSocket &socket) {
+    boost::system::error_code err;
+    auto endpoint = socket.local_endpoint(err);
+    return "unix:" + (err ? std::string() : endpoint.path());
+  }
+};
+
+template <>
+struct StreamTraits<SerialStream> {
+  static constexpr bool kHasAddress = false;
+
+  static boost::optional<boost::asio::ip::address> getPeer(
+      const SerialStream &stream) {
+    if (!stream.is_open()) return boost::none;
+    return boost::asio::ip::address();
+  }
+
+  /**
+   * \return the device the descriptor is open on
+   */
+  static std::string getName(SerialStream &stream) {
+    char path[256];
+    const std::string link =
+        "/proc/self/fd/" + std::to_string(stream.native_handle());
+    const ssize_t length = readlink(link.c_str(), path, sizeof(path));
+    return "serial:" + std::string(path, length > 0 ? length : 0);
+  }
+};
+
+/**
+ * State of one device connection, a fixed-size record of the transport's
+ * connection pool. Between reads a connection keeps nothing but the partial
+ * frame the last read ended with, so an idle one costs a few hundred bytes.
+ *
+ * Stream is what the frames arrive on: a TCP or Unix domain socket, or the
+ * descriptor of a serial line.
+ */
+template <typename Stream>
+struct BasicConnection {
+  // room for the partial frame of the typical small messages
+  static const size_t kInlineSize = 128;
+  // room for the pending wait on the socket
+  static const size_t kHandlerMemorySize = 160;
+
+  Stream socket;
+  // bytes of the partial frame carried over to the next read
+  uint16_t carried;
+  // the stream is being searched for a header, see FrameResync
+  bool resyncing;
+  // bytes skipped by the search so far
+  uint32_t skipped;
+  // the codec the stream is read with, see detectFrameFormat(); detected
+  // ones are Undetected until the first frame, or the first header a resync
+  // finds, tells
+  FrameFormat format;
+  // holds the partial frame when it is longer than kInlineSize
+  FrameBlock *spill;
+  uint8_t inlineBuffer[kInlineSize];
+  HandlerMemory<kHandlerMemorySize> handlerMemory;
+  // source the connection was admitted as and is released as, see
+  // AdmissionControl; it is logged as this one once the socket can't tell
+  boost::asio::ip::address peer;
+  // read budgets, used only if the transport limits the rates
+  TokenBucket bytesBudget;
+  TokenBucket framesBudget;
+  // the connection in the capture and the bytes captured, used only if the
+  // transport captures
+  uint32_t captureId;
+  uint64_t captured;
+
+  explicit BasicConnection(boost::asio::io_service &io_service)
+      : socket(io_service),
+        carried(0),
+        resyncing(false),
+        skipped(0),
+        format(FrameFormat::Undetected),
+        spill(nullptr),
+        captureId(0),
+        captured(0) {}
+  BasicConnection(const BasicConnection &) = delete;
+  BasicConnection &operator=(BasicConnection const &) = delete;
+  ~BasicConnection() {
+    // the socket may be already reset by peer or never connected at all
+    // (e.g. pending accept during shutdown), so don't log it then
+    auto peer = StreamTraits<Stream>::getPeer(socket);
+    if (peer) Logger::instance().log(Logger::Event::DeviceDisconnected, *peer);
+  }
+};
+
+template <typename Stream>
+const size_t BasicConnection<Stream>::kInlineSize;
+template <typename Stream>
+const size_t BasicConnection<Stream>::kHandlerMemorySize;
+
+using Connection = BasicConnection<boost::asio::ip::tcp::socket>;
+using UnixConnection = BasicConnection<UnixSocket>;
+using SerialConnection = BasicConnection<SerialStream>;
+
+template <typename Stream>
+class BasicRfcTransport;
+
+using RfcTransport = BasicRfcTransport<boost::asio::ip::tcp::socket>;
+using UnixTransport = BasicRfcTransport<UnixSocket>;
+using SerialTransport = BasicRfcTransport<SerialStream>;
+
+}  // namespace DeviceListener
+
+#endif
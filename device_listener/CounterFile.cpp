@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+#include "CounterFile.h"
+#include "SystemUtils.h"
+
+using namespace DeviceListener;
+
+const uint64_t CounterFile::kMagic;
+const uint32_t CounterFile::kFormatVersion;
+const size_t CounterFile::kHeaderSize;
+
+CounterFile::CounterFile(const std::string &path, size_t shardCount)
+    : memory_(nullptr),
+      size_(kHeaderSize + 3 * shardCount * sizeof(CounterShard)),
+      shardCount_(shardCount),
+      header_(nullptr) {
+  static_assert(sizeof(Header) <= kHeaderSize, "header must fit its page");
+  static_assert(kHeaderSize % kCacheLineSize == 0, "shards must stay aligned");
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) throwSystemError("open(state file)");
+  struct stat info;
+  if (fstat(fd, &info)) {
+    int err = errno;
+    close(fd);
+    throwSystemError("fstat(state file)", err);
+  }
+  const size_t fileSize = info.st_size;
+
+  // don't touch a healthy file written by a differently configured listener
+  Header existing;
+  if (fileSize >= sizeof(existing) &&
+      pread(fd, &existing, sizeof(existing), 0) ==
+          static_cast<ssize_t>(sizeof(existing)) &&
+      existing.magic == kMagic &&
+      existing.headerChecksum == getHeaderChecksum(existing) &&
+      existing.shardCount != shardCount) {
+    close(fd);
+    throw std::invalid_argument(
+        "state file " + path + " keeps " +
+        std::to_string(existing.shardCount) + " shards, start with -t " +
+        std::to_string(existing.shardCount) + " or use another file");
+  }
+
+  if (fileSize != size_ && ftruncate(fd, size_)) {
+    int err = errno;
+    close(fd);
+    throwSystemError("ftruncate(state file)", err);
+  }
+  void *memory =
+      mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int err = errno;
+  close(fd);
+  if (memory == MAP_FAILED) throwSystemError("mmap(state file)", err);
+  memory_ = static_cast<uint8_t *>(memory);
+  header_ = reinterpret_cast<Header *>(memory_);
+
+  if (!fileSize) {
+    reset(nullptr);
+  } else if (fileSize != size_ || header_->magic != kMagic ||
+             header_->headerChecksum != getHeaderChecksum(*header_) ||
+             header_->formatVersion != kFormatVersion ||
+             header_->deviceCount != CounterShard::kDeviceCount ||
+             header_->shardSize != sizeof(CounterShard)) {
+    reset("state file header is corrupted or of another format");
+  } else {
+    recover();
+  }
+
+  for (size_t i = 0; i < shardCount_; i++)
+    new (&getShards()[i].transport) TransportStats();
+  header_->clean = 0;
+  writeHeader();
+}
+
+CounterFile::~CounterFile() {
+  checkpoint();
+  sync(region(kLive), regionSize());
+  header_->liveChecksum = getChecksum(kLive);
+  header_->clean = 1;
+  writeHeader();
+  munmap(memory_, size_);
+}
+
+void CounterFile::checkpoint() {
+  const uint64_t generation = header_->generation + 1;
+  const int slot = generation % 2;
+  CounterShard *live = region(kLive);
+  CounterShard *copy = region(kSlot0 + slot);
+  for (size_t i = 0; i < shardCount_; i++) {
+    for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+      copy[i].counters[devId].store(
+          live[i].counters[devId].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+      copy[i].overflow[devId].store(
+          live[i].overflow[devId].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+      copy[i].bytes[devId].store(
+          live[i].bytes[devId].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+  }
+  const uint64_t checksum = getChecksum(kSlot0 + slot);
+  // the slot must be on disk before the header points to it
+  sync(copy, regionSize());
+  header_->slots[slot].generation = generation;
+  header_->slots[slot].checksum = checksum;
+  header_->generation = generation;
+  writeHeader();
+}
+
+uint64_t CounterFile::getChecksum(int idx) {
+  return mixWords(kChecksumSeed, region(idx), regionSize());
+}
+
+uint64_t CounterFile::getHeaderChecksum(const Header &header) {
+  return mixWords(kChecksumSeed, &header, offsetof(Header, headerChecksum));
+}
+
+void CounterFile::writeHeader() {
+  header_->headerChecksum = getHeaderChecksum(*header_);
+  sync(header_, sizeof(Header));
+}
+
+void CounterFile::sync(const void *begin, size_t length) {
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  const size_t offset = static_cast<const uint8_t *>(begin) - memory_;
+  const size_t aligned = offset / pageSize * pageSize;
+  if (msync(memory_ + aligned, offset - aligned + length, MS_SYNC))
+    std::cerr << "Failed to sync state file: " << strerror(errno)
+              << std::endl;
+}
+
+void CounterFile::recover() {
+  if (header_->clean && getChecksum(kLive) == header_->liveChecksum) return;
+
+  int newest = -1;
+  for (int slot = 0; slot < 2; slot++) {
+    const Header::Slot &info = header_->slots[slot];
+    if (!info.generation || getChecksum(kSlot0 + slot) != info.checksum)
+      continue;
+    if (newest < 0 || info.generation > header_->slots[newest].generation)
+      newest = slot;
+  }
+  if (newest < 0) {
+    reset(header_->clean ? "state file counters are corrupted"
+                         : "no valid checkpoint in state file after crash");
+    return;
+  }
+
+  // counters never go back, so a live region behind the checkpoint lost
+  // pages it had before; after a process crash it is just newer
+  const CounterShard *live = region(kLive);
+  const CounterShard *copy = region(kSlot0 + newest);
+  bool consistent = !header_->clean;
+  for (size_t i = 0; consistent && i < shardCount_; i++) {
+    for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+      if (live[i].counters[devId] < copy[i].counters[devId] ||
+          live[i].bytes[devId] < copy[i].bytes[devId]) {
+        consistent = false;
+        break;
+      }
+    }
+  }
+  if (consistent) {
+    std::cout << "Recovered counters after unclean shutdown" << std::endl;
+    return;
+  }
+
+  std::memcpy(static_cast<void *>(region(kLive)), copy, regionSize());
+  std::cerr << "Warning: state file counters are damaged, restored checkpoint "
+            << header_->slots[newest].generation
+            << ", messages counted after it are lost" << std::endl;
+}
+
+void CounterFile::reset(const char *reason) {
+  if (reason)
+    std::cerr << "Warning: " << reason << ", starting with zeroed counters"
+              << std::endl;
+  std::memset(memory_, 0, size_);
+  header_->magic = kMagic;
+  header_->formatVersion = kFormatVersion;
+  header_->deviceCount = CounterShard::kDeviceCount;
+  header_->shardCount = shardCount_;
+  header_->shardSize = sizeof(CounterShard);
+  sync(memory_, size_);
+  writeHeader();
+}
@@ -0,0 +1,114 @@
+#ifndef CounterFile_H
+#define CounterFile_H
+#include <cstdint>
+#include <string>
+
+#include "MsgCounter.h"
+
+namespace DeviceListener {
+
+/**
+ * Memory-mapped file holding the counter shards, so the counts survive
+ * restarts and crashes.
+ *
+ * The file is a header page followed by three regions of shardCount
+ * CounterShards: the live one, updated in place by the ingestion threads,
+ * and two checkpoint slots written alternately by checkpoint(). A slot is
+ * synced before the header names it, and every slot and the header carry a
+ * checksum, so a torn write leaves at most one of them invalid.
+ *
+ * On open:
+ * - a cleanly closed file is used as is after its checksum is verified;
+ * - after a crash the live region is kept if no counter in it is behind the
+ *   newest valid checkpoint (true unless the machine itself went down),
+ *   otherwise the checkpoint is copied over it;
+ * - anything unreadable falls back to zeroed counters with a warning.
+ * Transport statistics (connections, errors) describe one run and are reset.
+ */
+class CounterFile {
+ public:
+  static const uint64_t kMagic = 0x3154534c44564544;  // "DEVDLST1"
+  static const uint32_t kFormatVersion = 1;
+
+  /**
+   * \brief maps the file, creating it if needed, and recovers the counters
+   * \param path path to the state file
+   * \param shardCount number of shards to keep, the file must have been
+   * created with the same number
+   * \throws boost::system::system_error if the file can't be mapped
+   * \throws std::invalid_argument on shard count mismatch, the file is left
+   * untouched then
+   */
+  CounterFile(const std::string &path, size_t shardCount);
+
+  /**
+   * \brief takes the last checkpoint and marks the file clean, all the
+   * writers must be stopped by then
+   */
+  ~CounterFile();
+
+  CounterShard *getShards() { return region(kLive); }
+
+  /**
+   * \brief copies the live counters into the older checkpoint slot, syncs it
+   * and makes it the newest one; must not run concurrently with itself
+   */
+  void checkpoint();
+
+  /**
+   * \brief generation of the newest checkpoint, 0 if there was none
+   */
+  uint64_t getGeneration() const { return header_->generation; }
+
+ protected:
+  struct Header {
+    uint64_t magic;
+    uint32_t formatVersion;
+    uint32_t deviceCount;
+    uint64_t shardCount;
+    uint64_t shardSize;
+    // generation of the newest checkpoint, it is in slots[generation % 2]
+    uint64_t generation;
+    // 1 if closed cleanly, the live region matches liveChecksum then
+    uint64_t clean;
+    uint64_t liveChecksum;
+    struct Slot {
+      uint64_t generation;
+      uint64_t checksum;
+    } slots[2];
+    // checksum of all the fields above
+    uint64_t headerChecksum;
+  };
+
+  enum Region { kLive, kSlot0, kSlot1 };
+
+  static const size_t kHeaderSize = 4096;
+
+  CounterFile(CounterFile const &) = delete;
+  CounterFile &operator=(CounterFile const &) = delete;
+
+  uint8_t *memory_;
+  size_t size_;
+  size_t shardCount_;
+  Header *header_;
+
+  CounterShard *region(int idx) {
+    return reinterpret_cast<CounterShard *>(memory_ + kHeaderSize) +
+           idx * shardCount_;
+  }
+  size_t regionSize() const { return shardCount_ * sizeof(CounterShard); }
+
+  uint64_t getChecksum(int idx);
+  static uint64_t getHeaderChecksum(const Header &header);
+  void writeHeader();
+  void sync(const void *begin, size_t length);
+  /**
+   * \brief decides what's trustworthy in a mapped file of the right layout
+   */
+  void recover();
+  void reset(const char *reason);
+};
+
+}  // namespace DeviceListener
+
+#endif
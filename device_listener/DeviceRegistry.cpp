@@ -0,0 +1,200 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "DeviceRegistry.h"
+
+using namespace DeviceListener;
+
+const uint64_t DeviceRegistry::kMagic;
+const uint32_t DeviceRegistry::kFormatVersion;
+const size_t DeviceRegistry::kDeviceCount;
+
+namespace {
+
+const size_t kOffsetsLength = (DeviceRegistry::kDeviceCount + 1) *
+                              sizeof(uint32_t);
+const size_t kKnownLength = DeviceRegistry::kDeviceCount / 8;
+
+/**
+ * \brief parses a device ID the way the file format allows: optional
+ * leading blanks, then decimal digits only
+ * \return true if [begin, end) is a valid ID
+ */
+bool parseDeviceId(const char *begin, const char *end, uint16_t &devId) {
+  while (begin != end && (*begin == ' ' || *begin == '\t')) begin++;
+  if (begin == end) return false;
+  uint32_t value = 0;
+  for (; begin != end; begin++) {
+    if (*begin < '0' || *begin > '9') return false;
+    value = value * 10 + (*begin - '0');
+    if (value >= DeviceRegistry::kDeviceCount) return false;
+  }
+  devId = value;
+  return true;
+}
+
+}  // namespace
+
+DeviceRegistry::DeviceRegistry() {
+  image_.resize(getImageLength(0));
+  Header header = {kMagic, kFormatVersion, 0, 0};
+  std::memcpy(image_.data(), &header, sizeof(header));
+  attach(image_.data(), image_.size());
+}
+
+size_t DeviceRegistry::getImageLength(uint64_t namesLength) {
+  return sizeof(Header) + kOffsetsLength + kKnownLength + namesLength;
+}
+
+bool DeviceRegistry::attach(const uint8_t *image, size_t length) {
+  if (length < getImageLength(0)) return false;
+  header_ = reinterpret_cast<const Header *>(image);
+  if (header_->magic != kMagic || header_->formatVersion != kFormatVersion ||
+      length != getImageLength(header_->namesLength))
+    return false;
+  offsets_ = reinterpret_cast<const uint32_t *>(image + sizeof(Header));
+  known_ = image + sizeof(Header) + kOffsetsLength;
+  names_ = reinterpret_cast<const char *>(known_ + kKnownLength);
+
+  // cheap enough to do on every load and keeps getName() free of checks
+  if (offsets_[0] != 0 || offsets_[kDeviceCount] != header_->namesLength)
+    return false;
+  size_t known = 0;
+  for (size_t id = 0; id < kDeviceCount; id++) {
+    if (offsets_[id] > offsets_[id + 1]) return false;
+    known += isKnown(id);
+  }
+  return known == header_->deviceCount;
+}
+
+boost::string_view DeviceRegistry::getName(uint16_t id) const {
+  if (!isKnown(id)) return "Unknown device";
+  return boost::string_view(names_ + offsets_[id],
+                            offsets_[id + 1] - offsets_[id]);
+}
+
+std::shared_ptr<const DeviceRegistry> DeviceRegistry::parse(const char *data,
+                                                            size_t length) {
+  // the last description of a device wins
+  std::vector<boost::string_view> names(kDeviceCount);
+  std::vector<bool> described(kDeviceCount);
+  size_t lineNum = 0;
+  const char *end = data + length;
+  for (const char *line = data; line < end;) {
+    lineNum++;
+    const char *lineEnd =
+        static_cast<const char *>(std::memchr(line, '\n', end - line));
+    if (!lineEnd) lineEnd = end;
+    const char *next = lineEnd + 1;
+    if (lineEnd != line && lineEnd[-1] == '\r') lineEnd--;
+
+    const char *colon =
+        static_cast<const char *>(std::memchr(line, ':', lineEnd - line));
+    uint16_t devId;
+    if (!colon) {
+      if (lineEnd != line)
+        std::cerr << "Wrong device description format at line " << lineNum
+                  << std::endl;
+    } else if (!parseDeviceId(line, colon, devId)) {
+      std::cerr << "Wrong device ID at line " << lineNum << std::endl;
+    } else {
+      // the name ends at the next separator, if any
+      const char *nameEnd = static_cast<const char *>(
+          std::memchr(colon + 1, ':', lineEnd - colon - 1));
+      if (!nameEnd) nameEnd = lineEnd;
+      names[devId] = boost::string_view(colon + 1, nameEnd - colon - 1);
+      described[devId] = true;
+    }
+    line = next;
+  }
+
+  uint64_t namesLength = 0;
+  uint32_t deviceCount = 0;
+  for (size_t id = 0; id < kDeviceCount; id++) {
+    namesLength += names[id].size();
+    deviceCount += described[id];
+  }
+
+  std::shared_ptr<DeviceRegistry> registry(new DeviceRegistry());
+  std::vector<uint8_t> &image = registry->image_;
+  image.assign(getImageLength(namesLength), 0);
+  Header header = {kMagic, kFormatVersion, deviceCount, namesLength};
+  std::memcpy(image.data(), &header, sizeof(header));
+  uint32_t *offsets = reinterpret_cast<uint32_t *>(&image[sizeof(Header)]);
+  uint8_t *known = &image[sizeof(Header) + kOffsetsLength];
+  char *out = reinterpret_cast<char *>(known + kKnownLength);
+  uint32_t offset = 0;
+  for (size_t id = 0; id < kDeviceCount; id++) {
+    offsets[id] = offset;
+    if (described[id]) known[id >> 3] |= 1 << (id & 7);
+    std::memcpy(out + offset, names[id].data(), names[id].size());
+    offset += names[id].size();
+  }
+  offsets[kDeviceCount] = offset;
+  registry->attach(image.data(), image.size());
+  return registry;
+}
+
+std::shared_ptr<const DeviceRegistry> DeviceRegistry::load(
+    const std::string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info)) {
+    std::cerr << "Failed to open device description file: " << filename
+              << std::endl;
+    if (fd >= 0) close(fd);
+    return nullptr;
+  }
+  // read rather than mapped: a mapping would fault if the file shrank under
+  // a registry in use
+  std::vector<uint8_t> data(info.st_size);
+  size_t length = 0;
+  while (length < data.size()) {
+    ssize_t count = read(fd, &data[length], data.size() - length);
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0) {
+      std::cerr << "Failed to read device description file: " << filename
+                << std::endl;
+      close(fd);
+      return nullptr;
+    }
+    // shortened since fstat()
+    if (count == 0) break;
+    length += count;
+  }
+  close(fd);
+  data.resize(length);
+
+  uint64_t magic = 0;
+  if (length >= sizeof(magic)) std::memcpy(&magic, data.data(), sizeof(magic));
+  if (magic != kMagic)
+    return parse(reinterpret_cast<const char *>(data.data()), length);
+
+  std::shared_ptr<DeviceRegistry> registry(new DeviceRegistry());
+  registry->image_.swap(data);
+  if (!registry->attach(registry->image_.data(), registry->image_.size())) {
+    std::cerr << "Device registry is damaged: " << filename << std::endl;
+    return nullptr;
+  }
+  return registry;
+}
+
+bool DeviceRegistry::save(const std::string &filename) const {
+  // renamed over the old file, so load() reads either of them whole
+  const std::string temporary = filename + ".tmp";
+  std::ofstream outfile(temporary, std::ios::binary | std::ios::trunc);
+  outfile.write(reinterpret_cast<const char *>(header_),
+                getImageLength(header_->namesLength));
+  outfile.close();
+  if (outfile.fail() || std::rename(temporary.c_str(), filename.c_str())) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
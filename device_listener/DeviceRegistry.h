@@ -0,0 +1,104 @@
+#ifndef DeviceRegistry_H
+#define DeviceRegistry_H
+#include <boost/utility/string_view.hpp>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace DeviceListener {
+
+/**
+ * Immutable table of human-readable device names.
+ *
+ * In memory it is a single flat image: a header, name offsets of all the
+ * 65536 device IDs, a bitmap of the described ones and the names glued
+ * together. save() writes this image as is, so a precompiled registry is
+ * loaded by reading the file into memory, without any parsing. The image
+ * is always owned by the registry, so the file may be replaced or
+ * truncated while a loaded registry is in use.
+ */
+class DeviceRegistry {
+ public:
+  static const uint64_t kMagic = 0x3147455256454420;  // " DEVREG1"
+  static const uint32_t kFormatVersion = 1;
+  static const size_t kDeviceCount = 65536;
+
+  /**
+   * \brief creates a registry without any devices
+   */
+  DeviceRegistry();
+
+  /**
+   * \brief loads a registry, either a precompiled binary one or a text file
+   * of "deviceID:deviceName" lines; wrong lines of a text file are reported
+   * to stderr and skipped
+   * \param filename path to the devices descriptions file
+   * \return the registry, nullptr if the file can't be read or a binary one
+   * is damaged
+   */
+  static std::shared_ptr<const DeviceRegistry> load(
+      const std::string &filename);
+
+  /**
+   * \brief parses "deviceID:deviceName" lines
+   * \param data text of the file, doesn't have to be null-terminated
+   * \param length length of the text
+   */
+  static std::shared_ptr<const DeviceRegistry> parse(const char *data,
+                                                     size_t length);
+
+  /**
+   * \brief writes the precompiled binary form of the registry to a temporary
+   * file next to filename and renames it over filename, so a reader never
+   * sees a partial file
+   * \return false if the file can't be written
+   */
+  bool save(const std::string &filename) const;
+
+  bool isKnown(uint16_t id) const { return known_[id >> 3] & (1 << (id & 7)); }
+
+  /**
+   * \brief gathers human-readable device name by it ID
+   * \return human-readable device name if any, "Unknown device" if not found;
+   * valid as long as the registry is
+   */
+  boost::string_view getName(uint16_t id) const;
+
+  /**
+   * \brief number of the described devices
+   */
+  size_t size() const { return header_->deviceCount; }
+
+ private:
+  struct Header {
+    uint64_t magic;
+    uint32_t formatVersion;
+    uint32_t deviceCount;
+    uint64_t namesLength;
+  };
+
+  // image built in memory or read from a file
+  std::vector<uint8_t> image_;
+
+  const Header *header_;
+  // name of device i is names_[offsets_[i], offsets_[i + 1])
+  const uint32_t *offsets_;
+  const uint8_t *known_;
+  const char *names_;
+
+  DeviceRegistry(DeviceRegistry const &) = delete;
+  DeviceRegistry &operator=(DeviceRegistry const &) = delete;
+
+  static size_t getImageLength(uint64_t namesLength);
+
+  /**
+   * \brief points the accessors into the image after validating it
+   * \return false if the image is damaged
+   */
+  bool attach(const uint8_t *image, size_t length);
+};
+
+}  // namespace DeviceListener
+
+#endif
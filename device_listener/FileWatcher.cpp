@@ -0,0 +1,57 @@
+#include <sys/inotify.h>
+#include <boost/bind.hpp>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#include "FileWatcher.h"
+#include "SystemUtils.h"
+
+using namespace DeviceListener;
+
+FileWatcher::FileWatcher(boost::asio::io_service &ioservice,
+                         const std::string &path,
+                         std::function<void()> onChange)
+    : descriptor_(ioservice), onChange_(std::move(onChange)) {
+  auto slash = path.rfind('/');
+  directory_ = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+  name_ = slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+void FileWatcher::start() {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) throwSystemError("inotify_init1");
+  descriptor_.assign(fd);
+  if (inotify_add_watch(fd, directory_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) <
+      0)
+    throwSystemError("inotify_add_watch");
+  startReading();
+}
+
+void FileWatcher::startReading() {
+  auto handler = boost::bind(&FileWatcher::handleRead, this,
+                             boost::asio::placeholders::error,
+                             boost::asio::placeholders::bytes_transferred);
+  descriptor_.async_read_some(boost::asio::buffer(buffer_), handler);
+}
+
+void FileWatcher::handleRead(boost::system::error_code const &err,
+                             size_t length) {
+  if (err) {
+    if (err != boost::asio::error::operation_aborted)
+      std::cerr << "Error occured during 'read' call: " << err.message()
+                << std::endl;
+    return;
+  }
+
+  bool changed = false;
+  for (size_t offset = 0; offset + sizeof(inotify_event) <= length;) {
+    inotify_event event;
+    std::memcpy(&event, buffer_ + offset, sizeof(event));
+    const char *name = buffer_ + offset + sizeof(event);
+    if (event.len && name_ == name) changed = true;
+    offset += sizeof(event) + event.len;
+  }
+  if (changed) onChange_();
+  startReading();
+}
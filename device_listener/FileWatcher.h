@@ -0,0 +1,41 @@
+#ifndef FileWatcher_H
+#define FileWatcher_H
+#include <boost/asio.hpp>
+#include <functional>
+#include <string>
+
+namespace DeviceListener {
+
+/**
+ * Calls back whenever a file is rewritten or replaced, using inotify on the
+ * directory of the file, so editors saving via rename are caught as well.
+ */
+class FileWatcher {
+ public:
+  /**
+   * \param path file to watch, it may not exist yet
+   * \param onChange called from ioservice after a batch of changes
+   */
+  FileWatcher(boost::asio::io_service &ioservice, const std::string &path,
+              std::function<void()> onChange);
+
+  /**
+   * \brief starts watching, throws boost::system::system_error on failure
+   */
+  void start();
+
+ protected:
+  boost::asio::posix::stream_descriptor descriptor_;
+  std::string directory_;
+  std::string name_;
+  std::function<void()> onChange_;
+  // room for a batch of inotify events
+  alignas(8) char buffer_[4096];
+
+  void startReading();
+  void handleRead(boost::system::error_code const &err, size_t length);
+};
+
+}  // namespace DeviceListener
+
+#endif
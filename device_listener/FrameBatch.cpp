@@ -0,0 +1,249 @@
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_BATCH_X86
+#endif
+
+#include "FrameBatch.h"
+
+using namespace DeviceListener;
+
+const size_t FrameBatch::kCapacity;
+
+namespace {
+
+inline uint32_t load32(const uint8_t *data) {
+  uint32_t value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+template <typename Codec>
+void validateScalar(const uint8_t *data, FrameBatch &batch, size_t from) {
+  for (size_t i = from; i < batch.count; i++) {
+    const uint8_t *frame = data + batch.offsets[i];
+    const bool valid = Codec::isValidHeader(frame);
+    batch.valid[i] = valid;
+    // a located frame holds a whole payload header
+    batch.deviceIds[i] = valid ? Codec::getDeviceId(frame) : 0;
+  }
+}
+
+#ifdef FRAME_BATCH_X86
+
+// Both headers of a frame are read as little-endian dwords: the RFC1006 one
+// gives version in the low byte and length in the high word, the first dword
+// of the payload header gives deviceId in its low word. A big-endian codec
+// swaps the bytes of those words, the little-endian one has no swap at all.
+
+template <typename Codec>
+void assumeLayout() {
+  using Layout = typename Codec::Layout;
+  static_assert(Layout::kVersionOffset == 0 && Layout::kLengthOffset == 2,
+                "header layout is assumed by the vector code");
+  static_assert(Layout::kDeviceIdOffset == Layout::kHeaderLength,
+                "header layout is assumed by the vector code");
+  static_assert(kNativeByteOrder == ByteOrder::Little,
+                "x86 is little-endian");
+}
+
+/**
+ * \brief takes the 16-bit values in the low words of the lanes, whose high
+ * words are zero, to the native order
+ */
+inline __m128i toNativeWords(__m128i words, std::false_type) { return words; }
+
+inline __m128i toNativeWords(__m128i words, std::true_type) {
+  return _mm_and_si128(
+      _mm_or_si128(_mm_srli_epi32(words, 8), _mm_slli_epi32(words, 8)),
+      _mm_set1_epi32(0xFFFF));
+}
+
+__attribute__((target("avx2"))) inline __m256i toNativeWords(
+    __m256i words, std::false_type) {
+  return words;
+}
+
+__attribute__((target("avx2"))) inline __m256i toNativeWords(
+    __m256i words, std::true_type) {
+  return _mm256_and_si256(
+      _mm256_or_si256(_mm256_srli_epi32(words, 8), _mm256_slli_epi32(words, 8)),
+      _mm256_set1_epi32(0xFFFF));
+}
+
+template <typename Codec>
+void validateSse2(const uint8_t *data, FrameBatch &batch) {
+  assumeLayout<Codec>();
+  using Layout = typename Codec::Layout;
+  const std::integral_constant<bool, Codec::kSwapped> swapped{};
+  const size_t kHeaderLength = Layout::kHeaderLength;
+  const __m128i versionMask = _mm_set1_epi32(0xFF);
+  const __m128i version = _mm_set1_epi32(Codec::kVersion);
+  // lengths are compared as signed 32-bit values, they fit easily
+  const __m128i minLength = _mm_set1_epi32(Layout::kMinLength - 1);
+  const __m128i maxLength = _mm_set1_epi32(Layout::kMaxLength + 1);
+
+  size_t i = 0;
+  for (; i + 4 <= batch.count; i += 4) {
+    const uint32_t *off = &batch.offsets[i];
+    __m128i headers =
+        _mm_set_epi32(load32(data + off[3]), load32(data + off[2]),
+                      load32(data + off[1]), load32(data + off[0]));
+    __m128i payloads = _mm_set_epi32(
+        load32(data + off[3] + kHeaderLength),
+        load32(data + off[2] + kHeaderLength),
+        load32(data + off[1] + kHeaderLength),
+        load32(data + off[0] + kHeaderLength));
+
+    __m128i lengths = toNativeWords(_mm_srli_epi32(headers, 16), swapped);
+    __m128i ok = _mm_cmpeq_epi32(_mm_and_si128(headers, versionMask), version);
+    ok = _mm_and_si128(ok, _mm_cmpgt_epi32(lengths, minLength));
+    ok = _mm_and_si128(ok, _mm_cmplt_epi32(lengths, maxLength));
+
+    __m128i valid = _mm_packs_epi32(ok, ok);
+    valid = _mm_and_si128(_mm_packs_epi16(valid, valid), _mm_set1_epi8(1));
+    uint32_t validBytes = _mm_cvtsi128_si32(valid);
+    std::memcpy(&batch.valid[i], &validBytes, sizeof(validBytes));
+
+    // keep deviceId of valid frames only and narrow it to 16 bits; SSE2 has
+    // only the signed pack, so the values are biased into int16 range first
+    __m128i ids = toNativeWords(
+        _mm_and_si128(_mm_and_si128(payloads, ok), _mm_set1_epi32(0xFFFF)),
+        swapped);
+    ids = _mm_sub_epi32(ids, _mm_set1_epi32(0x8000));
+    ids = _mm_packs_epi32(ids, ids);
+    ids = _mm_add_epi16(ids, _mm_set1_epi16(static_cast<short>(0x8000)));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(&batch.deviceIds[i]), ids);
+  }
+  validateScalar<Codec>(data, batch, i);
+}
+
+template <typename Codec>
+__attribute__((target("avx2"))) void validateAvx2(const uint8_t *data,
+                                                  FrameBatch &batch) {
+  assumeLayout<Codec>();
+  using Layout = typename Codec::Layout;
+  const std::integral_constant<bool, Codec::kSwapped> swapped{};
+  const __m256i versionMask = _mm256_set1_epi32(0xFF);
+  const __m256i version = _mm256_set1_epi32(Codec::kVersion);
+  const __m256i minLength = _mm256_set1_epi32(Layout::kMinLength - 1);
+  const __m256i maxLength = _mm256_set1_epi32(Layout::kMaxLength + 1);
+  const __m256i idMask = _mm256_set1_epi32(0xFFFF);
+  const int *base = reinterpret_cast<const int *>(data);
+  const int *payloadBase =
+      reinterpret_cast<const int *>(data + Layout::kHeaderLength);
+
+  size_t i = 0;
+  for (; i + 8 <= batch.count; i += 8) {
+    __m256i off = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(&batch.offsets[i]));
+    __m256i headers = _mm256_i32gather_epi32(base, off, 1);
+    __m256i payloads = _mm256_i32gather_epi32(payloadBase, off, 1);
+
+    __m256i lengths = toNativeWords(_mm256_srli_epi32(headers, 16), swapped);
+    __m256i ok =
+        _mm256_cmpeq_epi32(_mm256_and_si256(headers, versionMask), version);
+    ok = _mm256_and_si256(ok, _mm256_cmpgt_epi32(lengths, minLength));
+    ok = _mm256_and_si256(ok, _mm256_cmpgt_epi32(maxLength, lengths));
+
+    __m128i valid = _mm_packs_epi32(_mm256_castsi256_si128(ok),
+                                    _mm256_extracti128_si256(ok, 1));
+    valid = _mm_and_si128(_mm_packs_epi16(valid, valid), _mm_set1_epi8(1));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(&batch.valid[i]), valid);
+
+    // packus works within 128-bit lanes, so fix the order afterwards
+    __m256i ids = toNativeWords(
+        _mm256_and_si256(_mm256_and_si256(payloads, ok), idMask), swapped);
+    ids = _mm256_packus_epi32(ids, ids);
+    ids = _mm256_permute4x64_epi64(ids, 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&batch.deviceIds[i]),
+                     _mm256_castsi256_si128(ids));
+  }
+  validateScalar<Codec>(data, batch, i);
+}
+
+#endif
+
+}  // namespace
+
+template <typename Codec>
+void FrameBatch::locate(const uint8_t *data, size_t dataLength) {
+  const size_t kHeaderLength = Codec::Layout::kHeaderLength;
+  count = 0;
+  length = 0;
+  stop = Stop::Incomplete;
+
+  while (dataLength - length >= kHeaderLength) {
+    if (count == kCapacity) {
+      stop = Stop::Full;
+      return;
+    }
+    const uint16_t payloadLength = Codec::getLength(data + length);
+    if (!Codec::isValidLength(payloadLength)) {
+      stop = Stop::InvalidLength;
+      return;
+    }
+    if (dataLength - length - kHeaderLength < payloadLength) return;
+
+    offsets[count] = static_cast<uint32_t>(length);
+    frameLengths[count++] = kHeaderLength + payloadLength;
+    length += kHeaderLength + payloadLength;
+  }
+}
+
+template <typename Codec>
+void FrameBatch::decode(const uint8_t *data) {
+  // every located frame holds a whole payload header
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t *frame = data + offsets[i];
+    measurementTags[i] = Codec::getMeasurementTag(frame);
+    measurementTypes[i] = Codec::getMeasurementType(frame);
+    timestamps[i] = Codec::getTimestamp(frame);
+  }
+}
+
+template <typename Codec>
+void FrameBatch::validate(const uint8_t *data, SimdLevel level) {
+  switch (level) {
+#ifdef FRAME_BATCH_X86
+    case SimdLevel::Avx2:
+      validateAvx2<Codec>(data, *this);
+      break;
+    case SimdLevel::Sse2:
+      validateSse2<Codec>(data, *this);
+      break;
+#endif
+    default:
+      validateScalar<Codec>(data, *this, 0);
+      break;
+  }
+}
+
+FrameBatch::SimdLevel FrameBatch::getSimdLevel() {
+#ifdef FRAME_BATCH_X86
+  static const SimdLevel level = __builtin_cpu_supports("avx2")
+                                     ? SimdLevel::Avx2
+                                     : __builtin_cpu_supports("sse2")
+                                           ? SimdLevel::Sse2
+                                           : SimdLevel::Scalar;
+  return level;
+#else
+  return SimdLevel::Scalar;
+#endif
+}
+
+// every codec of FrameFormat
+template void FrameBatch::locate<FrameCodec<0, ByteOrder::Little>>(
+    const uint8_t *, size_t);
+template void FrameBatch::validate<FrameCodec<0, ByteOrder::Little>>(
+    const uint8_t *, SimdLevel);
+template void FrameBatch::decode<FrameCodec<0, ByteOrder::Little>>(
+    const uint8_t *);
+template void FrameBatch::locate<FrameCodec<0, ByteOrder::Big>>(
+    const uint8_t *, size_t);
+template void FrameBatch::validate<FrameCodec<0, ByteOrder::Big>>(
+    const uint8_t *, SimdLevel);
+template void FrameBatch::decode<FrameCodec<0, ByteOrder::Big>>(
+    const uint8_t *);
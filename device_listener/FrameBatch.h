@@ -0,0 +1,105 @@
+#ifndef FrameBatch_H
+#define FrameBatch_H
+#include <cstddef>
+#include <cstdint>
+
+#include "FrameCodec.h"
+
+namespace DeviceListener {
+
+/**
+ * Structure-of-arrays description of back-to-back frames found in one chunk
+ * of the received stream.
+ *
+ * The frames are read with a FrameCodec, the native one unless told
+ * otherwise; every codec of FrameFormat is instantiated in FrameBatch.cpp.
+ */
+struct FrameBatch {
+  static const size_t kCapacity = 256;
+
+  enum class SimdLevel { Scalar, Sse2, Avx2 };
+
+  enum class Stop {
+    // the rest of the data is a partial frame (or nothing)
+    Incomplete,
+    // the next frame has a length out of the protocol bounds
+    InvalidLength,
+    // kCapacity frames located, there may be more in the data
+    Full
+  };
+
+  // offset of every frame's RFC1006 header from the beginning of the data
+  uint32_t offsets[kCapacity];
+  // bytes taken by every frame, RFC1006 header included
+  uint16_t frameLengths[kCapacity];
+  // device ID from the payload header, meaningful only if valid[i]
+  uint16_t deviceIds[kCapacity];
+  // 1 if the frame passes the codec's isValidHeader()
+  uint8_t valid[kCapacity];
+  // from the payload header, filled only if withMetadata is set
+  uint16_t measurementTags[kCapacity];
+  uint16_t measurementTypes[kCapacity];
+  uint32_t timestamps[kCapacity];
+  // number of located frames
+  size_t count;
+  // number of bytes taken by the located frames
+  size_t length;
+  Stop stop;
+  // scan() decodes the measurement metadata as well
+  bool withMetadata = false;
+
+  /**
+   * \brief walks through the frame lengths and fills offsets, frameLengths,
+   * count, length and stop; the walk is serial by nature, so it does nothing
+   * else
+   * \param data beginning of the received bytes, must start at a frame boundary
+   * \param length number of received bytes
+   */
+  template <typename Codec = NativeFrameCodec>
+  void locate(const uint8_t *data, size_t length);
+
+  /**
+   * \brief fills valid and deviceIds for all the located frames using the
+   * best instruction set supported by the CPU
+   * \param data the same pointer locate() was called with
+   */
+  template <typename Codec = NativeFrameCodec>
+  void validate(const uint8_t *data) {
+    validate<Codec>(data, getSimdLevel());
+  }
+
+  /**
+   * \brief validate() with the explicitly chosen implementation, the level
+   * must be supported by the CPU
+   */
+  template <typename Codec = NativeFrameCodec>
+  void validate(const uint8_t *data, SimdLevel level);
+
+  /**
+   * \brief fills measurementTags, measurementTypes and timestamps for all
+   * the located frames
+   * \param data the same pointer locate() was called with
+   */
+  template <typename Codec = NativeFrameCodec>
+  void decode(const uint8_t *data);
+
+  /**
+   * \brief locate() and validate() in one call, and decode() if
+   * withMetadata is set
+   */
+  template <typename Codec = NativeFrameCodec>
+  void scan(const uint8_t *data, size_t length) {
+    locate<Codec>(data, length);
+    validate<Codec>(data);
+    if (withMetadata) decode<Codec>(data);
+  }
+
+  /**
+   * \brief returns the widest instruction set detected at runtime
+   */
+  static SimdLevel getSimdLevel();
+};
+
+}  // namespace DeviceListener
+
+#endif
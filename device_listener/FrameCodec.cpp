@@ -0,0 +1,69 @@
+#include "FrameCodec.h"
+
+using namespace DeviceListener;
+
+constexpr size_t FrameLayout<0>::kHeaderLength;
+constexpr size_t FrameLayout<0>::kVersionOffset;
+constexpr size_t FrameLayout<0>::kLengthOffset;
+constexpr size_t FrameLayout<0>::kPayloadHeaderLength;
+constexpr size_t FrameLayout<0>::kDeviceIdOffset;
+constexpr size_t FrameLayout<0>::kTagOffset;
+constexpr size_t FrameLayout<0>::kTimestampOffset;
+constexpr size_t FrameLayout<0>::kTypeOffset;
+constexpr size_t FrameLayout<0>::kDataLengthOffset;
+constexpr uint16_t FrameLayout<0>::kMinLength;
+constexpr uint16_t FrameLayout<0>::kMaxLength;
+
+namespace {
+
+template <uint8_t Version>
+FrameFormat detectByteOrder(const uint8_t *frame, size_t length,
+                            FrameFormat little, FrameFormat big) {
+  using Little = FrameCodec<Version, ByteOrder::Little>;
+  using Big = FrameCodec<Version, ByteOrder::Big>;
+  const FrameFormat native =
+      kNativeByteOrder == ByteOrder::Little ? little : big;
+  const bool inLittle = Little::isValidHeader(frame);
+  const bool inBig = Big::isValidHeader(frame);
+  if (inLittle != inBig) return inLittle ? little : big;
+  using Layout = FrameLayout<Version>;
+  if (inLittle &&
+      length < Layout::kHeaderLength + Layout::kPayloadHeaderLength)
+    return FrameFormat::Undetected;
+  // a length whose bytes read within bounds either way, 16 and 0x1000 for
+  // one; the data lengths can't agree in both orders then
+  if (inLittle && Little::isConsistent(frame) != Big::isConsistent(frame))
+    return Little::isConsistent(frame) ? little : big;
+  return native;
+}
+
+}  // namespace
+
+bool DeviceListener::isValidInAnyFormat(const uint8_t *frame) {
+  return FrameCodec<0, ByteOrder::Little>::isValidHeader(frame) ||
+         FrameCodec<0, ByteOrder::Big>::isValidHeader(frame);
+}
+
+FrameFormat DeviceListener::detectFrameFormat(const uint8_t *data,
+                                              size_t length,
+                                              ByteOrderMode mode) {
+  const FrameFormat native = kNativeByteOrder == ByteOrder::Little
+                                 ? FrameFormat::Version0Little
+                                 : FrameFormat::Version0Big;
+  // a stream in a given order is read in it whatever its first bytes are,
+  // garbage included; that is for the codec to reject
+  switch (mode) {
+    case ByteOrderMode::Native:
+      return native;
+    case ByteOrderMode::Little:
+      return FrameFormat::Version0Little;
+    case ByteOrderMode::Big:
+      return FrameFormat::Version0Big;
+    default:
+      break;
+  }
+  if (length < FrameLayout<0>::kHeaderLength || !isValidInAnyFormat(data))
+    return FrameFormat::Undetected;
+  return detectByteOrder<0>(data, length, FrameFormat::Version0Little,
+                            FrameFormat::Version0Big);
+}
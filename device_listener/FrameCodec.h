@@ -0,0 +1,217 @@
+#ifndef FrameCodec_H
+#define FrameCodec_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "RfcMessage.h"
+
+namespace DeviceListener {
+
+enum class ByteOrder : uint8_t { Little, Big };
+
+constexpr ByteOrder kNativeByteOrder =
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? ByteOrder::Big : ByteOrder::Little;
+
+/**
+ * Byte order of the devices' frames, as the listener is told.
+ */
+enum class ByteOrderMode {
+  // the byte order of this machine
+  Native,
+  Little,
+  Big,
+  // every connection is read in the order its first frame makes sense in,
+  // see detectFrameFormat()
+  Detect
+};
+
+/**
+ * Offsets and bounds of one protocol version, specialized for every version
+ * the listener speaks. Offsets are from the beginning of the frame.
+ */
+template <uint8_t Version>
+struct FrameLayout;
+
+template <>
+struct FrameLayout<0> {
+  static constexpr size_t kHeaderLength = sizeof(RfcMessage::Rfc1006Header);
+  static constexpr size_t kVersionOffset =
+      offsetof(RfcMessage::Rfc1006Header, version);
+  static constexpr size_t kLengthOffset =
+      offsetof(RfcMessage::Rfc1006Header, length);
+  static constexpr size_t kPayloadHeaderLength =
+      sizeof(RfcMessage::PayloadHeader);
+  static constexpr size_t kDeviceIdOffset =
+      kHeaderLength + offsetof(RfcMessage::PayloadHeader, deviceId);
+  static constexpr size_t kTagOffset =
+      kHeaderLength + offsetof(RfcMessage::PayloadHeader, measurementTag);
+  static constexpr size_t kTimestampOffset =
+      kHeaderLength + offsetof(RfcMessage::PayloadHeader, timestamp);
+  static constexpr size_t kTypeOffset =
+      kHeaderLength + offsetof(RfcMessage::PayloadHeader, measurementType);
+  static constexpr size_t kDataLengthOffset =
+      kHeaderLength + offsetof(RfcMessage::PayloadHeader, dataLength);
+  // bounds of the payload length in the header
+  static constexpr uint16_t kMinLength = sizeof(RfcMessage::PayloadHeader);
+  static constexpr uint16_t kMaxLength = RfcMessage::kMaxPayloadLength;
+};
+
+inline uint8_t swapBytes(uint8_t value) { return value; }
+inline uint16_t swapBytes(uint16_t value) { return __builtin_bswap16(value); }
+inline uint32_t swapBytes(uint32_t value) { return __builtin_bswap32(value); }
+
+/**
+ * Reads the frames of one protocol version in one byte order. Everything
+ * is resolved at compile time: the offsets are constants and a field in the
+ * native order is a plain load, the swap exists only in the other codec.
+ */
+template <uint8_t Version, ByteOrder Order>
+struct FrameCodec {
+  using Layout = FrameLayout<Version>;
+  static constexpr uint8_t kVersion = Version;
+  static constexpr ByteOrder kByteOrder = Order;
+  static constexpr bool kSwapped = Order != kNativeByteOrder;
+
+  /**
+   * \brief reads a field of the type T at data
+   */
+  template <typename T>
+  static T load(const uint8_t *data) {
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return fromOrder(value, std::integral_constant<bool, kSwapped>());
+  }
+
+  /**
+   * \brief writes a field of the type T at data, the way a device does
+   */
+  template <typename T>
+  static void store(uint8_t *data, T value) {
+    value = fromOrder(value, std::integral_constant<bool, kSwapped>());
+    std::memcpy(data, &value, sizeof(value));
+  }
+
+  /**
+   * \brief the payload length in the header at frame, unchecked
+   */
+  static uint16_t getLength(const uint8_t *frame) {
+    return load<uint16_t>(frame + Layout::kLengthOffset);
+  }
+
+  static bool isValidLength(size_t length) {
+    return length >= Layout::kMinLength && length <= Layout::kMaxLength;
+  }
+
+  /**
+   * \brief the counterpart of RfcMessage::validateHeaderAndGetLength(),
+   * frame must hold a whole header
+   */
+  static bool isValidHeader(const uint8_t *frame) {
+    return frame[Layout::kVersionOffset] == Version &&
+           isValidLength(getLength(frame));
+  }
+
+  /**
+   * \brief checks the data length of the payload header against the
+   * payload length, which the protocol doesn't require; frame must hold a
+   * whole payload header
+   */
+  static bool isConsistent(const uint8_t *frame) {
+    return load<uint16_t>(frame + Layout::kDataLengthOffset) +
+               Layout::kPayloadHeaderLength ==
+           getLength(frame);
+  }
+
+  static uint16_t getDeviceId(const uint8_t *frame) {
+    return load<uint16_t>(frame + Layout::kDeviceIdOffset);
+  }
+  static uint16_t getMeasurementTag(const uint8_t *frame) {
+    return load<uint16_t>(frame + Layout::kTagOffset);
+  }
+  static uint32_t getTimestamp(const uint8_t *frame) {
+    return load<uint32_t>(frame + Layout::kTimestampOffset);
+  }
+  static uint16_t getMeasurementType(const uint8_t *frame) {
+    return load<uint16_t>(frame + Layout::kTypeOffset);
+  }
+
+ private:
+  template <typename T>
+  static T fromOrder(T value, std::false_type) {
+    return value;
+  }
+  template <typename T>
+  static T fromOrder(T value, std::true_type) {
+    return swapBytes(value);
+  }
+};
+
+template <uint8_t Version, ByteOrder Order>
+constexpr uint8_t FrameCodec<Version, Order>::kVersion;
+template <uint8_t Version, ByteOrder Order>
+constexpr ByteOrder FrameCodec<Version, Order>::kByteOrder;
+template <uint8_t Version, ByteOrder Order>
+constexpr bool FrameCodec<Version, Order>::kSwapped;
+
+using NativeFrameCodec =
+    FrameCodec<RfcMessage::kProtocolVersion, kNativeByteOrder>;
+
+/**
+ * Every codec the listener may read a stream with, one per protocol version
+ * and byte order; a connection keeps its format in a byte.
+ */
+enum class FrameFormat : uint8_t {
+  Version0Little,
+  Version0Big,
+  // nothing received yet to pick a format by
+  Undetected
+};
+
+/**
+ * \brief calls visit(codec) with a FrameCodec object of the format, so a
+ * stream is dispatched to its specialization once per call rather than
+ * once per frame
+ * \return what visit returns
+ */
+template <typename Visitor>
+auto visitFrameFormat(FrameFormat format, Visitor &&visit)
+    -> decltype(visit(NativeFrameCodec())) {
+  switch (format) {
+    case FrameFormat::Version0Little:
+      return visit(FrameCodec<0, ByteOrder::Little>());
+    case FrameFormat::Version0Big:
+      return visit(FrameCodec<0, ByteOrder::Big>());
+    default:
+      return visit(NativeFrameCodec());
+  }
+}
+
+/**
+ * \brief checks the header at frame, which must hold a whole header,
+ * against every codec of FrameFormat
+ */
+bool isValidInAnyFormat(const uint8_t *frame);
+
+/**
+ * \brief picks the format of a stream: with ByteOrderMode::Native, Little
+ * or Big the one of that order, whatever the stream begins with. With
+ * ByteOrderMode::Detect the one of the first frame: the version comes from
+ * the header, the byte order is the one the payload length is within
+ * bounds in; if it is in both, the order the data length of the payload
+ * header agrees with the payload length in, and the native order if that
+ * doesn't tell either.
+ * \param data beginning of the stream, or the header a resync found
+ * \param length number of bytes received
+ * \return FrameFormat::Undetected in the Detect mode until there is enough
+ * to tell (a header, or the payload header as well if the length reads
+ * within bounds either way) and if the header is valid in no format (see
+ * isValidInAnyFormat()); the stream is then to be resynchronized or closed
+ */
+FrameFormat detectFrameFormat(const uint8_t *data, size_t length,
+                              ByteOrderMode mode);
+
+}  // namespace DeviceListener
+
+#endif
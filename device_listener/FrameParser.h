@@ -0,0 +1,86 @@
+#ifndef FrameParser_H
+#define FrameParser_H
+#include <cstdint>
+#include <cstring>
+
+#include "FrameBatch.h"
+#include "FrameCodec.h"
+
+namespace DeviceListener {
+
+/**
+ * Splits a chunk of the received stream into RFC1006 frames, read with the
+ * given FrameCodec.
+ */
+class FrameParser {
+ public:
+  struct Result {
+    // number of bytes taken by complete frames, the rest is a partial frame
+    size_t consumed;
+    // number of complete valid frames found
+    size_t frames;
+    // true if parsing stopped at an invalid header
+    bool invalidHeader;
+  };
+
+  /**
+   * \brief walks through all the complete frames in the buffer, FrameBatch
+   * by FrameBatch
+   * \param data beginning of the received bytes, must start at a frame boundary
+   * \param length number of received bytes
+   * \param batch scratch space for the frames descriptions
+   * \param onBatch callable invoked as onBatch(deviceIds, frameLengths, count)
+   * for every run of consecutive valid frames; the run is always the first
+   * count frames of batch, so its other columns may be read as well
+   * \return what has been parsed, see Result
+   */
+  template <typename Codec = NativeFrameCodec, typename BatchHandler>
+  static Result parseBatches(const uint8_t *data, size_t length,
+                             FrameBatch &batch, BatchHandler &&onBatch) {
+    Result result = {0, 0, false};
+    for (;;) {
+      batch.scan<Codec>(data + result.consumed, length - result.consumed);
+
+      size_t frames = batch.count;
+      auto firstInvalid = static_cast<const uint8_t *>(
+          std::memchr(batch.valid, 0, batch.count));
+      if (firstInvalid) {
+        frames = firstInvalid - batch.valid;
+        result.invalidHeader = true;
+      }
+      if (frames) onBatch(batch.deviceIds, batch.frameLengths, frames);
+
+      result.frames += frames;
+      result.consumed +=
+          frames == batch.count ? batch.length : batch.offsets[frames];
+
+      if (batch.stop == FrameBatch::Stop::InvalidLength)
+        result.invalidHeader = true;
+      if (result.invalidHeader || batch.stop != FrameBatch::Stop::Full)
+        return result;
+    }
+  }
+
+  /**
+   * \brief walks through all the complete frames in the buffer in one pass
+   * \param data beginning of the received bytes, must start at a frame boundary
+   * \param length number of received bytes
+   * \param onFrame callable invoked as onFrame(deviceId) for every complete
+   * valid frame
+   * \return what has been parsed, see Result
+   */
+  template <typename Codec = NativeFrameCodec, typename Handler>
+  static Result parse(const uint8_t *data, size_t length, Handler &&onFrame) {
+    FrameBatch batch;
+    return parseBatches<Codec>(data, length, batch,
+                               [&onFrame](const uint16_t *deviceIds,
+                                          const uint16_t *, size_t count) {
+                                 for (size_t i = 0; i < count; i++)
+                                   onFrame(deviceIds[i]);
+                               });
+  }
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,152 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_RESYNC_X86
+#endif
+
+#include "FrameResync.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+/**
+ * \brief offset of the high byte of the length in a header of the codec
+ */
+template <typename Codec>
+constexpr size_t getLengthHighByte() {
+  return Codec::Layout::kLengthOffset +
+         (Codec::kByteOrder == ByteOrder::Little ? 1 : 0);
+}
+
+/**
+ * \brief first position in [from, limit) holding a plausible header, limit
+ * if there is none
+ */
+template <typename Codec>
+size_t findCandidateScalar(const uint8_t *data, size_t from, size_t limit) {
+  for (size_t pos = from; pos < limit; pos++)
+    if (FrameResync::isPlausibleHeader<Codec>(data + pos)) return pos;
+  return limit;
+}
+
+#ifdef FRAME_RESYNC_X86
+
+// The vector code only prefilters: a position passes if its byte is the
+// protocol version and the byte 2 or 3 further, by the byte order, is a
+// possible high byte of the length. Those are validated one by one, in the
+// stream order.
+
+template <typename Codec>
+size_t findCandidateSse2(const uint8_t *data, size_t from, size_t limit) {
+  static_assert(Codec::Layout::kVersionOffset == 0,
+                "header layout is assumed by the vector code");
+  const size_t kLengthHighByte = getLengthHighByte<Codec>();
+  const __m128i version = _mm_set1_epi8(Codec::kVersion);
+  // a plausible header has at most this in the high byte of its length
+  const __m128i maxHighByte = _mm_set1_epi8(Codec::Layout::kMaxLength >> 8);
+
+  size_t pos = from;
+  // both loads stay within the positions that hold a whole header
+  for (; pos + 16 <= limit; pos += 16) {
+    __m128i first =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+    __m128i high = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(data + pos + kLengthHighByte));
+    __m128i ok = _mm_and_si128(
+        _mm_cmpeq_epi8(first, version),
+        _mm_cmpeq_epi8(_mm_min_epu8(high, maxHighByte), high));
+    for (unsigned mask = _mm_movemask_epi8(ok); mask; mask &= mask - 1) {
+      const size_t candidate = pos + __builtin_ctz(mask);
+      if (FrameResync::isPlausibleHeader<Codec>(data + candidate))
+        return candidate;
+    }
+  }
+  return findCandidateScalar<Codec>(data, pos, limit);
+}
+
+template <typename Codec>
+__attribute__((target("avx2"))) size_t findCandidateAvx2(const uint8_t *data,
+                                                         size_t from,
+                                                         size_t limit) {
+  const size_t kLengthHighByte = getLengthHighByte<Codec>();
+  const __m256i version = _mm256_set1_epi8(Codec::kVersion);
+  const __m256i maxHighByte =
+      _mm256_set1_epi8(Codec::Layout::kMaxLength >> 8);
+
+  size_t pos = from;
+  for (; pos + 32 <= limit; pos += 32) {
+    __m256i first =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos));
+    __m256i high = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(data + pos + kLengthHighByte));
+    __m256i ok = _mm256_and_si256(
+        _mm256_cmpeq_epi8(first, version),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(high, maxHighByte), high));
+    for (uint32_t mask = _mm256_movemask_epi8(ok); mask; mask &= mask - 1) {
+      const size_t candidate = pos + __builtin_ctz(mask);
+      if (FrameResync::isPlausibleHeader<Codec>(data + candidate))
+        return candidate;
+    }
+  }
+  return findCandidateSse2<Codec>(data, pos, limit);
+}
+
+#endif
+
+template <typename Codec>
+size_t findCandidate(const uint8_t *data, size_t from, size_t limit,
+                     FrameBatch::SimdLevel level) {
+  switch (level) {
+#ifdef FRAME_RESYNC_X86
+    case FrameBatch::SimdLevel::Avx2:
+      return findCandidateAvx2<Codec>(data, from, limit);
+    case FrameBatch::SimdLevel::Sse2:
+      return findCandidateSse2<Codec>(data, from, limit);
+#endif
+    default:
+      return findCandidateScalar<Codec>(data, from, limit);
+  }
+}
+
+}  // namespace
+
+template <typename Codec>
+FrameResync::Result FrameResync::find(const uint8_t *data, size_t length,
+                                      size_t from, bool confirm,
+                                      FrameBatch::SimdLevel level) {
+  const size_t kHeaderLength = Codec::Layout::kHeaderLength;
+  // positions below the limit hold a whole header
+  const size_t limit = length >= kHeaderLength ? length - kHeaderLength + 1 : 0;
+  for (size_t pos = from;; pos++) {
+    pos = findCandidate<Codec>(data, pos, limit, level);
+    if (pos >= limit) return {pos > from ? pos : from, false};
+    if (!confirm) return {pos, true};
+
+    const size_t next = pos + kHeaderLength + Codec::getLength(data + pos);
+    if (next + kHeaderLength > length) return {pos, false};
+    if (isPlausibleHeader<Codec>(data + next)) return {pos, true};
+  }
+}
+
+FrameResync::Result FrameResync::findInAnyFormat(const uint8_t *data,
+                                                 size_t length, size_t from,
+                                                 bool confirm) {
+  const FrameBatch::SimdLevel level = FrameBatch::getSimdLevel();
+  auto little = find<FrameCodec<0, ByteOrder::Little>>(data, length, from,
+                                                       confirm, level);
+  auto big =
+      find<FrameCodec<0, ByteOrder::Big>>(data, length, from, confirm, level);
+  // what can't start a frame in either order is skipped; a header found in
+  // one order at the position the other one waits at wins
+  if (little.skipped != big.skipped)
+    return little.skipped < big.skipped ? little : big;
+  return {little.skipped, little.found || big.found};
+}
+
+// every codec of FrameFormat
+template FrameResync::Result
+FrameResync::find<FrameCodec<0, ByteOrder::Little>>(const uint8_t *, size_t,
+                                                    size_t, bool,
+                                                    FrameBatch::SimdLevel);
+template FrameResync::Result FrameResync::find<FrameCodec<0, ByteOrder::Big>>(
+    const uint8_t *, size_t, size_t, bool, FrameBatch::SimdLevel);
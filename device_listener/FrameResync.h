@@ -0,0 +1,84 @@
+#ifndef FrameResync_H
+#define FrameResync_H
+#include <cstddef>
+#include <cstdint>
+
+#include "FrameBatch.h"
+#include "FrameCodec.h"
+
+namespace DeviceListener {
+
+/**
+ * What a connection does when it meets an invalid RFC1006 header.
+ */
+enum class ResyncMode {
+  // the connection is closed, the device has to reconnect
+  Off,
+  // the stream resumes at the next plausible header
+  Header,
+  // the stream resumes at the next plausible header that is followed by
+  // another plausible header, so a stray zero byte in the garbage is less
+  // likely to be taken for a frame
+  Confirmed
+};
+
+/**
+ * Finds the way back into an RFC1006 stream after an invalid header.
+ *
+ * A plausible header is one the FrameCodec of the stream accepts, the
+ * native one unless told otherwise. The scan checks 16 or 32 positions at
+ * once for the version byte and the high byte of the length, and validates
+ * only the positions passing both; it never reads past the given length.
+ */
+struct FrameResync {
+  struct Result {
+    // bytes before the header found; if none was found, bytes that can't
+    // start a frame, the rest is too short to tell
+    size_t skipped;
+    // a header was found at skipped
+    bool found;
+  };
+
+  /**
+   * \brief looks for the first plausible header at or after from
+   * \param data received bytes, may start anywhere in the stream
+   * \param length number of received bytes
+   * \param from position to start at, at most length
+   * \param confirm the header must be followed by another plausible header;
+   * if that one isn't received yet, the search stops at the header with
+   * found == false, to be repeated once there is more data
+   */
+  template <typename Codec = NativeFrameCodec>
+  static Result find(const uint8_t *data, size_t length, size_t from,
+                     bool confirm) {
+    return find<Codec>(data, length, from, confirm,
+                       FrameBatch::getSimdLevel());
+  }
+
+  /**
+   * \brief find() with the explicitly chosen implementation, the level must
+   * be supported by the CPU
+   */
+  template <typename Codec = NativeFrameCodec>
+  static Result find(const uint8_t *data, size_t length, size_t from,
+                     bool confirm, FrameBatch::SimdLevel level);
+
+  /**
+   * \brief find() for a stream whose FrameFormat isn't detected yet: looks
+   * for the first header plausible in any format, in the stream order
+   */
+  static Result findInAnyFormat(const uint8_t *data, size_t length,
+                                size_t from, bool confirm);
+
+  /**
+   * \brief checks the RFC1006 header at data, which must hold its 4 bytes
+   */
+  template <typename Codec = NativeFrameCodec>
+  static bool isPlausibleHeader(const uint8_t *data) {
+    return Codec::isValidHeader(data);
+  }
+};
+
+}  // namespace DeviceListener
+
+#endif
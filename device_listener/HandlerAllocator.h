@@ -0,0 +1,162 @@
+#ifndef HandlerAllocator_H
+#define HandlerAllocator_H
+#include <boost/asio/io_service.hpp>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace DeviceListener {
+
+/**
+ * Storage for the operation asio keeps while a handler is pending, owned by
+ * the object the operation is started for (a connection, an acceptor).
+ *
+ * Such an object has at most one operation of the kind in flight, so a
+ * single block is enough and the steady state never reaches the heap. A
+ * second concurrent operation, or one larger than kSize, falls back to
+ * operator new.
+ *
+ * The operation must be gone before the memory is: before owners are
+ * destroyed ahead of their io_service, every one of them is closed and
+ * then completeAbortedOperations() runs once, as ~Worker does.
+ */
+template <size_t kSize>
+class HandlerMemory {
+ public:
+  HandlerMemory() : inUse_(false) {}
+  HandlerMemory(const HandlerMemory &) = delete;
+  HandlerMemory &operator=(HandlerMemory const &) = delete;
+
+  void *allocate(size_t size) {
+    if (!inUse_ && size <= kSize) {
+      inUse_ = true;
+      return &storage_;
+    }
+    return ::operator new(size);
+  }
+
+  void deallocate(void *pointer) {
+    if (pointer == &storage_)
+      inUse_ = false;
+    else
+      ::operator delete(pointer);
+  }
+
+ private:
+  typename std::aligned_storage<kSize>::type storage_;
+  bool inUse_;
+};
+
+/**
+ * Standard allocator handing out HandlerMemory, what asio uses for the
+ * operation once a handler reports it as its associated allocator.
+ */
+template <typename T, typename Memory>
+class HandlerAllocator {
+ public:
+  using value_type = T;
+
+  explicit HandlerAllocator(Memory &memory) : memory_(memory) {}
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U, Memory> &other) noexcept
+      : memory_(other.memory_) {}
+
+  T *allocate(size_t count) {
+    return static_cast<T *>(memory_.allocate(sizeof(T) * count));
+  }
+  void deallocate(T *pointer, size_t) { memory_.deallocate(pointer); }
+
+  bool operator==(const HandlerAllocator &other) const noexcept {
+    return &memory_ == &other.memory_;
+  }
+  bool operator!=(const HandlerAllocator &other) const noexcept {
+    return &memory_ != &other.memory_;
+  }
+
+ private:
+  template <typename, typename>
+  friend class HandlerAllocator;
+  Memory &memory_;
+};
+
+/**
+ * Wraps a completion handler, so asio allocates its operation from the given
+ * HandlerMemory.
+ */
+template <typename Memory, typename Handler>
+class AllocatingHandler {
+ public:
+  using allocator_type = HandlerAllocator<Handler, Memory>;
+
+  AllocatingHandler(Memory &memory, Handler handler)
+      : memory_(memory), handler_(std::move(handler)) {}
+
+  allocator_type get_allocator() const noexcept {
+    return allocator_type(memory_);
+  }
+
+  template <typename... Args>
+  void operator()(Args &&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+ private:
+  Memory &memory_;
+  Handler handler_;
+};
+
+/**
+ * \brief runs the handlers of operations aborted by closing their I/O
+ * objects, which frees the operations; otherwise they'd stay queued until
+ * the io_service is destroyed, after the HandlerMemory they live in.
+ * Everything using the io_service must be closed by then, so that no
+ * handler starts anything new, and no other thread may be running it.
+ */
+inline void completeAbortedOperations(boost::asio::io_service &ioService) {
+  const bool stopped = ioService.stopped();
+  ioService.restart();
+  ioService.poll();
+  if (stopped) ioService.stop();
+}
+
+/**
+ * Closes objects sharing an io_service and completes their aborted
+ * operations when it goes out of scope; declared after the objects, it
+ * runs before any of them is destroyed. An object is anything with a
+ * close() method, e.g. a TcpServer or an RfcTransport.
+ */
+class ClosingGuard {
+ public:
+  template <typename... Closeable>
+  explicit ClosingGuard(boost::asio::io_service &ioService,
+                        Closeable &... objects)
+      : ioService_(ioService),
+        closers_{std::function<void()>([&objects]() { objects.close(); })...} {
+  }
+  ~ClosingGuard() {
+    for (auto &close : closers_) close();
+    completeAbortedOperations(ioService_);
+  }
+  ClosingGuard(const ClosingGuard &) = delete;
+  ClosingGuard &operator=(ClosingGuard const &) = delete;
+
+ private:
+  boost::asio::io_service &ioService_;
+  std::vector<std::function<void()>> closers_;
+};
+
+/**
+ * \brief makes a handler allocating its asio operation from memory
+ */
+template <typename Memory, typename Handler>
+AllocatingHandler<Memory, Handler> makeAllocatingHandler(Memory &memory,
+                                                         Handler handler) {
+  return AllocatingHandler<Memory, Handler>(memory, std::move(handler));
+}
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef Histogram_H
+#define Histogram_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace DeviceListener {
+
+/**
+ * Log-bucketed (HDR-style) histogram of uint64_t values: every power of two
+ * is split into 2^kSubBucketBits linear buckets, so the relative error of any
+ * percentile is below 1/2^kSubBucketBits (6%) over the whole uint64_t range,
+ * in fixed 8 KiB of memory.
+ *
+ * Like CounterShard, one thread records and any other thread may read, so
+ * record() is a relaxed load and store without locked instructions.
+ */
+class Histogram {
+ public:
+  static const unsigned kSubBucketBits = 4;
+  static const size_t kSubBucketCount = 1 << kSubBucketBits;
+  static const size_t kBucketCount = (64 - kSubBucketBits + 1)
+                                     << kSubBucketBits;
+
+  Histogram() { reset(); }
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(Histogram const &) = delete;
+
+  /**
+   * \brief drops all the recorded values, must be called from the owner
+   * thread only
+   */
+  void reset() {
+    for (auto &bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief adds one value, must be called from the owner thread only
+   */
+  void record(uint64_t value) {
+    auto &bucket = buckets_[getBucket(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief adds all the values recorded by another histogram, may be called
+   * while the other one is still recording
+   */
+  void add(const Histogram &other) {
+    for (size_t i = 0; i < kBucketCount; i++)
+      buckets_[i].store(buckets_[i].load(std::memory_order_relaxed) +
+                            other.buckets_[i].load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief number of recorded values
+   */
+  uint64_t getCount() const {
+    uint64_t count = 0;
+    for (auto &bucket : buckets_)
+      count += bucket.load(std::memory_order_relaxed);
+    return count;
+  }
+
+  /**
+   * \brief value at the given percentile
+   * \param percentile [0..100]
+   * \return lower bound of the bucket holding the percentile, 0 if empty
+   */
+  uint64_t getValueAtPercentile(double percentile) const {
+    const uint64_t count = getCount();
+    if (!count) return 0;
+    uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; i++) {
+      seen += buckets_[i].load(std::memory_order_relaxed);
+      if (seen > rank) return getBucketLowerBound(i);
+    }
+    return 0;
+  }
+
+  /**
+   * \brief lower bound of the highest non-empty bucket, 0 if empty
+   */
+  uint64_t getMax() const {
+    for (size_t i = kBucketCount; i > 0; i--)
+      if (buckets_[i - 1].load(std::memory_order_relaxed))
+        return getBucketLowerBound(i - 1);
+    return 0;
+  }
+
+  static size_t getBucket(uint64_t value) {
+    // small values get exact buckets
+    if (value < kSubBucketCount) return value;
+    const unsigned shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+    return ((shift + 1) << kSubBucketBits) +
+           ((value >> shift) & (kSubBucketCount - 1));
+  }
+
+  static uint64_t getBucketLowerBound(size_t bucket) {
+    if (bucket < kSubBucketCount) return bucket;
+    const unsigned shift = (bucket >> kSubBucketBits) - 1;
+    return (kSubBucketCount + (bucket & (kSubBucketCount - 1))) << shift;
+  }
+
+ private:
+  std::atomic<uint64_t> buckets_[kBucketCount];
+};
+
+}  // namespace DeviceListener
+
+#endif
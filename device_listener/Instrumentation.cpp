@@ -0,0 +1,8 @@
+#include "Instrumentation.h"
+
+using namespace DeviceListener;
+
+Instrumentation::Instrumentation(size_t shardCount) {
+  for (size_t i = 0; i < (shardCount ? shardCount : 1); i++)
+    shards_.emplace_back(new StageHistograms());
+}
@@ -0,0 +1,64 @@
+#ifndef Instrumentation_H
+#define Instrumentation_H
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Histogram.h"
+#include "MsgCounter.h"
+
+namespace DeviceListener {
+
+// build with -DDEVICE_LISTENER_NO_INSTRUMENTATION (cmake -DINSTRUMENTATION=OFF)
+// to compile all the recording code out
+#ifdef DEVICE_LISTENER_NO_INSTRUMENTATION
+static constexpr bool kInstrumentationEnabled = false;
+#else
+static constexpr bool kInstrumentationEnabled = true;
+#endif
+
+/**
+ * Hot-path histograms of one ingestion thread.
+ */
+struct alignas(kCacheLineSize) StageHistograms {
+  // nanoseconds from a read completion handler start to the counters update
+  Histogram readToCount;
+  // bytes delivered by one read completion
+  Histogram bytesPerRead;
+  // complete frames parsed after one read completion
+  Histogram framesPerRead;
+  // nanoseconds a ready handler waits before the thread gets to it
+  Histogram queueDelay;
+
+  /**
+   * \brief monotonic timestamp for the histograms, 0 if instrumentation is
+   * compiled out
+   */
+  static uint64_t now() {
+    if (!kInstrumentationEnabled) return 0;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+};
+
+class Instrumentation {
+ public:
+  /**
+   * \param shardCount number of ingestion threads, each of them gets its own
+   * StageHistograms via getShard()
+   */
+  explicit Instrumentation(size_t shardCount);
+
+  StageHistograms &getShard(size_t idx) { return *shards_[idx]; }
+  const StageHistograms &getShard(size_t idx) const { return *shards_[idx]; }
+  size_t getShardCount() const { return shards_.size(); }
+
+ protected:
+  std::vector<std::unique_ptr<StageHistograms>> shards_;
+};
+
+}  // namespace DeviceListener
+
+#endif
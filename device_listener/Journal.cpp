@@ -0,0 +1,491 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "Journal.h"
+#include "SystemUtils.h"
+
+using namespace DeviceListener;
+
+const uint64_t JournalFormat::kMagic;
+const uint32_t JournalFormat::kFormatVersion;
+const uint32_t JournalFormat::kBlockMagic;
+const size_t JournalShard::kBlockRows;
+const size_t JournalShard::kBlocks;
+const uint64_t JournalShard::kMaxBlockAge;
+
+namespace {
+
+// how long the writing thread sleeps once there is nothing to write
+const std::chrono::milliseconds kPollInterval(10);
+// a varint takes up to 10 bytes for 64 bits
+const size_t kMaxVarintLength = 10;
+// blocks start at multiples of it, so their headers can be read in place
+const size_t kBlockAlignment = 8;
+const size_t kMaxBlockLength =
+    sizeof(JournalFormat::BlockHeader) +
+    JournalShard::kBlockRows * kMaxVarintLength * JournalFormat::kColumnCount +
+    kBlockAlignment;
+// encoded blocks are appended in writes of up to this
+const size_t kBufferSize = JournalShard::kBlocks * kMaxBlockLength;
+
+static_assert(sizeof(JournalFormat::FileHeader) % kBlockAlignment == 0,
+              "the first block must be aligned");
+static_assert(sizeof(JournalFormat::BlockHeader) % kBlockAlignment == 0,
+              "the columns must start right after the block header");
+static_assert((JournalShard::kBlocks & (JournalShard::kBlocks - 1)) == 0,
+              "the number of blocks must be a power of two");
+
+uint64_t getArrival() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * \brief writes the column as zigzag-encoded varint deltas
+ * \return end of the column
+ */
+template <typename T>
+uint8_t *encodeColumn(const T *values, size_t rows, uint8_t *out) {
+  uint64_t previous = 0;
+  for (size_t i = 0; i < rows; i++) {
+    const auto delta = static_cast<int64_t>(values[i] - previous);
+    uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^
+                      static_cast<uint64_t>(delta >> 63);
+    for (; zigzag >= 0x80; zigzag >>= 7)
+      *out++ = static_cast<uint8_t>(zigzag | 0x80);
+    *out++ = static_cast<uint8_t>(zigzag);
+    previous = values[i];
+  }
+  return out;
+}
+
+/**
+ * \brief reverse of encodeColumn()
+ * \return false if the column doesn't hold exactly rows values
+ */
+template <typename T>
+bool decodeColumn(const uint8_t *data, size_t length, size_t rows, T *out) {
+  const uint8_t *end = data + length;
+  uint64_t previous = 0;
+  for (size_t i = 0; i < rows; i++) {
+    uint64_t zigzag = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      if (data == end || shift >= 64) return false;
+      const uint8_t byte = *data++;
+      zigzag |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) break;
+    }
+    previous += (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+    out[i] = static_cast<T>(previous);
+  }
+  return data == end;
+}
+
+size_t getColumnOffset(const JournalFormat::BlockHeader &header,
+                       JournalFormat::Column column) {
+  size_t offset = sizeof(header);
+  for (int i = 0; i < column; i++) offset += header.columnLengths[i];
+  return offset;
+}
+
+}  // namespace
+
+uint64_t JournalFormat::getChecksum(const void *data, size_t length) {
+  const size_t words = length / sizeof(uint64_t) * sizeof(uint64_t);
+  uint64_t tail = 0;
+  std::memcpy(&tail, static_cast<const uint8_t *>(data) + words,
+              length - words);
+  return mixWord(mixWords(kChecksumSeed ^ length, data, words), tail);
+}
+
+JournalShard::JournalShard()
+    : blocks_(new Block[kBlocks]), sealed_(0), released_(0), dropped_(0) {
+  for (size_t i = 0; i < kBlocks; i++) blocks_[i].rows = 0;
+}
+
+JournalShard::Block *JournalShard::getOpenBlock() {
+  const size_t sealed = sealed_.load(std::memory_order_relaxed);
+  if (sealed - released_.load(std::memory_order_acquire) >= kBlocks)
+    return nullptr;
+  return &blocks_[sealed & (kBlocks - 1)];
+}
+
+const JournalShard::Block *JournalShard::getSealedBlock() {
+  const size_t released = released_.load(std::memory_order_relaxed);
+  if (released == sealed_.load(std::memory_order_acquire)) return nullptr;
+  return &blocks_[released & (kBlocks - 1)];
+}
+
+void JournalShard::release() {
+  const size_t released = released_.load(std::memory_order_relaxed);
+  blocks_[released & (kBlocks - 1)].rows = 0;
+  released_.store(released + 1, std::memory_order_release);
+}
+
+void JournalShard::add(const FrameBatch &batch, size_t count) {
+  // one clock read per batch, its frames arrived together
+  const uint64_t arrival = getArrival();
+  for (size_t done = 0; done < count;) {
+    Block *block = getOpenBlock();
+    if (!block) {
+      addRelaxed(dropped_, count - done);
+      return;
+    }
+    const size_t rows = block->rows;
+    if (rows && arrival - block->arrivals[0] > kMaxBlockAge) {
+      seal();
+      continue;
+    }
+
+    const size_t n = std::min(count - done, kBlockRows - rows);
+    std::memcpy(block->deviceIds + rows, batch.deviceIds + done,
+                n * sizeof(uint16_t));
+    std::memcpy(block->measurementTags + rows, batch.measurementTags + done,
+                n * sizeof(uint16_t));
+    std::memcpy(block->measurementTypes + rows, batch.measurementTypes + done,
+                n * sizeof(uint16_t));
+    std::memcpy(block->timestamps + rows, batch.timestamps + done,
+                n * sizeof(uint32_t));
+    std::memcpy(block->frameLengths + rows, batch.frameLengths + done,
+                n * sizeof(uint16_t));
+    std::fill_n(block->arrivals + rows, n, arrival);
+    block->rows = rows + n;
+    done += n;
+    if (block->rows == kBlockRows) seal();
+  }
+}
+
+Journal::Journal(const std::string &path, size_t shardCount)
+    : fd_(-1),
+      stopping_(false),
+      rows_(0),
+      bytes_(0),
+      lost_(0),
+      buffer_(new uint8_t[kBufferSize]),
+      buffered_(0),
+      pendingRows_(0),
+      pendingBytes_(0),
+      failed_(false) {
+  for (size_t i = 0; i < (shardCount ? shardCount : 1); i++)
+    shards_.emplace_back(new JournalShard());
+
+  // every write goes to the end, right after the last valid block
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) throwSystemError("open(journal)");
+  struct stat info;
+  if (fstat(fd, &info)) {
+    int err = errno;
+    close(fd);
+    throwSystemError("fstat(journal)", err);
+  }
+
+  if (!info.st_size) {
+    const JournalFormat::FileHeader header = {
+        JournalFormat::kMagic, JournalFormat::kFormatVersion, 0};
+    if (::write(fd, &header, sizeof(header)) !=
+        static_cast<ssize_t>(sizeof(header))) {
+      int err = errno;
+      close(fd);
+      throwSystemError("write(journal)", err);
+    }
+  } else {
+    size_t validLength;
+    try {
+      validLength = JournalReader(path).getValidLength();
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    if (validLength < static_cast<size_t>(info.st_size)) {
+      std::cerr << "Cut off " << info.st_size - validLength
+                << " bytes of a torn block at the end of journal " << path
+                << std::endl;
+      if (ftruncate(fd, validLength)) {
+        int err = errno;
+        close(fd);
+        throwSystemError("ftruncate(journal)", err);
+      }
+    }
+  }
+  fd_ = fd;
+}
+
+Journal::~Journal() {
+  stop();
+  close(fd_);
+}
+
+void Journal::start() {
+  if (thread_.joinable()) return;
+  stopping_ = false;
+  thread_ = std::thread(&Journal::run, this);
+}
+
+void Journal::stop() {
+  if (thread_.joinable()) {
+    stopping_ = true;
+    thread_.join();
+  }
+  for (auto &shard : shards_) {
+    JournalShard::Block *block = shard->getOpenBlock();
+    if (block && block->rows) shard->seal();
+  }
+  drain();
+}
+
+uint64_t Journal::getDroppedCount() const {
+  uint64_t dropped = lost_.load(std::memory_order_relaxed);
+  for (auto &shard : shards_) dropped += shard->getDroppedCount();
+  return dropped;
+}
+
+void Journal::run() {
+  while (!stopping_.load(std::memory_order_relaxed))
+    if (!drain()) std::this_thread::sleep_for(kPollInterval);
+}
+
+bool Journal::drain() {
+  bool drained = false;
+  for (auto &shard : shards_) {
+    while (const JournalShard::Block *block = shard->getSealedBlock()) {
+      if (buffered_ + kMaxBlockLength > kBufferSize) append();
+      encode(*block);
+      pendingRows_ += block->rows;
+      shard->release();
+      drained = true;
+    }
+  }
+  if (!drained) return false;
+  append();
+  sync();
+  return true;
+}
+
+void Journal::encode(const JournalShard::Block &block) {
+  const size_t rows = block.rows;
+  JournalFormat::BlockHeader header = {};
+  header.magic = JournalFormat::kBlockMagic;
+  header.rows = static_cast<uint32_t>(rows);
+  const auto arrivals = std::minmax_element(block.arrivals,
+                                            block.arrivals + rows);
+  header.minArrival = *arrivals.first;
+  header.maxArrival = *arrivals.second;
+  const auto timestamps =
+      std::minmax_element(block.timestamps, block.timestamps + rows);
+  header.minTimestamp = *timestamps.first;
+  header.maxTimestamp = *timestamps.second;
+  for (size_t i = 0; i < rows; i++) {
+    const uint8_t bit = block.deviceIds[i] & 0xFF;
+    header.deviceFilter[bit >> 6] |= uint64_t(1) << (bit & 63);
+  }
+
+  uint8_t *begin = &buffer_[buffered_];
+  uint8_t *out = begin + sizeof(header);
+  auto finish = [&header, &out](JournalFormat::Column column, uint8_t *end) {
+    header.columnLengths[column] = static_cast<uint32_t>(end - out);
+    header.columnChecksums[column] =
+        JournalFormat::getChecksum(out, end - out);
+    out = end;
+  };
+  finish(JournalFormat::kDeviceIds, encodeColumn(block.deviceIds, rows, out));
+  finish(JournalFormat::kMeasurementTags,
+         encodeColumn(block.measurementTags, rows, out));
+  finish(JournalFormat::kMeasurementTypes,
+         encodeColumn(block.measurementTypes, rows, out));
+  finish(JournalFormat::kTimestamps,
+         encodeColumn(block.timestamps, rows, out));
+  finish(JournalFormat::kFrameLengths,
+         encodeColumn(block.frameLengths, rows, out));
+  finish(JournalFormat::kArrivals, encodeColumn(block.arrivals, rows, out));
+  header.headerChecksum = JournalFormat::getHeaderChecksum(header);
+  std::memcpy(begin, &header, sizeof(header));
+
+  // zero padding up to the next block
+  const size_t length = out - begin;
+  const size_t padded =
+      (length + kBlockAlignment - 1) & ~(kBlockAlignment - 1);
+  std::fill(out, begin + padded, 0);
+  buffered_ += padded;
+}
+
+void Journal::append() {
+  for (size_t done = 0; !failed_ && done < buffered_;) {
+    const ssize_t written =
+        ::write(fd_, buffer_.get() + done, buffered_ - done);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) failed_ = true;
+    done += written > 0 ? written : 0;
+  }
+  pendingBytes_ += buffered_;
+  buffered_ = 0;
+}
+
+void Journal::sync() {
+  // the blocks of a drain become durable together
+  if (!failed_ && fdatasync(fd_)) failed_ = true;
+  if (failed_) {
+    if (pendingRows_ && !lost_.load(std::memory_order_relaxed))
+      std::cerr << "Failed to write the journal: " << std::strerror(errno)
+                << ", its rows are dropped from now on" << std::endl;
+    addRelaxed(lost_, pendingRows_);
+  } else {
+    addRelaxed(rows_, pendingRows_);
+    addRelaxed(bytes_, pendingBytes_);
+  }
+  pendingRows_ = 0;
+  pendingBytes_ = 0;
+}
+
+JournalReader::JournalReader(const std::string &path)
+    : memory_(nullptr), size_(0) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) throwSystemError("open(journal)");
+  struct stat info;
+  if (fstat(fd, &info)) {
+    int err = errno;
+    close(fd);
+    throwSystemError("fstat(journal)", err);
+  }
+  if (static_cast<size_t>(info.st_size) < sizeof(JournalFormat::FileHeader)) {
+    close(fd);
+    throw std::invalid_argument(path + " is not a journal");
+  }
+  size_ = info.st_size;
+  void *memory = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  int err = errno;
+  close(fd);
+  if (memory == MAP_FAILED) throwSystemError("mmap(journal)", err);
+  memory_ = static_cast<const uint8_t *>(memory);
+
+  JournalFormat::FileHeader header;
+  std::memcpy(&header, memory_, sizeof(header));
+  if (header.magic != JournalFormat::kMagic ||
+      header.formatVersion != JournalFormat::kFormatVersion) {
+    munmap(memory, size_);
+    throw std::invalid_argument(path + " is not a journal");
+  }
+}
+
+JournalReader::~JournalReader() {
+  munmap(const_cast<uint8_t *>(memory_), size_);
+}
+
+size_t JournalReader::getBlockLength(const JournalFormat::BlockHeader &header) {
+  const size_t end = getColumnOffset(header, JournalFormat::kColumnCount);
+  return (end + kBlockAlignment - 1) & ~(kBlockAlignment - 1);
+}
+
+const JournalFormat::BlockHeader *JournalReader::getBlock(size_t pos) const {
+  if (size_ - pos < sizeof(JournalFormat::BlockHeader)) return nullptr;
+  const auto *header =
+      reinterpret_cast<const JournalFormat::BlockHeader *>(memory_ + pos);
+  if (header->magic != JournalFormat::kBlockMagic ||
+      header->headerChecksum != JournalFormat::getHeaderChecksum(*header))
+    return nullptr;
+  // a torn append may have written the header only
+  if (size_ - pos < getBlockLength(*header)) return nullptr;
+  return header;
+}
+
+template <typename T>
+bool JournalReader::decode(size_t pos, JournalFormat::Column column,
+                           std::vector<T> &out, Stats *stats) const {
+  const auto &header =
+      *reinterpret_cast<const JournalFormat::BlockHeader *>(memory_ + pos);
+  const uint8_t *data = memory_ + pos + getColumnOffset(header, column);
+  const size_t length = header.columnLengths[column];
+  if (stats) stats->columnsDecoded++;
+  out.resize(header.rows);
+  return JournalFormat::getChecksum(data, length) ==
+             header.columnChecksums[column] &&
+         decodeColumn(data, length, header.rows, out.data());
+}
+
+bool JournalReader::mayMatch(const JournalFormat::BlockHeader &header,
+                             const Query &query) {
+  if (query.oneDevice && !JournalFormat::mayHaveDevice(header, query.deviceId))
+    return false;
+  if (query.field == TimeField::Arrival)
+    return header.maxArrival >= query.from && header.minArrival <= query.to;
+  return header.maxTimestamp >= query.from && header.minTimestamp <= query.to;
+}
+
+bool JournalReader::decodeAll(size_t pos, Columns &columns,
+                              Stats *stats) const {
+  const bool decoded =
+      decode(pos, JournalFormat::kDeviceIds, columns.deviceIds, stats) &&
+      decode(pos, JournalFormat::kMeasurementTags, columns.measurementTags,
+             stats) &&
+      decode(pos, JournalFormat::kMeasurementTypes, columns.measurementTypes,
+             stats) &&
+      decode(pos, JournalFormat::kTimestamps, columns.timestamps, stats) &&
+      decode(pos, JournalFormat::kFrameLengths, columns.frameLengths,
+             stats) &&
+      decode(pos, JournalFormat::kArrivals, columns.arrivals, stats);
+  if (!decoded && stats) stats->damaged++;
+  return decoded;
+}
+
+std::map<uint16_t, uint64_t> JournalReader::count(const Query &query,
+                                                  Stats *stats) const {
+  std::vector<uint64_t> counts(UINT16_MAX + 1);
+  std::vector<uint16_t> deviceIds;
+  std::vector<uint64_t> times;
+  const auto timeColumn = query.field == TimeField::Arrival
+                              ? JournalFormat::kArrivals
+                              : JournalFormat::kTimestamps;
+  for (size_t pos = getFirstBlock(); const auto *header = getBlock(pos);
+       pos += getBlockLength(*header)) {
+    if (stats) stats->blocks++;
+    if (!mayMatch(*header, query)) {
+      if (stats) stats->skipped++;
+      continue;
+    }
+    // the times are needed only if the block sticks out of the range
+    const uint64_t minTime = query.field == TimeField::Arrival
+                                 ? header->minArrival
+                                 : header->minTimestamp;
+    const uint64_t maxTime = query.field == TimeField::Arrival
+                                 ? header->maxArrival
+                                 : header->maxTimestamp;
+    const bool inside = minTime >= query.from && maxTime <= query.to;
+    if (!decode(pos, JournalFormat::kDeviceIds, deviceIds, stats) ||
+        (!inside && !decode(pos, timeColumn, times, stats))) {
+      if (stats) stats->damaged++;
+      continue;
+    }
+    for (size_t i = 0; i < header->rows; i++)
+      if (inside ? !query.oneDevice || deviceIds[i] == query.deviceId
+                 : matches(deviceIds[i], times[i], query))
+        counts[deviceIds[i]]++;
+  }
+
+  std::map<uint16_t, uint64_t> result;
+  for (size_t devId = 0; devId < counts.size(); devId++)
+    if (counts[devId]) result.emplace(devId, counts[devId]);
+  return result;
+}
+
+size_t JournalReader::getValidLength() const {
+  size_t pos = getFirstBlock();
+  for (const JournalFormat::BlockHeader *header; (header = getBlock(pos));
+       pos += getBlockLength(*header)) {
+    for (int column = 0; column < JournalFormat::kColumnCount; column++) {
+      const auto id = static_cast<JournalFormat::Column>(column);
+      if (JournalFormat::getChecksum(
+              memory_ + pos + getColumnOffset(*header, id),
+              header->columnLengths[column]) !=
+          header->columnChecksums[column])
+        return pos;
+    }
+  }
+  return pos;
+}
@@ -0,0 +1,385 @@
+#ifndef Journal_H
+#define Journal_H
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FrameBatch.h"
+#include "MsgCounter.h"
+
+namespace DeviceListener {
+
+/**
+ * Layout of the journal file, shared by the writer and the reader.
+ *
+ * The file is a FileHeader followed by blocks. A block is a BlockHeader and
+ * the columns of its rows, one after another in the Column order; every
+ * column is the zigzag-encoded difference of each value from the previous
+ * one of the column (the first one from 0), written as a LEB128 varint. The
+ * header tells the length of every column, so a reader decodes only the
+ * columns it needs, and the ranges of the block, so it can skip the block
+ * without decoding any.
+ */
+struct JournalFormat {
+  static const uint64_t kMagic = 0x314c4e524a564544;  // "DEVJRNL1"
+  static const uint32_t kFormatVersion = 1;
+  static const uint32_t kBlockMagic = 0x4b4c424a;  // "JBLK"
+
+  enum Column {
+    kDeviceIds,
+    kMeasurementTags,
+    kMeasurementTypes,
+    kTimestamps,
+    // bytes of the frame, RFC1006 header included
+    kFrameLengths,
+    // microseconds since the Unix epoch the batch was received at
+    kArrivals,
+    kColumnCount
+  };
+
+  struct FileHeader {
+    uint64_t magic;
+    uint32_t formatVersion;
+    uint32_t reserved;
+  };
+
+  struct BlockHeader {
+    uint32_t magic;
+    uint32_t rows;
+    uint32_t columnLengths[kColumnCount];
+    uint64_t minArrival;
+    uint64_t maxArrival;
+    uint32_t minTimestamp;
+    uint32_t maxTimestamp;
+    // bit deviceId % 256 is set for every device having a row in the block
+    uint64_t deviceFilter[4];
+    // every column is checked on its own, as it is decoded on its own
+    uint64_t columnChecksums[kColumnCount];
+    // checksum of all the fields above
+    uint64_t headerChecksum;
+  };
+
+  static uint64_t getChecksum(const void *data, size_t length);
+  static uint64_t getHeaderChecksum(const BlockHeader &header) {
+    return getChecksum(&header, offsetof(BlockHeader, headerChecksum));
+  }
+  static bool mayHaveDevice(const BlockHeader &header, uint16_t deviceId) {
+    return header.deviceFilter[(deviceId & 0xFF) >> 6] >> (deviceId & 63) & 1;
+  }
+};
+
+/**
+ * Rows of one ingestion thread waiting to be written to the journal.
+ *
+ * The owner thread copies the header fields of its batches column by column
+ * into the open block of a fixed ring of blocks and seals the block once it
+ * is full, or once it is more than kMaxBlockAge old when the next batch
+ * comes. Sealed blocks are encoded and written by the journal thread, which
+ * hands them back afterwards. The owner never waits for the disk and never
+ * allocates: if all the blocks are still waiting to be written, the rows are
+ * dropped and counted instead.
+ */
+class JournalShard {
+ public:
+  // rows of a block
+  static const size_t kBlockRows = 4096;
+  // blocks of the ring, a power of two
+  static const size_t kBlocks = 8;
+  // microseconds a block stays open for while the thread receives anything
+  static const uint64_t kMaxBlockAge = 1000000;
+
+  struct Block {
+    uint16_t deviceIds[kBlockRows];
+    uint16_t measurementTags[kBlockRows];
+    uint16_t measurementTypes[kBlockRows];
+    uint32_t timestamps[kBlockRows];
+    uint16_t frameLengths[kBlockRows];
+    uint64_t arrivals[kBlockRows];
+    size_t rows;
+  };
+
+  JournalShard();
+  JournalShard(const JournalShard &) = delete;
+  JournalShard &operator=(JournalShard const &) = delete;
+
+  /**
+   * \brief queues the first count frames of the batch, must be called from
+   * the owner thread only
+   * \param batch validated batch with metadata decoded, see
+   * FrameBatch::withMetadata; the frames must be valid
+   */
+  void add(const FrameBatch &batch, size_t count);
+
+  /**
+   * \brief returns the number of rows lost because the journal thread was
+   * behind
+   */
+  uint64_t getDroppedCount() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+ protected:
+  friend class Journal;
+
+  std::unique_ptr<Block[]> blocks_;
+  // blocks sealed by the owner thread so far, the open one is next
+  std::atomic<size_t> sealed_;
+  // blocks handed back by the journal thread so far
+  std::atomic<size_t> released_;
+  std::atomic<uint64_t> dropped_;
+
+  /**
+   * \brief the open block, nullptr if the whole ring waits for the journal
+   * thread
+   */
+  Block *getOpenBlock();
+  void seal() { sealed_.store(sealed_ + 1, std::memory_order_release); }
+
+  /**
+   * \brief the oldest sealed block, nullptr if there is none; called by the
+   * journal thread only
+   */
+  const Block *getSealedBlock();
+  void release();
+};
+
+/**
+ * Append-only on-disk journal of every valid frame received: device,
+ * measurement tag and type, timestamp, length and arrival time.
+ *
+ * The ingestion threads fill their JournalShards; a background thread
+ * encodes the sealed blocks (see JournalFormat), writes all it has with
+ * one large sequential append and syncs the file once after it, so a block
+ * is either on disk whole or is the torn tail a crash left. That tail is
+ * cut off when the journal is opened again, and new blocks are appended
+ * after the valid ones.
+ */
+class Journal {
+ public:
+  /**
+   * \brief opens the journal, creating it if needed
+   * \param path path to the journal file
+   * \param shardCount number of ingestion threads, each of them gets its own
+   * JournalShard via getShard()
+   * \throws boost::system::system_error if the file can't be opened
+   * \throws std::invalid_argument if the file is not a journal, it is left
+   * untouched then
+   * \note doesn't start the background thread, sealed blocks wait in the
+   * shards until start() or stop()
+   */
+  Journal(const std::string &path, size_t shardCount);
+
+  /**
+   * \brief stop()s and closes the file
+   */
+  ~Journal();
+  Journal(const Journal &) = delete;
+  Journal &operator=(Journal const &) = delete;
+
+  JournalShard &getShard(size_t idx) { return *shards_[idx]; }
+  size_t getShardCount() const { return shards_.size(); }
+
+  /**
+   * \brief starts writing the sealed blocks in a background thread
+   */
+  void start();
+
+  /**
+   * \brief seals the open blocks, writes out everything and stops the
+   * background thread if it was started; the ingestion threads must be
+   * stopped by then
+   */
+  void stop();
+
+  /**
+   * \brief returns the number of rows written to the file
+   */
+  uint64_t getRowCount() const {
+    return rows_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief returns the number of bytes appended to the file
+   */
+  uint64_t getBytesWritten() const {
+    return bytes_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief sums up JournalShard::getDroppedCount() of all the threads and
+   * the rows lost to write errors
+   */
+  uint64_t getDroppedCount() const;
+
+ protected:
+  std::vector<std::unique_ptr<JournalShard>> shards_;
+  int fd_;
+  std::atomic<bool> stopping_;
+  std::atomic<uint64_t> rows_;
+  std::atomic<uint64_t> bytes_;
+  std::atomic<uint64_t> lost_;
+  std::thread thread_;
+  // owned by the thread writing the blocks: encoded blocks not appended
+  // yet, and rows and bytes appended but not synced yet
+  std::unique_ptr<uint8_t[]> buffer_;
+  size_t buffered_;
+  uint64_t pendingRows_;
+  uint64_t pendingBytes_;
+  bool failed_;
+
+  void run();
+
+  /**
+   * \brief encodes, appends and syncs the blocks sealed so far
+   * \return false if there were none
+   */
+  bool drain();
+  void encode(const JournalShard::Block &block);
+  void append();
+  void sync();
+};
+
+/**
+ * Read-only view of a journal file, mapped into memory.
+ *
+ * Queries look at the block headers first and skip the blocks out of the
+ * time range or without the device; of the others they decode only the
+ * columns they need.
+ */
+class JournalReader {
+ public:
+  enum class TimeField {
+    // microseconds since the Unix epoch the frame was received at
+    Arrival,
+    // timestamp the device put in the payload header
+    Timestamp
+  };
+
+  struct Query {
+    // count the rows of this device only, if set
+    bool oneDevice = false;
+    uint16_t deviceId = 0;
+    TimeField field = TimeField::Arrival;
+    // inclusive range of the time field
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+  };
+
+  struct Row {
+    uint16_t deviceId;
+    uint16_t measurementTag;
+    uint16_t measurementType;
+    uint32_t timestamp;
+    uint16_t frameLength;
+    uint64_t arrival;
+  };
+
+  struct Stats {
+    // valid blocks in the file
+    size_t blocks = 0;
+    // blocks skipped on their header alone
+    size_t skipped = 0;
+    // columns decoded
+    size_t columnsDecoded = 0;
+    // blocks with an intact header but a damaged column
+    size_t damaged = 0;
+  };
+
+  /**
+   * \brief maps the journal
+   * \throws boost::system::system_error if the file can't be mapped
+   * \throws std::invalid_argument if it is not a journal
+   */
+  explicit JournalReader(const std::string &path);
+  ~JournalReader();
+  JournalReader(const JournalReader &) = delete;
+  JournalReader &operator=(JournalReader const &) = delete;
+
+  /**
+   * \brief counts the rows matching the query
+   * \param stats incremented by the work done, if given
+   * \return number of rows by device ID
+   */
+  std::map<uint16_t, uint64_t> count(const Query &query,
+                                     Stats *stats = nullptr) const;
+
+  /**
+   * \brief calls visit(row) for every row matching the query, in the order
+   * of the file
+   */
+  template <typename Visitor>
+  void forEach(const Query &query, Visitor &&visit,
+               Stats *stats = nullptr) const {
+    Columns columns;
+    for (size_t pos = getFirstBlock(); const auto *header = getBlock(pos);
+         pos += getBlockLength(*header)) {
+      if (stats) stats->blocks++;
+      if (!mayMatch(*header, query)) {
+        if (stats) stats->skipped++;
+        continue;
+      }
+      if (!decodeAll(pos, columns, stats)) continue;
+      for (size_t i = 0; i < header->rows; i++) {
+        const Row row = {
+            columns.deviceIds[i],    columns.measurementTags[i],
+            columns.measurementTypes[i], columns.timestamps[i],
+            columns.frameLengths[i], columns.arrivals[i]};
+        const uint64_t time =
+            query.field == TimeField::Arrival ? row.arrival : row.timestamp;
+        if (matches(row.deviceId, time, query)) visit(row);
+      }
+    }
+  }
+
+  /**
+   * \brief bytes up to the end of the last block that is valid, with all
+   * the blocks before it
+   */
+  size_t getValidLength() const;
+
+ protected:
+  struct Columns {
+    std::vector<uint16_t> deviceIds;
+    std::vector<uint16_t> measurementTags;
+    std::vector<uint16_t> measurementTypes;
+    std::vector<uint32_t> timestamps;
+    std::vector<uint16_t> frameLengths;
+    std::vector<uint64_t> arrivals;
+  };
+
+  const uint8_t *memory_;
+  size_t size_;
+
+  static size_t getFirstBlock() { return sizeof(JournalFormat::FileHeader); }
+  static size_t getBlockLength(const JournalFormat::BlockHeader &header);
+
+  /**
+   * \brief header of the block at pos, nullptr if there is no valid one
+   */
+  const JournalFormat::BlockHeader *getBlock(size_t pos) const;
+
+  /**
+   * \brief decodes a column of the block at pos
+   * \return false if the column is damaged
+   */
+  template <typename T>
+  bool decode(size_t pos, JournalFormat::Column column, std::vector<T> &out,
+              Stats *stats) const;
+
+  static bool mayMatch(const JournalFormat::BlockHeader &header,
+                       const Query &query);
+  static bool matches(uint16_t deviceId, uint64_t time, const Query &query) {
+    return (!query.oneDevice || deviceId == query.deviceId) &&
+           time >= query.from && time <= query.to;
+  }
+
+  bool decodeAll(size_t pos, Columns &columns, Stats *stats) const;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,227 @@
+#include "Logger.h"
+
+using namespace DeviceListener;
+
+const size_t Logger::kEventCount;
+const size_t Logger::kCapacity;
+const unsigned Logger::kMaxLinesPerSecond;
+
+namespace {
+
+// how long the writing thread sleeps once the ring is empty
+const std::chrono::milliseconds kPollInterval(10);
+const std::chrono::seconds kRateWindow(1);
+
+struct EventFormat {
+  // start of the line, followed by the address and/or the error
+  const char *prefix;
+  // name in the "suppressed" summaries
+  const char *name;
+  bool withAddress;
+  bool error;
+  // printed before the count, nullptr if the event has none
+  const char *countLabel;
+};
+
+const EventFormat kFormats[] = {
+    {"Device connected: ", "device connected", true, false, nullptr},
+    {"Disconnected device: ", "device disconnected", true, false, nullptr},
+    {"Error occured during 'accept' call: ", "accept error", false, true,
+     nullptr},
+    {"Error occured during 'read' call from ", "read error", true, true,
+     nullptr},
+    {"Error occured during 'wait' call from ", "wait error", true, true,
+     nullptr},
+    {"Error occured during 'ioctl' call from ", "ioctl error", true, true,
+     nullptr},
+    {"Error occured during 'recvmmsg' call: ", "recvmmsg error", false, true,
+     nullptr},
+    {"Error occured: invalid header from ", "invalid header", true, true,
+     nullptr},
+    {"Failed to wake up io_uring worker: ", "io_uring wakeup error", false,
+     true, nullptr},
+    {"Rejected connection from ", "connection rejected", true, true, nullptr},
+    {"Resynchronized stream from ", "stream resynchronized", true, true,
+     ", bytes skipped: "},
+    {"Error occured during 'open' call: ", "open error", false, true,
+     nullptr},
+};
+
+static_assert(sizeof(kFormats) / sizeof(kFormats[0]) == Logger::kEventCount,
+              "every event needs a format");
+static_assert((Logger::kCapacity & (Logger::kCapacity - 1)) == 0,
+              "the ring capacity must be a power of two");
+
+const EventFormat &getFormat(Logger::Event event) {
+  return kFormats[static_cast<size_t>(event)];
+}
+
+}  // namespace
+
+Logger::Logger(std::ostream &out, std::ostream &err)
+    : out_(out),
+      err_(err),
+      cells_(new Cell[kCapacity]),
+      enqueuePos_(0),
+      dequeuePos_(0),
+      enabled_(true),
+      stopping_(false),
+      dropped_(0),
+      suppressedTotal_(0),
+      hasLast_(false),
+      repeats_(0),
+      windowStart_(Clock::now()),
+      printed_(),
+      suppressed_() {
+  for (size_t i = 0; i < kCapacity; i++)
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+Logger::~Logger() { stop(); }
+
+Logger &Logger::instance() {
+  static Logger logger;
+  static const bool started = (logger.start(), true);
+  (void)started;
+  return logger;
+}
+
+void Logger::log(Event event, const boost::asio::ip::address &address,
+                 const boost::system::error_code &err,
+                 uint64_t count) noexcept {
+  if (!enabled_.load(std::memory_order_relaxed)) return;
+
+  size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+  for (;;) {
+    Cell &cell = cells_[pos & (kCapacity - 1)];
+    const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    const auto diff = static_cast<std::ptrdiff_t>(sequence) -
+                      static_cast<std::ptrdiff_t>(pos);
+    if (diff == 0) {
+      if (enqueuePos_.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+        cell.record.event = event;
+        cell.record.address = address;
+        cell.record.err = err;
+        cell.record.count = count;
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        return;
+      }
+    } else if (diff < 0) {
+      // the slot still holds a record from the previous lap: full
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = enqueuePos_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void Logger::start() {
+  if (thread_.joinable()) return;
+  stopping_ = false;
+  windowStart_ = Clock::now();
+  thread_ = std::thread(&Logger::run, this);
+}
+
+void Logger::stop() {
+  if (thread_.joinable()) {
+    stopping_ = true;
+    thread_.join();
+  } else {
+    drain();
+    closeWindow(Clock::now());
+  }
+}
+
+void Logger::run() {
+  while (!stopping_.load(std::memory_order_relaxed)) {
+    if (!drain()) std::this_thread::sleep_for(kPollInterval);
+    const auto now = Clock::now();
+    if (now - windowStart_ >= kRateWindow) closeWindow(now);
+  }
+  drain();
+  closeWindow(Clock::now());
+}
+
+bool Logger::drain() {
+  bool drained = false;
+  for (;;) {
+    Cell &cell = cells_[dequeuePos_ & (kCapacity - 1)];
+    if (cell.sequence.load(std::memory_order_acquire) != dequeuePos_ + 1)
+      break;
+    // the slot is given back before the slow formatting
+    const Record record = cell.record;
+    cell.sequence.store(dequeuePos_ + kCapacity, std::memory_order_release);
+    dequeuePos_++;
+    write(record);
+    drained = true;
+  }
+  if (drained) {
+    out_.flush();
+    err_.flush();
+  }
+  return drained;
+}
+
+void Logger::write(const Record &record) {
+  if (hasLast_ && record == last_) {
+    repeats_++;
+    return;
+  }
+  writeRepeats();
+
+  const size_t event = static_cast<size_t>(record.event);
+  if (printed_[event] >= kMaxLinesPerSecond) {
+    suppressed_[event]++;
+    suppressedTotal_.fetch_add(1, std::memory_order_relaxed);
+    hasLast_ = false;
+    return;
+  }
+  printed_[event]++;
+  writeLine(record);
+  last_ = record;
+  hasLast_ = true;
+}
+
+void Logger::writeLine(const Record &record) {
+  const EventFormat &format = getFormat(record.event);
+  std::ostream &stream = format.error ? err_ : out_;
+  stream << format.prefix;
+  if (format.withAddress) {
+    if (record.address.is_unspecified())
+      stream << "unknown";
+    else
+      stream << record.address.to_string();
+  }
+  if (format.error && record.err) {
+    if (format.withAddress) stream << ": ";
+    stream << record.err.message();
+  }
+  if (format.countLabel) stream << format.countLabel << record.count;
+  stream << '\n';
+}
+
+void Logger::writeRepeats() {
+  if (!repeats_) return;
+  std::ostream &stream = getFormat(last_.event).error ? err_ : out_;
+  stream << "Last message repeated " << repeats_ << " times\n";
+  repeats_ = 0;
+}
+
+void Logger::closeWindow(Clock::time_point now) {
+  writeRepeats();
+  for (size_t event = 0; event < kEventCount; event++) {
+    if (suppressed_[event]) {
+      const EventFormat &format = kFormats[event];
+      (format.error ? err_ : out_)
+          << "Suppressed " << suppressed_[event] << " '" << format.name
+          << "' messages in the last second\n";
+    }
+    suppressed_[event] = 0;
+    printed_[event] = 0;
+  }
+  windowStart_ = now;
+  out_.flush();
+  err_.flush();
+}
@@ -0,0 +1,175 @@
+#ifndef Logger_H
+#define Logger_H
+#include <boost/asio/ip/address.hpp>
+#include <boost/system/error_code.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+namespace DeviceListener {
+
+/**
+ * Log of the ingestion threads, written by a background thread.
+ *
+ * An ingestion thread only stores a fixed-size record (what happened, to
+ * which peer, with which error) into a bounded lock-free ring; it never
+ * formats, allocates, takes a lock or waits for the terminal. If the ring is
+ * full the record is dropped and counted instead.
+ *
+ * The background thread formats the records and flushes the streams once per
+ * batch. A record equal to the previous one is not repeated but summed up as
+ * "Last message repeated N times", and every event prints at most
+ * kMaxLinesPerSecond lines a second, the rest is counted as suppressed and
+ * summed up at the end of the second. So a device reconnecting in a loop or a
+ * connection storm can't flood the terminal.
+ */
+class Logger {
+ public:
+  enum class Event : uint8_t {
+    DeviceConnected,
+    DeviceDisconnected,
+    AcceptFailed,
+    ReadFailed,
+    WaitFailed,
+    IoctlFailed,
+    ReceiveFailed,
+    InvalidHeader,
+    WakeupFailed,
+    ConnectionRejected,
+    StreamResynced,
+    OpenFailed,
+  };
+  static const size_t kEventCount = 12;
+
+  // records the ring holds, a power of two
+  static const size_t kCapacity = 4096;
+  static const unsigned kMaxLinesPerSecond = 100;
+
+  /**
+   * \param out stream of the informational events
+   * \param err stream of the errors
+   * \note doesn't start the background thread, records are kept in the ring
+   * until start() or stop()
+   */
+  explicit Logger(std::ostream &out = std::cout, std::ostream &err = std::cerr);
+  ~Logger();
+  Logger(const Logger &) = delete;
+  Logger &operator=(Logger const &) = delete;
+
+  /**
+   * \brief the log of the process, writing to std::cout and std::cerr, with
+   * its thread started on first use
+   */
+  static Logger &instance();
+
+  /**
+   * \brief queues a record, never blocks; safe to call from any thread
+   * \param address peer the event is about, if any
+   * \param err error the event is about, if any
+   * \param count number the event is about, if any
+   */
+  void log(Event event,
+           const boost::asio::ip::address &address = boost::asio::ip::address(),
+           const boost::system::error_code &err = boost::system::error_code(),
+           uint64_t count = 0) noexcept;
+
+  /**
+   * \brief starts writing the records in a background thread
+   */
+  void start();
+
+  /**
+   * \brief writes out everything queued so far, including the pending
+   * summaries, and stops the background thread if it was started
+   */
+  void stop();
+
+  /**
+   * \brief turns logging on or off, records logged while it's off are
+   * discarded without being counted
+   */
+  void setEnabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief returns the number of records lost because the ring was full
+   */
+  uint64_t getDroppedCount() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief returns the number of records not printed because of the rate
+   * limit
+   */
+  uint64_t getSuppressedCount() const {
+    return suppressedTotal_.load(std::memory_order_relaxed);
+  }
+
+ protected:
+  using Clock = std::chrono::steady_clock;
+
+  struct Record {
+    Event event;
+    boost::asio::ip::address address;
+    boost::system::error_code err;
+    uint64_t count;
+
+    bool operator==(const Record &other) const {
+      return event == other.event && address == other.address &&
+             err == other.err && count == other.count;
+    }
+  };
+
+  // a slot of the ring; sequence tells whose turn it is (Vyukov's bounded
+  // queue): the producer claiming position p waits for p, the consumer
+  // for p + 1
+  struct Cell {
+    std::atomic<size_t> sequence;
+    Record record;
+  };
+
+  std::ostream &out_;
+  std::ostream &err_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(64) std::atomic<size_t> enqueuePos_;
+  alignas(64) size_t dequeuePos_;
+  std::atomic<bool> enabled_;
+  std::atomic<bool> stopping_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<uint64_t> suppressedTotal_;
+  std::thread thread_;
+
+  // owned by the thread writing the records
+  Record last_;
+  bool hasLast_;
+  uint64_t repeats_;
+  Clock::time_point windowStart_;
+  std::array<unsigned, kEventCount> printed_;
+  std::array<uint64_t, kEventCount> suppressed_;
+
+  void run();
+
+  /**
+   * \brief writes the records queued so far
+   * \return false if there were none
+   */
+  bool drain();
+  void write(const Record &record);
+  void writeLine(const Record &record);
+  void writeRepeats();
+
+  /**
+   * \brief sums up the suppressed records and starts a new rate window
+   */
+  void closeWindow(Clock::time_point now);
+};
+
+}  // namespace DeviceListener
+
+#endif
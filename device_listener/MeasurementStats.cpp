@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <map>
+
+#include "MeasurementStats.h"
+#include "RfcTransport.h"
+
+using namespace DeviceListener;
+
+const size_t MeasurementShard::kCapacity;
+const size_t MeasurementShard::kMaxProbes;
+const uint64_t MeasurementShard::kUsed;
+
+namespace {
+
+const unsigned kIndexBits = 14;
+const size_t kHeadersLength =
+    sizeof(RfcMessage::Rfc1006Header) + sizeof(RfcMessage::PayloadHeader);
+
+static_assert(MeasurementShard::kCapacity == size_t(1) << kIndexBits,
+              "the table is indexed by the top bits of the hash");
+
+inline size_t getIndex(uint32_t key) {
+  // Fibonacci hashing, so the IDs of a device range spread over the table
+  return (key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - kIndexBits);
+}
+
+}  // namespace
+
+MeasurementShard::MeasurementShard()
+    : slots_(new Slot[kCapacity]),
+      dropped_(0),
+      lastSlot_(nullptr),
+      lastKey_(0) {}
+
+MeasurementShard::Slot *MeasurementShard::getSlot(uint32_t key) {
+  const uint64_t tag = kUsed | key;
+  const size_t index = getIndex(key);
+  for (size_t probe = 0; probe < kMaxProbes; probe++) {
+    Slot &slot = slots_[(index + probe) & (kCapacity - 1)];
+    const uint64_t current = slot.tag.load(std::memory_order_relaxed);
+    if (current == tag) return &slot;
+    if (!current) {
+      slot.tag.store(tag, std::memory_order_release);
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+void MeasurementShard::add(const FrameBatch &batch, size_t count) {
+  const uint16_t *deviceIds = batch.deviceIds;
+  const uint16_t *types = batch.measurementTypes;
+  const uint16_t *frameLengths = batch.frameLengths;
+  const uint32_t *timestamps = batch.timestamps;
+  uint32_t *keys = keys_;
+  for (size_t i = 0; i < count; i++)
+    keys[i] = static_cast<uint32_t>(deviceIds[i]) << 16 | types[i];
+
+  for (size_t begin = 0, end; begin < count; begin = end) {
+    const uint32_t key = keys[begin];
+    for (end = begin + 1; end < count && keys[end] == key;) end++;
+
+    Slot *slot = lastSlot_ && lastKey_ == key ? lastSlot_ : getSlot(key);
+    if (!slot) {
+      addRelaxed(dropped_, end - begin);
+      continue;
+    }
+    lastSlot_ = slot;
+    lastKey_ = key;
+
+    // reductions over the columns of the run, free of branches
+    uint32_t minTimestamp = timestamps[begin];
+    uint32_t maxTimestamp = timestamps[begin];
+    uint64_t bytes = 0;
+    uint64_t outOfOrder = 0;
+    for (size_t i = begin; i < end; i++) {
+      minTimestamp = std::min(minTimestamp, timestamps[i]);
+      maxTimestamp = std::max(maxTimestamp, timestamps[i]);
+      bytes += frameLengths[i];
+    }
+    for (size_t i = begin + 1; i < end; i++)
+      outOfOrder += timestamps[i] < timestamps[i - 1];
+    bytes -= (end - begin) * kHeadersLength;
+
+    if (slot->count.load(std::memory_order_relaxed)) {
+      outOfOrder += timestamps[begin] <
+                    slot->lastTimestamp.load(std::memory_order_relaxed);
+      minTimestamp = std::min(
+          minTimestamp, slot->minTimestamp.load(std::memory_order_relaxed));
+      maxTimestamp = std::max(
+          maxTimestamp, slot->maxTimestamp.load(std::memory_order_relaxed));
+    }
+    slot->minTimestamp.store(minTimestamp, std::memory_order_relaxed);
+    slot->maxTimestamp.store(maxTimestamp, std::memory_order_relaxed);
+    slot->lastTimestamp.store(timestamps[end - 1], std::memory_order_relaxed);
+    addRelaxed(slot->dataBytes, bytes);
+    addRelaxed(slot->outOfOrder, outOfOrder);
+    addRelaxed(slot->count, end - begin);
+  }
+}
+
+MeasurementStats::MeasurementStats(size_t shardCount) {
+  for (size_t i = 0; i < (shardCount ? shardCount : 1); i++)
+    shards_.emplace_back(new MeasurementShard());
+}
+
+std::vector<MeasurementStats::Entry> MeasurementStats::getEntries() const {
+  std::map<uint32_t, Entry> merged;
+  for (auto &shard : shards_) {
+    shard->forEach([&merged](const MeasurementShard::Slot &slot) {
+      const uint64_t count = slot.count.load(std::memory_order_relaxed);
+      if (!count) return;
+      const auto key = static_cast<uint32_t>(
+          slot.tag.load(std::memory_order_relaxed) & 0xFFFFFFFF);
+      const Entry entry = {
+          static_cast<uint16_t>(key >> 16),
+          static_cast<uint16_t>(key & 0xFFFF),
+          count,
+          slot.dataBytes.load(std::memory_order_relaxed),
+          slot.outOfOrder.load(std::memory_order_relaxed),
+          slot.minTimestamp.load(std::memory_order_relaxed),
+          slot.maxTimestamp.load(std::memory_order_relaxed),
+          slot.lastTimestamp.load(std::memory_order_relaxed)};
+
+      auto inserted = merged.emplace(key, entry);
+      if (inserted.second) return;
+      Entry &total = inserted.first->second;
+      total.count += entry.count;
+      total.dataBytes += entry.dataBytes;
+      total.outOfOrder += entry.outOfOrder;
+      total.minTimestamp = std::min(total.minTimestamp, entry.minTimestamp);
+      if (entry.maxTimestamp > total.maxTimestamp) {
+        total.maxTimestamp = entry.maxTimestamp;
+        total.lastTimestamp = entry.lastTimestamp;
+      }
+    });
+  }
+
+  std::vector<Entry> entries;
+  entries.reserve(merged.size());
+  for (const auto &pair : merged) entries.push_back(pair.second);
+  return entries;
+}
+
+uint64_t MeasurementStats::getDroppedCount() const {
+  uint64_t dropped = 0;
+  for (auto &shard : shards_) dropped += shard->getDroppedCount();
+  return dropped;
+}
@@ -0,0 +1,134 @@
+#ifndef MeasurementStats_H
+#define MeasurementStats_H
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "FrameBatch.h"
+#include "MsgCounter.h"
+
+namespace DeviceListener {
+
+/**
+ * Aggregates of one ingestion thread per device and measurement type, taken
+ * from the payload headers of the counted frames.
+ *
+ * Same threading rules as for CounterShard: only the owner thread writes,
+ * other threads may read concurrently. The pairs live in an open-addressing
+ * table of a fixed size allocated once, so the hot path never allocates;
+ * frames of a pair that finds no free slot are only counted as dropped.
+ *
+ * A batch is aggregated column by column: the keys are computed for all the
+ * frames at once, then every run of frames of the same pair, which is what
+ * a connection usually sends, is reduced in tight loops and written to its
+ * slot once.
+ */
+class MeasurementShard {
+ public:
+  // slots of the table, a power of two
+  static const size_t kCapacity = 16384;
+  // slots probed before a new pair is given up on
+  static const size_t kMaxProbes = 32;
+
+  struct Slot {
+    // kUsed | deviceId << 16 | measurementType, 0 while the slot is free
+    std::atomic<uint64_t> tag{0};
+    std::atomic<uint64_t> count{0};
+    // measurement data after the payload header
+    std::atomic<uint64_t> dataBytes{0};
+    // frames with a timestamp below the one of the previous frame
+    std::atomic<uint64_t> outOfOrder{0};
+    std::atomic<uint32_t> minTimestamp{0};
+    std::atomic<uint32_t> maxTimestamp{0};
+    std::atomic<uint32_t> lastTimestamp{0};
+  };
+
+  static const uint64_t kUsed = uint64_t(1) << 32;
+
+  MeasurementShard();
+  MeasurementShard(const MeasurementShard &) = delete;
+  MeasurementShard &operator=(MeasurementShard const &) = delete;
+
+  /**
+   * \brief aggregates the first count frames of the batch, must be called
+   * from the owner thread only
+   * \param batch validated batch with metadata decoded, see
+   * FrameBatch::withMetadata; the frames must be valid
+   */
+  void add(const FrameBatch &batch, size_t count);
+
+  /**
+   * \brief calls visit(slot) for every slot taken by a pair
+   */
+  template <typename Visitor>
+  void forEach(Visitor &&visit) const {
+    for (size_t i = 0; i < kCapacity; i++)
+      if (slots_[i].tag.load(std::memory_order_acquire)) visit(slots_[i]);
+  }
+
+  /**
+   * \brief returns the number of frames not aggregated for lack of a slot
+   */
+  uint64_t getDroppedCount() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+ protected:
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> dropped_;
+  // slot of the previous run, the next batch most likely continues it
+  Slot *lastSlot_;
+  uint32_t lastKey_;
+  // scratch column of the keys of a batch
+  uint32_t keys_[FrameBatch::kCapacity];
+
+  /**
+   * \brief finds or takes the slot of the pair
+   * \return nullptr if the table has no room for it
+   */
+  Slot *getSlot(uint32_t key);
+};
+
+class MeasurementStats {
+ public:
+  struct Entry {
+    uint16_t deviceId;
+    uint16_t measurementType;
+    uint64_t count;
+    uint64_t dataBytes;
+    uint64_t outOfOrder;
+    uint32_t minTimestamp;
+    uint32_t maxTimestamp;
+    // of the thread that has seen the highest timestamp, if several threads
+    // received the pair
+    uint32_t lastTimestamp;
+  };
+
+  /**
+   * \param shardCount number of ingestion threads, each of them gets its own
+   * MeasurementShard via getShard()
+   */
+  explicit MeasurementStats(size_t shardCount);
+
+  MeasurementShard &getShard(size_t idx) { return *shards_[idx]; }
+  size_t getShardCount() const { return shards_.size(); }
+
+  /**
+   * \brief merges the pairs of all the threads
+   * \return the pairs ordered by device ID and measurement type
+   */
+  std::vector<Entry> getEntries() const;
+
+  /**
+   * \brief sums up MeasurementShard::getDroppedCount() of all the threads
+   */
+  uint64_t getDroppedCount() const;
+
+ protected:
+  std::vector<std::unique_ptr<MeasurementShard>> shards_;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,415 @@
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+
+#include "Logger.h"
+#include "MetricsServer.h"
+
+using namespace DeviceListener;
+
+const unsigned MetricsServer::kAcceptRetryMs;
+
+namespace {
+
+// rough size of one per-device line, to reserve the first response
+const size_t kDeviceLineEstimate = 96;
+
+void appendUint(std::string &out, uint64_t value) {
+  char digits[20];
+  size_t pos = sizeof(digits);
+  do {
+    digits[--pos] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  out.append(digits + pos, sizeof(digits) - pos);
+}
+
+void appendLabelValue(std::string &out, boost::string_view value) {
+  for (char c : value) {
+    switch (c) {
+      case '\\':
+        out.append("\\\\", 2);
+        break;
+      case '"':
+        out.append("\\\"", 2);
+        break;
+      case '\n':
+        out.append("\\n", 2);
+        break;
+      default:
+        out.push_back(c);
+    }
+  }
+}
+
+void appendFamily(std::string &out, const char *name, const char *type,
+                  const char *help) {
+  out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+  out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+struct WorkerMetric {
+  const char *name;
+  const char *help;
+  std::atomic<uint64_t> TransportStats::*value;
+};
+
+const WorkerMetric kWorkerMetrics[] = {
+    {"device_listener_messages_total",
+     "Valid messages counted by the ingestion thread.",
+     &TransportStats::messagesReceived},
+    {"device_listener_received_bytes_total",
+     "Bytes received by the ingestion thread.", &TransportStats::bytesReceived},
+    {"device_listener_invalid_headers_total",
+     "Connections dropped or datagrams cut short because of an invalid "
+     "RFC1006 header.",
+     &TransportStats::invalidHeaders},
+    {"device_listener_read_errors_total",
+     "Connections terminated by a read error other than end of file.",
+     &TransportStats::readErrors},
+    {"device_listener_connections_accepted_total",
+     "Connections accepted by the ingestion thread.",
+     &TransportStats::connectionsOpened},
+    {"device_listener_connections_closed_total",
+     "Connections closed by the ingestion thread.",
+     &TransportStats::connectionsClosed},
+    {"device_listener_datagrams_total",
+     "Datagrams received by the ingestion thread.",
+     &TransportStats::datagramsReceived},
+    {"device_listener_truncated_datagrams_total",
+     "Datagrams ending in the middle of a frame.",
+     &TransportStats::truncatedDatagrams},
+    {"device_listener_connections_rejected_total",
+     "Connections closed right away for exceeding the connection limits.",
+     &TransportStats::connectionsRejected},
+    {"device_listener_throttle_pauses_total",
+     "Times a connection was paused for exceeding its rate limit.",
+     &TransportStats::throttlePauses},
+    {"device_listener_resyncs_total",
+     "Invalid headers a connection recovered from by skipping to the next "
+     "header.",
+     &TransportStats::resyncs},
+    {"device_listener_resync_skipped_bytes_total",
+     "Bytes skipped while looking for the next header after an invalid one.",
+     &TransportStats::bytesSkipped},
+};
+
+struct MeasurementMetric {
+  const char *name;
+  const char *type;
+  const char *help;
+  uint64_t (*value)(const MeasurementStats::Entry &);
+};
+
+const MeasurementMetric kMeasurementMetrics[] = {
+    {"device_listener_measurements_total", "counter",
+     "Valid messages by device and measurement type.",
+     [](const MeasurementStats::Entry &entry) -> uint64_t {
+       return entry.count;
+     }},
+    {"device_listener_measurement_data_bytes_total", "counter",
+     "Measurement data after the payload header.",
+     [](const MeasurementStats::Entry &entry) -> uint64_t {
+       return entry.dataBytes;
+     }},
+    {"device_listener_measurement_out_of_order_total", "counter",
+     "Messages with a timestamp below the one of the previous message.",
+     [](const MeasurementStats::Entry &entry) -> uint64_t {
+       return entry.outOfOrder;
+     }},
+    {"device_listener_measurement_min_timestamp", "gauge",
+     "Lowest timestamp received.",
+     [](const MeasurementStats::Entry &entry) -> uint64_t {
+       return entry.minTimestamp;
+     }},
+    {"device_listener_measurement_max_timestamp", "gauge",
+     "Highest timestamp received.",
+     [](const MeasurementStats::Entry &entry) -> uint64_t {
+       return entry.maxTimestamp;
+     }},
+    {"device_listener_measurement_last_timestamp", "gauge",
+     "Timestamp of the latest message.",
+     [](const MeasurementStats::Entry &entry) -> uint64_t {
+       return entry.lastTimestamp;
+     }},
+};
+
+}  // namespace
+
+void MetricsServer::render(std::string &out) const {
+  appendFamily(out, "device_listener_device_messages_total", "counter",
+               "Valid messages received from the device.");
+  auto registry = counter_.getRegistry();
+  for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+    uint64_t counterValue;
+    bool overflow;
+    std::tie(counterValue, overflow) = counter_.getStatForDevice(devId);
+    const bool known = registry->isKnown(devId);
+    if (!counterValue && !overflow && !known) continue;
+    out.append("device_listener_device_messages_total{device_id=\"");
+    appendUint(out, devId);
+    if (known) {
+      out.append("\",device_name=\"");
+      appendLabelValue(out, registry->getName(devId));
+    }
+    out.append("\"} ");
+    appendUint(out, counterValue);
+    out.push_back('\n');
+  }
+
+  appendFamily(out, "device_listener_device_counter_overflow", "gauge",
+               "1 if the device counter has saturated.");
+  for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+    if (!counter_.getStatForDevice(devId).second) continue;
+    out.append("device_listener_device_counter_overflow{device_id=\"");
+    appendUint(out, devId);
+    out.append("\"} 1\n");
+  }
+
+  const size_t workers = counter_.getShardCount();
+  for (const WorkerMetric &metric : kWorkerMetrics) {
+    appendFamily(out, metric.name, "counter", metric.help);
+    for (size_t i = 0; i < workers; i++) {
+      const TransportStats &stats = counter_.getShard(i).transport;
+      out.append(metric.name).append("{worker=\"");
+      appendUint(out, i);
+      out.append("\"} ");
+      appendUint(out, (stats.*metric.value).load(std::memory_order_relaxed));
+      out.push_back('\n');
+    }
+  }
+
+  appendFamily(out, "device_listener_connections_active", "gauge",
+               "Connections currently served by the ingestion thread.");
+  for (size_t i = 0; i < workers; i++) {
+    const TransportStats &stats = counter_.getShard(i).transport;
+    // closed first: it never overtakes opened of the same thread
+    uint64_t closed = stats.connectionsClosed.load(std::memory_order_relaxed);
+    uint64_t opened = stats.connectionsOpened.load(std::memory_order_relaxed);
+    out.append("device_listener_connections_active{worker=\"");
+    appendUint(out, i);
+    out.append("\"} ");
+    appendUint(out, opened > closed ? opened - closed : 0);
+    out.push_back('\n');
+  }
+
+  appendFamily(out, "device_listener_connections_throttled", "gauge",
+               "Connections paused until their rate budget refills.");
+  for (size_t i = 0; i < workers; i++) {
+    out.append("device_listener_connections_throttled{worker=\"");
+    appendUint(out, i);
+    out.append("\"} ");
+    appendUint(out, counter_.getShard(i).transport.connectionsThrottled.load(
+                        std::memory_order_relaxed));
+    out.push_back('\n');
+  }
+
+  const Logger &logger = Logger::instance();
+  appendFamily(out, "device_listener_log_records_dropped_total", "counter",
+               "Log records lost because the log queue was full.");
+  out.append("device_listener_log_records_dropped_total ");
+  appendUint(out, logger.getDroppedCount());
+  out.push_back('\n');
+  appendFamily(out, "device_listener_log_records_suppressed_total", "counter",
+               "Log records not printed because of the rate limit.");
+  out.append("device_listener_log_records_suppressed_total ");
+  appendUint(out, logger.getSuppressedCount());
+  out.push_back('\n');
+
+  if (measurements_) renderMeasurements(out);
+  if (journal_) renderJournal(out);
+  if (sketches_) renderSketches(out);
+
+  if (!sourceErrors_) return;
+  appendFamily(out, "device_listener_source_errors_total", "counter",
+               "Malformed datagrams by sender address.");
+  const SourceErrors::Reason reasons[] = {
+      SourceErrors::Reason::InvalidHeader, SourceErrors::Reason::Truncated};
+  for (const auto &entry : sourceErrors_->getEntries()) {
+    for (auto reason : reasons) {
+      const uint64_t count = entry.counts[static_cast<size_t>(reason)];
+      if (!count) continue;
+      out.append("device_listener_source_errors_total{source=\"");
+      appendLabelValue(out, entry.source);
+      out.append("\",reason=\"")
+          .append(SourceErrors::getReasonName(reason))
+          .append("\"} ");
+      appendUint(out, count);
+      out.push_back('\n');
+    }
+  }
+}
+
+void MetricsServer::renderMeasurements(std::string &out) const {
+  const auto entries = measurements_->getEntries();
+  for (const MeasurementMetric &metric : kMeasurementMetrics) {
+    appendFamily(out, metric.name, metric.type, metric.help);
+    for (const auto &entry : entries) {
+      out.append(metric.name).append("{device_id=\"");
+      appendUint(out, entry.deviceId);
+      out.append("\",measurement_type=\"");
+      appendUint(out, entry.measurementType);
+      out.append("\"} ");
+      appendUint(out, metric.value(entry));
+      out.push_back('\n');
+    }
+  }
+  appendFamily(out, "device_listener_measurements_dropped_total", "counter",
+               "Messages left out of the measurement aggregates because "
+               "their table was full.");
+  out.append("device_listener_measurements_dropped_total ");
+  appendUint(out, measurements_->getDroppedCount());
+  out.push_back('\n');
+}
+
+void MetricsServer::renderJournal(std::string &out) const {
+  appendFamily(out, "device_listener_journal_messages_total", "counter",
+               "Messages written to the journal.");
+  out.append("device_listener_journal_messages_total ");
+  appendUint(out, journal_->getRowCount());
+  out.push_back('\n');
+  appendFamily(out, "device_listener_journal_bytes_total", "counter",
+               "Bytes appended to the journal.");
+  out.append("device_listener_journal_bytes_total ");
+  appendUint(out, journal_->getBytesWritten());
+  out.push_back('\n');
+  appendFamily(out, "device_listener_journal_dropped_total", "counter",
+               "Messages left out of the journal because its writer was "
+               "behind or failed.");
+  out.append("device_listener_journal_dropped_total ");
+  appendUint(out, journal_->getDroppedCount());
+  out.push_back('\n');
+}
+
+void MetricsServer::renderSketches(std::string &out) const {
+  const auto hitters = sketches_->getHeavyHitters();
+  appendFamily(out, "device_listener_tag_heavy_hitter_messages", "gauge",
+               "Estimated messages of the pairs of device and measurement "
+               "tag with the most messages, never below the true count.");
+  for (const auto &hitter : hitters) {
+    out.append("device_listener_tag_heavy_hitter_messages{device_id=\"");
+    appendUint(out, hitter.deviceId);
+    out.append("\",measurement_tag=\"");
+    appendUint(out, hitter.measurementTag);
+    out.append("\"} ");
+    appendUint(out, hitter.count);
+    out.push_back('\n');
+  }
+  appendFamily(out, "device_listener_tag_heavy_hitter_error", "gauge",
+               "How far the estimated messages may be above the true count.");
+  for (const auto &hitter : hitters) {
+    out.append("device_listener_tag_heavy_hitter_error{device_id=\"");
+    appendUint(out, hitter.deviceId);
+    out.append("\",measurement_tag=\"");
+    appendUint(out, hitter.measurementTag);
+    out.append("\"} ");
+    appendUint(out, hitter.error);
+    out.push_back('\n');
+  }
+  appendFamily(out, "device_listener_distinct_measurement_tags", "gauge",
+               "Estimated distinct measurement tags by device.");
+  for (const auto &device : sketches_->getDistinctTags()) {
+    out.append("device_listener_distinct_measurement_tags{device_id=\"");
+    appendUint(out, device.deviceId);
+    out.append("\"} ");
+    appendUint(out, static_cast<uint64_t>(std::llround(device.estimate)));
+    out.push_back('\n');
+  }
+  appendFamily(out, "device_listener_tag_sketch_dropped_total", "counter",
+               "Runs of messages whose tags were not counted as distinct "
+               "because the table of devices was full.");
+  out.append("device_listener_tag_sketch_dropped_total ");
+  appendUint(out, sketches_->getDroppedCount());
+  out.push_back('\n');
+}
+
+void MetricsServer::listen() {
+  auto endpoint =
+      boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port_);
+  acceptor_.open(endpoint.protocol());
+  acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+  acceptor_.bind(endpoint);
+  acceptor_.listen();
+  port_ = acceptor_.local_endpoint().port();
+  std::cout << "Metrics are served on port " << port_ << "..." << std::endl;
+  startAccepting();
+}
+
+void MetricsServer::startAccepting() {
+  auto session = std::make_shared<Session>(ioService_);
+  auto handler = boost::bind(&MetricsServer::handleAccept, this, session,
+                             boost::asio::placeholders::error);
+  acceptor_.async_accept(session->socket, handler);
+}
+
+void MetricsServer::handleAccept(SessionHandle session,
+                                 boost::system::error_code const &err) {
+  if (err == boost::asio::error::operation_aborted) return;
+  if (err) {
+    Logger::instance().log(Logger::Event::AcceptFailed,
+                           boost::asio::ip::address(), err);
+    acceptTimer_.expires_from_now(
+        boost::posix_time::milliseconds(kAcceptRetryMs));
+    acceptTimer_.async_wait(boost::bind(&MetricsServer::handleAcceptRetry,
+                                        this,
+                                        boost::asio::placeholders::error));
+    return;
+  }
+  auto handler = boost::bind(&MetricsServer::handleRequest, this, session,
+                             boost::asio::placeholders::error);
+  boost::asio::async_read_until(session->socket, session->request,
+                                "\r\n\r\n", handler);
+  startAccepting();
+}
+
+void MetricsServer::handleAcceptRetry(boost::system::error_code const &err) {
+  if (!err) startAccepting();
+}
+
+void MetricsServer::handleRequest(SessionHandle session,
+                                  boost::system::error_code const &err) {
+  // oversized or truncated request, nothing sensible to answer
+  if (err) return;
+
+  std::istream request(&session->request);
+  std::string method, target;
+  request >> method >> target;
+  const bool found =
+      method == "GET" &&
+      (target == "/metrics" || target.compare(0, 9, "/metrics?") == 0);
+
+  std::string &body = session->body;
+  if (found) {
+    body.reserve(lastResponseSize_ ? lastResponseSize_ + lastResponseSize_ / 8
+                                   : counter_.getShardCount() * 512 +
+                                         kDeviceLineEstimate * 1024);
+    render(body);
+    lastResponseSize_ = body.size();
+  } else {
+    body = "Not found, metrics are served on /metrics\n";
+  }
+
+  std::string &header = session->header;
+  header.append(found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n");
+  header.append("Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n");
+  header.append("Content-Length: ");
+  appendUint(header, body.size());
+  header.append("\r\nConnection: close\r\n\r\n");
+
+  std::array<boost::asio::const_buffer, 2> response = {
+      {boost::asio::buffer(header), boost::asio::buffer(body)}};
+  auto handler = boost::bind(&MetricsServer::handleWrite, this, session,
+                             boost::asio::placeholders::error);
+  boost::asio::async_write(session->socket, response, handler);
+}
+
+void MetricsServer::handleWrite(SessionHandle session,
+                                boost::system::error_code const &) {
+  boost::system::error_code ignored;
+  session->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both,
+                           ignored);
+}
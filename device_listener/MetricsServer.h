@@ -0,0 +1,117 @@
+#ifndef MetricsServer_H
+#define MetricsServer_H
+#include <boost/asio.hpp>
+#include <memory>
+#include <string>
+
+#include "Journal.h"
+#include "MeasurementStats.h"
+#include "MsgCounter.h"
+#include "SourceErrors.h"
+#include "TagSketches.h"
+
+namespace DeviceListener {
+
+/**
+ * Minimal HTTP server exposing the counters in the Prometheus text format
+ * (version 0.0.4, also accepted by OpenMetrics scrapers) on GET /metrics.
+ *
+ * It is meant to run on an io_service that serves no connections of the
+ * devices: a scrape only reads the counters with relaxed loads, so it never
+ * blocks or slows down the ingestion threads.
+ */
+class MetricsServer {
+ public:
+  /**
+   * \param port TCP port to listen on, 0 means "any free port"
+   * \param counter counters to expose, device names are taken from it too
+   * \param sourceErrors per-sender datagram errors to expose, nullptr if
+   * datagrams are not received
+   * \param measurements aggregates by device and measurement type to
+   * expose, nullptr if they are not collected
+   * \param journal journal whose progress to expose, nullptr if there is
+   * none
+   * \param sketches heavy hitters and distinct tags to expose, nullptr if
+   * they are not kept
+   */
+  MetricsServer(uint16_t port, boost::asio::io_service &ioservice,
+                const MsgCounter &counter,
+                const SourceErrors *sourceErrors = nullptr,
+                const MeasurementStats *measurements = nullptr,
+                const Journal *journal = nullptr,
+                const TagSketches *sketches = nullptr)
+      : ioService_(ioservice),
+        acceptor_(ioservice),
+        acceptTimer_(ioservice),
+        counter_(counter),
+        sourceErrors_(sourceErrors),
+        measurements_(measurements),
+        journal_(journal),
+        sketches_(sketches),
+        port_(port),
+        lastResponseSize_(0) {}
+
+  /**
+   * \brief opens socket, binds TCP port for it and starts accepting scrapes
+   */
+  void listen();
+
+  /**
+   * \brief returns the port the server is actually bound to, useful when it
+   * was created with port 0
+   */
+  uint16_t port() const { return port_; }
+
+  /**
+   * \brief renders all the metrics, appending them to out; the caller is
+   * expected to reserve the capacity, nothing is allocated per line then
+   * \param out destination of the text exposition
+   */
+  void render(std::string &out) const;
+
+ protected:
+  struct Session {
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::streambuf request;
+    std::string header;
+    std::string body;
+    explicit Session(boost::asio::io_service &ioservice)
+        : socket(ioservice), request(kMaxRequestSize) {}
+  };
+  using SessionHandle = std::shared_ptr<Session>;
+
+  static const size_t kMaxRequestSize = 8192;
+  // pause after a failed accept, which is most likely out of descriptors
+  // and would fail again right away
+  static const unsigned kAcceptRetryMs = 100;
+
+  boost::asio::io_service &ioService_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+  boost::asio::deadline_timer acceptTimer_;
+  const MsgCounter &counter_;
+  const SourceErrors *sourceErrors_;
+  const MeasurementStats *measurements_;
+  const Journal *journal_;
+  const TagSketches *sketches_;
+  uint16_t port_;
+  // size of the previous response, used to reserve the next one up front
+  size_t lastResponseSize_;
+
+  void renderMeasurements(std::string &out) const;
+  void renderJournal(std::string &out) const;
+  void renderSketches(std::string &out) const;
+  void startAccepting();
+  void handleAccept(SessionHandle session,
+                    boost::system::error_code const &err);
+  void handleAcceptRetry(boost::system::error_code const &err);
+  /**
+   * \brief answers the request once its header is received
+   */
+  void handleRequest(SessionHandle session,
+                     boost::system::error_code const &err);
+  void handleWrite(SessionHandle session, boost::system::error_code const &err);
+};
+
+}  // namespace DeviceListener
+
+#endif
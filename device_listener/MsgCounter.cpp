@@ -1,71 +1,85 @@
-#include <boost/algorithm/string.hpp>
-#include <fstream>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
-#include <vector>
+#include <new>
 
+#include "CounterFile.h"
 #include "MsgCounter.h"
 
 using namespace DeviceListener;
 
-const std::string &MsgCounter::getDeviceNameById(uint16_t id) const {
-  static const std::string kUknownDevice = std::string("Unknown device");
-  auto deviceNameIt = deviceNames_.find(id);
-  if (deviceNameIt == deviceNames_.end())
-    return kUknownDevice;
-  else
-    return deviceNameIt->second;
+MsgCounter::MsgCounter(size_t shardCount, const std::string &stateFile)
+    : shards_(nullptr),
+      shardCount_(shardCount ? shardCount : 1),
+      registry_(std::make_shared<DeviceRegistry>()) {
+  if (!stateFile.empty()) {
+    file_.reset(new CounterFile(stateFile, shardCount_));
+    shards_ = file_->getShards();
+    return;
+  }
+
+  // operator new doesn't respect over-aligned types before C++17
+  void *memory = nullptr;
+  if (posix_memalign(&memory, kCacheLineSize,
+                     sizeof(CounterShard) * shardCount_))
+    throw std::bad_alloc();
+  shards_ = static_cast<CounterShard *>(memory);
+  for (size_t i = 0; i < shardCount_; i++) new (&shards_[i]) CounterShard();
 }
 
-void MsgCounter::incrementCounter(uint16_t devId) {
-  if (stats_[devId].first < kCounterMax)
-    stats_[devId].first++;
-  else
-    stats_[devId].second = true;
+MsgCounter::~MsgCounter() {
+  // the shards in a state file are never constructed nor destroyed, they
+  // outlive the process
+  if (file_) return;
+  for (size_t i = 0; i < shardCount_; i++) shards_[i].~CounterShard();
+  free(shards_);
 }
 
-void MsgCounter::printStatistics() const {
-  std::cout << "\033[32m-----------------------------------------------------"
-            << std::endl;
-  std::cout << "Current statistics of received messages from devices:"
-            << std::endl;
-  std::cout << "[device id] - [number of valid messages]" << std::endl;
-  for (auto &i : stats_) {
-    uint64_t counterValue;
-    bool overflow;
-    std::tie(counterValue, overflow) = i.second;
-    std::cout << getDeviceNameById(i.first) << " - " << (overflow ? ">" : "")
-              << counterValue << std::endl;
-  }
-  std::cout << "-----------------------------------------------------\033[0m"
-            << std::endl;
+void MsgCounter::checkpoint() {
+  if (file_) file_->checkpoint();
 }
 
-void MsgCounter::readDevicesFromFile(const std::string &filename) {
-  std::ifstream infile(filename);
-  if (infile.is_open()) {
-    std::string line;
-    size_t lineNum = 0;
-    while (std::getline(infile, line)) {
-      lineNum++;
-      std::vector<std::string> parts;
-      boost::split(parts, line, boost::is_any_of(":"));
-      if (parts.size() < 2)
-        std::cerr << "Wrong device description format at line " << lineNum
-                  << std::endl;
-      else {
-        try {
-          uint16_t devId = std::stoi(parts[0]);
-          std::string devName = parts[1];
-          std::cout << "Added device '" << devName << "' with id = " << devId
-                    << std::endl;
-          deviceNames_[devId] = devName;
-          stats_[devId] = std::make_pair(0, false);
-        } catch (const std::invalid_argument &) {
-          std::cerr << "Wrong device ID at line " << lineNum << std::endl;
-        }
-      }
+std::pair<uint64_t, bool> MsgCounter::getStatForDevice(uint16_t devId) const {
+  uint64_t total = 0;
+  bool overflow = false;
+  for (size_t i = 0; i < shardCount_; i++) {
+    uint64_t value = shards_[i].counters[devId].load(std::memory_order_relaxed);
+    overflow |= shards_[i].overflow[devId].load(std::memory_order_relaxed);
+    if (value > kCounterMax - total) {
+      total = kCounterMax;
+      overflow = true;
+    } else {
+      total += value;
     }
-  } else
-    std::cerr << "Failed to open device description file: " << filename
-              << std::endl;
-}
\ No newline at end of file
+  }
+  return std::make_pair(total, overflow);
+}
+
+uint64_t MsgCounter::getBytesForDevice(uint16_t devId) const {
+  uint64_t total = 0;
+  for (size_t i = 0; i < shardCount_; i++)
+    total += shards_[i].bytes[devId].load(std::memory_order_relaxed);
+  return total;
+}
+
+uint64_t MsgCounter::getTotalCount() const {
+  uint64_t total = 0;
+  for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+    uint64_t value = getStatForDevice(devId).first;
+    if (value > kCounterMax - total) return kCounterMax;
+    total += value;
+  }
+  return total;
+}
+
+bool MsgCounter::readDevicesFromFile(const std::string &filename) {
+  auto started = std::chrono::steady_clock::now();
+  auto registry = DeviceRegistry::load(filename);
+  if (!registry) return false;
+  std::atomic_store(&registry_, registry);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - started);
+  std::cout << "Loaded " << registry->size() << " devices from " << filename
+            << " in " << elapsed.count() << " us" << std::endl;
+  return true;
+}
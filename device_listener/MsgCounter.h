@@ -1,53 +1,205 @@
 #ifndef MsgCounter_H
 #define MsgCounter_H
 
+#include <atomic>
 #include <limits>
+#include <memory>
 #include <string>
-#include <unordered_map>
 #include <utility>
 
+#include "DeviceRegistry.h"
+
 namespace DeviceListener {
 
+static const size_t kCacheLineSize = 64;
+
+/**
+ * \brief adds delta to a statistic written by a single thread only, without
+ * a locked read-modify-write
+ */
+inline void addRelaxed(std::atomic<uint64_t> &value, uint64_t delta) {
+  value.store(value.load(std::memory_order_relaxed) + delta,
+              std::memory_order_relaxed);
+}
+
+/**
+ * Ingest and connection statistics of one ingestion thread, same threading
+ * rules as for CounterShard.
+ */
+struct TransportStats {
+  std::atomic<uint64_t> messagesReceived{0};
+  std::atomic<uint64_t> bytesReceived{0};
+  std::atomic<uint64_t> invalidHeaders{0};
+  std::atomic<uint64_t> readErrors{0};
+  std::atomic<uint64_t> connectionsOpened{0};
+  std::atomic<uint64_t> connectionsClosed{0};
+  std::atomic<uint64_t> datagramsReceived{0};
+  // datagrams ending in the middle of a frame
+  std::atomic<uint64_t> truncatedDatagrams{0};
+  // connections closed right away because of AdmissionLimits
+  std::atomic<uint64_t> connectionsRejected{0};
+  // times a connection over its rate was paused
+  std::atomic<uint64_t> throttlePauses{0};
+  // connections paused right now, a gauge
+  std::atomic<uint64_t> connectionsThrottled{0};
+  // invalid headers a connection recovered from, see ResyncMode
+  std::atomic<uint64_t> resyncs{0};
+  // bytes dropped while looking for the next header
+  std::atomic<uint64_t> bytesSkipped{0};
+};
+
+/**
+ * Dense per-device counter table owned by exactly one ingestion thread.
+ *
+ * Only the owner thread writes to it, so increments are a plain load and
+ * store (relaxed atomics compile to ordinary moves) without any locked
+ * instructions. Other threads may read it concurrently and always see whole,
+ * monotonically growing values.
+ */
+struct alignas(kCacheLineSize) CounterShard {
+  static const size_t kDeviceCount = std::numeric_limits<uint16_t>::max() + 1;
+  static constexpr uint64_t kCounterMax = std::numeric_limits<uint64_t>::max();
+
+  std::atomic<uint64_t> counters[kDeviceCount];
+  std::atomic<bool> overflow[kDeviceCount];
+  // bytes of the counted frames, headers included
+  std::atomic<uint64_t> bytes[kDeviceCount];
+  TransportStats transport;
+
+  /**
+   * \brief increments the specified device received messages counter, must
+   * be called from the owner thread only
+   * \param devId ID of the device to increment stats
+   * \param frameLength bytes taken by the message, 0 if unknown
+   */
+  void incrementCounter(uint16_t devId, uint16_t frameLength = 0) {
+    uint64_t value = counters[devId].load(std::memory_order_relaxed);
+    if (value < kCounterMax)
+      counters[devId].store(value + 1, std::memory_order_relaxed);
+    else
+      overflow[devId].store(true, std::memory_order_relaxed);
+    addRelaxed(bytes[devId], frameLength);
+  }
+
+  /**
+   * \brief incrementCounter() for every frame of a parsed batch
+   * \param devIds device IDs, may repeat
+   * \param frameLengths bytes taken by every frame
+   * \param count number of frames
+   */
+  void incrementCounters(const uint16_t *devIds, const uint16_t *frameLengths,
+                         size_t count) {
+    for (size_t i = 0; i < count; i++)
+      incrementCounter(devIds[i], frameLengths[i]);
+    addRelaxed(transport.messagesReceived, count);
+  }
+};
+
+static_assert(sizeof(CounterShard) % kCacheLineSize == 0,
+              "adjacent shards must not share cache lines");
+
+class CounterFile;
+
 class MsgCounter {
  public:
-  static MsgCounter &get() {
-    static MsgCounter instance;
-    return instance;
-  }
   /**
-   * \brief increments the specified device received messages counter
+   * \param shardCount number of ingestion threads, each of them gets its own
+   * CounterShard via getShard()
+   * \param stateFile path to a CounterFile to keep the counters in, so they
+   * survive restarts; empty to keep them in memory only
+   */
+  explicit MsgCounter(size_t shardCount = 1,
+                      const std::string &stateFile = std::string());
+  ~MsgCounter();
+
+  /**
+   * \brief saves a consistent copy of the counters to the state file, does
+   * nothing without one; must be called from a single thread
+   */
+  void checkpoint();
+
+  /**
+   * \brief returns the counter table of one ingestion thread
+   * \param idx index of the shard, [0, getShardCount())
+   */
+  CounterShard &getShard(size_t idx) { return shards_[idx]; }
+  const CounterShard &getShard(size_t idx) const { return shards_[idx]; }
+  size_t getShardCount() const { return shardCount_; }
+
+  /**
+   * \brief increments the specified device counter in the first shard, for
+   * single-threaded users
    * \param devId ID of the device to increment stats
+   * \param frameLength bytes taken by the message, 0 if unknown
+   */
+  void incrementCounter(uint16_t devId, uint16_t frameLength = 0) {
+    shards_[0].incrementCounter(devId, frameLength);
+  }
+
+  /**
+   * \brief merges counters of the device from all the shards
+   * \param devId ID of the device
+   * \return { number of valid messages, true if the counter overflowed }
+   */
+  std::pair<uint64_t, bool> getStatForDevice(uint16_t devId) const;
+
+  /**
+   * \brief merges received bytes of the device from all the shards
+   * \param devId ID of the device
    */
-  void incrementCounter(uint16_t devId);
+  uint64_t getBytesForDevice(uint16_t devId) const;
+
   /**
-   * \brief prints current statistis to stdout in human-readable form
+   * \brief sums up counters of all the devices
+   * \return total number of valid messages received, saturated at kCounterMax
    */
-  void printStatistics() const;
+  uint64_t getTotalCount() const;
   /**
-   * \brief parses "deviceID:deviceName" description file and save it to
-   * thedeviceNames_ map
+   * \brief loads the devices description file, text or precompiled (see
+   * DeviceRegistry), and publishes it for the readers; the registry in use is
+   * kept if the file can't be read
    * \param filename path to the devices descriptions file
+   * \return true if the new registry is published
+   */
+  bool readDevicesFromFile(const std::string &filename);
+
+  /**
+   * \brief returns the registry in use; it stays valid for the holder even if
+   * a reload publishes another one meanwhile, so bulk readers should take it
+   * once and query it directly
    */
-  void readDevicesFromFile(const std::string &filename);
+  std::shared_ptr<const DeviceRegistry> getRegistry() const {
+    return std::atomic_load(&registry_);
+  }
 
   /**
    * \brief gathers human-readable device name by it ID
    * \param id device ID
    * \return human-readable device name if any, "Unknown device" if not found
    */
-  const std::string &getDeviceNameById(uint16_t id) const;
+  std::string getDeviceNameById(uint16_t id) const {
+    return getRegistry()->getName(id).to_string();
+  }
+
+  /**
+   * \brief checks if the device is described in the devices file
+   * \param id device ID
+   */
+  bool isKnownDevice(uint16_t id) const { return getRegistry()->isKnown(id); }
 
  protected:
-  static constexpr uint64_t kCounterMax = std::numeric_limits<uint64_t>::max();
-  MsgCounter() = default;
+  static constexpr uint64_t kCounterMax = CounterShard::kCounterMax;
   MsgCounter(MsgCounter const &) = delete;
   MsgCounter(MsgCounter &&) = delete;
   MsgCounter &operator=(MsgCounter const &) = delete;
   MsgCounter &operator=(MsgCounter &&) = delete;
-  std::unordered_map<uint16_t, std::pair<uint64_t, bool>> stats_;
-  std::unordered_map<uint16_t, std::string> deviceNames_;
+  CounterShard *shards_;
+  size_t shardCount_;
+  std::unique_ptr<CounterFile> file_;
+  // published with atomic_store, so readers never wait for a reload
+  std::shared_ptr<const DeviceRegistry> registry_;
 };
 
 }  // namespace DeviceListener
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cmath>
+
+#include "RateTracker.h"
+
+using namespace DeviceListener;
+
+constexpr double RateTracker::kDeviationFactor;
+constexpr double RateTracker::kMinBaselineRate;
+
+namespace {
+
+const uint64_t kNsPerSecond = 1000000000;
+// rates decayed below this are snapped to zero, so silent devices are skipped
+const float kMinRate = 1e-3f;
+
+}  // namespace
+
+RateTracker::RateTracker(const MsgCounter &counter, uint32_t staleAfterSeconds)
+    : counter_(counter),
+      staleAfterNs_(staleAfterSeconds * kNsPerSecond),
+      lastSampleNs_(0),
+      lastCounts_(CounterShard::kDeviceCount),
+      lastBytes_(CounterShard::kDeviceCount),
+      counts_(CounterShard::kDeviceCount),
+      bytes_(CounterShard::kDeviceCount),
+      firstSeenNs_(CounterShard::kDeviceCount),
+      lastSeenNs_(CounterShard::kDeviceCount) {
+  for (size_t w = 0; w < kWindowCount; w++) {
+    messageRates_[w].resize(CounterShard::kDeviceCount);
+    byteRates_[w].resize(CounterShard::kDeviceCount);
+  }
+}
+
+double RateTracker::getWindowSeconds(Window window) {
+  static const double kSeconds[kWindowCount] = {1, 10, 60};
+  return kSeconds[window];
+}
+
+void RateTracker::sample(uint64_t nowNs) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // the first sample only takes the baseline, there is no interval yet
+  const bool first = !lastSampleNs_;
+  if (!first && nowNs <= lastSampleNs_) return;
+  const double seconds =
+      first ? 0 : static_cast<double>(nowNs - lastSampleNs_) / kNsPerSecond;
+  lastSampleNs_ = nowNs;
+
+  // share of the new observation for every window, exact for any interval
+  float weights[kWindowCount];
+  for (size_t w = 0; w < kWindowCount; w++)
+    weights[w] = 1 - std::exp(-seconds / getWindowSeconds(Window(w)));
+
+  // merge the shards one after another, each of them is a sequential read;
+  // only differences are used, so wrapping sums would do no harm
+  std::fill(counts_.begin(), counts_.end(), 0);
+  std::fill(bytes_.begin(), bytes_.end(), 0);
+  for (size_t i = 0; i < counter_.getShardCount(); i++) {
+    const CounterShard &shard = counter_.getShard(i);
+    for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+      counts_[devId] += shard.counters[devId].load(std::memory_order_relaxed);
+      bytes_[devId] += shard.bytes[devId].load(std::memory_order_relaxed);
+    }
+  }
+
+  for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+    const uint64_t messages = counts_[devId] - lastCounts_[devId];
+    const uint64_t received = bytes_[devId] - lastBytes_[devId];
+    lastCounts_[devId] = counts_[devId];
+    lastBytes_[devId] = bytes_[devId];
+
+    if (messages) {
+      if (!firstSeenNs_[devId]) firstSeenNs_[devId] = nowNs;
+      lastSeenNs_[devId] = nowNs;
+    } else if (!messageRates_[kWindow60s][devId]) {
+      // the longest window decays last, all the rates are zero already
+      continue;
+    }
+    if (first) continue;
+
+    const float messageRate = messages / seconds;
+    const float byteRate = received / seconds;
+    for (size_t w = 0; w < kWindowCount; w++) {
+      float &messageAverage = messageRates_[w][devId];
+      float &byteAverage = byteRates_[w][devId];
+      messageAverage += weights[w] * (messageRate - messageAverage);
+      byteAverage += weights[w] * (byteRate - byteAverage);
+      if (messageAverage < kMinRate) messageAverage = byteAverage = 0;
+    }
+  }
+}
+
+RateTracker::Health RateTracker::getHealth(uint16_t devId) const {
+  if (!firstSeenNs_[devId]) return Health::Unseen;
+  if (lastSampleNs_ - lastSeenNs_[devId] > staleAfterNs_) return Health::Stale;
+
+  // the 60 s average means nothing until the device has been around that long
+  const uint64_t baselineNs =
+      static_cast<uint64_t>(getWindowSeconds(kWindow60s)) * kNsPerSecond;
+  if (lastSampleNs_ - firstSeenNs_[devId] < baselineNs) return Health::Ok;
+
+  const double baseline = messageRates_[kWindow60s][devId];
+  const double recent = messageRates_[kWindow10s][devId];
+  if (baseline < kMinBaselineRate) return Health::Ok;
+  if (recent > baseline * kDeviationFactor) return Health::Flooding;
+  if (recent < baseline / kDeviationFactor) return Health::Quiet;
+  return Health::Ok;
+}
+
+void RateTracker::getRates(std::vector<DeviceRates> &rates) const {
+  rates.clear();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+    const Health health = getHealth(devId);
+    if (health == Health::Unseen) continue;
+    DeviceRates device;
+    device.devId = static_cast<uint16_t>(devId);
+    device.health = health;
+    for (size_t w = 0; w < kWindowCount; w++) {
+      device.messageRates[w] = messageRates_[w][devId];
+      device.byteRates[w] = byteRates_[w][devId];
+    }
+    device.silentSeconds = (lastSampleNs_ - lastSeenNs_[devId]) / kNsPerSecond;
+    rates.push_back(device);
+  }
+}
+
+const char *RateTracker::getHealthName(Health health) {
+  switch (health) {
+    case Health::Unseen:
+      return "unseen";
+    case Health::Stale:
+      return "stale";
+    case Health::Flooding:
+      return "flooding";
+    case Health::Quiet:
+      return "quiet";
+    default:
+      return "ok";
+  }
+}
@@ -0,0 +1,117 @@
+#ifndef RateTracker_H
+#define RateTracker_H
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "MsgCounter.h"
+
+namespace DeviceListener {
+
+/**
+ * Per-device message and byte rates over 1 s, 10 s and 60 s windows.
+ *
+ * The ingestion threads only keep cumulative counters, the rates are derived
+ * from their differences by sample(), which is expected to be called about
+ * once a second from a single non-ingestion thread. Every window is an
+ * exponentially weighted moving average, the same way load averages are
+ * computed, so a device costs a fixed amount of memory and every sample is
+ * O(1) per device. The rates may be copied out by getRates() from another
+ * thread meanwhile.
+ */
+class RateTracker {
+ public:
+  enum Window { kWindow1s, kWindow10s, kWindow60s, kWindowCount };
+
+  enum class Health {
+    // silent since start, nothing to judge
+    Unseen,
+    Ok,
+    // nothing received for longer than staleAfter
+    Stale,
+    // 10 s rate is far above the 60 s baseline
+    Flooding,
+    // 10 s rate is far below the 60 s baseline
+    Quiet
+  };
+
+  // a rate deviates if it is this many times above or below the baseline
+  static constexpr double kDeviationFactor = 2.0;
+  // baselines below this (msgs/s) are too noisy to compare against
+  static constexpr double kMinBaselineRate = 1.0;
+
+  struct DeviceRates {
+    uint16_t devId;
+    Health health;
+    float messageRates[kWindowCount];
+    float byteRates[kWindowCount];
+    // since the last message, as of the last sample()
+    uint64_t silentSeconds;
+  };
+
+  /**
+   * \param counter counters to track
+   * \param staleAfterSeconds silence after which a device is reported stale
+   */
+  explicit RateTracker(const MsgCounter &counter,
+                       uint32_t staleAfterSeconds = 10);
+
+  /**
+   * \brief reads the counters and updates the rates of all the devices
+   * \param nowNs monotonic time of the sample in nanoseconds
+   */
+  void sample(uint64_t nowNs);
+
+  /**
+   * \brief copies the rates of all the devices seen so far, in ID order; may
+   * be called from any thread
+   * \param rates cleared and filled, its capacity is reused
+   */
+  void getRates(std::vector<DeviceRates> &rates) const;
+
+  /**
+   * \brief messages per second of the device averaged over the window, from
+   * the thread calling sample() only, like getByteRate() and getHealth()
+   */
+  double getMessageRate(uint16_t devId, Window window) const {
+    return messageRates_[window][devId];
+  }
+
+  /**
+   * \brief bytes per second of the device averaged over the window
+   */
+  double getByteRate(uint16_t devId, Window window) const {
+    return byteRates_[window][devId];
+  }
+
+  /**
+   * \brief judges the device by its rates as of the last sample()
+   */
+  Health getHealth(uint16_t devId) const;
+
+  static const char *getHealthName(Health health);
+
+ protected:
+  static double getWindowSeconds(Window window);
+
+  const MsgCounter &counter_;
+  const uint64_t staleAfterNs_;
+  // taken by sample() and getRates()
+  mutable std::mutex mutex_;
+  uint64_t lastSampleNs_;
+  // cumulative values as of the last sample
+  std::vector<uint64_t> lastCounts_;
+  std::vector<uint64_t> lastBytes_;
+  // scratch space of sample() for the merged counters
+  std::vector<uint64_t> counts_;
+  std::vector<uint64_t> bytes_;
+  // sample time of the first and the latest change of the counter, 0 if none
+  std::vector<uint64_t> firstSeenNs_;
+  std::vector<uint64_t> lastSeenNs_;
+  std::vector<float> messageRates_[kWindowCount];
+  std::vector<float> byteRates_[kWindowCount];
+};
+
+}  // namespace DeviceListener
+
+#endif
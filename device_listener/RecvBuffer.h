@@ -0,0 +1,56 @@
+#ifndef RecvBuffer_H
+#define RecvBuffer_H
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace DeviceListener {
+
+/**
+ * Receive buffer of a transport, shared by all of its connections: a
+ * connection's partial frame is prepended, its reads append to the tail and
+ * the frame parser consumes complete frames from the head. What is left is
+ * a partial frame again, which the transport moves into the connection (see
+ * BasicConnection) before the buffer serves the next one, so the same
+ * memory is used for every read of the transport.
+ */
+class RecvBuffer {
+ public:
+  static const size_t kDefaultCapacity = 64 * 1024;
+
+  explicit RecvBuffer(size_t capacity = kDefaultCapacity)
+      : buffer_(capacity), size_(0) {}
+
+  const uint8_t *data() const { return buffer_.data(); }
+  size_t size() const { return size_; }
+
+  /**
+   * \brief free space at the tail of the buffer for the next read
+   */
+  uint8_t *writePtr() { return buffer_.data() + size_; }
+  size_t writable() const { return buffer_.size() - size_; }
+
+  /**
+   * \brief marks bytes written to writePtr() as received
+   */
+  void commit(size_t length) { size_ += length; }
+
+  /**
+   * \brief drops processed bytes from the head of the buffer and moves the
+   * leftover (a partial frame, at most one header plus kMaxPayloadLength) to
+   * the beginning
+   */
+  void consume(size_t length) {
+    if (length < size_)
+      std::memmove(buffer_.data(), buffer_.data() + length, size_ - length);
+    size_ -= length;
+  }
+
+ private:
+  std::vector<uint8_t> buffer_;
+  size_t size_;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,193 @@
+#include <glob.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include "Replay.h"
+#include "StreamReassembler.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+/**
+ * \brief whether the name ends like a segment name, `.<worker>.<sequence>`
+ */
+bool isSegmentName(const std::string &path, size_t prefixLength) {
+  size_t dots = 0;
+  for (size_t i = prefixLength; i < path.size(); i++) {
+    if (path[i] == '.') {
+      if (++dots > 2 || i + 1 == path.size() || path[i + 1] == '.')
+        return false;
+    } else if (path[i] < '0' || path[i] > '9' || !dots) {
+      return false;
+    }
+  }
+  return dots == 2;
+}
+
+/**
+ * \brief a replayed connection
+ */
+struct Stream {
+  StreamReassembler reassembler;
+  // bytes replayed so far
+  uint64_t offset = 0;
+  // an invalid header or a gap ended it, the rest is ignored
+  bool ended = false;
+
+  explicit Stream(ByteOrderMode byteOrder) : reassembler(byteOrder) {}
+};
+
+/**
+ * \brief the next record of one worker, across its segments
+ */
+struct Cursor {
+  const std::vector<std::unique_ptr<CaptureReader>> *segments;
+  size_t segment;
+  size_t pos;
+  const CaptureFormat::RecordHeader *record;
+
+  void skipEmpty() {
+    while (!record && ++segment < segments->size()) {
+      pos = CaptureReader::getFirstRecord();
+      record = (*segments)[segment]->getRecord(pos);
+    }
+  }
+
+  void next() {
+    pos += CaptureFormat::getRecordLength(*record);
+    record = (*segments)[segment]->getRecord(pos);
+    skipEmpty();
+  }
+};
+
+}  // namespace
+
+Replay::Replay(const std::string &prefix) {
+  glob_t found;
+  const std::string pattern = prefix + ".*.*";
+  const int err = glob(pattern.c_str(), 0, nullptr, &found);
+  std::vector<std::string> paths;
+  if (!err)
+    for (size_t i = 0; i < found.gl_pathc; i++)
+      if (isSegmentName(found.gl_pathv[i], prefix.size()))
+        paths.push_back(found.gl_pathv[i]);
+  globfree(&found);
+  if (paths.empty())
+    throw std::invalid_argument("no capture segments at " + prefix);
+
+  std::vector<std::unique_ptr<CaptureReader>> segments;
+  for (const auto &path : paths)
+    segments.emplace_back(new CaptureReader(path));
+  // the names may have been sorted as text, the headers tell the order
+  std::sort(segments.begin(), segments.end(),
+            [](const std::unique_ptr<CaptureReader> &a,
+               const std::unique_ptr<CaptureReader> &b) {
+              return a->getWorker() != b->getWorker()
+                         ? a->getWorker() < b->getWorker()
+                         : a->getSequence() < b->getSequence();
+            });
+  for (auto &segment : segments) {
+    if (workers_.empty() ||
+        workers_.back().back()->getWorker() != segment->getWorker())
+      workers_.emplace_back();
+    workers_.back().push_back(std::move(segment));
+  }
+}
+
+size_t Replay::getSegmentCount() const {
+  size_t count = 0;
+  for (const auto &segments : workers_) count += segments.size();
+  return count;
+}
+
+Replay::Stats Replay::run(CounterShard &counter, double speed,
+                          ByteOrderMode byteOrder) const {
+  Stats stats;
+  std::vector<Cursor> cursors;
+  for (const auto &segments : workers_) {
+    Cursor cursor = {&segments, 0, CaptureReader::getFirstRecord(), nullptr};
+    cursor.record = segments[0]->getRecord(cursor.pos);
+    cursor.skipEmpty();
+    if (cursor.record) cursors.push_back(cursor);
+  }
+
+  // by worker in the high half and connection in the low one
+  std::unordered_map<uint64_t, std::unique_ptr<Stream>> streams;
+  FrameBatch batch;
+  auto onBatch = [&counter](const uint16_t *devIds,
+                            const uint16_t *frameLengths, size_t count) {
+    counter.incrementCounters(devIds, frameLengths, count);
+  };
+  const auto start = std::chrono::steady_clock::now();
+  uint64_t first = 0, last = 0;
+
+  while (!cursors.empty()) {
+    // the workers are few, the earliest record is looked for among them all
+    auto earliest = cursors.begin();
+    for (auto it = cursors.begin(); it != cursors.end(); ++it)
+      if (it->record->time < earliest->record->time) earliest = it;
+    const CaptureFormat::RecordHeader &record = *earliest->record;
+    const uint64_t key =
+        static_cast<uint64_t>((*earliest->segments)[0]->getWorker()) << 32 |
+        record.connection;
+    const uint8_t *data =
+        (*earliest->segments)[earliest->segment]->getData(earliest->pos);
+
+    if (!stats.records++) first = record.time;
+    last = std::max(last, record.time);
+    if (speed > 0 && record.time > first) {
+      const auto due =
+          start + std::chrono::nanoseconds(
+                      static_cast<uint64_t>((record.time - first) / speed));
+      if (due > std::chrono::steady_clock::now())
+        std::this_thread::sleep_until(due);
+    }
+
+    switch (record.type) {
+      case CaptureFormat::kOpen:
+        streams[key].reset(new Stream(byteOrder));
+        stats.connections++;
+        break;
+      case CaptureFormat::kData: {
+        auto &stream = streams[key];
+        if (!stream) {
+          // the open record was dropped, the stream is whole if this is
+          // its beginning
+          stream.reset(new Stream(byteOrder));
+          stats.connections++;
+        }
+        if (stream->ended) break;
+        if (record.offset != stream->offset) {
+          stats.gaps++;
+          stream->ended = true;
+          break;
+        }
+        auto result =
+            stream->reassembler.feed(data, record.length, batch, onBatch);
+        stream->offset += record.length;
+        stats.bytes += record.length;
+        stats.frames += result.frames;
+        if (result.invalidHeader) {
+          stats.invalidHeaders++;
+          stream->ended = true;
+        }
+        break;
+      }
+      case CaptureFormat::kClose:
+        streams.erase(key);
+        break;
+      default:
+        break;
+    }
+
+    earliest->next();
+    if (!earliest->record) cursors.erase(earliest);
+  }
+  stats.span = last - first;
+  return stats;
+}
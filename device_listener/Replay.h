@@ -0,0 +1,70 @@
+#ifndef Replay_H
+#define Replay_H
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Capture.h"
+#include "FrameCodec.h"
+#include "MsgCounter.h"
+
+namespace DeviceListener {
+
+/**
+ * Feeds a Capture back through the framing, validation and counting of the
+ * listener, without any sockets.
+ *
+ * The segments are mapped into memory and their records merged by time, so
+ * the connections of all the workers interleave as they did. Every
+ * connection is reassembled and parsed the way the io_uring backend does it
+ * (see StreamReassembler) and counted into a CounterShard; an invalid header
+ * ends the connection, like it does in the listener without resync, which
+ * is why the listener doesn't capture with resync. A connection missing a
+ * record of the capture is replayed up to the gap only.
+ */
+class Replay {
+ public:
+  struct Stats {
+    uint64_t records = 0;
+    uint64_t connections = 0;
+    uint64_t bytes = 0;
+    uint64_t frames = 0;
+    // connections ended by an invalid header
+    uint64_t invalidHeaders = 0;
+    // connections cut short by a record missing from the capture
+    uint64_t gaps = 0;
+    // nanoseconds from the first record to the last one
+    uint64_t span = 0;
+  };
+
+  /**
+   * \brief maps all the segments of a capture
+   * \param prefix the prefix the capture was written with
+   * \throws std::invalid_argument if there are no segments or one of them is
+   * not a capture segment
+   * \throws boost::system::system_error if a segment can't be mapped
+   */
+  explicit Replay(const std::string &prefix);
+
+  size_t getSegmentCount() const;
+
+  /**
+   * \brief replays the whole capture, can be called again
+   * \param counter counts the frames of all the connections
+   * \param speed 0 to replay as fast as possible, otherwise how many times
+   * faster than it was captured (1 for the original pacing)
+   * \param byteOrder byte order of the devices' frames, as the listener was
+   * told
+   */
+  Stats run(CounterShard &counter, double speed = 0,
+            ByteOrderMode byteOrder = ByteOrderMode::Native) const;
+
+ protected:
+  // segments of every worker, in their sequence
+  std::vector<std::vector<std::unique_ptr<CaptureReader>>> workers_;
+};
+
+}  // namespace DeviceListener
+
+#endif
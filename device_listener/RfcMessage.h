@@ -0,0 +1,89 @@
+#ifndef RfcMessage_H
+#define RfcMessage_H
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace DeviceListener {
+
+struct RfcMessage {
+  struct Rfc1006Header {
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t length;
+  } __attribute__((packed));
+
+  struct PayloadHeader {
+    uint16_t deviceId;
+    uint16_t measurementTag;
+    uint32_t timestamp;
+    uint16_t measurementType;
+    uint16_t dataLength;
+  } __attribute__((packed));
+
+  static const size_t kMaxPayloadLength = 4096;
+  static const uint8_t kProtocolVersion = 0x0;
+
+  Rfc1006Header headerBuffer;
+  std::vector<uint8_t> payloadBuffer;
+
+  /**
+   * \brief checks if the header is valid and return the length of the payload
+   * \param header RFC1006 header structure
+   * \result: length of the payload if header is valid, boost::none if no
+   */
+  static boost::optional<size_t> validateHeaderAndGetLength(
+      const Rfc1006Header &header) {
+    if (header.version != kProtocolVersion) return boost::none;
+    if ((header.length > kMaxPayloadLength) ||
+        (header.length < sizeof(PayloadHeader)))
+      return boost::none;
+
+    return static_cast<size_t>(header.length);
+  }
+
+  /**
+   * \brief checks if the buffer is valid and extracts device ID from payload
+   * raw buffer
+   * \param buffer pointer to the raw payload buffer
+   * \param length length of the payload
+   * \result device ID if buffer is valid, boost::none if no
+   */
+  static boost::optional<uint16_t> getDevIdFromBuffer(const uint8_t *buffer,
+                                                      size_t length) {
+    PayloadHeader header;
+
+    // I'm only gathering deviceID from the header
+    // No validation for other fields, because our job is only to count
+    // messages
+
+    if (length < sizeof(header)) return boost::none;
+
+    // reinterpret_cast will cause UB due to breaking aliasing rules,
+    // using union type will also break "active member" rule,
+    // so let's use std::memcpy. Modern compilers should be able to optimize
+    // it.
+    std::memcpy(&header, buffer, sizeof(header));
+
+    return header.deviceId;
+  }
+
+  /**
+   * \brief validateHeaderAndGetLength() for headerBuffer
+   */
+  boost::optional<size_t> validateHeaderAndGetLength() const {
+    return validateHeaderAndGetLength(headerBuffer);
+  }
+
+  /**
+   * \brief getDevIdFromBuffer() for payloadBuffer
+   */
+  boost::optional<uint16_t> getDevIdFromBuffer() const {
+    return getDevIdFromBuffer(payloadBuffer.data(), payloadBuffer.size());
+  }
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -1,102 +1,421 @@
-#define BOOST_ASIO_DISABLE_THREADS
-
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
-#include <boost/optional.hpp>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cstdint>
-#include <iostream>
-#include <list>
-#include <memory>
+#include <cstring>
 
-#include "MsgCounter.h"
+#include "FrameParser.h"
+#include "FrameResync.h"
+#include "Logger.h"
 #include "RfcTransport.h"
 
 using namespace DeviceListener;
 
-boost::optional<uint16_t> RfcMessage::getDevIdFromBuffer() {
-  PayloadHeader header;
+template <typename Stream>
+const size_t BasicRfcTransport<Stream>::kReadBufferSize;
+template <typename Stream>
+const unsigned BasicRfcTransport<Stream>::kMaxReadsPerWakeup;
+template <typename Stream>
+const unsigned BasicRfcTransport<Stream>::kResumeIntervalMs;
+template <typename Stream>
+const unsigned BasicRfcTransport<Stream>::kBurstMs;
+template <typename Stream>
+const size_t BasicRfcTransport<Stream>::kMinFrameSize;
 
-  // I'm only gathering deviceID from the header
-  // No validation for other fields, because our job is only to count messages
+namespace {
 
-  if (payloadBuffer.size() < sizeof(header)) return boost::none;
+uint64_t getBurst(uint64_t rate) {
+  return std::max<uint64_t>(rate * RfcTransport::kBurstMs / 1000, 1);
+}
 
-  // reinterpret_cast will cause UB due to breaking aliasing rules,
-  // using union type will also break "active member" rule,
-  // so let's use std::memcpy. Modern compilers should be able to optimize it.
-  std::memcpy(&header, &payloadBuffer[0], sizeof(header));
+}  // namespace
 
-  return header.deviceId;
+template <typename Stream>
+BasicRfcTransport<Stream>::BasicRfcTransport(
+    boost::asio::io_service &ioservice, const WorkerContext &context)
+    : ioService_(ioservice),
+      counter_(context.counter),
+      histograms_(context.histograms),
+      measurements_(context.measurements),
+      journal_(context.journal),
+      capture_(context.capture),
+      sketches_(context.sketches),
+      readBuffer_(kReadBufferSize),
+      resync_(context.resync),
+      byteOrder_(context.byteOrder),
+      admission_(context.admission),
+      bytesPerSecond_(admission_ ? admission_->getLimits().bytesPerSecond : 0),
+      framesPerSecond_(admission_ ? admission_->getLimits().framesPerSecond
+                                  : 0),
+      bytesBurst_(getBurst(bytesPerSecond_)),
+      framesBurst_(getBurst(framesPerSecond_)),
+      resumeTimer_(ioservice),
+      resumeScheduled_(false),
+      resumeRunning_(false),
+      closed_(false) {
+  batch_.withMetadata = measurements_ || journal_ || sketches_;
 }
 
-boost::optional<size_t> RfcMessage::validateHeaderAndGetLength() {
-  if (headerBuffer.version != kProtocolVersion) return boost::none;
-  if ((headerBuffer.length > kMaxPayloadLength) ||
-      (headerBuffer.length < sizeof(PayloadHeader)))
-    return boost::none;
+template <typename Stream>
+uint64_t BasicRfcTransport<Stream>::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
 
-  return static_cast<size_t>(headerBuffer.length);
+template <typename Stream>
+BasicRfcTransport<Stream>::~BasicRfcTransport() {
+  // the pending waits live in the connection records and resumeMemory_
+  assert(closed_);
 }
 
-void RfcTransport::handleHeaderRead(TcpServer::ConHandle conHandle,
-                                    MessagePtr msg,
-                                    boost::system::error_code const &err,
-                                    size_t bytesTransfered) {
-  if (bytesTransfered > 0) {
-    auto validationResult = msg->validateHeaderAndGetLength();
-    if (validationResult.is_initialized()) {
-      performPayloadAsyncRead(validationResult.get(), conHandle, msg);
+template <typename Stream>
+void BasicRfcTransport<Stream>::close() {
+  closed_ = true;
+  // their pending waits live in the records, which the pool keeps until it
+  // is destroyed
+  boost::system::error_code ignored;
+  connections_.forEach([&ignored](BasicConnection<Stream> &connection) {
+    connection.socket.close(ignored);
+  });
+  resumeTimer_.cancel(ignored);
+}
+
+template <typename Stream>
+bool BasicRfcTransport<Stream>::readAvailable(ConHandle conHandle) {
+  RecvBuffer &buffer = readBuffer_;
+  if (conHandle->carried) {
+    const uint8_t *carried =
+        conHandle->spill ? conHandle->spill->data : conHandle->inlineBuffer;
+    std::memcpy(buffer.writePtr(), carried, conHandle->carried);
+    buffer.commit(conHandle->carried);
+  }
+
+  const bool limited = isRateLimited();
+  bool mayRead = !limited || refillBudgets(conHandle, now());
+  for (unsigned i = 0; mayRead && i < kMaxReadsPerWakeup; i++) {
+    boost::system::error_code err;
+    size_t space = buffer.writable();
+    // a read stays within the budgets, give or take the partial frame
+    if (bytesPerSecond_)
+      space = std::min<uint64_t>(space, conHandle->bytesBudget.getAvailable());
+    if (framesPerSecond_)
+      space = std::min<uint64_t>(
+          space, conHandle->framesBudget.getAvailable() * kMinFrameSize);
+    size_t bytesTransfered = conHandle->socket.read_some(
+        boost::asio::buffer(buffer.writePtr(), space), err);
+    if (err == boost::asio::error::would_block) break;
+
+    if (bytesTransfered > 0) {
+      const uint64_t readCompleted =
+          kInstrumentationEnabled && histograms_ ? StageHistograms::now() : 0;
+      if (capture_) {
+        capture_->addData(conHandle->captureId, conHandle->captured,
+                          buffer.writePtr(), bytesTransfered);
+        conHandle->captured += bytesTransfered;
+      }
+      buffer.commit(bytesTransfered);
+      addRelaxed(counter_.transport.bytesReceived, bytesTransfered);
+
+      auto frames = countFrames(conHandle);
+      if (limited) {
+        conHandle->bytesBudget.consume(bytesTransfered);
+        conHandle->framesBudget.consume(frames.value_or(0));
+        mayRead = refillBudgets(conHandle, now());
+      }
+
+      if (kInstrumentationEnabled && histograms_) {
+        histograms_->bytesPerRead.record(bytesTransfered);
+        histograms_->framesPerRead.record(frames.value_or(0));
+        histograms_->readToCount.record(StageHistograms::now() -
+                                        readCompleted);
+      }
+
+      if (!frames) {
+        Logger::instance().log(Logger::Event::InvalidHeader,
+                               getPeer(conHandle));
+        addRelaxed(counter_.transport.invalidHeaders, 1);
+        buffer.consume(buffer.size());
+        closeConnection(conHandle);
+        return false;
+      }
+    }
+
+    if (err) {
+      Logger::instance().log(Logger::Event::ReadFailed, getPeer(conHandle),
+                             err);
+      // a peer closing the connection is not an error worth alerting on
+      if (err != boost::asio::error::eof)
+        addRelaxed(counter_.transport.readErrors, 1);
+      buffer.consume(buffer.size());
+      closeConnection(conHandle);
+      return false;
+    }
+    // a short read means the socket is drained
+    if (bytesTransfered < space) break;
+  }
+
+  keepPartialFrame(conHandle);
+  if (!mayRead) {
+    throttle(conHandle);
+    return false;
+  }
+  return true;
+}
+
+template <typename Stream>
+boost::optional<size_t> BasicRfcTransport<Stream>::countFrames(
+    ConHandle conHandle) {
+  RecvBuffer &buffer = readBuffer_;
+  CounterShard &counter = counter_;
+  MeasurementShard *measurements = measurements_;
+  JournalShard *journal = journal_;
+  TagSketchShard *sketches = sketches_;
+  const FrameBatch &batch = batch_;
+  auto onBatch = [&counter, measurements, journal, sketches, &batch](
+                     const uint16_t *devIds, const uint16_t *frameLengths,
+                     size_t count) {
+    counter.incrementCounters(devIds, frameLengths, count);
+    if (measurements) measurements->add(batch, count);
+    if (journal) journal->add(batch, count);
+    if (sketches) sketches->add(batch, count);
+  };
+
+  size_t frames = 0;
+  for (;;) {
+    if (conHandle->resyncing && !resync(conHandle)) return frames;
+    if (conHandle->format == FrameFormat::Undetected)
+      conHandle->format =
+          detectFrameFormat(buffer.data(), buffer.size(), byteOrder_);
+    FrameParser::Result result = {0, 0, false};
+    if (conHandle->format != FrameFormat::Undetected) {
+      result = visitFrameFormat(conHandle->format, [&](auto codec) {
+        return FrameParser::parseBatches<decltype(codec)>(
+            buffer.data(), buffer.size(), batch_, onBatch);
+      });
+    } else if (buffer.size() < sizeof(RfcMessage::Rfc1006Header) ||
+               isValidInAnyFormat(buffer.data())) {
+      // too little to tell the format by yet
+      return frames;
     } else {
-      std::cerr << "Error occured: invalid header" << std::endl;
+      // the stream begins with a header of no format, the format is
+      // detected at the header the resync finds
+      result.invalidHeader = true;
     }
+    buffer.consume(result.consumed);
+    frames += result.frames;
+    if (!result.invalidHeader) return frames;
+    if (resync_ == ResyncMode::Off) return boost::none;
+
+    // no frame starts at the invalid header, the search goes on after it;
+    // every round consumes something, so this ends with the buffer
+    buffer.consume(1);
+    addRelaxed(counter_.transport.bytesSkipped, 1);
+    conHandle->resyncing = true;
+    conHandle->skipped = 1;
   }
+}
 
-  if (err) {
-    std::cerr << "Error occured during 'read' call: " << err.message()
-              << std::endl;
+template <typename Stream>
+bool BasicRfcTransport<Stream>::resync(ConHandle conHandle) {
+  RecvBuffer &buffer = readBuffer_;
+  const bool confirm = resync_ == ResyncMode::Confirmed;
+  FrameResync::Result result;
+  if (conHandle->format == FrameFormat::Undetected)
+    result = FrameResync::findInAnyFormat(buffer.data(), buffer.size(), 0,
+                                          confirm);
+  else
+    result = visitFrameFormat(conHandle->format, [&](auto codec) {
+      return FrameResync::find<decltype(codec)>(buffer.data(), buffer.size(),
+                                                0, confirm);
+    });
+  buffer.consume(result.skipped);
+  addRelaxed(counter_.transport.bytesSkipped, result.skipped);
+  conHandle->skipped += result.skipped;
+  if (!result.found) return false;
+
+  addRelaxed(counter_.transport.resyncs, 1);
+  Logger::instance().log(Logger::Event::StreamResynced, getPeer(conHandle),
+                         boost::system::error_code(), conHandle->skipped);
+  conHandle->resyncing = false;
+  conHandle->skipped = 0;
+  return true;
+}
+
+template <typename Stream>
+bool BasicRfcTransport<Stream>::refillBudgets(ConHandle conHandle,
+                                              uint64_t now) {
+  bool mayRead = true;
+  if (bytesPerSecond_) {
+    conHandle->bytesBudget.refill(bytesPerSecond_, bytesBurst_, now);
+    mayRead = conHandle->bytesBudget.getAvailable();
+  }
+  if (framesPerSecond_) {
+    conHandle->framesBudget.refill(framesPerSecond_, framesBurst_, now);
+    mayRead = mayRead && conHandle->framesBudget.getAvailable();
   }
+  return mayRead;
 }
 
-void RfcTransport::handlePayloadRead(TcpServer::ConHandle conHandle,
-                                     MessagePtr msg,
-                                     boost::system::error_code const &err,
-                                     size_t bytesTransfered) {
-  if (bytesTransfered > 0) {
-    auto devId = msg->getDevIdFromBuffer();
-    if (devId.is_initialized()) MsgCounter::get().incrementCounter(devId.get());
+template <typename Stream>
+void BasicRfcTransport<Stream>::throttle(ConHandle conHandle) {
+  throttled_.push_back(conHandle);
+  // one that is paused again as soon as it is resumed stays in the same pause
+  if (!resumeRunning_) addRelaxed(counter_.transport.throttlePauses, 1);
+  counter_.transport.connectionsThrottled.store(throttled_.size(),
+                                                std::memory_order_relaxed);
+  scheduleResume();
+}
+
+template <typename Stream>
+void BasicRfcTransport<Stream>::scheduleResume() {
+  if (resumeScheduled_) return;
+  resumeScheduled_ = true;
+  resumeTimer_.expires_from_now(
+      boost::posix_time::milliseconds(kResumeIntervalMs));
+  auto handler = boost::bind(&BasicRfcTransport::handleResume, this,
+                             boost::asio::placeholders::error);
+  resumeTimer_.async_wait(makeAllocatingHandler(resumeMemory_, handler));
+}
+
+template <typename Stream>
+void BasicRfcTransport<Stream>::handleResume(
+    boost::system::error_code const &err) {
+  // aborted with the transport, the pool cleans up
+  if (err || closed_) return;
+  resumeScheduled_ = false;
+  // resumed connections may be paused again, into the emptied list
+  resuming_.swap(throttled_);
+  const uint64_t timestamp = now();
+  resumeRunning_ = true;
+  for (auto conHandle : resuming_) {
+    if (!refillBudgets(conHandle, timestamp)) {
+      throttled_.push_back(conHandle);
+      continue;
+    }
+    if (readAvailable(conHandle)) startWaiting(conHandle);
   }
+  resumeRunning_ = false;
+  resuming_.clear();
+  counter_.transport.connectionsThrottled.store(throttled_.size(),
+                                                std::memory_order_relaxed);
+  if (!throttled_.empty()) scheduleResume();
+}
 
-  if (!err) {
-    startPacketAsyncRead(conHandle);
+template <typename Stream>
+void BasicRfcTransport<Stream>::keepPartialFrame(ConHandle conHandle) {
+  RecvBuffer &buffer = readBuffer_;
+  // the parser stops at a frame it can't complete, so this is shorter than
+  // a frame of the maximal length; a resync may also wait for the header
+  // after it, which still fits a FrameBlock
+  const size_t leftover = buffer.size();
+  uint8_t *destination;
+  if (leftover <= BasicConnection<Stream>::kInlineSize) {
+    if (conHandle->spill) {
+      frameBlocks_.release(conHandle->spill);
+      conHandle->spill = nullptr;
+    }
+    destination = conHandle->inlineBuffer;
   } else {
-    std::cerr << "Error occured during 'read' call: " << err.message()
-              << std::endl;
+    if (!conHandle->spill) conHandle->spill = frameBlocks_.allocate();
+    destination = conHandle->spill->data;
+  }
+  std::memcpy(destination, buffer.data(), leftover);
+  conHandle->carried = leftover;
+  buffer.consume(leftover);
+}
+
+template <typename Stream>
+void BasicRfcTransport<Stream>::handleReadable(
+    ConHandle conHandle, boost::system::error_code const &err) {
+  // aborted, or completed just before the transport was closed; the pool
+  // cleans up
+  if (closed_ || err == boost::asio::error::operation_aborted) return;
+  if (err) {
+    Logger::instance().log(Logger::Event::WaitFailed, getPeer(conHandle),
+                           err);
+    addRelaxed(counter_.transport.readErrors, 1);
+    closeConnection(conHandle);
+    return;
+  }
+  if (readAvailable(conHandle)) startWaiting(conHandle);
+}
+
+template <typename Stream>
+bool BasicRfcTransport<Stream>::admitConnection(
+    ConHandle conHandle, const boost::asio::ip::address &source) {
+  conHandle->peer = source;
+  if (!admission_) return true;
+  const bool admitted = StreamTraits<Stream>::kHasAddress
+                            ? admission_->tryAdmit(source)
+                            : admission_->tryAdmitLocal();
+  if (!admitted) {
+    addRelaxed(counter_.transport.connectionsRejected, 1);
+    return false;
+  }
+  return true;
+}
+
+template <typename Stream>
+void BasicRfcTransport<Stream>::startConnection(ConHandle conHandle) {
+  addRelaxed(counter_.transport.connectionsOpened, 1);
+  if (capture_) {
+    conHandle->captureId =
+        capture_->addOpen(StreamTraits<Stream>::getName(conHandle->socket));
+    conHandle->captured = 0;
+  }
+  if (isRateLimited()) {
+    const uint64_t timestamp = now();
+    conHandle->bytesBudget.reset(bytesBurst_, timestamp);
+    conHandle->framesBudget.reset(framesBurst_, timestamp);
+  }
+  boost::system::error_code err;
+  conHandle->socket.non_blocking(true, err);
+  if (err) {
+    Logger::instance().log(Logger::Event::IoctlFailed, getPeer(conHandle),
+                           err);
+    closeConnection(conHandle);
+    return;
   }
+  // the device may have sent something already
+  if (readAvailable(conHandle)) startWaiting(conHandle);
 }
 
-void RfcTransport::performPayloadAsyncRead(size_t length,
-                                           TcpServer::ConHandle conHandle,
-                                           MessagePtr msg) {
-  auto handler = boost::bind(&RfcTransport::handlePayloadRead, this, conHandle,
-                             msg, boost::asio::placeholders::error,
-                             boost::asio::placeholders::bytes_transferred);
-  msg->payloadBuffer.resize(length);
-  boost::asio::async_read(conHandle->socket,
-                          boost::asio::buffer(msg->payloadBuffer, length),
-                          boost::asio::transfer_exactly(length), handler);
-}
-
-void RfcTransport::startPacketAsyncRead(TcpServer::ConHandle conHandle) {
-  auto msg = std::make_shared<RfcMessage>();
-  // This can be optimized, actually: don't create new RfcMessage every time,
-  // just pass it like ConHandle through the chain of callbacks
-  auto handler = boost::bind(&RfcTransport::handleHeaderRead, this, conHandle,
-                             msg, boost::asio::placeholders::error,
-                             boost::asio::placeholders::bytes_transferred);
-  boost::asio::async_read(
-      conHandle->socket,
-      boost::asio::buffer(&msg->headerBuffer,
-                          sizeof(RfcMessage::Rfc1006Header)),
-      boost::asio::transfer_exactly(sizeof(RfcMessage::Rfc1006Header)),
-      handler);
+template <typename Stream>
+void BasicRfcTransport<Stream>::releaseConnection(ConHandle conHandle) {
+  if (conHandle->spill) frameBlocks_.release(conHandle->spill);
+  conHandle->resyncing = false;
+  conHandle->skipped = 0;
+  conHandle->format = FrameFormat::Undetected;
+  connections_.release(conHandle);
 }
+
+template <typename Stream>
+void BasicRfcTransport<Stream>::closeConnection(ConHandle conHandle) {
+  addRelaxed(counter_.transport.connectionsClosed, 1);
+  if (capture_) capture_->addClose(conHandle->captureId, conHandle->captured);
+  if (admission_) {
+    if (StreamTraits<Stream>::kHasAddress)
+      admission_->release(conHandle->peer);
+    else
+      admission_->releaseLocal();
+  }
+  releaseConnection(conHandle);
+}
+
+template <typename Stream>
+void BasicRfcTransport<Stream>::startWaiting(ConHandle conHandle) {
+  auto handler = boost::bind(&BasicRfcTransport::handleReadable, this,
+                             conHandle, boost::asio::placeholders::error);
+  conHandle->socket.async_wait(
+      Stream::wait_read,
+      makeAllocatingHandler(conHandle->handlerMemory, handler));
+}
+
+// every stream the listener reads frames from
+template class DeviceListener::BasicRfcTransport<
+    boost::asio::ip::tcp::socket>;
+template class DeviceListener::BasicRfcTransport<UnixSocket>;
+template class DeviceListener::BasicRfcTransport<SerialStream>;
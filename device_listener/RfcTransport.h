@@ -1,92 +1,264 @@
 #ifndef RfcTransport_H
 #define RfcTransport_H
-#define BOOST_ASIO_DISABLE_THREADS
-
 #include <boost/asio.hpp>
 #include <boost/optional.hpp>
+#include <cstring>
 #include <vector>
 
-#include "TcpServer.h"
+#include "Connection.h"
+#include "FrameBatch.h"
+#include "RecvBuffer.h"
+#include "RfcMessage.h"
+#include "SlabPool.h"
+#include "WorkerContext.h"
 
 namespace DeviceListener {
 
-struct RfcMessage {
-  struct Rfc1006Header {
-    uint8_t version;
-    uint8_t reserved;
-    uint16_t length;
-  } __attribute__((packed));
+// a frame of the maximal length, and the header after it that a resync
+// waits for to confirm the frame
+struct FrameBlock {
+  uint8_t data[2 * sizeof(RfcMessage::Rfc1006Header) +
+               RfcMessage::kMaxPayloadLength];
+};
 
-  struct PayloadHeader {
-    uint16_t deviceId;
-    uint16_t measurementTag;
-    uint32_t timestamp;
-    uint16_t measurementType;
-    uint16_t dataLength;
-  } __attribute__((packed));
+/**
+ * Receives the RFC1006 stream of all the connections of one worker thread.
+ *
+ * Stream is the type the connections read from, see BasicConnection: the
+ * transport is instantiated for TCP (RfcTransport, fed by TcpServer), Unix
+ * domain sockets (UnixTransport, fed by UnixServer) and serial lines
+ * (SerialTransport, fed by SerialLine). All of them count into the same
+ * kind of CounterShard with the same parser.
+ *
+ * Connections don't own receive buffers. The transport waits until a socket
+ * is readable, reads it into a buffer shared by all of its connections,
+ * counts the complete frames and keeps only the trailing partial frame in the
+ * connection: inline if it is short, in a FrameBlock borrowed from a shared
+ * pool otherwise. Connection records come from a slab pool, so accepting and
+ * closing a connection allocates nothing once the pool has grown.
+ *
+ * With rate limits a connection over its budget is not read: it leaves the
+ * wait loop for a list of paused connections, which a timer resumes once
+ * their budgets refill. Meanwhile the kernel buffers fill up and flow
+ * control slows the device down, the other connections keep their share.
+ *
+ * An invalid header closes the connection, unless resync is enabled: then
+ * the bytes up to the next plausible header are skipped and counted, and
+ * the connection carries on.
+ *
+ * With a capture every read is also copied, as it was read, into the
+ * capture records of the thread, for replaying it later (see Replay).
+ *
+ * A connection is read with the codec of its FrameFormat, the one of the
+ * byte order given or, when it is detected, the one its first frame makes
+ * sense in (see detectFrameFormat()); a stream that begins with garbage is
+ * detected at the first header its resync finds. A read is dispatched to
+ * the parser of that codec as a whole.
+ *
+ * The io_service must be run by a single thread: the shared buffer and the
+ * pools are not locked.
+ */
+template <typename Stream>
+class BasicRfcTransport {
+ public:
+  // a record of the connection pool
+  using ConHandle = BasicConnection<Stream> *;
 
-  static const size_t kMaxPayloadLength = 4096;
-  static const uint8_t kProtocolVersion = 0x0;
+  // shared read buffer, a read takes as much as fits
+  static const size_t kReadBufferSize = RecvBuffer::kDefaultCapacity;
+  // reads per readiness notification, so one busy connection doesn't
+  // starve the others
+  static const unsigned kMaxReadsPerWakeup = 4;
+  // how often paused connections are checked for a refilled budget
+  static const unsigned kResumeIntervalMs = 10;
+  // a budget holds at most what the rate gives in this time, so a paused
+  // connection can't catch up in one long burst
+  static const unsigned kBurstMs = 100;
+  // the shortest valid frame, a header and an empty payload
+  static const size_t kMinFrameSize =
+      sizeof(RfcMessage::Rfc1006Header) + sizeof(RfcMessage::PayloadHeader);
 
-  Rfc1006Header headerBuffer;
-  std::vector<uint8_t> payloadBuffer;
+  /**
+   * \param context shards of the thread running ioservice, the limits and
+   * how the frames are read; the source errors are not used
+   */
+  BasicRfcTransport(boost::asio::io_service &ioservice,
+                    const WorkerContext &context);
+  /**
+   * \brief the transport must be closed by then and the aborted waits of its
+   * connections completed, see close(); checked in debug builds
+   */
+  ~BasicRfcTransport();
+  BasicRfcTransport(const BasicRfcTransport &) = delete;
+  BasicRfcTransport &operator=(BasicRfcTransport const &) = delete;
 
   /**
-   * \brief checks if the header is valid and return the length of the payload
-   * \param header RFC1006 header structure
-   * \result: length of the payload if header is valid, boost::none if no
+   * \brief takes a connection record from the pool, for the acceptor to
+   * accept into
    */
-  boost::optional<size_t> validateHeaderAndGetLength();
+  ConHandle allocateConnection() {
+    return connections_.allocate(ioService_);
+  }
 
   /**
-   * \brief checks if the buffer is valid and extracts device ID from payload
-   * raw buffer
-   * \param buffer reference to the raw payload buffer
-   * \result device ID if buffer is valid, boost::none if no
+   * \brief returns a connection that was never started to the pool
    */
-  boost::optional<uint16_t> getDevIdFromBuffer();
-};
+  void releaseConnection(ConHandle conHandle);
 
-class RfcTransport {
- public:
-  using MessagePtr = std::shared_ptr<RfcMessage>;
-  explicit RfcTransport(boost::asio::io_service &ioservice)
-      : ioService_(ioservice) {}
+  /**
+   * \brief takes a place for an accepted connection in the admission
+   * control, if any
+   * \param source address of the peer; streams without addresses (see
+   * StreamTraits::kHasAddress) have none and are limited in total only
+   * \return false if the connection exceeds the limits, it must be released
+   * then without being started
+   */
+  bool admitConnection(
+      ConHandle conHandle,
+      const boost::asio::ip::address &source = boost::asio::ip::address());
+
+  /**
+   * \brief accounts a newly accepted connection and starts reading from it
+   * \param conHandle object representing the accepted connection
+   */
+  void startConnection(ConHandle conHandle);
+
+  /**
+   * \brief closes the connections left and stops resuming the paused ones;
+   * their pending waits are aborted and must be completed before the
+   * transport is destroyed, see completeAbortedOperations()
+   */
+  void close();
+
+  /**
+   * \brief number of open connections
+   */
+  size_t getConnectionCount() const { return connections_.size(); }
+
+  /**
+   * \brief number of connections holding a large partial frame
+   */
+  size_t getSpilledCount() const { return frameBlocks_.size(); }
 
   /**
-   * \brief read RFC1006 header asynchronously and schedule header and payload
-   * processing if everything is fine
-   * \param conHandle object representing a connection we work with
+   * \brief number of connections paused for exceeding their rate
    */
-  void startPacketAsyncRead(TcpServer::ConHandle conHandle);
+  size_t getThrottledCount() const { return throttled_.size(); }
 
  protected:
   boost::asio::io_service &ioService_;
+  CounterShard &counter_;
+  StageHistograms *histograms_;
+  MeasurementShard *measurements_;
+  JournalShard *journal_;
+  CaptureShard *capture_;
+  TagSketchShard *sketches_;
+  // scratch space of the frame parser, reused by all the connections
+  FrameBatch batch_;
+  // every read lands here, empty between the reads
+  RecvBuffer readBuffer_;
+  SlabPool<BasicConnection<Stream>> connections_;
+  SlabPool<FrameBlock, 64> frameBlocks_;
+  ResyncMode resync_;
+  ByteOrderMode byteOrder_;
+
+  AdmissionControl *admission_;
+  // per connection, 0 for unlimited
+  uint64_t bytesPerSecond_;
+  uint64_t framesPerSecond_;
+  uint64_t bytesBurst_;
+  uint64_t framesBurst_;
+  // connections waiting for their budgets, and the ones being resumed
+  std::vector<ConHandle> throttled_;
+  std::vector<ConHandle> resuming_;
+  boost::asio::deadline_timer resumeTimer_;
+  HandlerMemory<BasicConnection<Stream>::kHandlerMemorySize> resumeMemory_;
+  bool resumeScheduled_;
+  // handleResume() is going through the paused connections
+  bool resumeRunning_;
+  bool closed_;
 
   /**
-   * \brief validate RFC1006 header and schedule receiving the packet payloadd
-   * \param conHandle pointer to the Connection object we are working with
-   * \param err error code of 'read' call
-   * \param message pointer to the Message object for this connection
-   * \param bytesTransfered - number of received bytes, must be equal to the
-   * RFC1006 header length
+   * \brief accounts a started connection as closed and returns it to the
+   * pool, which closes the socket
    */
-  void handleHeaderRead(TcpServer::ConHandle conHandle, MessagePtr msg,
-                        boost::system::error_code const &err,
-                        size_t bytesTransfered);
+  void closeConnection(ConHandle conHandle);
+
   /**
-   * \brief validate payload structure and pass it to the data counter
+   * \brief schedules a wait for the connection to become readable
+   */
+  void startWaiting(ConHandle conHandle);
+
+  /**
+   * \brief reads and counts what's available, then waits again
    * \param conHandle pointer to the Connection object we are working with
-   * \param err error code of 'read' call
-   * \param message pointer to the Message object for this connection
-   * \param bytesTransfered - number of received bytes, must be bigger than
-   * payload header length
-   */
-  void handlePayloadRead(TcpServer::ConHandle conHandle, MessagePtr msg,
-                         boost::system::error_code const &err,
-                         size_t bytesTransfered);
-  void performPayloadAsyncRead(size_t length, TcpServer::ConHandle conHandle,
-                               MessagePtr msg);
+   * \param err error code of 'wait' call
+   */
+  void handleReadable(ConHandle conHandle,
+                      boost::system::error_code const &err);
+
+  /**
+   * \brief reads the socket until it would block, kMaxReadsPerWakeup reads
+   * are done or the connection runs out of budget, counting the complete
+   * frames
+   * \return false if the connection has been closed or paused, so it must
+   * not wait for the socket
+   */
+  bool readAvailable(ConHandle conHandle);
+
+  /**
+   * \brief counts the complete frames in readBuffer_ and consumes them,
+   * resynchronizing the stream on invalid headers if enabled
+   * \return number of frames counted, boost::none if an invalid header was
+   * met and the connection must be closed
+   */
+  boost::optional<size_t> countFrames(ConHandle conHandle);
+
+  /**
+   * \brief skips the bytes of readBuffer_ before the next plausible header
+   * \return true if the header was found, so the stream is in sync again
+   */
+  bool resync(ConHandle conHandle);
+
+  bool isRateLimited() const { return bytesPerSecond_ || framesPerSecond_; }
+
+  /**
+   * \brief refills the budgets of the connection
+   * \return true if it may read
+   */
+  bool refillBudgets(ConHandle conHandle, uint64_t now);
+
+  /**
+   * \brief puts the connection on the paused list
+   */
+  void throttle(ConHandle conHandle);
+
+  /**
+   * \brief arms the timer resuming the paused connections, unless it is
+   * armed already
+   */
+  void scheduleResume();
+
+  /**
+   * \brief resumes the paused connections whose budgets have refilled
+   */
+  void handleResume(boost::system::error_code const &err);
+
+  static uint64_t now();
+
+  /**
+   * \brief the source the connection is logged as; the one it was admitted
+   * as once the socket can't tell, e.g. after a reset
+   */
+  static boost::asio::ip::address getPeer(ConHandle conHandle) {
+    return StreamTraits<Stream>::getPeer(conHandle->socket)
+        .value_or(conHandle->peer);
+  }
+
+  /**
+   * \brief moves the partial frame left in readBuffer_ into the connection
+   */
+  void keepPartialFrame(ConHandle conHandle);
 };
 
 }  // namespace DeviceListener
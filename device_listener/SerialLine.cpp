@@ -0,0 +1,116 @@
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+#include "Logger.h"
+#include "RfcTransport.h"
+#include "SerialLine.h"
+
+using namespace DeviceListener;
+
+const unsigned SerialLine::kReopenIntervalMs;
+
+SerialOptions SerialOptions::parse(const std::string &value) {
+  SerialOptions options;
+  const size_t colon = value.rfind(':');
+  options.device = value.substr(0, colon);
+  if (colon != std::string::npos) {
+    const std::string baud = value.substr(colon + 1);
+    char *end = nullptr;
+    const unsigned long baudRate = std::strtoul(baud.c_str(), &end, 10);
+    if (baud.empty() || *end || !baudRate || baud[0] == '-')
+      throw std::invalid_argument("incorrect baud rate: " + baud);
+    options.baudRate = static_cast<unsigned>(baudRate);
+  }
+  if (options.device.empty())
+    throw std::invalid_argument("no serial device given");
+  return options;
+}
+
+SerialLine::~SerialLine() {
+  // a pending reopen would call back into the line
+  assert(closed_);
+}
+
+void SerialLine::close() {
+  closed_ = true;
+  boost::system::error_code ignored;
+  reopenTimer_.cancel(ignored);
+}
+
+void SerialLine::open() {
+  boost::system::error_code err;
+  if (!tryOpen(err))
+    throw boost::system::system_error(err, "failed to open " +
+                                               options_.device);
+  std::cout << "Reading serial line " << options_.device << " at "
+            << options_.baudRate << " baud..." << std::endl;
+  scheduleReopen();
+}
+
+bool SerialLine::tryOpen(boost::system::error_code &err) {
+  using boost::asio::serial_port;
+  auto &context = reopenTimer_.get_executor().context();
+  // serial_port opens the line raw and sets it up, but can't wait for it to
+  // become readable; the transport reads a copy of its descriptor instead
+  serial_port port(static_cast<boost::asio::io_service &>(context));
+  port.open(options_.device, err);
+  if (!err) port.set_option(serial_port::baud_rate(options_.baudRate), err);
+  if (!err) port.set_option(serial_port::character_size(8), err);
+  if (!err)
+    port.set_option(serial_port::parity(serial_port::parity::none), err);
+  if (!err)
+    port.set_option(serial_port::stop_bits(serial_port::stop_bits::one), err);
+  if (!err)
+    port.set_option(
+        serial_port::flow_control(serial_port::flow_control::none), err);
+  if (err) return false;
+  const int fd = ::dup(port.native_handle());
+  if (fd < 0) {
+    err.assign(errno, boost::system::system_category());
+    return false;
+  }
+
+  auto conHandle = transport_.allocateConnection();
+  conHandle->socket.assign(fd, err);
+  if (err) {
+    ::close(fd);
+    transport_.releaseConnection(conHandle);
+    return false;
+  }
+  if (!transport_.admitConnection(conHandle)) {
+    Logger::instance().log(Logger::Event::ConnectionRejected);
+    boost::system::error_code ignored;
+    conHandle->socket.close(ignored);
+    transport_.releaseConnection(conHandle);
+    err = boost::asio::error::connection_refused;
+    return false;
+  }
+  Logger::instance().log(Logger::Event::DeviceConnected);
+  transport_.startConnection(conHandle);
+  return true;
+}
+
+void SerialLine::scheduleReopen() {
+  reopenTimer_.expires_from_now(
+      boost::posix_time::milliseconds(kReopenIntervalMs));
+  reopenTimer_.async_wait(boost::bind(&SerialLine::handleReopen, this,
+                                      boost::asio::placeholders::error));
+}
+
+void SerialLine::handleReopen(boost::system::error_code const &err) {
+  // aborted with the line, or closed after the timer had expired
+  if (err || closed_) return;
+  if (!transport_.getConnectionCount()) {
+    boost::system::error_code openErr;
+    if (!tryOpen(openErr))
+      Logger::instance().log(Logger::Event::OpenFailed,
+                             boost::asio::ip::address(), openErr);
+  }
+  scheduleReopen();
+}
@@ -0,0 +1,87 @@
+#ifndef SerialLine_H
+#define SerialLine_H
+#include <boost/asio.hpp>
+#include <string>
+
+#include "Connection.h"
+
+namespace DeviceListener {
+
+/**
+ * A serial line to read frames from, as given with `-S device[:baud]`.
+ */
+struct SerialOptions {
+  std::string device;
+  unsigned baudRate = 115200;
+
+  /**
+   * \brief parses `device[:baud]`
+   * \throws std::invalid_argument if the device is empty or the baud rate
+   * isn't a positive number
+   */
+  static SerialOptions parse(const std::string &value);
+};
+
+/**
+ * An RS-232/RS-485 line (or a pseudo-terminal) read by a SerialTransport as
+ * one long-lived connection: the line is opened raw, 8N1 without flow
+ * control, at the given baud rate, and its frames are counted like the
+ * ones of a TCP connection.
+ *
+ * A line is closed on the same conditions as a connection, a read error or
+ * an invalid header without resync; it is then reopened every
+ * kReopenIntervalMs until that succeeds. The line has its transport to
+ * itself, an empty transport is how it tells the line was closed.
+ */
+class SerialLine {
+ public:
+  static const unsigned kReopenIntervalMs = 1000;
+
+  SerialLine(const SerialOptions &options, boost::asio::io_service &ioservice,
+             SerialTransport &transport)
+      : options_(options),
+        transport_(transport),
+        reopenTimer_(ioservice),
+        closed_(false) {}
+  /**
+   * \brief the line must be closed by then and its aborted reopen completed,
+   * see close(); checked in debug builds
+   */
+  ~SerialLine();
+  SerialLine(const SerialLine &) = delete;
+  SerialLine &operator=(SerialLine const &) = delete;
+
+  /**
+   * \brief opens the line, starts reading it and watching it to reopen it
+   * once it is closed; throws boost::system::system_error on failure
+   */
+  void open();
+
+  /**
+   * \brief stops reopening the line, the transport closes the line itself;
+   * the pending wait of the timer is aborted and must be completed before
+   * the line is destroyed, see completeAbortedOperations()
+   */
+  void close();
+
+  const SerialOptions &getOptions() const { return options_; }
+
+ protected:
+  SerialOptions options_;
+  SerialTransport &transport_;
+  boost::asio::deadline_timer reopenTimer_;
+  bool closed_;
+
+  /**
+   * \brief opens and configures the device and starts a connection on it
+   * \return false with err set if it can't be opened
+   */
+  bool tryOpen(boost::system::error_code &err);
+
+  void scheduleReopen();
+  void handleReopen(boost::system::error_code const &err);
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef SlabPool_H
+#define SlabPool_H
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace DeviceListener {
+
+/**
+ * Pool of fixed-size records of type T, carved out of slabs of kSlabRecords
+ * records each. Both allocate() and release() are O(1): a released record
+ * goes to the head of an intrusive free list and is the next one reused.
+ *
+ * Slabs are never returned to the system before the pool is destroyed, the
+ * pool stays at its high-water mark; untouched records of the last slab
+ * don't take any resident memory though. Not thread-safe, meant to be owned
+ * by one ingestion thread.
+ */
+template <typename T, size_t kSlabRecords = 1024>
+class SlabPool {
+ public:
+  SlabPool() : free_(nullptr), carved_(kSlabRecords), size_(0) {}
+
+  /**
+   * \brief destroys the records still in use
+   */
+  ~SlabPool() {
+    forEach([](T &record) { record.~T(); });
+  }
+
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(SlabPool const &) = delete;
+
+  /**
+   * \brief constructs a record in a free slot, adding a slab if there is
+   * none
+   */
+  template <typename... Args>
+  T *allocate(Args &&... args) {
+    Slot *slot = free_;
+    if (slot) {
+      free_ = slot->next;
+    } else {
+      if (carved_ == kSlabRecords) {
+        slabs_.emplace_back(new Slot[kSlabRecords]);
+        carved_ = 0;
+      }
+      slot = &slabs_.back()[carved_++];
+    }
+    T *record;
+    try {
+      record = new (slot->storage) T(std::forward<Args>(args)...);
+    } catch (...) {
+      slot->next = free_;
+      free_ = slot;
+      throw;
+    }
+    size_++;
+    return record;
+  }
+
+  /**
+   * \brief destroys a record got from allocate() and makes its slot the
+   * next one to reuse
+   */
+  void release(T *record) {
+    record->~T();
+    Slot *slot = reinterpret_cast<Slot *>(record);
+    slot->next = free_;
+    free_ = slot;
+    size_--;
+  }
+
+  /**
+   * \brief calls function with every record in use; slow, it has to sort
+   * the free list out first, meant for shutdown
+   */
+  template <typename Function>
+  void forEach(Function function) {
+    std::vector<Slot *> freeSlots;
+    freeSlots.reserve(capacity() - size_);
+    for (Slot *slot = free_; slot; slot = slot->next) freeSlots.push_back(slot);
+    std::sort(freeSlots.begin(), freeSlots.end());
+    for (size_t s = 0; s < slabs_.size(); s++) {
+      const size_t carved = s + 1 == slabs_.size() ? carved_ : kSlabRecords;
+      for (size_t i = 0; i < carved; i++) {
+        Slot *slot = &slabs_[s][i];
+        if (!std::binary_search(freeSlots.begin(), freeSlots.end(), slot))
+          function(*reinterpret_cast<T *>(slot->storage));
+      }
+    }
+  }
+
+  /**
+   * \brief number of records in use
+   */
+  size_t size() const { return size_; }
+
+  /**
+   * \brief number of records the slabs allocated so far can hold
+   */
+  size_t capacity() const { return slabs_.size() * kSlabRecords; }
+
+ private:
+  union Slot {
+    Slot *next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  std::vector<std::unique_ptr<Slot[]>> slabs_;
+  Slot *free_;
+  // slots of the last slab handed out at least once
+  size_t carved_;
+  size_t size_;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <map>
+
+#include "MsgCounter.h"
+#include "SourceErrors.h"
+
+using namespace DeviceListener;
+
+const size_t SourceErrorShard::kReasonCount;
+const size_t SourceErrorShard::kMaxSources;
+const size_t SourceErrorShard::kCapacity;
+const size_t SourceErrors::kReasonCount;
+const size_t SourceErrors::kMaxSources;
+const size_t SourceErrors::kShownSources;
+
+namespace {
+
+size_t getHash(const boost::asio::ip::address &source) {
+  uint64_t key = 0;
+  if (source.is_v4()) {
+    key = source.to_v4().to_uint();
+  } else {
+    for (uint8_t byte : source.to_v6().to_bytes()) key = key * 131 + byte;
+  }
+  // the high bits of a Fibonacci hash mix in every bit of the key
+  return (key * 0x9e3779b97f4a7c15ull) >> 40;
+}
+
+}  // namespace
+
+SourceErrorShard::Slot::Slot() : used(false) {
+  for (auto &count : counts) count.store(0, std::memory_order_relaxed);
+}
+
+SourceErrorShard::SourceErrorShard()
+    : slots_(new Slot[kCapacity]), size_(0) {}
+
+void SourceErrorShard::record(const boost::asio::ip::address &source,
+                              Reason reason) {
+  const size_t r = static_cast<size_t>(reason);
+  // the table is at most half full, a free slot ends the probing
+  for (size_t i = getHash(source);; i++) {
+    Slot &slot = slots_[i & (kCapacity - 1)];
+    if (!slot.used.load(std::memory_order_relaxed)) {
+      if (size_ >= kMaxSources) break;
+      slot.source = source;
+      slot.used.store(true, std::memory_order_release);
+      size_++;
+    } else if (slot.source != source) {
+      continue;
+    }
+    addRelaxed(slot.counts[r], 1);
+    return;
+  }
+  addRelaxed(others_.counts[r], 1);
+}
+
+uint64_t SourceErrors::Entry::total() const {
+  uint64_t sum = 0;
+  for (uint64_t count : counts) sum += count;
+  return sum;
+}
+
+SourceErrors::SourceErrors(size_t shardCount) {
+  for (size_t i = 0; i < shardCount; i++)
+    shards_.emplace_back(new SourceErrorShard());
+}
+
+std::vector<SourceErrors::Entry> SourceErrors::getEntries() const {
+  std::map<boost::asio::ip::address, Counts> sources;
+  Counts others = Counts();
+  auto add = [](Counts &to, const SourceErrorShard::Slot &slot) {
+    for (size_t r = 0; r < kReasonCount; r++)
+      to[r] += slot.counts[r].load(std::memory_order_relaxed);
+  };
+  for (const auto &shard : shards_) {
+    shard->forEach([&](const SourceErrorShard::Slot &slot) {
+      auto it = sources.find(slot.source);
+      if (it == sources.end()) {
+        if (sources.size() >= kMaxSources) return add(others, slot);
+        it = sources.emplace(slot.source, Counts()).first;
+      }
+      add(it->second, slot);
+    });
+    add(others, shard->getOthers());
+  }
+
+  std::vector<Entry> entries;
+  entries.reserve(sources.size() + 1);
+  for (const auto &source : sources)
+    entries.push_back({source.first.to_string(), source.second});
+  entries.push_back({"other", others});
+  if (!entries.back().total()) entries.pop_back();
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const Entry &a, const Entry &b) {
+                     return a.total() > b.total();
+                   });
+  return entries;
+}
+
+const char *SourceErrors::getReasonName(Reason reason) {
+  switch (reason) {
+    case Reason::InvalidHeader:
+      return "invalid_header";
+    case Reason::Truncated:
+      return "truncated";
+  }
+  return "";
+}
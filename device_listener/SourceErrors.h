@@ -0,0 +1,121 @@
+#ifndef SourceErrors_H
+#define SourceErrors_H
+#include <boost/asio/ip/address.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace DeviceListener {
+
+/**
+ * Error counters of one ingestion thread per source address of the
+ * datagrams.
+ *
+ * Same threading rules as for CounterShard: only the owner thread records,
+ * other threads may read concurrently. The senders live in an
+ * open-addressing table allocated once, an address is written before its
+ * slot is published and never changes, so recording an error neither locks
+ * nor allocates. Once kMaxSources addresses are known, errors of new ones
+ * are added up as "other".
+ */
+class SourceErrorShard {
+ public:
+  enum class Reason {
+    // the datagram has a frame with an invalid RFC1006 header
+    InvalidHeader,
+    // the datagram ends in the middle of a frame or didn't fit the buffer
+    Truncated,
+  };
+  static const size_t kReasonCount = 2;
+  static const size_t kMaxSources = 4096;
+  // slots of the table, a power of two; never more than half of them taken
+  static const size_t kCapacity = 2 * kMaxSources;
+
+  struct Slot {
+    Slot();
+    // set once source is written
+    std::atomic<bool> used;
+    boost::asio::ip::address source;
+    std::atomic<uint64_t> counts[kReasonCount];
+  };
+
+  SourceErrorShard();
+  SourceErrorShard(const SourceErrorShard &) = delete;
+  SourceErrorShard &operator=(SourceErrorShard const &) = delete;
+
+  /**
+   * \brief counts an error of the sender, must be called from the owner
+   * thread only
+   */
+  void record(const boost::asio::ip::address &source, Reason reason);
+
+  /**
+   * \brief calls visit(slot) for every slot taken by a sender
+   */
+  template <typename Visitor>
+  void forEach(Visitor &&visit) const {
+    for (size_t i = 0; i < kCapacity; i++)
+      if (slots_[i].used.load(std::memory_order_acquire)) visit(slots_[i]);
+  }
+
+  /**
+   * \brief returns the counters of the senders beyond kMaxSources
+   */
+  const Slot &getOthers() const { return others_; }
+
+ protected:
+  std::unique_ptr<Slot[]> slots_;
+  // taken slots, of the owner thread only
+  size_t size_;
+  Slot others_;
+};
+
+/**
+ * Datagram errors per source address of all the ingestion threads, to spot
+ * the senders that misbehave. Each thread records into its own shard, the
+ * readers merge them.
+ */
+class SourceErrors {
+ public:
+  using Reason = SourceErrorShard::Reason;
+  static const size_t kReasonCount = SourceErrorShard::kReasonCount;
+  static const size_t kMaxSources = SourceErrorShard::kMaxSources;
+  // senders the statistics show at most, the worst ones
+  static const size_t kShownSources = 10;
+
+  using Counts = std::array<uint64_t, kReasonCount>;
+
+  struct Entry {
+    // address of the sender, "other" for the ones beyond kMaxSources
+    std::string source;
+    Counts counts;
+    uint64_t total() const;
+  };
+
+  /**
+   * \param shardCount number of ingestion threads, each of them gets its own
+   * SourceErrorShard via getShard()
+   */
+  explicit SourceErrors(size_t shardCount = 1);
+
+  SourceErrorShard &getShard(size_t idx) { return *shards_[idx]; }
+  size_t getShardCount() const { return shards_.size(); }
+
+  /**
+   * \brief merges the counters of all the threads, the worst senders first;
+   * kMaxSources of them at most, the rest are added to "other"
+   */
+  std::vector<Entry> getEntries() const;
+
+  static const char *getReasonName(Reason reason);
+
+ protected:
+  std::vector<std::unique_ptr<SourceErrorShard>> shards_;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,550 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <memory>
+
+#include "StatsRenderer.h"
+
+using namespace DeviceListener;
+
+const size_t StatsRenderer::kDefaultTop;
+
+namespace {
+
+// how long the rendering thread sleeps between checks for a tick
+const std::chrono::milliseconds kPollInterval(10);
+// room of the buffer from the start, it grows to the largest render once
+const size_t kInitialBufferSize = 256 * 1024;
+
+const char kRuler[] = "-----------------------------------------------------";
+const char kGreen[] = "\033[32m";
+const char kYellow[] = "\033[33m";
+const char kRed[] = "\033[31m";
+const char kCyan[] = "\033[36m";
+const char kReset[] = "\033[0m";
+
+void append(std::string &buffer, const char *text) { buffer += text; }
+
+void append(std::string &buffer, boost::string_view text) {
+  buffer.append(text.data(), text.size());
+}
+
+void append(std::string &buffer, uint64_t number) {
+  char digits[20];
+  size_t length = 0;
+  do {
+    digits[length++] = static_cast<char>('0' + number % 10);
+    number /= 10;
+  } while (number);
+  while (length) buffer += digits[--length];
+}
+
+/**
+ * \brief appends the non-negative value with one decimal
+ */
+void appendFixed(std::string &buffer, double value) {
+  const uint64_t tenths = static_cast<uint64_t>(std::llround(value * 10));
+  append(buffer, tenths / 10);
+  buffer += '.';
+  buffer += static_cast<char>('0' + tenths % 10);
+}
+
+void appendUpper(std::string &buffer, const char *text) {
+  for (; *text; text++)
+    buffer += static_cast<char>(*text >= 'a' && *text <= 'z'
+                                    ? *text - 'a' + 'A'
+                                    : *text);
+}
+
+void appendRuler(std::string &buffer, const char *color) {
+  append(buffer, color);
+  append(buffer, kRuler);
+  buffer += '\n';
+}
+
+void appendClosingRuler(std::string &buffer) {
+  append(buffer, kRuler);
+  append(buffer, kReset);
+  buffer += '\n';
+}
+
+/**
+ * \brief appends the text as a quoted value, escaping the quotes in it
+ */
+void appendQuoted(std::string &buffer, boost::string_view text) {
+  buffer += '"';
+  for (char c : text) {
+    if (c == '"' || c == '\\') buffer += '\\';
+    buffer += c;
+  }
+  buffer += '"';
+}
+
+/**
+ * \brief whether every rate of the device shows as 0.0, as the averages of
+ * a silent device decay towards zero without reaching it
+ */
+bool hasZeroRates(const RateTracker::DeviceRates &device) {
+  for (size_t w = 0; w < RateTracker::kWindowCount; w++)
+    if (device.messageRates[w] >= 0.05f || device.byteRates[w] >= 0.05f)
+      return false;
+  return true;
+}
+
+const char *getViewName(StatsView view) {
+  switch (view) {
+    case StatsView::Top:
+      return "top";
+    case StatsView::Changed:
+      return "changed";
+    default:
+      return "all";
+  }
+}
+
+}  // namespace
+
+StatsRenderer::StatsRenderer(const MsgCounter &counter,
+                             const StatsOptions &options, int fd,
+                             const StatsSections &sections)
+    : counter_(counter),
+      options_(options),
+      fd_(fd),
+      sections_(sections),
+      requested_(0),
+      renders_(0),
+      stopping_(false),
+      rendered_(0),
+      counts_(CounterShard::kDeviceCount),
+      previous_(CounterShard::kDeviceCount),
+      overflow_(CounterShard::kDeviceCount) {
+  shown_.reserve(CounterShard::kDeviceCount);
+  buffer_.reserve(kInitialBufferSize);
+  if (kInstrumentationEnabled && sections_.instrumentation)
+    merged_.reset(new StageHistograms());
+}
+
+StatsRenderer::~StatsRenderer() { stop(); }
+
+void StatsRenderer::start() {
+  if (thread_.joinable()) return;
+  stopping_ = false;
+  thread_ = std::thread(&StatsRenderer::run, this);
+}
+
+void StatsRenderer::stop() {
+  if (thread_.joinable()) {
+    stopping_ = true;
+    thread_.join();
+  }
+  if (requested_.load(std::memory_order_relaxed) != rendered_) {
+    rendered_ = requested_.load(std::memory_order_relaxed);
+    render();
+  }
+}
+
+void StatsRenderer::run() {
+  while (!stopping_.load(std::memory_order_relaxed)) {
+    const uint64_t requested = requested_.load(std::memory_order_relaxed);
+    if (requested == rendered_) {
+      std::this_thread::sleep_for(kPollInterval);
+      continue;
+    }
+    rendered_ = requested;
+    render();
+  }
+}
+
+const std::string &StatsRenderer::render() {
+  // taken once, a reload meanwhile shows up in the next render
+  auto registry = counter_.getRegistry();
+  takeSnapshot();
+  selectDevices(*registry);
+  buffer_.clear();
+  format(*registry);
+  formatRates(*registry);
+  formatSourceErrors();
+  formatInstrumentation();
+  write();
+  renders_.fetch_add(1, std::memory_order_relaxed);
+  return buffer_;
+}
+
+void StatsRenderer::takeSnapshot() {
+  counts_.swap(previous_);
+  std::fill(counts_.begin(), counts_.end(), 0);
+  std::fill(overflow_.begin(), overflow_.end(), 0);
+  // shard by shard, so every table is read front to back
+  for (size_t i = 0; i < counter_.getShardCount(); i++) {
+    const CounterShard &shard = counter_.getShard(i);
+    for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++) {
+      const uint64_t value =
+          shard.counters[devId].load(std::memory_order_relaxed);
+      overflow_[devId] |=
+          shard.overflow[devId].load(std::memory_order_relaxed);
+      if (value > CounterShard::kCounterMax - counts_[devId]) {
+        counts_[devId] = CounterShard::kCounterMax;
+        overflow_[devId] = true;
+      } else {
+        counts_[devId] += value;
+      }
+    }
+  }
+}
+
+void StatsRenderer::selectDevices(const DeviceRegistry &registry) {
+  shown_.clear();
+  const auto &counts = counts_;
+  const auto &previous = previous_;
+  size_t limit = options_.limit;
+  switch (options_.view) {
+    case StatsView::All:
+      for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++)
+        if (counts[devId] || overflow_[devId] || registry.isKnown(devId))
+          shown_.push_back(static_cast<uint16_t>(devId));
+      if (limit && shown_.size() > limit) shown_.resize(limit);
+      return;
+
+    case StatsView::Top: {
+      for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++)
+        if (counts[devId]) shown_.push_back(static_cast<uint16_t>(devId));
+      limit = std::min(limit ? limit : kDefaultTop, shown_.size());
+      // only the first ones are put in order
+      std::partial_sort(shown_.begin(), shown_.begin() + limit, shown_.end(),
+                        [&counts](uint16_t a, uint16_t b) {
+                          return counts[a] != counts[b] ? counts[a] > counts[b]
+                                                        : a < b;
+                        });
+      shown_.resize(limit);
+      return;
+    }
+
+    case StatsView::Changed: {
+      for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++)
+        if (counts[devId] != previous[devId])
+          shown_.push_back(static_cast<uint16_t>(devId));
+      limit = limit ? std::min(limit, shown_.size()) : shown_.size();
+      std::partial_sort(shown_.begin(), shown_.begin() + limit, shown_.end(),
+                        [&counts, &previous](uint16_t a, uint16_t b) {
+                          const uint64_t deltaA = counts[a] - previous[a];
+                          const uint64_t deltaB = counts[b] - previous[b];
+                          return deltaA != deltaB ? deltaA > deltaB : a < b;
+                        });
+      shown_.resize(limit);
+      return;
+    }
+  }
+}
+
+void StatsRenderer::format(const DeviceRegistry &registry) {
+  std::string &out = buffer_;
+  if (options_.machine) {
+    uint64_t total = 0;
+    for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++)
+      total = counts_[devId] > CounterShard::kCounterMax - total
+                  ? CounterShard::kCounterMax
+                  : total + counts_[devId];
+    append(out, "statistics view=");
+    append(out, getViewName(options_.view));
+    append(out, " devices=");
+    append(out, static_cast<uint64_t>(shown_.size()));
+    append(out, " total=");
+    append(out, total);
+    out += '\n';
+    for (uint16_t devId : shown_) {
+      append(out, "device=");
+      append(out, static_cast<uint64_t>(devId));
+      append(out, " name=");
+      appendQuoted(out, registry.getName(devId));
+      append(out, " messages=");
+      append(out, counts_[devId]);
+      append(out, " new=");
+      append(out, counts_[devId] - previous_[devId]);
+      if (overflow_[devId]) append(out, " overflow=1");
+      out += '\n';
+    }
+    formatTransport();
+    return;
+  }
+
+  appendRuler(out, kGreen);
+  switch (options_.view) {
+    case StatsView::All:
+      append(out, "Current statistics of received messages from devices:\n");
+      break;
+    case StatsView::Top:
+      append(out, "Busiest devices:\n");
+      break;
+    case StatsView::Changed:
+      append(out, "Devices that received messages since the last "
+                  "statistics:\n");
+      break;
+  }
+  append(out, options_.view == StatsView::Changed
+                  ? "[device id] - [number of valid messages] (+[new ones])\n"
+                  : "[device id] - [number of valid messages]\n");
+  for (uint16_t devId : shown_) {
+    append(out, registry.getName(devId));
+    append(out, " - ");
+    if (overflow_[devId]) out += '>';
+    append(out, counts_[devId]);
+    if (options_.view == StatsView::Changed) {
+      append(out, " (+");
+      append(out, counts_[devId] - previous_[devId]);
+      out += ')';
+    }
+    out += '\n';
+  }
+  formatTransport();
+  appendClosingRuler(out);
+}
+
+void StatsRenderer::formatTransport() {
+  uint64_t rejected = 0, throttled = 0, pauses = 0, resyncs = 0, skipped = 0;
+  for (size_t i = 0; i < counter_.getShardCount(); i++) {
+    const TransportStats &stats = counter_.getShard(i).transport;
+    rejected += stats.connectionsRejected.load(std::memory_order_relaxed);
+    throttled += stats.connectionsThrottled.load(std::memory_order_relaxed);
+    pauses += stats.throttlePauses.load(std::memory_order_relaxed);
+    resyncs += stats.resyncs.load(std::memory_order_relaxed);
+    skipped += stats.bytesSkipped.load(std::memory_order_relaxed);
+  }
+
+  std::string &out = buffer_;
+  if (options_.machine) {
+    append(out, "transport connections_rejected=");
+    append(out, rejected);
+    append(out, " connections_throttled=");
+    append(out, throttled);
+    append(out, " throttle_pauses=");
+    append(out, pauses);
+    append(out, " resyncs=");
+    append(out, resyncs);
+    append(out, " skipped_bytes=");
+    append(out, skipped);
+    out += '\n';
+    return;
+  }
+
+  // only shown once the admission limits have been hit or a stream resynced
+  if (rejected || pauses) {
+    append(out, "Rejected connections: ");
+    append(out, rejected);
+    append(out, ", throttled connections: ");
+    append(out, throttled);
+    append(out, " (paused ");
+    append(out, pauses);
+    append(out, " times)\n");
+  }
+  if (resyncs || skipped) {
+    append(out, "Resynchronized streams: ");
+    append(out, resyncs);
+    append(out, " times, ");
+    append(out, skipped);
+    append(out, " bytes skipped\n");
+  }
+}
+
+void StatsRenderer::formatRates(const DeviceRegistry &registry) {
+  if (!sections_.rates) return;
+  // copied under the tracker's lock, formatted without it
+  sections_.rates->getRates(rates_);
+
+  std::string &out = buffer_;
+  if (!options_.machine) {
+    appendRuler(out, kYellow);
+    append(out, "Receive rates over 1s/10s/60s:\n");
+    append(out, "[device] - [msgs/s] [bytes/s]\n");
+  }
+  // the devices of the counters above, in their order
+  const auto byId = [](const RateTracker::DeviceRates &device,
+                       uint16_t devId) { return device.devId < devId; };
+  for (uint16_t devId : shown_) {
+    auto found = std::lower_bound(rates_.begin(), rates_.end(), devId, byId);
+    if (found == rates_.end() || found->devId != devId ||
+        hasZeroRates(*found))
+      continue;
+    const RateTracker::DeviceRates &device = *found;
+    if (options_.machine) {
+      static const char *const kWindowNames[RateTracker::kWindowCount] = {
+          "1s", "10s", "60s"};
+      append(out, "rates device=");
+      append(out, static_cast<uint64_t>(device.devId));
+      append(out, " name=");
+      appendQuoted(out, registry.getName(device.devId));
+      for (size_t w = 0; w < RateTracker::kWindowCount; w++) {
+        append(out, " msgs_");
+        append(out, kWindowNames[w]);
+        out += '=';
+        appendFixed(out, device.messageRates[w]);
+      }
+      for (size_t w = 0; w < RateTracker::kWindowCount; w++) {
+        append(out, " bytes_");
+        append(out, kWindowNames[w]);
+        out += '=';
+        appendFixed(out, device.byteRates[w]);
+      }
+      append(out, " health=");
+      append(out, RateTracker::getHealthName(device.health));
+      if (device.health == RateTracker::Health::Stale) {
+        append(out, " silent_seconds=");
+        append(out, device.silentSeconds);
+      }
+      out += '\n';
+      continue;
+    }
+
+    append(out, registry.getName(device.devId));
+    append(out, " (");
+    append(out, static_cast<uint64_t>(device.devId));
+    append(out, ") - ");
+    for (size_t w = 0; w < RateTracker::kWindowCount; w++) {
+      if (w) out += '/';
+      appendFixed(out, device.messageRates[w]);
+    }
+    out += ' ';
+    for (size_t w = 0; w < RateTracker::kWindowCount; w++) {
+      if (w) out += '/';
+      appendFixed(out, device.byteRates[w]);
+    }
+    if (device.health != RateTracker::Health::Ok) {
+      out += ' ';
+      appendUpper(out, RateTracker::getHealthName(device.health));
+    }
+    if (device.health == RateTracker::Health::Stale) {
+      append(out, " (silent for ");
+      append(out, device.silentSeconds);
+      append(out, " s)");
+    }
+    out += '\n';
+  }
+  if (!options_.machine) appendClosingRuler(out);
+}
+
+void StatsRenderer::formatSourceErrors() {
+  if (!sections_.sourceErrors) return;
+  const auto entries = sections_.sourceErrors->getEntries();
+  if (entries.empty()) return;
+
+  std::string &out = buffer_;
+  const size_t shown = std::min(entries.size(), SourceErrors::kShownSources);
+  if (options_.machine) {
+    for (size_t i = 0; i < shown; i++) {
+      append(out, "source_errors source=");
+      appendQuoted(out, entries[i].source);
+      for (size_t r = 0; r < SourceErrors::kReasonCount; r++) {
+        out += ' ';
+        append(out, SourceErrors::getReasonName(SourceErrors::Reason(r)));
+        out += '=';
+        append(out, entries[i].counts[r]);
+      }
+      out += '\n';
+    }
+    if (entries.size() > shown) {
+      append(out, "source_errors more_senders=");
+      append(out, static_cast<uint64_t>(entries.size() - shown));
+      out += '\n';
+    }
+    return;
+  }
+
+  appendRuler(out, kRed);
+  append(out, "Datagram errors by sender:\n");
+  append(out, "[address] - [invalid headers] [truncated]\n");
+  for (size_t i = 0; i < shown; i++) {
+    append(out, entries[i].source);
+    append(out, " -");
+    for (uint64_t count : entries[i].counts) {
+      out += ' ';
+      append(out, count);
+    }
+    out += '\n';
+  }
+  if (entries.size() > shown) {
+    append(out, "... and ");
+    append(out, static_cast<uint64_t>(entries.size() - shown));
+    append(out, " more senders\n");
+  }
+  appendClosingRuler(out);
+}
+
+void StatsRenderer::formatInstrumentation() {
+  if (!kInstrumentationEnabled || !sections_.instrumentation) return;
+  const Instrumentation &instrumentation = *sections_.instrumentation;
+
+  StageHistograms &merged = *merged_;
+  merged.readToCount.reset();
+  merged.bytesPerRead.reset();
+  merged.framesPerRead.reset();
+  for (size_t i = 0; i < instrumentation.getShardCount(); i++) {
+    const StageHistograms &shard = instrumentation.getShard(i);
+    merged.readToCount.add(shard.readToCount);
+    merged.bytesPerRead.add(shard.bytesPerRead);
+    merged.framesPerRead.add(shard.framesPerRead);
+  }
+
+  if (!options_.machine) {
+    appendRuler(buffer_, kCyan);
+    append(buffer_, "Hot path histograms since start:\n");
+  }
+  formatHistogram("read to count, ns", "read_to_count_ns",
+                  merged.readToCount);
+  formatHistogram("bytes per read", "bytes_per_read", merged.bytesPerRead);
+  formatHistogram("frames per read", "frames_per_read", merged.framesPerRead);
+  for (size_t i = 0; i < instrumentation.getShardCount(); i++)
+    formatHistogram("queue delay, ns", "queue_delay_ns",
+                    instrumentation.getShard(i).queueDelay,
+                    static_cast<int>(i));
+  if (!options_.machine) appendClosingRuler(buffer_);
+}
+
+void StatsRenderer::formatHistogram(const char *name, const char *key,
+                                    const Histogram &histogram, int worker) {
+  // the names are padded to a column in the human output
+  static const size_t kNameWidth = 24;
+
+  std::string &out = buffer_;
+  if (options_.machine) {
+    append(out, "histogram name=");
+    append(out, key);
+    if (worker >= 0) {
+      append(out, " worker=");
+      append(out, static_cast<uint64_t>(worker));
+    }
+  } else {
+    const size_t start = out.size();
+    append(out, name);
+    if (worker >= 0) {
+      append(out, " #");
+      append(out, static_cast<uint64_t>(worker));
+    }
+    const size_t length = out.size() - start;
+    if (length < kNameWidth) out.append(kNameWidth - length, ' ');
+  }
+  append(out, " count=");
+  append(out, histogram.getCount());
+  append(out, " p50=");
+  append(out, histogram.getValueAtPercentile(50));
+  append(out, " p90=");
+  append(out, histogram.getValueAtPercentile(90));
+  append(out, " p99=");
+  append(out, histogram.getValueAtPercentile(99));
+  append(out, " p99.9=");
+  append(out, histogram.getValueAtPercentile(99.9));
+  append(out, " max=");
+  append(out, histogram.getMax());
+  out += '\n';
+}
+
+void StatsRenderer::write() {
+  const char *data = buffer_.data();
+  for (size_t left = buffer_.size(); left;) {
+    const ssize_t written = ::write(fd_, data, left);
+    if (written < 0 && errno == EINTR) continue;
+    // nobody to tell about a terminal that's gone
+    if (written <= 0) return;
+    data += written;
+    left -= written;
+  }
+}
@@ -0,0 +1,172 @@
+#ifndef StatsRenderer_H
+#define StatsRenderer_H
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DeviceRegistry.h"
+#include "Instrumentation.h"
+#include "MsgCounter.h"
+#include "RateTracker.h"
+#include "SourceErrors.h"
+
+namespace DeviceListener {
+
+/**
+ * Which devices the statistics show.
+ */
+enum class StatsView {
+  // every device seen or described, by ID
+  All,
+  // the busiest devices, by their counts
+  Top,
+  // the devices that received anything since the previous statistics, by
+  // how much they received
+  Changed
+};
+
+struct StatsOptions {
+  StatsView view = StatsView::All;
+  // devices shown at most, 0 for all of them; the top view shows
+  // StatsRenderer::kDefaultTop then
+  size_t limit = 0;
+  // one `key=value` line per device and no colors, for scripts and logs
+  bool machine = false;
+};
+
+/**
+ * Sections rendered after the counters, each of them left out if not set.
+ * They must outlive the renderer.
+ */
+struct StatsSections {
+  // receive rates of the devices shown by the counters, unless they are all
+  // zero
+  const RateTracker *rates = nullptr;
+  // the worst senders of broken datagrams, once there are any
+  const SourceErrors *sourceErrors = nullptr;
+  // hot path histograms, unless compiled out
+  const Instrumentation *instrumentation = nullptr;
+};
+
+/**
+ * Periodic statistics of the message counters, rendered off the event loop.
+ *
+ * tick() only flags that a render is due; the renderer's thread then takes a
+ * snapshot of the counters of all the shards, formats it and the further
+ * StatsSections into a buffer kept from one render to the next and writes
+ * it out with a single write(). So a
+ * tick costs the event loop nothing, however many devices there are, and
+ * the output of a render is never interleaved line by line with the other
+ * writers of the terminal.
+ */
+class StatsRenderer {
+ public:
+  static const size_t kDefaultTop = 10;
+
+  /**
+   * \param counter counters to render, must outlive the renderer
+   * \param fd where the statistics are written to
+   * \param sections rendered after the counters
+   * \note doesn't start the background thread, see start() and render()
+   */
+  explicit StatsRenderer(const MsgCounter &counter,
+                         const StatsOptions &options = StatsOptions(),
+                         int fd = STDOUT_FILENO,
+                         const StatsSections &sections = StatsSections());
+
+  /**
+   * \brief stop()s
+   */
+  ~StatsRenderer();
+  StatsRenderer(const StatsRenderer &) = delete;
+  StatsRenderer &operator=(StatsRenderer const &) = delete;
+
+  /**
+   * \brief starts rendering in a background thread on every tick()
+   */
+  void start();
+
+  /**
+   * \brief renders a tick that is still due and stops the background thread
+   */
+  void stop();
+
+  /**
+   * \brief asks the background thread to render, never blocks; ticks coming
+   * faster than the renders are merged
+   */
+  void tick() { requested_.fetch_add(1, std::memory_order_relaxed); }
+
+  /**
+   * \brief renders right away in the calling thread, which must not be the
+   * background one
+   * \return text written, valid until the next render
+   */
+  const std::string &render();
+
+  /**
+   * \brief returns the number of renders done
+   */
+  uint64_t getRenderCount() const {
+    return renders_.load(std::memory_order_relaxed);
+  }
+
+ protected:
+  const MsgCounter &counter_;
+  const StatsOptions options_;
+  const int fd_;
+  const StatsSections sections_;
+  std::atomic<uint64_t> requested_;
+  std::atomic<uint64_t> renders_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
+
+  // owned by the rendering thread, sized once: the ticks rendered, the
+  // counts as of this render and of the previous one, and the devices to
+  // show
+  uint64_t rendered_;
+  std::vector<uint64_t> counts_;
+  std::vector<uint64_t> previous_;
+  std::vector<uint8_t> overflow_;
+  std::vector<uint16_t> shown_;
+  std::vector<RateTracker::DeviceRates> rates_;
+  // the histograms of all the workers, merged anew on every render; too
+  // large for the stack
+  std::unique_ptr<StageHistograms> merged_;
+  std::string buffer_;
+
+  void run();
+
+  /**
+   * \brief merges the counters of all the shards into counts_, saturating
+   * like MsgCounter::getStatForDevice()
+   */
+  void takeSnapshot();
+
+  /**
+   * \brief fills shown_ with the devices of the view, in their order
+   */
+  void selectDevices(const DeviceRegistry &registry);
+
+  void format(const DeviceRegistry &registry);
+  void formatTransport();
+  void formatRates(const DeviceRegistry &registry);
+  void formatSourceErrors();
+  void formatInstrumentation();
+  /**
+   * \param name shown in the human output, followed by the worker if any
+   * \param key of the machine output
+   * \param worker thread of the histogram, -1 if merged over all of them
+   */
+  void formatHistogram(const char *name, const char *key,
+                       const Histogram &histogram, int worker = -1);
+  void write();
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef StreamReassembler_H
+#define StreamReassembler_H
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "FrameCodec.h"
+#include "FrameParser.h"
+
+namespace DeviceListener {
+
+/**
+ * Frame parsing over a stream that arrives in chunks the reader doesn't own
+ * (e.g. kernel-provided buffers that must be given back right away). Complete
+ * frames are parsed in place, only a frame split between two chunks is copied
+ * into the small carry buffer.
+ *
+ * The stream's FrameFormat is the one of the byte order given or, when it
+ * is detected, the one its first bytes make sense in (see
+ * detectFrameFormat()); every chunk goes to the parser of that format.
+ */
+class StreamReassembler {
+ public:
+  static const size_t kMaxFrameLength =
+      sizeof(RfcMessage::Rfc1006Header) + RfcMessage::kMaxPayloadLength;
+
+  // what the format of a stream is picked by at most
+  static const size_t kDetectLength =
+      sizeof(RfcMessage::Rfc1006Header) + sizeof(RfcMessage::PayloadHeader);
+
+  explicit StreamReassembler(ByteOrderMode byteOrder = ByteOrderMode::Native)
+      : carrySize_(0),
+        byteOrder_(byteOrder),
+        format_(FrameFormat::Undetected) {}
+
+  /**
+   * \brief parses the next chunk of the stream
+   * \param data chunk of the stream, may start and end in the middle of a
+   * frame
+   * \param length length of the chunk
+   * \param batch scratch space for the frames descriptions
+   * \param onBatch callable invoked as onBatch(deviceIds, frameLengths, count)
+   * for every run of consecutive valid frames
+   * \return see FrameParser::Result; Result::consumed counts bytes of the
+   * chunk either parsed or kept in the carry buffer, so it equals length
+   * unless an invalid header was met
+   */
+  template <typename BatchHandler>
+  FrameParser::Result feed(const uint8_t *data, size_t length,
+                           FrameBatch &batch, BatchHandler &&onBatch) {
+    size_t taken = 0;
+    if (format_ == FrameFormat::Undetected) {
+      // the first bytes may come in several chunks, they wait in the carry
+      // buffer until there are enough of them
+      const uint8_t *first = data;
+      size_t available = length;
+      if (carrySize_) {
+        taken = append(data, length, kDetectLength);
+        first = carry_;
+        available = carrySize_;
+      }
+      format_ = detectFrameFormat(first, available, byteOrder_);
+      if (format_ == FrameFormat::Undetected) {
+        // a stream can't begin with a header of no format
+        if (available >= sizeof(RfcMessage::Rfc1006Header) &&
+            !isValidInAnyFormat(first))
+          return {taken, 0, true};
+        taken += append(data + taken, length - taken, kDetectLength);
+        return {taken, 0, false};
+      }
+    }
+
+    auto result = visitFrameFormat(format_, [&](auto codec) {
+      return feedWith<decltype(codec)>(data + taken, length - taken, batch,
+                                       onBatch);
+    });
+    result.consumed += taken;
+    return result;
+  }
+
+  /**
+   * \brief number of bytes of a partial frame waiting for the next chunk
+   */
+  size_t pending() const { return carrySize_; }
+
+  /**
+   * \brief the format the stream is read in, FrameFormat::Undetected until
+   * its first bytes are fed
+   */
+  FrameFormat getFormat() const { return format_; }
+
+ private:
+  uint8_t carry_[kMaxFrameLength];
+  size_t carrySize_;
+  ByteOrderMode byteOrder_;
+  FrameFormat format_;
+
+  template <typename Codec, typename BatchHandler>
+  FrameParser::Result feedWith(const uint8_t *data, size_t length,
+                               FrameBatch &batch, BatchHandler &onBatch) {
+    FrameParser::Result result = {0, 0, false};
+    const size_t kHeaderLength = sizeof(RfcMessage::Rfc1006Header);
+
+    if (carrySize_) {
+      size_t taken = append(data, length, kHeaderLength);
+      data += taken;
+      length -= taken;
+      result.consumed += taken;
+      if (carrySize_ < kHeaderLength) return result;
+
+      if (!Codec::isValidHeader(carry_)) {
+        result.invalidHeader = true;
+        return result;
+      }
+
+      const size_t frameLength = kHeaderLength + Codec::getLength(carry_);
+      taken = append(data, length, frameLength);
+      data += taken;
+      length -= taken;
+      result.consumed += taken;
+      if (carrySize_ < frameLength) return result;
+
+      auto carried =
+          FrameParser::parseBatches<Codec>(carry_, frameLength, batch, onBatch);
+      carrySize_ = 0;
+      result.frames = carried.frames;
+      result.invalidHeader = carried.invalidHeader;
+      if (result.invalidHeader) return result;
+    }
+
+    auto inPlace =
+        FrameParser::parseBatches<Codec>(data, length, batch, onBatch);
+    result.frames += inPlace.frames;
+    result.consumed += inPlace.consumed;
+    result.invalidHeader = inPlace.invalidHeader;
+    if (!result.invalidHeader) {
+      // the leftover is a partial frame behind a valid header, so it fits
+      carrySize_ = length - inPlace.consumed;
+      std::memcpy(carry_, data + inPlace.consumed, carrySize_);
+      result.consumed += carrySize_;
+    }
+    return result;
+  }
+
+  size_t append(const uint8_t *data, size_t length, size_t upTo) {
+    if (carrySize_ >= upTo) return 0;
+    size_t taken = std::min(length, upTo - carrySize_);
+    std::memcpy(carry_ + carrySize_, data, taken);
+    carrySize_ += taken;
+    return taken;
+  }
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef SystemUtils_H
+#define SystemUtils_H
+#include <boost/system/system_error.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+namespace DeviceListener {
+
+/**
+ * \brief throws boost::system::system_error for a failed system call
+ * \param what the call, e.g. "open(journal)"
+ * \param err the error, errno if not given
+ */
+[[noreturn]] inline void throwSystemError(const char *what, int err = errno) {
+  throw boost::system::system_error(
+      boost::system::error_code(err, boost::system::system_category()), what);
+}
+
+// starting value of the checksums of the files, the FNV-1a offset basis
+const uint64_t kChecksumSeed = 0xcbf29ce484222325ull;
+
+/**
+ * \brief folds a word into a checksum of the files; the files written
+ * before depend on it, so it must not change
+ */
+inline uint64_t mixWord(uint64_t hash, uint64_t word) {
+  hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+  return hash ^ hash >> 32;
+}
+
+/**
+ * \brief folds the whole words of the data into the checksum, a tail shorter
+ * than a word is left out
+ */
+inline uint64_t mixWords(uint64_t hash, const void *data, size_t length) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, sizeof(word));
+    hash = mixWord(hash, word);
+  }
+  return hash;
+}
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include "MsgCounter.h"
+#include "TagSketches.h"
+
+using namespace DeviceListener;
+
+const size_t HyperLogLogTable::kMaxProbes;
+const uint32_t HyperLogLogTable::kUsed;
+
+namespace {
+
+/**
+ * \brief the finalizer of MurmurHash3, every bit of the key affects every
+ * bit of the hash
+ */
+inline uint64_t mix(uint64_t key) {
+  key ^= key >> 33;
+  key *= UINT64_C(0xFF51AFD7ED558CCD);
+  key ^= key >> 33;
+  key *= UINT64_C(0xC4CEB9FE1A85EC53);
+  key ^= key >> 33;
+  return key;
+}
+
+inline bool isPowerOfTwo(size_t value) {
+  return value && !(value & (value - 1));
+}
+
+inline size_t floorPowerOfTwo(size_t value) {
+  return size_t(1) << (63 - __builtin_clzll(value | 1));
+}
+
+/**
+ * \brief slots of the index of a heavy hitters list, at most a quarter of
+ * them taken so that the probes stay short
+ */
+inline size_t getIndexSize(size_t capacity) {
+  return std::max<size_t>(floorPowerOfTwo(capacity) * 4, 8);
+}
+
+// the two halves of the hash are told apart, so that the count-min rows and
+// the registers of a device don't pick their positions with the same bits
+const uint64_t kRegisterSeed = UINT64_C(0x9E3779B97F4A7C15);
+
+}  // namespace
+
+CountMinSketch::CountMinSketch(size_t width, size_t depth, uint64_t seed)
+    : width_(width), depth_(depth), seed_(seed), total_(0) {
+  if (!isPowerOfTwo(width) || !depth)
+    throw std::invalid_argument("count-min width must be a power of two");
+  counters_.reset(new std::atomic<uint64_t>[width * depth]());
+}
+
+size_t CountMinSketch::getIndex(uint64_t hash, size_t row) const {
+  // double hashing, an odd step gives every row another counter
+  const uint64_t step = hash >> 32 | 1;
+  return row * width_ + ((hash + row * step) & (width_ - 1));
+}
+
+void CountMinSketch::add(uint32_t key, uint64_t count) {
+  const uint64_t hash = mix(key ^ seed_);
+  for (size_t row = 0; row < depth_; row++)
+    addRelaxed(counters_[getIndex(hash, row)], count);
+  addRelaxed(total_, count);
+}
+
+void CountMinSketch::addCounters(uint32_t key, uint64_t *sums) const {
+  const uint64_t hash = mix(key ^ seed_);
+  for (size_t row = 0; row < depth_; row++)
+    sums[row] +=
+        counters_[getIndex(hash, row)].load(std::memory_order_relaxed);
+}
+
+uint64_t CountMinSketch::estimate(uint32_t key) const {
+  std::vector<uint64_t> sums(depth_);
+  addCounters(key, sums.data());
+  return *std::min_element(sums.begin(), sums.end());
+}
+
+HyperLogLogTable::HyperLogLogTable(size_t devices, unsigned precision,
+                                   uint64_t seed)
+    : devices_(devices),
+      precision_(precision),
+      seed_(seed ^ kRegisterSeed),
+      dropped_(0) {
+  if (!isPowerOfTwo(devices))
+    throw std::invalid_argument("number of devices must be a power of two");
+  if (precision < 4 || precision > 16)
+    throw std::invalid_argument("precision must be in [4, 16]");
+  tags_.reset(new std::atomic<uint32_t>[devices]());
+  registers_.reset(new std::atomic<uint8_t>[devices << precision]());
+}
+
+size_t HyperLogLogTable::findSlot(uint16_t devId) const {
+  // Fibonacci hashing, so the IDs of a device range spread over the table
+  const size_t index = (devId * UINT64_C(0x9E3779B97F4A7C15)) >> 32;
+  for (size_t probe = 0; probe < kMaxProbes; probe++) {
+    const size_t slot = (index + probe) & (devices_ - 1);
+    const uint32_t tag = tags_[slot].load(std::memory_order_acquire);
+    if (tag == (kUsed | devId)) return slot;
+    if (!tag) break;
+  }
+  return devices_;
+}
+
+size_t HyperLogLogTable::getSlot(uint16_t devId) {
+  const size_t index = (devId * UINT64_C(0x9E3779B97F4A7C15)) >> 32;
+  for (size_t probe = 0; probe < kMaxProbes; probe++) {
+    const size_t slot = (index + probe) & (devices_ - 1);
+    const uint32_t tag = tags_[slot].load(std::memory_order_relaxed);
+    if (tag == (kUsed | devId)) return slot;
+    if (!tag) {
+      tags_[slot].store(kUsed | devId, std::memory_order_release);
+      return slot;
+    }
+  }
+  return devices_;
+}
+
+void HyperLogLogTable::add(uint16_t devId, uint16_t tag) {
+  const size_t slot = getSlot(devId);
+  if (slot == devices_) {
+    addRelaxed(dropped_, 1);
+    return;
+  }
+  // the top bits pick the register, the rest give the rank of the first 1
+  const uint64_t hash =
+      mix((static_cast<uint64_t>(devId) << 16 | tag) ^ seed_);
+  const size_t index = hash >> (64 - precision_);
+  const uint64_t rest = hash << precision_;
+  const auto rank = static_cast<uint8_t>(
+      rest ? __builtin_clzll(rest) + 1 : 64 - precision_ + 1);
+  std::atomic<uint8_t> &reg = registers_[(slot << precision_) + index];
+  if (rank > reg.load(std::memory_order_relaxed))
+    reg.store(rank, std::memory_order_relaxed);
+}
+
+bool HyperLogLogTable::mergeRegisters(uint16_t devId,
+                                      uint8_t *registers) const {
+  const size_t slot = findSlot(devId);
+  if (slot == devices_) return false;
+  const std::atomic<uint8_t> *own = &registers_[slot << precision_];
+  for (size_t i = 0; i < size_t(1) << precision_; i++)
+    registers[i] =
+        std::max(registers[i], own[i].load(std::memory_order_relaxed));
+  return true;
+}
+
+double HyperLogLogTable::estimate(uint16_t devId) const {
+  std::vector<uint8_t> registers(size_t(1) << precision_);
+  return mergeRegisters(devId, registers.data())
+             ? estimate(registers.data(), precision_)
+             : 0;
+}
+
+double HyperLogLogTable::estimate(const uint8_t *registers,
+                                  unsigned precision) {
+  const size_t count = size_t(1) << precision;
+  double sum = 0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < count; i++) {
+    sum += std::ldexp(1.0, -registers[i]);
+    zeros += !registers[i];
+  }
+  const double m = static_cast<double>(count);
+  const double alpha = count == 16   ? 0.673
+                       : count == 32 ? 0.697
+                       : count == 64 ? 0.709
+                                     : 0.7213 / (1 + 1.079 / m);
+  const double raw = alpha * m * m / sum;
+  // linear counting is more accurate while many registers are still empty
+  if (raw <= 2.5 * m && zeros) return m * std::log(m / zeros);
+  return raw;
+}
+
+SpaceSaving::SpaceSaving(size_t capacity)
+    : capacity_(capacity), sequence_(0), size_(0) {
+  if (!capacity)
+    throw std::invalid_argument("heavy hitters capacity must be positive");
+  counters_.reset(new Counter[capacity]);
+  index_.resize(getIndexSize(capacity));
+  slots_.resize(capacity);
+}
+
+size_t SpaceSaving::getHome(uint32_t key) const {
+  return mix(key) & (index_.size() - 1);
+}
+
+size_t SpaceSaving::findSlot(uint32_t key) const {
+  const size_t mask = index_.size() - 1;
+  for (size_t slot = getHome(key);; slot = (slot + 1) & mask) {
+    const uint32_t pos = index_[slot];
+    if (!pos || counters_[pos - 1].key.load(std::memory_order_relaxed) == key)
+      return slot;
+  }
+}
+
+void SpaceSaving::eraseSlot(size_t slot) {
+  // backward shift deletion: the entries after the hole that may live in
+  // it move back, so that no probe sequence is cut short
+  const size_t mask = index_.size() - 1;
+  for (size_t next = (slot + 1) & mask; index_[next];
+       next = (next + 1) & mask) {
+    const size_t home = getHome(
+        counters_[index_[next] - 1].key.load(std::memory_order_relaxed));
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      index_[slot] = index_[next];
+      slots_[index_[slot] - 1] = slot;
+      slot = next;
+    }
+  }
+  index_[slot] = 0;
+}
+
+SpaceSaving::Entry SpaceSaving::getEntry(size_t pos) const {
+  const Counter &counter = counters_[pos];
+  return {counter.key.load(std::memory_order_relaxed),
+          counter.count.load(std::memory_order_relaxed),
+          counter.error.load(std::memory_order_relaxed)};
+}
+
+void SpaceSaving::place(size_t pos, const Entry &entry, size_t slot) {
+  Counter &counter = counters_[pos];
+  counter.key.store(entry.key, std::memory_order_relaxed);
+  counter.count.store(entry.count, std::memory_order_relaxed);
+  counter.error.store(entry.error, std::memory_order_relaxed);
+  slots_[pos] = slot;
+  index_[slot] = static_cast<uint32_t>(pos + 1);
+}
+
+void SpaceSaving::siftUp(size_t pos) {
+  // the parents move down into the hole, the entry is written once
+  const Entry entry = getEntry(pos);
+  const size_t slot = slots_[pos];
+  while (pos) {
+    const size_t parent = (pos - 1) / 2;
+    if (entry.count >= counters_[parent].count.load(std::memory_order_relaxed))
+      break;
+    place(pos, getEntry(parent), slots_[parent]);
+    pos = parent;
+  }
+  place(pos, entry, slot);
+}
+
+void SpaceSaving::siftDown(size_t pos) {
+  const Entry entry = getEntry(pos);
+  const size_t slot = slots_[pos];
+  const size_t size = size_.load(std::memory_order_relaxed);
+  for (;;) {
+    size_t child = 2 * pos + 1;
+    if (child >= size) break;
+    uint64_t count = counters_[child].count.load(std::memory_order_relaxed);
+    if (child + 1 < size) {
+      // without a branch, which child is smaller is a coin flip
+      const uint64_t right =
+          counters_[child + 1].count.load(std::memory_order_relaxed);
+      const bool smaller = right < count;
+      child += smaller;
+      count = smaller ? right : count;
+    }
+    if (count >= entry.count) break;
+    place(pos, getEntry(child), slots_[child]);
+    pos = child;
+  }
+  place(pos, entry, slot);
+}
+
+void SpaceSaving::add(const uint32_t *keys, const uint64_t *counts,
+                      size_t n) {
+  // odd while the entries change, see getEntries()
+  const uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+  sequence_.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (size_t i = 0; i < n; i++) {
+    const uint32_t key = keys[i];
+    size_t slot = findSlot(key);
+    if (index_[slot]) {
+      const size_t pos = index_[slot] - 1;
+      addRelaxed(counters_[pos].count, counts[i]);
+      siftDown(pos);
+      continue;
+    }
+
+    const size_t size = size_.load(std::memory_order_relaxed);
+    if (size < capacity_) {
+      place(size, {key, counts[i], 0}, slot);
+      size_.store(size + 1, std::memory_order_relaxed);
+      siftUp(size);
+      continue;
+    }
+
+    // the key takes over the smallest count, at the top of the heap
+    const uint64_t smallest =
+        counters_[0].count.load(std::memory_order_relaxed);
+    eraseSlot(slots_[0]);
+    slot = findSlot(key);
+    place(0, {key, smallest + counts[i], smallest}, slot);
+    siftDown(0);
+  }
+
+  sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+std::vector<SpaceSaving::Entry> SpaceSaving::getEntries() const {
+  std::vector<Entry> entries;
+  entries.reserve(capacity_);
+  for (;;) {
+    const uint64_t sequence = sequence_.load(std::memory_order_acquire);
+    if (sequence & 1) {
+      std::this_thread::yield();
+      continue;
+    }
+    entries.clear();
+    const size_t size = size_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < size; i++) entries.push_back(getEntry(i));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence_.load(std::memory_order_relaxed) == sequence) break;
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.count != b.count ? a.count > b.count : a.key < b.key;
+            });
+  return entries;
+}
+
+std::vector<SpaceSaving::Entry> SpaceSaving::merge(
+    const std::vector<std::vector<Entry>> &lists, size_t capacity) {
+  struct Merged {
+    uint64_t count;
+    uint64_t error;
+    // of the lists the key is in, the rest add theirs
+    uint64_t smallest;
+  };
+  std::unordered_map<uint32_t, Merged> merged;
+  uint64_t smallest = 0;
+  for (const auto &list : lists) {
+    const uint64_t listSmallest =
+        list.size() >= capacity
+            ? std::min_element(list.begin(), list.end(),
+                               [](const Entry &a, const Entry &b) {
+                                 return a.count < b.count;
+                               })
+                  ->count
+            : 0;
+    smallest += listSmallest;
+    for (const Entry &entry : list) {
+      Merged &total = merged[entry.key];
+      total.count += entry.count;
+      total.error += entry.error;
+      total.smallest += listSmallest;
+    }
+  }
+
+  std::vector<Entry> entries;
+  entries.reserve(merged.size());
+  for (const auto &pair : merged)
+    entries.push_back({pair.first,
+                       pair.second.count + smallest - pair.second.smallest,
+                       pair.second.error + smallest - pair.second.smallest});
+  const size_t kept = std::min(capacity, entries.size());
+  std::partial_sort(entries.begin(), entries.begin() + kept, entries.end(),
+                    [](const Entry &a, const Entry &b) {
+                      return a.count != b.count ? a.count > b.count
+                                                : a.key < b.key;
+                    });
+  entries.resize(kept);
+  return entries;
+}
+
+TagSketchShard::TagSketchShard(const SketchOptions &options, uint64_t seed)
+    : counts_(options.width, options.depth, seed),
+      distinctTags_(options.devices, options.precision, seed),
+      heavyHitters_(options.heavyHitters) {}
+
+void TagSketchShard::add(const FrameBatch &batch, size_t count) {
+  const uint16_t *deviceIds = batch.deviceIds;
+  const uint16_t *tags = batch.measurementTags;
+  uint32_t *keys = keys_;
+  for (size_t i = 0; i < count; i++)
+    keys[i] = TagSketches::getKey(deviceIds[i], tags[i]);
+
+  // the runs are compacted to the front of the columns, a run is never
+  // written before its frames have been read
+  size_t runs = 0;
+  for (size_t begin = 0, end; begin < count; begin = end) {
+    const uint32_t key = keys[begin];
+    for (end = begin + 1; end < count && keys[end] == key;) end++;
+    keys[runs] = key;
+    runLengths_[runs++] = end - begin;
+  }
+
+  for (size_t i = 0; i < runs; i++) {
+    counts_.add(keys[i], runLengths_[i]);
+    distinctTags_.add(static_cast<uint16_t>(keys[i] >> 16),
+                      static_cast<uint16_t>(keys[i] & 0xFFFF));
+  }
+  heavyHitters_.add(keys, runLengths_, runs);
+}
+
+TagSketches::TagSketches(size_t shardCount, const SketchOptions &options)
+    : options_(options) {
+  if (!options_.seed) {
+    std::random_device random;
+    options_.seed = static_cast<uint64_t>(random()) << 32 | random();
+  }
+  for (size_t i = 0; i < (shardCount ? shardCount : 1); i++)
+    shards_.emplace_back(new TagSketchShard(options_, options_.seed));
+}
+
+uint64_t TagSketches::estimateCount(uint16_t devId, uint16_t tag) const {
+  std::vector<uint64_t> sums(options_.depth);
+  for (auto &shard : shards_)
+    shard->getCounts().addCounters(getKey(devId, tag), sums.data());
+  return *std::min_element(sums.begin(), sums.end());
+}
+
+double TagSketches::estimateDistinctTags(uint16_t devId) const {
+  std::vector<uint8_t> registers(size_t(1) << options_.precision);
+  bool found = false;
+  for (auto &shard : shards_)
+    found |= shard->getDistinctTags().mergeRegisters(devId, registers.data());
+  return found ? HyperLogLogTable::estimate(registers.data(),
+                                            options_.precision)
+               : 0;
+}
+
+std::vector<TagSketches::DistinctTags> TagSketches::getDistinctTags() const {
+  std::vector<bool> seen(CounterShard::kDeviceCount);
+  for (auto &shard : shards_)
+    shard->getDistinctTags().forEach(
+        [&seen](uint16_t devId) { seen[devId] = true; });
+
+  std::vector<DistinctTags> devices;
+  for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++)
+    if (seen[devId])
+      devices.push_back({static_cast<uint16_t>(devId),
+                         estimateDistinctTags(static_cast<uint16_t>(devId))});
+  return devices;
+}
+
+std::vector<TagSketches::HeavyHitter> TagSketches::getHeavyHitters() const {
+  std::vector<std::vector<SpaceSaving::Entry>> lists;
+  for (auto &shard : shards_)
+    lists.push_back(shard->getHeavyHitters().getEntries());
+
+  std::vector<HeavyHitter> hitters;
+  for (const auto &entry :
+       SpaceSaving::merge(lists, options_.heavyHitters)) {
+    const auto devId = static_cast<uint16_t>(entry.key >> 16);
+    const auto tag = static_cast<uint16_t>(entry.key & 0xFFFF);
+    // both are upper bounds, the list's one less its error a lower one
+    const uint64_t lower = entry.count - entry.error;
+    const uint64_t count = std::min(entry.count, estimateCount(devId, tag));
+    hitters.push_back({devId, tag, count, count - lower});
+  }
+  std::stable_sort(hitters.begin(), hitters.end(),
+                   [](const HeavyHitter &a, const HeavyHitter &b) {
+                     return a.count > b.count;
+                   });
+  return hitters;
+}
+
+uint64_t TagSketches::getDroppedCount() const {
+  uint64_t dropped = 0;
+  for (auto &shard : shards_)
+    dropped += shard->getDistinctTags().getDroppedCount();
+  return dropped;
+}
+
+size_t TagSketches::getMemorySize(const SketchOptions &options) {
+  const size_t counts = options.width * options.depth * sizeof(uint64_t);
+  const size_t registers =
+      options.devices * (sizeof(uint32_t) + (size_t(1) << options.precision));
+  const size_t heavyHitters =
+      options.heavyHitters * (sizeof(uint32_t) + 2 * sizeof(uint64_t) +
+                              sizeof(size_t)) +
+      getIndexSize(options.heavyHitters) * sizeof(uint32_t);
+  return sizeof(TagSketchShard) + counts + registers + heavyHitters;
+}
+
+SketchOptions TagSketches::getOptionsFor(size_t bytes) {
+  SketchOptions options;
+  const size_t perDevice =
+      sizeof(uint32_t) + (size_t(1) << options.precision);
+  options.devices =
+      floorPowerOfTwo(std::max<size_t>(bytes / 8 / perDevice, 16));
+  options.width = 1;
+  const size_t taken = getMemorySize(options);
+  const size_t left = bytes > taken ? bytes - taken : 0;
+  options.width = floorPowerOfTwo(
+      std::max<size_t>(left / options.depth / sizeof(uint64_t), 256));
+  return options;
+}
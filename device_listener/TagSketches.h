@@ -0,0 +1,357 @@
+#ifndef TagSketches_H
+#define TagSketches_H
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "FrameBatch.h"
+
+namespace DeviceListener {
+
+/**
+ * Sizes of the sketches of one ingestion thread, see
+ * TagSketches::getMemorySize() for the memory they take.
+ */
+struct SketchOptions {
+  // counters of a count-min row, a power of two; a count is overestimated
+  // by at most e / width of all the messages
+  size_t width = 16384;
+  // count-min rows; the bound above fails with a probability of e^-depth
+  size_t depth = 4;
+  // HyperLogLog registers of a device are 2^precision bytes, [4, 16]; the
+  // standard error of a distinct count is 1.04 / 2^(precision / 2)
+  unsigned precision = 8;
+  // devices whose distinct tags are counted, a power of two; tags of the
+  // devices beyond are only counted as dropped
+  size_t devices = 1024;
+  // (device, tag) pairs in the heavy hitters list
+  size_t heavyHitters = 64;
+  // of the hashes, the same for all the threads; 0 picks a random one, so
+  // that the collisions can't be aimed at from the outside
+  uint64_t seed = 0;
+};
+
+/**
+ * Count-min sketch of 32-bit keys: depth rows of width counters, a key adds
+ * its count to one counter of every row and is estimated by the smallest of
+ * them. An estimate is never below the true count.
+ *
+ * Same threading rules as for CounterShard: only the owner thread adds,
+ * other threads may read concurrently.
+ */
+class CountMinSketch {
+ public:
+  /**
+   * \throws std::invalid_argument if width isn't a power of two or depth is
+   * 0
+   */
+  CountMinSketch(size_t width, size_t depth, uint64_t seed);
+  CountMinSketch(const CountMinSketch &) = delete;
+  CountMinSketch &operator=(CountMinSketch const &) = delete;
+
+  void add(uint32_t key, uint64_t count);
+
+  /**
+   * \brief adds the counters of the key to the depth sums, which is how the
+   * sketches of several threads are merged for a key: the merged estimate
+   * is the smallest sum
+   */
+  void addCounters(uint32_t key, uint64_t *sums) const;
+
+  uint64_t estimate(uint32_t key) const;
+
+  /**
+   * \brief returns the sum of all the counts added
+   */
+  uint64_t getTotal() const { return total_.load(std::memory_order_relaxed); }
+  size_t getWidth() const { return width_; }
+  size_t getDepth() const { return depth_; }
+
+ protected:
+  const size_t width_;
+  const size_t depth_;
+  const uint64_t seed_;
+  std::unique_ptr<std::atomic<uint64_t>[]> counters_;
+  std::atomic<uint64_t> total_;
+
+  size_t getIndex(uint64_t hash, size_t row) const;
+};
+
+/**
+ * HyperLogLog registers of up to a fixed number of devices, counting the
+ * distinct tags of every device. The devices take the slots of an
+ * open-addressing table in the order they show up.
+ *
+ * Same threading rules as for CounterShard.
+ */
+class HyperLogLogTable {
+ public:
+  // slots probed before a new device is given up on
+  static const size_t kMaxProbes = 32;
+
+  /**
+   * \throws std::invalid_argument if devices isn't a power of two or the
+   * precision is out of [4, 16]
+   */
+  HyperLogLogTable(size_t devices, unsigned precision, uint64_t seed);
+  HyperLogLogTable(const HyperLogLogTable &) = delete;
+  HyperLogLogTable &operator=(HyperLogLogTable const &) = delete;
+
+  void add(uint16_t devId, uint16_t tag);
+
+  /**
+   * \brief raises the registers to the ones of the device, which is how
+   * the tables of several threads are merged
+   * \param registers 2^precision of them
+   * \return false if the device has no registers in this table
+   */
+  bool mergeRegisters(uint16_t devId, uint8_t *registers) const;
+
+  /**
+   * \brief calls visit(deviceId) for every device with registers
+   */
+  template <typename Visitor>
+  void forEach(Visitor &&visit) const {
+    for (size_t i = 0; i < devices_; i++) {
+      const uint32_t tag = tags_[i].load(std::memory_order_acquire);
+      if (tag) visit(static_cast<uint16_t>(tag & 0xFFFF));
+    }
+  }
+
+  /**
+   * \brief distinct tags of the device, 0 for a device without registers
+   */
+  double estimate(uint16_t devId) const;
+
+  /**
+   * \brief the HyperLogLog estimate of the given registers
+   */
+  static double estimate(const uint8_t *registers, unsigned precision);
+
+  /**
+   * \brief returns the number of tags not counted for lack of a slot
+   */
+  uint64_t getDroppedCount() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+  unsigned getPrecision() const { return precision_; }
+
+ protected:
+  static const uint32_t kUsed = uint32_t(1) << 16;
+
+  const size_t devices_;
+  const unsigned precision_;
+  const uint64_t seed_;
+  // kUsed | deviceId, 0 while the slot is free
+  std::unique_ptr<std::atomic<uint32_t>[]> tags_;
+  std::unique_ptr<std::atomic<uint8_t>[]> registers_;
+  std::atomic<uint64_t> dropped_;
+
+  /**
+   * \brief finds the slot of the device, takes a free one for a new device
+   * \return devices_ if the table has no room for it
+   */
+  size_t getSlot(uint16_t devId);
+
+  /**
+   * \brief finds the slot of the device, safe from any thread
+   * \return devices_ if the device has none
+   */
+  size_t findSlot(uint16_t devId) const;
+};
+
+/**
+ * Space-saving heavy hitters: the keys with the largest counts, tracked in
+ * a fixed number of entries. A new key takes over the entry with the
+ * smallest count and inherits that count as its error, so a count is never
+ * below the true one and at most the error above it; a key whose true count
+ * is above 1 / capacity of all the counts is always in the list.
+ *
+ * The entries are a min-heap by count, with a hash index of the keys, so an
+ * update is O(log capacity). Only the owner thread adds; readers copy the
+ * entries under a sequence lock and retry if an update ran meanwhile, which
+ * is why the updates come in batches.
+ */
+class SpaceSaving {
+ public:
+  struct Entry {
+    uint32_t key;
+    uint64_t count;
+    uint64_t error;
+  };
+
+  /**
+   * \throws std::invalid_argument if the capacity is 0
+   */
+  explicit SpaceSaving(size_t capacity);
+  SpaceSaving(const SpaceSaving &) = delete;
+  SpaceSaving &operator=(SpaceSaving const &) = delete;
+
+  /**
+   * \brief adds counts[i] to keys[i] for all the n keys
+   */
+  void add(const uint32_t *keys, const uint64_t *counts, size_t n);
+  void add(uint32_t key, uint64_t count) { add(&key, &count, 1); }
+
+  /**
+   * \return the entries, the largest count first
+   */
+  std::vector<Entry> getEntries() const;
+
+  /**
+   * \brief merges the entries of several lists of the given capacity, a
+   * key missing from a full list is taken to have its smallest count
+   * \return capacity entries at most, the largest count first
+   */
+  static std::vector<Entry> merge(
+      const std::vector<std::vector<Entry>> &lists, size_t capacity);
+
+  size_t getCapacity() const { return capacity_; }
+
+ protected:
+  struct Counter {
+    std::atomic<uint32_t> key{0};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> error{0};
+  };
+
+  const size_t capacity_;
+  std::atomic<uint64_t> sequence_;
+  std::atomic<size_t> size_;
+  // a min-heap by count
+  std::unique_ptr<Counter[]> counters_;
+  // owned by the writer: index slot -> heap position + 1 (0 while free),
+  // and heap position -> index slot
+  std::vector<uint32_t> index_;
+  std::vector<size_t> slots_;
+
+  size_t getHome(uint32_t key) const;
+  size_t findSlot(uint32_t key) const;
+  void eraseSlot(size_t slot);
+  Entry getEntry(size_t pos) const;
+
+  /**
+   * \brief writes the entry to the heap position and indexes it
+   */
+  void place(size_t pos, const Entry &entry, size_t slot);
+  void siftUp(size_t pos);
+  void siftDown(size_t pos);
+};
+
+/**
+ * Approximate statistics of one ingestion thread by device and measurement
+ * tag, in memory that is allocated once and doesn't depend on the traffic:
+ * a count-min sketch of the messages of every pair, the distinct tags of
+ * every device and the pairs with the most messages.
+ *
+ * Like MeasurementShard a batch is reduced to the runs of frames of the
+ * same pair first, and every run updates the sketches once.
+ */
+class TagSketchShard {
+ public:
+  TagSketchShard(const SketchOptions &options, uint64_t seed);
+  TagSketchShard(const TagSketchShard &) = delete;
+  TagSketchShard &operator=(TagSketchShard const &) = delete;
+
+  /**
+   * \brief adds the first count frames of the batch, must be called from
+   * the owner thread only
+   * \param batch validated batch with metadata decoded, see
+   * FrameBatch::withMetadata; the frames must be valid
+   */
+  void add(const FrameBatch &batch, size_t count);
+
+  const CountMinSketch &getCounts() const { return counts_; }
+  const HyperLogLogTable &getDistinctTags() const { return distinctTags_; }
+  const SpaceSaving &getHeavyHitters() const { return heavyHitters_; }
+
+ protected:
+  CountMinSketch counts_;
+  HyperLogLogTable distinctTags_;
+  SpaceSaving heavyHitters_;
+  // scratch columns of the keys of a batch, then of its runs
+  uint32_t keys_[FrameBatch::kCapacity];
+  uint64_t runLengths_[FrameBatch::kCapacity];
+};
+
+class TagSketches {
+ public:
+  struct HeavyHitter {
+    uint16_t deviceId;
+    uint16_t measurementTag;
+    // never below the true count, at most error above it
+    uint64_t count;
+    uint64_t error;
+  };
+
+  struct DistinctTags {
+    uint16_t deviceId;
+    double estimate;
+  };
+
+  /**
+   * \param shardCount number of ingestion threads, each of them gets its own
+   * TagSketchShard via getShard()
+   * \throws std::invalid_argument if the options are out of their bounds
+   */
+  explicit TagSketches(size_t shardCount,
+                       const SketchOptions &options = SketchOptions());
+
+  TagSketchShard &getShard(size_t idx) { return *shards_[idx]; }
+  const TagSketchShard &getShard(size_t idx) const { return *shards_[idx]; }
+  size_t getShardCount() const { return shards_.size(); }
+  const SketchOptions &getOptions() const { return options_; }
+
+  static uint32_t getKey(uint16_t devId, uint16_t tag) {
+    return static_cast<uint32_t>(devId) << 16 | tag;
+  }
+
+  /**
+   * \brief estimates the messages of the pair received by all the threads
+   */
+  uint64_t estimateCount(uint16_t devId, uint16_t tag) const;
+
+  /**
+   * \brief estimates the distinct tags of the device received by all the
+   * threads, 0 if none of them has registers for it
+   */
+  double estimateDistinctTags(uint16_t devId) const;
+
+  /**
+   * \return the devices with registers in any thread, by ID
+   */
+  std::vector<DistinctTags> getDistinctTags() const;
+
+  /**
+   * \brief merges the heavy hitters of all the threads, a count is the
+   * smaller of the merged list's and the count-min sketches' estimates
+   * \return the pairs, the most messages first
+   */
+  std::vector<HeavyHitter> getHeavyHitters() const;
+
+  /**
+   * \brief sums up HyperLogLogTable::getDroppedCount() of all the threads
+   */
+  uint64_t getDroppedCount() const;
+
+  /**
+   * \brief returns the bytes the sketches of one thread take
+   */
+  static size_t getMemorySize(const SketchOptions &options);
+
+  /**
+   * \brief sizes the sketches of one thread to fit in the given bytes: an
+   * eighth for the devices' registers, the rest mostly for the count-min
+   * sketch, the other sizes are the defaults
+   */
+  static SketchOptions getOptionsFor(size_t bytes);
+
+ protected:
+  SketchOptions options_;
+  std::vector<std::unique_ptr<TagSketchShard>> shards_;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -1,31 +1,56 @@
-#define BOOST_ASIO_DISABLE_THREADS
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <cassert>
 #include <cstdint>
 #include <iostream>
-#include <list>
-#include <memory>
 
+#include "Logger.h"
 #include "RfcTransport.h"
 #include "TcpServer.h"
 
 using namespace DeviceListener;
 
-Connection::~Connection() {
-  std::cout << "Disconnected device: "
-            << socket.remote_endpoint().address().to_string() << std::endl;
+TcpServer::~TcpServer() {
+  // the pending accept lives in acceptMemory_, a server still open may
+  // leave it to run after the memory is gone
+  assert(!acceptor_.is_open());
+}
+
+void TcpServer::close() {
+  boost::system::error_code ignored;
+  acceptor_.close(ignored);
 }
 
 void TcpServer::handleAccept(ConHandle conHandle,
                              boost::system::error_code const &err) {
+  if (err == boost::asio::error::operation_aborted || !acceptor_.is_open()) {
+    // the acceptor is closed, a connection accepted just before is dropped
+    // and nothing is accepted again
+    boost::system::error_code ignored;
+    conHandle->socket.close(ignored);
+    transport_.releaseConnection(conHandle);
+    return;
+  }
   if (!err) {
-    std::cout << "Device connected: "
-              << conHandle->socket.remote_endpoint().address().to_string()
-              << std::endl;
-    transport_.startPacketAsyncRead(conHandle);
+    // the peer may be gone already, that's for the first read to find out
+    boost::system::error_code endpointErr;
+    auto endpoint = conHandle->socket.remote_endpoint(endpointErr);
+    if (transport_.admitConnection(conHandle, endpoint.address())) {
+      if (!endpointErr)
+        Logger::instance().log(Logger::Event::DeviceConnected,
+                               endpoint.address());
+      transport_.startConnection(conHandle);
+    } else {
+      Logger::instance().log(Logger::Event::ConnectionRejected,
+                             endpoint.address());
+      // closed here, so it isn't logged as a disconnected device
+      conHandle->socket.close(endpointErr);
+      transport_.releaseConnection(conHandle);
+    }
   } else {
-    std::cerr << "Error occured during 'accept' call: " << err.message()
-              << std::endl;
+    Logger::instance().log(Logger::Event::AcceptFailed,
+                           boost::asio::ip::address(), err);
+    transport_.releaseConnection(conHandle);
   }
   startAccepting();
 }
@@ -35,15 +60,22 @@ void TcpServer::listen() {
       boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port_);
   acceptor_.open(endpoint.protocol());
   acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+  if (reusePort_) {
+    using reuse_port =
+        boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    acceptor_.set_option(reuse_port(true));
+  }
   acceptor_.bind(endpoint);
   acceptor_.listen();
+  port_ = acceptor_.local_endpoint().port();
   std::cout << "Server is listening on port " << port_ << "..." << std::endl;
   startAccepting();
 }
 
 void TcpServer::startAccepting() {
-  auto conHandle = std::make_shared<Connection>(ioService_);
+  auto conHandle = transport_.allocateConnection();
   auto handler = boost::bind(&TcpServer::handleAccept, this, conHandle,
                              boost::asio::placeholders::error);
-  acceptor_.async_accept(conHandle->socket, handler);
+  acceptor_.async_accept(conHandle->socket,
+                         makeAllocatingHandler(acceptMemory_, handler));
 }
\ No newline at end of file
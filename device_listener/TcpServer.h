@@ -1,36 +1,47 @@
 #ifndef TcpServer_H
 #define TcpServer_H
-#define BOOST_ASIO_DISABLE_THREADS
 #include <boost/asio.hpp>
+#include <cstdint>
 
-namespace DeviceListener {
-
-class RfcTransport;
+#include "Connection.h"
+#include "HandlerAllocator.h"
 
-struct Connection {
-  boost::asio::ip::tcp::socket socket;
-  explicit Connection(boost::asio::io_service &io_service)
-      : socket(io_service) {}
-  Connection(const Connection &) = delete;
-  Connection &operator=(Connection const &) = delete;
-  ~Connection();
-};
+namespace DeviceListener {
 
 class TcpServer {
  private:
-  boost::asio::io_service &ioService_;
+  // room for the pending accept
+  static const size_t kAcceptMemorySize = 256;
+
   boost::asio::ip::tcp::acceptor acceptor_;
   RfcTransport &transport_;
   uint16_t port_;
+  bool reusePort_;
+  HandlerMemory<kAcceptMemorySize> acceptMemory_;
 
  public:
-  using ConHandle = std::shared_ptr<Connection>;
+  // owned by the connection pool of the transport
+  using ConHandle = Connection *;
+  /**
+   * \param port TCP port to listen on, 0 means "any free port"
+   * \param reusePort bind with SO_REUSEPORT, so several servers (one per
+   * worker thread) can share the same port and the kernel spreads incoming
+   * connections between them
+   */
   explicit TcpServer(uint16_t port, boost::asio::io_service &ioservice,
-                     RfcTransport &transport)
-      : ioService_(ioservice),
-        acceptor_(ioservice),
+                     RfcTransport &transport, bool reusePort = false)
+      : acceptor_(ioservice),
         transport_(transport),
-        port_(port) {}
+        port_(port),
+        reusePort_(reusePort) {}
+  /**
+   * \brief the server must be closed by then and its aborted accept completed,
+   * see close(); checked in debug builds
+   */
+  ~TcpServer();
+  TcpServer(const TcpServer &) = delete;
+  TcpServer &operator=(TcpServer const &) = delete;
+
   /**
    * \brief starts receiving of the packets and schedules accepting next
    * connection
@@ -47,8 +58,21 @@ class TcpServer {
    * \brief schedules asynchronous accepting of new connection
    */
   void startAccepting();
+
+  /**
+   * \brief stops accepting; the pending accept is aborted and must be
+   * completed before the server is destroyed, see
+   * completeAbortedOperations()
+   */
+  void close();
+
+  /**
+   * \brief returns the port the server is actually bound to, useful when it
+   * was created with port 0
+   */
+  uint16_t port() const { return port_; }
 };
 
 }  // namespace DeviceListener
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,58 @@
+#ifndef TokenBucket_H
+#define TokenBucket_H
+#include <algorithm>
+#include <cstdint>
+
+namespace DeviceListener {
+
+/**
+ * Token bucket of one connection: refilled at `rate` tokens a second up to
+ * `burst` tokens, drained by what the connection consumed.
+ *
+ * Consumption may take the bucket below zero (a read can't be taken back),
+ * the debt is paid off by the following refills, so the long term rate
+ * stays exact. The rate and burst are passed in rather than kept, all the
+ * connections of a transport share them.
+ */
+class TokenBucket {
+ public:
+  TokenBucket() : tokens_(0), refilledAt_(0) {}
+
+  /**
+   * \brief fills the bucket up to burst
+   * \param now timestamp in nanoseconds
+   */
+  void reset(uint64_t burst, uint64_t now) {
+    tokens_ = static_cast<double>(burst);
+    refilledAt_ = now;
+  }
+
+  /**
+   * \brief adds the tokens earned since the previous refill
+   */
+  void refill(uint64_t rate, uint64_t burst, uint64_t now) {
+    if (now <= refilledAt_) return;
+    tokens_ = std::min(static_cast<double>(burst),
+                       tokens_ + static_cast<double>(now - refilledAt_) *
+                                     static_cast<double>(rate) * 1e-9);
+    refilledAt_ = now;
+  }
+
+  void consume(uint64_t count) { tokens_ -= static_cast<double>(count); }
+
+  /**
+   * \brief returns the whole tokens available, 0 if there are none or the
+   * bucket is in debt
+   */
+  uint64_t getAvailable() const {
+    return tokens_ >= 1 ? static_cast<uint64_t>(tokens_) : 0;
+  }
+
+ private:
+  double tokens_;
+  uint64_t refilledAt_;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,181 @@
+#include <boost/bind.hpp>
+#include <cassert>
+#include <cerrno>
+#include <iostream>
+
+#include "FrameParser.h"
+#include "Logger.h"
+#include "UdpServer.h"
+
+using namespace DeviceListener;
+
+const unsigned UdpServer::kBatchSize;
+const size_t UdpServer::kDatagramSize;
+const unsigned UdpServer::kMaxBatchesPerWakeup;
+const int UdpServer::kReceiveBufferSize;
+
+UdpServer::UdpServer(uint16_t port, boost::asio::io_service &ioservice,
+                     const WorkerContext &context, bool reusePort)
+    : socket_(ioservice),
+      counter_(context.counter),
+      errors_(context.sourceErrors),
+      port_(port),
+      reusePort_(reusePort),
+      histograms_(context.histograms),
+      measurements_(context.measurements),
+      journal_(context.journal),
+      sketches_(context.sketches),
+      byteOrder_(context.byteOrder),
+      buffers_(kBatchSize * kDatagramSize),
+      iovecs_(kBatchSize),
+      sources_(kBatchSize),
+      messages_(kBatchSize) {
+  batch_.withMetadata = measurements_ || journal_ || sketches_;
+  for (size_t i = 0; i < kBatchSize; i++) {
+    iovecs_[i].iov_base = &buffers_[i * kDatagramSize];
+    iovecs_[i].iov_len = kDatagramSize;
+    msghdr &header = messages_[i].msg_hdr;
+    header.msg_name = &sources_[i];
+    header.msg_iov = &iovecs_[i];
+    header.msg_iovlen = 1;
+  }
+}
+
+UdpServer::~UdpServer() {
+  // the pending wait lives in waitMemory_
+  assert(!socket_.is_open());
+}
+
+void UdpServer::close() {
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+}
+
+void UdpServer::listen() {
+  auto endpoint =
+      boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), port_);
+  socket_.open(endpoint.protocol());
+  socket_.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+  if (reusePort_) {
+    using reuse_port =
+        boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    socket_.set_option(reuse_port(true));
+  }
+  socket_.set_option(
+      boost::asio::socket_base::receive_buffer_size(kReceiveBufferSize));
+  socket_.bind(endpoint);
+  socket_.non_blocking(true);
+  port_ = socket_.local_endpoint().port();
+  std::cout << "Receiving datagrams on UDP port " << port_ << "..."
+            << std::endl;
+  startWaiting();
+}
+
+void UdpServer::startWaiting() {
+  auto handler = boost::bind(&UdpServer::handleReadable, this,
+                             boost::asio::placeholders::error);
+  socket_.async_wait(boost::asio::ip::udp::socket::wait_read,
+                     makeAllocatingHandler(waitMemory_, handler));
+}
+
+void UdpServer::handleReadable(boost::system::error_code const &err) {
+  // closed after the wait had completed
+  if (!socket_.is_open()) return;
+  if (err) {
+    if (err != boost::asio::error::operation_aborted)
+      Logger::instance().log(Logger::Event::WaitFailed,
+                             boost::asio::ip::address(), err);
+    return;
+  }
+
+  // a short batch means the socket is drained
+  for (unsigned i = 0; i < kMaxBatchesPerWakeup; i++)
+    if (receiveBatch() < kBatchSize) break;
+  startWaiting();
+}
+
+size_t UdpServer::receiveBatch() {
+  // the kernel shrinks msg_namelen to the address it writes
+  for (auto &message : messages_)
+    message.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+
+  int received;
+  do {
+    received = recvmmsg(socket_.native_handle(), messages_.data(), kBatchSize,
+                        MSG_DONTWAIT, nullptr);
+  } while (received < 0 && errno == EINTR);
+  if (received <= 0) {
+    if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      Logger::instance().log(
+          Logger::Event::ReceiveFailed, boost::asio::ip::address(),
+          boost::system::error_code(errno, boost::system::system_category()));
+      addRelaxed(counter_.transport.readErrors, 1);
+    }
+    return 0;
+  }
+
+  const uint64_t readCompleted =
+      kInstrumentationEnabled && histograms_ ? StageHistograms::now() : 0;
+  const uint64_t messagesBefore =
+      counter_.transport.messagesReceived.load(std::memory_order_relaxed);
+
+  size_t bytes = 0;
+  for (int i = 0; i < received; i++) {
+    const mmsghdr &message = messages_[i];
+    bytes += message.msg_len;
+    handleDatagram(static_cast<const uint8_t *>(iovecs_[i].iov_base),
+                   message.msg_len, sources_[i],
+                   message.msg_hdr.msg_flags & MSG_TRUNC);
+  }
+  addRelaxed(counter_.transport.datagramsReceived, received);
+  addRelaxed(counter_.transport.bytesReceived, bytes);
+
+  if (kInstrumentationEnabled && histograms_) {
+    histograms_->bytesPerRead.record(bytes);
+    histograms_->framesPerRead.record(
+        counter_.transport.messagesReceived.load(std::memory_order_relaxed) -
+        messagesBefore);
+    histograms_->readToCount.record(StageHistograms::now() - readCompleted);
+  }
+  return received;
+}
+
+void UdpServer::handleDatagram(const uint8_t *data, size_t length,
+                               const sockaddr_in &source, bool truncated) {
+  CounterShard &counter = counter_;
+  MeasurementShard *measurements = measurements_;
+  JournalShard *journal = journal_;
+  TagSketchShard *sketches = sketches_;
+  const FrameBatch &batch = batch_;
+  auto onBatch = [&counter, measurements, journal, sketches, &batch](
+                     const uint16_t *devIds, const uint16_t *frameLengths,
+                     size_t count) {
+    counter.incrementCounters(devIds, frameLengths, count);
+    if (measurements) measurements->add(batch, count);
+    if (journal) journal->add(batch, count);
+    if (sketches) sketches->add(batch, count);
+  };
+  // a datagram too short or too broken to tell is parsed natively, to be
+  // found truncated or invalid
+  const FrameFormat format = detectFrameFormat(data, length, byteOrder_);
+  auto result = visitFrameFormat(format, [&](auto codec) {
+    return FrameParser::parseBatches<decltype(codec)>(data, length, batch_,
+                                                      onBatch);
+  });
+
+  // nothing is printed per datagram, a broken sender would flood the log;
+  // the counters and the statistics of SourceErrors show it instead
+  SourceErrors::Reason reason;
+  if (result.invalidHeader) {
+    addRelaxed(counter_.transport.invalidHeaders, 1);
+    reason = SourceErrors::Reason::InvalidHeader;
+  } else if (truncated || !length || result.consumed != length) {
+    addRelaxed(counter_.transport.truncatedDatagrams, 1);
+    reason = SourceErrors::Reason::Truncated;
+  } else {
+    return;
+  }
+  if (errors_)
+    errors_->record(boost::asio::ip::address_v4(ntohl(source.sin_addr.s_addr)),
+                    reason);
+}
@@ -0,0 +1,123 @@
+#ifndef UdpServer_H
+#define UdpServer_H
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "FrameBatch.h"
+#include "HandlerAllocator.h"
+#include "WorkerContext.h"
+
+namespace DeviceListener {
+
+/**
+ * Datagram counterpart of TcpServer + RfcTransport for one worker.
+ *
+ * Every datagram carries one or more whole back-to-back frames, the same
+ * header and payload as on TCP. asio only tells when the socket is readable,
+ * the datagrams themselves are drained with recvmmsg, kBatchSize of them per
+ * syscall, into buffers allocated once. A datagram is validated on its own:
+ * its valid frames up to the first invalid header are counted, and invalid
+ * or incomplete frames count against the sender in SourceErrors. Every
+ * datagram is read in the FrameFormat its first frame tells, the way a
+ * connection is.
+ */
+class UdpServer {
+ public:
+  // datagrams received by one recvmmsg call
+  static const unsigned kBatchSize = 32;
+  // the largest UDP payload always fits
+  static const size_t kDatagramSize = 64 * 1024;
+  // recvmmsg calls per readiness notification, so a flood of datagrams
+  // doesn't starve the TCP connections of the same worker
+  static const unsigned kMaxBatchesPerWakeup = 8;
+  // kernel-side queue, absorbs bursts while the worker is busy; the kernel
+  // caps it at net.core.rmem_max
+  static const int kReceiveBufferSize = 4 * 1024 * 1024;
+
+  /**
+   * \param port UDP port to listen on, 0 means "any free port"
+   * \param context shards of the thread running ioservice, the source
+   * errors and how the frames are read; datagrams are neither limited,
+   * resynced nor captured
+   * \param reusePort bind with SO_REUSEPORT, see TcpServer
+   */
+  UdpServer(uint16_t port, boost::asio::io_service &ioservice,
+            const WorkerContext &context, bool reusePort = false);
+  /**
+   * \brief the server must be closed by then and its aborted wait completed,
+   * see close(); checked in debug builds
+   */
+  ~UdpServer();
+  UdpServer(const UdpServer &) = delete;
+  UdpServer &operator=(UdpServer const &) = delete;
+
+  /**
+   * \brief opens the socket, binds it and starts receiving; throws
+   * boost::system::system_error on failure
+   */
+  void listen();
+
+  /**
+   * \brief closes the socket; the pending wait is aborted and must be
+   * completed before the server is destroyed, see
+   * completeAbortedOperations()
+   */
+  void close();
+
+  /**
+   * \brief returns the port the server is actually bound to, useful when it
+   * was created with port 0
+   */
+  uint16_t port() const { return port_; }
+
+ protected:
+  // room for the pending wait on the socket
+  static const size_t kWaitMemorySize = 160;
+
+  boost::asio::ip::udp::socket socket_;
+  CounterShard &counter_;
+  SourceErrorShard *errors_;
+  uint16_t port_;
+  bool reusePort_;
+  StageHistograms *histograms_;
+  MeasurementShard *measurements_;
+  JournalShard *journal_;
+  TagSketchShard *sketches_;
+  ByteOrderMode byteOrder_;
+  FrameBatch batch_;
+  HandlerMemory<kWaitMemorySize> waitMemory_;
+
+  std::vector<uint8_t> buffers_;
+  std::vector<iovec> iovecs_;
+  std::vector<sockaddr_in> sources_;
+  std::vector<mmsghdr> messages_;
+
+  void startWaiting();
+
+  /**
+   * \brief drains the socket in batches and waits for it to become readable
+   * again
+   */
+  void handleReadable(boost::system::error_code const &err);
+
+  /**
+   * \brief receives one batch of datagrams and counts their frames
+   * \return number of datagrams received, 0 if there were none or the call
+   * failed
+   */
+  size_t receiveBatch();
+
+  /**
+   * \brief counts the frames of one datagram
+   * \param truncated the kernel had to cut the datagram to fit the buffer
+   */
+  void handleDatagram(const uint8_t *data, size_t length,
+                      const sockaddr_in &source, bool truncated);
+};
+
+}  // namespace DeviceListener
+
+#endif
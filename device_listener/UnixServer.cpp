@@ -0,0 +1,74 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <cassert>
+#include <iostream>
+
+#include "Logger.h"
+#include "RfcTransport.h"
+#include "UnixServer.h"
+
+using namespace DeviceListener;
+
+UnixServer::~UnixServer() {
+  // the pending accept lives in acceptMemory_
+  assert(!acceptor_.is_open());
+}
+
+void UnixServer::close() {
+  if (!acceptor_.is_open()) return;
+  boost::system::error_code ignored;
+  acceptor_.close(ignored);
+  ::unlink(path_.c_str());
+}
+
+void UnixServer::handleAccept(ConHandle conHandle,
+                              boost::system::error_code const &err) {
+  if (err == boost::asio::error::operation_aborted || !acceptor_.is_open()) {
+    // the acceptor is closed, a connection accepted just before is dropped
+    // and nothing is accepted again
+    boost::system::error_code ignored;
+    conHandle->socket.close(ignored);
+    transport_.releaseConnection(conHandle);
+    return;
+  }
+  if (!err) {
+    if (transport_.admitConnection(conHandle)) {
+      Logger::instance().log(Logger::Event::DeviceConnected);
+      transport_.startConnection(conHandle);
+    } else {
+      Logger::instance().log(Logger::Event::ConnectionRejected);
+      // closed here, so it isn't logged as a disconnected device
+      boost::system::error_code ignored;
+      conHandle->socket.close(ignored);
+      transport_.releaseConnection(conHandle);
+    }
+  } else {
+    Logger::instance().log(Logger::Event::AcceptFailed,
+                           boost::asio::ip::address(), err);
+    transport_.releaseConnection(conHandle);
+  }
+  startAccepting();
+}
+
+void UnixServer::listen() {
+  // a socket outlives the process that bound it
+  struct stat status;
+  if (::stat(path_.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+    ::unlink(path_.c_str());
+  boost::asio::local::stream_protocol::endpoint endpoint(path_);
+  acceptor_.open(endpoint.protocol());
+  acceptor_.bind(endpoint);
+  acceptor_.listen();
+  std::cout << "Server is listening on " << path_ << "..." << std::endl;
+  startAccepting();
+}
+
+void UnixServer::startAccepting() {
+  auto conHandle = transport_.allocateConnection();
+  auto handler = boost::bind(&UnixServer::handleAccept, this, conHandle,
+                             boost::asio::placeholders::error);
+  acceptor_.async_accept(conHandle->socket,
+                         makeAllocatingHandler(acceptMemory_, handler));
+}
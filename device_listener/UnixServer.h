@@ -0,0 +1,78 @@
+#ifndef UnixServer_H
+#define UnixServer_H
+#include <boost/asio.hpp>
+#include <string>
+
+#include "Connection.h"
+#include "HandlerAllocator.h"
+
+namespace DeviceListener {
+
+/**
+ * Accepts the connections of local protocol bridges on a Unix domain socket
+ * and hands them to a UnixTransport, the way TcpServer does for TCP. The
+ * frames are read and counted by the same code as the TCP ones, minus the
+ * TCP/IP stack on the way.
+ *
+ * Local peers have no address: they count against the connection limit but
+ * not the per-source one, and the log shows them as unknown.
+ */
+class UnixServer {
+ private:
+  // room for the pending accept
+  static const size_t kAcceptMemorySize = 256;
+
+  boost::asio::local::stream_protocol::acceptor acceptor_;
+  UnixTransport &transport_;
+  std::string path_;
+  HandlerMemory<kAcceptMemorySize> acceptMemory_;
+
+ public:
+  // owned by the connection pool of the transport
+  using ConHandle = UnixConnection *;
+  /**
+   * \param path of the socket to create
+   */
+  UnixServer(const std::string &path, boost::asio::io_service &ioservice,
+             UnixTransport &transport)
+      : acceptor_(ioservice), transport_(transport), path_(path) {}
+  /**
+   * \brief the server must be closed by then and its aborted accept completed,
+   * see close(); checked in debug builds
+   */
+  ~UnixServer();
+  UnixServer(const UnixServer &) = delete;
+  UnixServer &operator=(UnixServer const &) = delete;
+
+  /**
+   * \brief starts reading from the accepted connection and schedules
+   * accepting the next one
+   * \param err - error code of 'accept' call
+   */
+  void handleAccept(ConHandle conHandle, boost::system::error_code const &err);
+
+  /**
+   * \brief creates the socket and calls startAccepting(); a socket left at
+   * the path by a previous run is replaced, anything else there is an error.
+   * Throws boost::system::system_error on failure.
+   */
+  void listen();
+
+  /**
+   * \brief schedules asynchronous accepting of new connection
+   */
+  void startAccepting();
+
+  /**
+   * \brief stops accepting and removes the socket; the pending accept is
+   * aborted and must be completed before the server is destroyed, see
+   * completeAbortedOperations()
+   */
+  void close();
+
+  const std::string &path() const { return path_; }
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -0,0 +1,444 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <boost/asio/error.hpp>
+#include <boost/system/system_error.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "Logger.h"
+#include "SystemUtils.h"
+#include "UringServer.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+#define URING_SERVER_ENABLED
+#endif
+
+using namespace DeviceListener;
+
+namespace {
+
+const uint16_t kBufferGroup = 0;
+const int kOpShift = 32;
+
+uint64_t makeUserData(uint64_t op, int fd) {
+  return (op << kOpShift) | static_cast<uint32_t>(fd);
+}
+
+}  // namespace
+
+UringServer::UringServer(uint16_t port, const WorkerContext &context,
+                         bool reusePort)
+    : port_(port),
+      counter_(context.counter),
+      reusePort_(reusePort),
+      histograms_(context.histograms),
+      measurements_(context.measurements),
+      journal_(context.journal),
+      sketches_(context.sketches),
+      byteOrder_(context.byteOrder),
+      reapedAt_(0),
+      listenFd_(-1),
+      ringFd_(-1),
+      wakeupFd_(-1),
+      wakeupValue_(0),
+      stopped_(false),
+      sqRing_(MAP_FAILED),
+      sqRingSize_(0),
+      sqes_(nullptr),
+      sqesSize_(0),
+      cqRing_(MAP_FAILED),
+      cqRingSize_(0),
+      bufRing_(nullptr),
+      bufTail_(0) {
+  batch_.withMetadata = measurements_ || journal_ || sketches_;
+}
+
+#ifdef URING_SERVER_ENABLED
+
+UringServer::~UringServer() {
+  // closing the ring cancels everything in flight, so do it before the
+  // buffers and sockets go away
+  if (ringFd_ >= 0) close(ringFd_);
+  if (bufRing_) munmap(bufRing_, kBufferCount * sizeof(io_uring_buf));
+  if (sqes_ && sqesSize_) munmap(sqes_, sqesSize_);
+  if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+    munmap(cqRing_, cqRingSize_);
+  if (sqRing_ != MAP_FAILED) munmap(sqRing_, sqRingSize_);
+  for (size_t fd = 0; fd < connections_.size(); fd++)
+    if (connections_[fd]) close(fd);
+  if (listenFd_ >= 0) close(listenFd_);
+  if (wakeupFd_ >= 0) close(wakeupFd_);
+}
+
+bool UringServer::isSupported() {
+  // multishot recv is a flag of IORING_OP_RECV no probe reports, it has come
+  // with Linux 6.0
+  utsname name;
+  int major = 0;
+  if (uname(&name) || sscanf(name.release, "%d", &major) != 1 || major < 6)
+    return false;
+
+  io_uring_params params = {};
+  int fd = syscall(__NR_io_uring_setup, 4, &params);
+  if (fd < 0) return false;
+
+  // a kernel may have io_uring but some of its operations disabled or
+  // filtered, ask it for the ones the server submits
+  const unsigned opCount = 256;
+  std::vector<uint8_t> probeBuffer(sizeof(io_uring_probe) +
+                                   opCount * sizeof(io_uring_probe_op));
+  auto probe = reinterpret_cast<io_uring_probe *>(probeBuffer.data());
+  bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                           probe, opCount) == 0;
+  for (unsigned op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ})
+    supported = supported && op <= probe->last_op &&
+                (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+
+  // and the buffer ring the recvs pick from, which is gone with the ring
+  const size_t ringSize = 8 * sizeof(io_uring_buf);
+  void *ring = supported ? mmap(nullptr, ringSize, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                         : MAP_FAILED;
+  if (ring != MAP_FAILED) {
+    io_uring_buf_reg reg = {};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = 8;
+    reg.bgid = kBufferGroup;
+    supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING,
+                        &reg, 1) == 0;
+  } else {
+    supported = false;
+  }
+  close(fd);
+  if (ring != MAP_FAILED) munmap(ring, ringSize);
+  return supported;
+}
+
+void UringServer::listen() {
+  setupRing();
+  setupBuffers();
+  openSocket();
+
+  wakeupFd_ = eventfd(0, EFD_CLOEXEC);
+  if (wakeupFd_ < 0) throwSystemError("eventfd");
+
+  std::cout << "Server is listening on port " << port_ << " (io_uring)..."
+            << std::endl;
+}
+
+void UringServer::setupRing() {
+  io_uring_params params = {};
+  // every connection can have a burst of recv completions in flight
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = kQueueDepth * 8;
+  ringFd_ = syscall(__NR_io_uring_setup, kQueueDepth, &params);
+  if (ringFd_ < 0) throwSystemError("io_uring_setup");
+
+  sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMmap)
+    sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+  sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+  if (sqRing_ == MAP_FAILED) throwSystemError("mmap(sq ring)");
+  cqRing_ = singleMmap ? sqRing_
+                       : mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ringFd_,
+                              IORING_OFF_CQ_RING);
+  if (cqRing_ == MAP_FAILED) throwSystemError("mmap(cq ring)");
+
+  sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    sqesSize_ = 0;
+    throwSystemError("mmap(sqes)");
+  }
+  sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+  auto sq = static_cast<uint8_t *>(sqRing_);
+  sqHead_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  sqMask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sqEntries_ = params.sq_entries;
+  sqLocalTail_ = *sqTail_;
+
+  auto cq = static_cast<uint8_t *>(cqRing_);
+  cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cqMask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+void UringServer::setupBuffers() {
+  const size_t ringSize = kBufferCount * sizeof(io_uring_buf);
+  void *ring = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) throwSystemError("mmap(buffer ring)");
+  bufRing_ = static_cast<io_uring_buf *>(ring);
+
+  io_uring_buf_reg reg = {};
+  reg.ring_addr = reinterpret_cast<uint64_t>(bufRing_);
+  reg.ring_entries = kBufferCount;
+  reg.bgid = kBufferGroup;
+  if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0)
+    throwSystemError("io_uring_register(pbuf ring)");
+
+  buffers_.resize(kBufferCount * kBufferSize);
+  for (unsigned bid = 0; bid < kBufferCount; bid++) recycleBuffer(bid);
+  // the ring tail is overlaid with the reserved field of the first entry
+  __atomic_store_n(&bufRing_[0].resv, bufTail_, __ATOMIC_RELEASE);
+}
+
+void UringServer::openSocket() {
+  listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenFd_ < 0) throwSystemError("socket");
+
+  int enable = 1;
+  setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if (reusePort_ && setsockopt(listenFd_, SOL_SOCKET, SO_REUSEPORT, &enable,
+                               sizeof(enable)))
+    throwSystemError("setsockopt(SO_REUSEPORT)");
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port_);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listenFd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)))
+    throwSystemError("bind");
+  if (::listen(listenFd_, SOMAXCONN)) throwSystemError("listen");
+
+  socklen_t addrLength = sizeof(addr);
+  getsockname(listenFd_, reinterpret_cast<sockaddr *>(&addr), &addrLength);
+  port_ = ntohs(addr.sin_port);
+}
+
+io_uring_sqe *UringServer::getSqe() {
+  const unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+  if (sqLocalTail_ - head >= sqEntries_) {
+    // the queue is full of not yet submitted entries, hand them over first
+    __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+    syscall(__NR_io_uring_enter, ringFd_, sqEntries_, 0, 0, nullptr, 0);
+  }
+  const unsigned idx = sqLocalTail_ & sqMask_;
+  io_uring_sqe *sqe = &sqes_[idx];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqArray_[idx] = idx;
+  sqLocalTail_++;
+  return sqe;
+}
+
+void UringServer::submitAndWait() {
+  __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+  const unsigned pending =
+      sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+  if (syscall(__NR_io_uring_enter, ringFd_, pending, 1, IORING_ENTER_GETEVENTS,
+              nullptr, 0) < 0 &&
+      errno != EINTR)
+    throwSystemError("io_uring_enter");
+}
+
+void UringServer::armAccept() {
+  io_uring_sqe *sqe = getSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenFd_;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = makeUserData(static_cast<uint64_t>(Op::Accept), listenFd_);
+}
+
+void UringServer::armRecv(int fd) {
+  io_uring_sqe *sqe = getSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufferGroup;
+  sqe->user_data = makeUserData(static_cast<uint64_t>(Op::Recv), fd);
+}
+
+void UringServer::armWakeup() {
+  io_uring_sqe *sqe = getSqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wakeupFd_;
+  sqe->addr = reinterpret_cast<uint64_t>(&wakeupValue_);
+  sqe->len = sizeof(wakeupValue_);
+  sqe->user_data = makeUserData(static_cast<uint64_t>(Op::Wakeup), wakeupFd_);
+}
+
+void UringServer::recycleBuffer(uint16_t bid) {
+  io_uring_buf &buf = bufRing_[bufTail_ & (kBufferCount - 1)];
+  buf.addr = reinterpret_cast<uint64_t>(&buffers_[bid * kBufferSize]);
+  buf.len = kBufferSize;
+  buf.bid = bid;
+  bufTail_++;
+}
+
+void UringServer::run() {
+  armAccept();
+  armWakeup();
+
+  while (!stopped_) {
+    submitAndWait();
+
+    unsigned head = *cqHead_;
+    const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    if (kInstrumentationEnabled && histograms_)
+      reapedAt_ = StageHistograms::now();
+    for (; head != tail; head++) handleCompletion(cqes_[head & cqMask_]);
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    // hand the consumed buffers back to the kernel in one go
+    __atomic_store_n(&bufRing_[0].resv, bufTail_, __ATOMIC_RELEASE);
+  }
+}
+
+void UringServer::stop() {
+  stopped_ = true;
+  uint64_t one = 1;
+  if (wakeupFd_ >= 0 && write(wakeupFd_, &one, sizeof(one)) < 0)
+    Logger::instance().log(
+        Logger::Event::WakeupFailed, boost::asio::ip::address(),
+        boost::system::error_code(errno, boost::system::system_category()));
+}
+
+void UringServer::handleCompletion(const io_uring_cqe &cqe) {
+  const int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+  switch (static_cast<Op>(cqe.user_data >> kOpShift)) {
+    case Op::Accept:
+      handleAccept(cqe);
+      break;
+    case Op::Recv:
+      handleRecv(fd, cqe);
+      break;
+    case Op::Wakeup:
+      stopped_ = true;
+      break;
+  }
+}
+
+void UringServer::handleAccept(const io_uring_cqe &cqe) {
+  if (cqe.res >= 0) {
+    const int fd = cqe.res;
+    if (connections_.size() <= static_cast<size_t>(fd))
+      connections_.resize(fd + 1);
+    connections_[fd].reset(new Connection(byteOrder_));
+
+    sockaddr_in addr = {};
+    socklen_t addrLength = sizeof(addr);
+    if (!getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &addrLength))
+      connections_[fd]->address =
+          boost::asio::ip::address_v4(ntohl(addr.sin_addr.s_addr));
+    Logger::instance().log(Logger::Event::DeviceConnected,
+                           connections_[fd]->address);
+    addRelaxed(counter_.transport.connectionsOpened, 1);
+
+    armRecv(fd);
+  } else {
+    Logger::instance().log(
+        Logger::Event::AcceptFailed, boost::asio::ip::address(),
+        boost::system::error_code(-cqe.res, boost::system::system_category()));
+  }
+  if (!(cqe.flags & IORING_CQE_F_MORE)) armAccept();
+}
+
+void UringServer::handleRecv(int fd, const io_uring_cqe &cqe) {
+  Connection &connection = *connections_[fd];
+  const bool instrument = kInstrumentationEnabled && histograms_;
+  const uint64_t readCompleted = instrument ? StageHistograms::now() : 0;
+  if (instrument) histograms_->queueDelay.record(readCompleted - reapedAt_);
+
+  if (cqe.flags & IORING_CQE_F_BUFFER) {
+    const uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe.res > 0 && !connection.closing) {
+      addRelaxed(counter_.transport.bytesReceived, cqe.res);
+      CounterShard &counter = counter_;
+      MeasurementShard *measurements = measurements_;
+      JournalShard *journal = journal_;
+      TagSketchShard *sketches = sketches_;
+      const FrameBatch &batch = batch_;
+      auto result = connection.stream.feed(
+          &buffers_[bid * kBufferSize], cqe.res, batch_,
+          [&counter, measurements, journal, sketches, &batch](
+              const uint16_t *devIds, const uint16_t *frameLengths,
+              size_t count) {
+            counter.incrementCounters(devIds, frameLengths, count);
+            if (measurements) measurements->add(batch, count);
+            if (journal) journal->add(batch, count);
+            if (sketches) sketches->add(batch, count);
+          });
+      if (result.invalidHeader) {
+        Logger::instance().log(Logger::Event::InvalidHeader,
+                               connection.address);
+        addRelaxed(counter_.transport.invalidHeaders, 1);
+        // makes the multishot recv terminate, the socket is closed then
+        connection.closing = true;
+        shutdown(fd, SHUT_RDWR);
+      }
+      if (instrument) {
+        histograms_->bytesPerRead.record(cqe.res);
+        histograms_->framesPerRead.record(result.frames);
+        histograms_->readToCount.record(StageHistograms::now() -
+                                        readCompleted);
+      }
+    }
+    recycleBuffer(bid);
+  }
+
+  if (cqe.flags & IORING_CQE_F_MORE) return;
+
+  // the multishot recv has terminated: the kernel ran out of provided
+  // buffers or the connection is done
+  if (!connection.closing && (cqe.res > 0 || cqe.res == -ENOBUFS)) {
+    armRecv(fd);
+    return;
+  }
+  if (!connection.closing) {
+    Logger::instance().log(
+        Logger::Event::ReadFailed, connection.address,
+        cqe.res ? boost::system::error_code(-cqe.res,
+                                            boost::system::system_category())
+                : boost::system::error_code(boost::asio::error::eof));
+    if (cqe.res) addRelaxed(counter_.transport.readErrors, 1);
+  }
+  closeConnection(fd);
+}
+
+void UringServer::closeConnection(int fd) {
+  Logger::instance().log(Logger::Event::DeviceDisconnected,
+                         connections_[fd]->address);
+  addRelaxed(counter_.transport.connectionsClosed, 1);
+  connections_[fd].reset();
+  close(fd);
+}
+
+#else
+
+UringServer::~UringServer() {}
+
+bool UringServer::isSupported() { return false; }
+
+void UringServer::listen() { throwSystemError("io_uring", ENOSYS); }
+
+void UringServer::run() {}
+
+void UringServer::stop() { stopped_ = true; }
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef UringServer_H
+#define UringServer_H
+#include <boost/asio/ip/address.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FrameBatch.h"
+#include "StreamReassembler.h"
+#include "WorkerContext.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf;
+
+namespace DeviceListener {
+
+/**
+ * Linux io_uring alternative to TcpServer + RfcTransport for one worker.
+ *
+ * A single multishot accept produces all the connections, every connection
+ * has a single multishot recv that picks its buffers from a ring registered
+ * in the kernel, so steady-state ingestion needs neither epoll wakeups nor a
+ * syscall per read. Received chunks go to the same frame parser and counter
+ * shard the asio path uses.
+ */
+class UringServer {
+ public:
+  static const unsigned kQueueDepth = 1024;
+  // must be a power of two
+  static const unsigned kBufferCount = 1024;
+  static const size_t kBufferSize = 16 * 1024;
+
+  /**
+   * \param port TCP port to listen on, 0 means "any free port"
+   * \param context shards of the thread calling run() and how the frames
+   * are read; the connections are neither limited, resynced nor captured
+   * \param reusePort bind with SO_REUSEPORT, see TcpServer
+   */
+  UringServer(uint16_t port, const WorkerContext &context,
+              bool reusePort = false);
+  ~UringServer();
+  UringServer(const UringServer &) = delete;
+  UringServer &operator=(UringServer const &) = delete;
+
+  /**
+   * \brief checks if the running kernel has everything the server needs:
+   * io_uring itself, the operations it submits, provided buffer rings (all
+   * of them probed) and multishot recv (told by the kernel version)
+   */
+  static bool isSupported();
+
+  /**
+   * \brief sets up the ring, opens the listening socket and binds it;
+   * throws boost::system::system_error on failure
+   */
+  void listen();
+
+  /**
+   * \brief processes completions until stop() is called
+   */
+  void run();
+
+  /**
+   * \brief makes run() return, may be called from any thread
+   */
+  void stop();
+
+  uint16_t port() const { return port_; }
+
+ protected:
+  enum class Op : uint64_t { Accept = 1, Recv, Wakeup };
+
+  struct Connection {
+    StreamReassembler stream;
+    boost::asio::ip::address address;
+    // an invalid header was met, waiting for the recv to terminate
+    bool closing = false;
+
+    explicit Connection(ByteOrderMode byteOrder) : stream(byteOrder) {}
+  };
+
+  uint16_t port_;
+  CounterShard &counter_;
+  bool reusePort_;
+  StageHistograms *histograms_;
+  MeasurementShard *measurements_;
+  JournalShard *journal_;
+  TagSketchShard *sketches_;
+  ByteOrderMode byteOrder_;
+  // when the current batch of completions has been reaped
+  uint64_t reapedAt_;
+  int listenFd_;
+  int ringFd_;
+  int wakeupFd_;
+  uint64_t wakeupValue_;
+  std::atomic<bool> stopped_;
+
+  // submission queue
+  void *sqRing_;
+  size_t sqRingSize_;
+  unsigned *sqHead_;
+  unsigned *sqTail_;
+  unsigned *sqArray_;
+  unsigned sqMask_;
+  unsigned sqEntries_;
+  unsigned sqLocalTail_;
+  io_uring_sqe *sqes_;
+  size_t sqesSize_;
+
+  // completion queue
+  void *cqRing_;
+  size_t cqRingSize_;
+  unsigned *cqHead_;
+  unsigned *cqTail_;
+  unsigned cqMask_;
+  io_uring_cqe *cqes_;
+
+  // provided buffers
+  io_uring_buf *bufRing_;
+  uint16_t bufTail_;
+  std::vector<uint8_t> buffers_;
+
+  FrameBatch batch_;
+  std::vector<std::unique_ptr<Connection>> connections_;
+
+  void setupRing();
+  void setupBuffers();
+  void openSocket();
+  io_uring_sqe *getSqe();
+  void submitAndWait();
+  void armAccept();
+  void armRecv(int fd);
+  void armWakeup();
+  void recycleBuffer(uint16_t bid);
+  void handleCompletion(const io_uring_cqe &cqe);
+  void handleAccept(const io_uring_cqe &cqe);
+  void handleRecv(int fd, const io_uring_cqe &cqe);
+  void closeConnection(int fd);
+};
+
+}  // namespace DeviceListener
+
+#endif
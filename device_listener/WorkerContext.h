@@ -0,0 +1,57 @@
+#ifndef WorkerContext_H
+#define WorkerContext_H
+#include "AdmissionControl.h"
+#include "Capture.h"
+#include "FrameCodec.h"
+#include "FrameResync.h"
+#include "Instrumentation.h"
+#include "Journal.h"
+#include "MeasurementStats.h"
+#include "MsgCounter.h"
+#include "SourceErrors.h"
+#include "TagSketches.h"
+
+namespace DeviceListener {
+
+/**
+ * What the servers and transports of one worker thread record into and how
+ * they read: the shards of that thread, the objects shared by all the
+ * workers and the settings of the frames.
+ *
+ * Every pointer may be nullptr, then nothing is recorded there. The
+ * servers and transports copy what they use, so the context only has to
+ * live as long as their constructors run; what the pointers point to must
+ * outlive them.
+ */
+struct WorkerContext {
+  // a shard alone is a context that counts and records nothing else
+  WorkerContext(CounterShard &counter) : counter(counter) {}
+
+  // counter table of the thread
+  CounterShard &counter;
+  // hot path histograms of the thread
+  StageHistograms *histograms = nullptr;
+  // measurement aggregates of the thread, to count the frames only if not
+  // set
+  MeasurementShard *measurements = nullptr;
+  // journal rows of the thread
+  JournalShard *journal = nullptr;
+  // capture records of the thread; asio streams only
+  CaptureShard *capture = nullptr;
+  // sketches by device and tag of the thread
+  TagSketchShard *sketches = nullptr;
+  // per-sender datagram errors of the thread, to keep only the totals in
+  // counter if not set
+  SourceErrorShard *sourceErrors = nullptr;
+  // connection limits shared by the workers and the rate limits of every
+  // connection; asio streams only
+  AdmissionControl *admission = nullptr;
+  // what a stream does about an invalid header; asio streams only
+  ResyncMode resync = ResyncMode::Off;
+  // byte order of the devices' frames
+  ByteOrderMode byteOrder = ByteOrderMode::Native;
+};
+
+}  // namespace DeviceListener
+
+#endif
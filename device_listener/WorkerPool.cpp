@@ -0,0 +1,193 @@
+#include <pthread.h>
+#include <sched.h>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "WorkerPool.h"
+
+using namespace DeviceListener;
+
+namespace {
+
+const boost::posix_time::milliseconds kProbeInterval(10);
+
+/**
+ * \brief the CPUs the process may run on, taskset or a cpuset may leave out
+ * some of the machine's; empty if that can't be told
+ */
+std::vector<int> getAllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) return cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+  return cpus;
+}
+
+}  // namespace
+
+Worker::~Worker() {
+  // the pending operations live in the objects closed here; everything is
+  // closed before the aborted handlers run, so none of them starts anything
+  // new on an object about to go
+  closed_ = true;
+  boost::system::error_code ignored;
+  probeTimer_.cancel(ignored);
+  for (auto &line : serialLines_) line->close();
+  if (unixServer_) unixServer_->close();
+  if (udpServer_) udpServer_->close();
+  if (server_) server_->close();
+  for (auto &transport : serialTransports_) transport->close();
+  if (unixTransport_) unixTransport_->close();
+  if (transport_) transport_->close();
+  completeAbortedOperations(ioService_);
+}
+
+void Worker::start(int cpu) { thread_ = std::thread(&Worker::run, this, cpu); }
+
+void Worker::join() {
+  if (thread_.joinable()) thread_.join();
+}
+
+void Worker::run(int cpu) {
+  if (cpu >= 0) {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (err)
+      std::cerr << "Failed to pin worker to CPU " << cpu << ": "
+                << std::strerror(err) << std::endl;
+  }
+
+  if (kInstrumentationEnabled && histograms_ && !uringServer_)
+    scheduleQueueProbe();
+
+  try {
+    if (uringServer_)
+      uringServer_->run();
+    else
+      ioService_.run();
+  } catch (boost::system::system_error &e) {
+    std::cerr << "\033[31mWorker failed: " << e.what() << "\033[0m"
+              << std::endl;
+  }
+}
+
+void Worker::scheduleQueueProbe() {
+  probeTimer_.expires_from_now(kProbeInterval);
+  probeTimer_.async_wait([this](boost::system::error_code const &err) {
+    if (err || closed_) return;
+    const uint64_t posted = StageHistograms::now();
+    ioService_.post([this, posted]() {
+      histograms_->queueDelay.record(StageHistograms::now() - posted);
+    });
+    scheduleQueueProbe();
+  });
+}
+
+WorkerPool::WorkerPool(MsgCounter &counter, const WorkerPoolOptions &options)
+    : counter_(counter), options_(options) {
+  if (!options_.threads) options_.threads = 1;
+  if (options_.backend == Backend::IoUring && !UringServer::isSupported()) {
+    std::cerr << "io_uring is not supported by the kernel, falling back to "
+                 "asio"
+              << std::endl;
+    options_.backend = Backend::Asio;
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  stop();
+  join();
+}
+
+void WorkerPool::listen() {
+  const size_t threads = options_.threads;
+  if (counter_.getShardCount() < threads ||
+      (options_.instrumentation &&
+       options_.instrumentation->getShardCount() < threads) ||
+      (options_.measurements &&
+       options_.measurements->getShardCount() < threads) ||
+      (options_.journal && options_.journal->getShardCount() < threads) ||
+      (options_.capture && options_.capture->getShardCount() < threads) ||
+      (options_.sketches && options_.sketches->getShardCount() < threads) ||
+      (options_.sourceErrors &&
+       options_.sourceErrors->getShardCount() < threads))
+    throw std::invalid_argument("not enough shards for the workers");
+  // an io_uring worker never runs its io_service
+  if (options_.backend == Backend::IoUring) {
+    if (options_.udpPort)
+      throw std::invalid_argument(
+          "datagrams are received by asio workers only");
+    if (options_.admission)
+      throw std::invalid_argument("limits are enforced by asio workers only");
+    if (options_.resync != ResyncMode::Off)
+      throw std::invalid_argument("streams are resynced by asio workers only");
+    if (options_.capture)
+      throw std::invalid_argument("streams are captured by asio workers only");
+    if (!options_.unixPath.empty() || !options_.serialLines.empty())
+      throw std::invalid_argument(
+          "Unix sockets and serial lines are read by asio workers only");
+  }
+
+  // the first worker resolves port 0 to a real one, the rest join it; the
+  // Unix socket and the serial lines can't be shared, the first one takes
+  // them
+  for (size_t i = 0; i < threads; i++) {
+    auto makeWorker = [this, i]() {
+      return new Worker(
+          options_.port, options_.backend, makeContext(i), options_.udpPort,
+          i ? std::string() : options_.unixPath,
+          i ? std::vector<SerialOptions>() : options_.serialLines);
+    };
+    workers_.emplace_back(makeWorker());
+    try {
+      workers_.back()->listen();
+    } catch (boost::system::system_error &e) {
+      // a kernel passing the probe may still refuse the ring (a locked
+      // memory limit, a seccomp filter), which the first worker tells
+      if (i || options_.backend != Backend::IoUring) throw;
+      std::cerr << "io_uring failed to set up (" << e.what()
+                << "), falling back to asio" << std::endl;
+      options_.backend = Backend::Asio;
+      workers_.back().reset(makeWorker());
+      workers_.back()->listen();
+    }
+    options_.port = workers_.back()->port();
+    options_.udpPort = workers_.back()->udpPort();
+  }
+}
+
+WorkerContext WorkerPool::makeContext(size_t i) const {
+  WorkerContext context(counter_.getShard(i));
+  if (options_.instrumentation)
+    context.histograms = &options_.instrumentation->getShard(i);
+  if (options_.measurements)
+    context.measurements = &options_.measurements->getShard(i);
+  if (options_.journal) context.journal = &options_.journal->getShard(i);
+  if (options_.capture) context.capture = &options_.capture->getShard(i);
+  if (options_.sketches) context.sketches = &options_.sketches->getShard(i);
+  if (options_.sourceErrors)
+    context.sourceErrors = &options_.sourceErrors->getShard(i);
+  context.admission = options_.admission;
+  context.resync = options_.resync;
+  context.byteOrder = options_.byteOrder;
+  return context;
+}
+
+void WorkerPool::start() {
+  const std::vector<int> cpus = getAllowedCpus();
+  for (size_t i = 0; i < workers_.size(); i++)
+    workers_[i]->start(cpus.empty() ? -1 : cpus[i % cpus.size()]);
+}
+
+void WorkerPool::stop() {
+  for (auto &worker : workers_) worker->stop();
+}
+
+void WorkerPool::join() {
+  for (auto &worker : workers_) worker->join();
+}
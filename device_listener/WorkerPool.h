@@ -0,0 +1,218 @@
+#ifndef WorkerPool_H
+#define WorkerPool_H
+#include <boost/asio.hpp>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RfcTransport.h"
+#include "SerialLine.h"
+#include "TcpServer.h"
+#include "UdpServer.h"
+#include "UnixServer.h"
+#include "UringServer.h"
+#include "WorkerContext.h"
+
+namespace DeviceListener {
+
+enum class Backend { Asio, IoUring };
+
+/**
+ * One ingestion thread: its own io_service, transport and SO_REUSEPORT
+ * acceptor (and UDP socket), so workers never share any asio state with each
+ * other. A worker may also accept on a Unix domain socket and read serial
+ * lines, each of them with a transport of its own.
+ */
+class Worker {
+ public:
+  /**
+   * \param backend io_uring or the asio one, the caller checks if io_uring
+   * is supported; an io_uring worker has neither TcpServer nor RfcTransport
+   * \param context shards of this worker and what the workers share; the
+   * limits, resync and capture need the asio backend
+   * \param udpPort UDP port to receive datagrams on as well, 0 for none;
+   * asio backend only
+   * \param unixPath Unix domain socket to accept on as well, empty for
+   * none; asio backend only
+   * \param serialLines serial lines to read as well; asio backend only
+   */
+  Worker(uint16_t port, Backend backend, const WorkerContext &context,
+         uint16_t udpPort = 0, const std::string &unixPath = std::string(),
+         const std::vector<SerialOptions> &serialLines =
+             std::vector<SerialOptions>())
+      : ioService_(1),
+        transport_(backend == Backend::Asio
+                       ? new RfcTransport(ioService_, context)
+                       : nullptr),
+        server_(transport_
+                    ? new TcpServer(port, ioService_, *transport_, true)
+                    : nullptr),
+        uringServer_(transport_ ? nullptr
+                                : new UringServer(port, context, true)),
+        udpServer_(udpPort ? new UdpServer(udpPort, ioService_, context, true)
+                           : nullptr),
+        histograms_(context.histograms),
+        probeTimer_(ioService_),
+        closed_(false) {
+    if (!unixPath.empty()) {
+      unixTransport_.reset(new UnixTransport(ioService_, context));
+      unixServer_.reset(new UnixServer(unixPath, ioService_, *unixTransport_));
+    }
+    for (const auto &options : serialLines) {
+      serialTransports_.emplace_back(new SerialTransport(ioService_, context));
+      serialLines_.emplace_back(
+          new SerialLine(options, ioService_, *serialTransports_.back()));
+    }
+  }
+  /**
+   * \brief closes the servers and transports, then completes their aborted
+   * operations in one go; the worker must be stopped and joined
+   */
+  ~Worker();
+  Worker(const Worker &) = delete;
+  Worker &operator=(Worker const &) = delete;
+
+  /**
+   * \brief binds the worker's acceptor and opens the serial lines, throws
+   * boost::system::system_error on failure
+   */
+  void listen() {
+    if (uringServer_)
+      uringServer_->listen();
+    else
+      server_->listen();
+    if (udpServer_) udpServer_->listen();
+    if (unixServer_) unixServer_->listen();
+    for (auto &line : serialLines_) line->open();
+  }
+
+  /**
+   * \brief runs the worker's io_service in a new thread
+   * \param cpu CPU core to pin the thread to, -1 to leave it unpinned
+   */
+  void start(int cpu);
+
+  /**
+   * \brief asks the worker's io_service to stop, doesn't wait for it
+   */
+  void stop() {
+    if (uringServer_)
+      uringServer_->stop();
+    else
+      ioService_.stop();
+  }
+
+  void join();
+
+  uint16_t port() const {
+    return uringServer_ ? uringServer_->port() : server_->port();
+  }
+  uint16_t udpPort() const { return udpServer_ ? udpServer_->port() : 0; }
+
+ protected:
+  boost::asio::io_service ioService_;
+  // either the transport and server or the io_uring one
+  std::unique_ptr<RfcTransport> transport_;
+  std::unique_ptr<TcpServer> server_;
+  std::unique_ptr<UringServer> uringServer_;
+  std::unique_ptr<UdpServer> udpServer_;
+  // the servers come after their transports, so they are destroyed first
+  std::unique_ptr<UnixTransport> unixTransport_;
+  std::unique_ptr<UnixServer> unixServer_;
+  std::vector<std::unique_ptr<SerialTransport>> serialTransports_;
+  std::vector<std::unique_ptr<SerialLine>> serialLines_;
+  StageHistograms *histograms_;
+  boost::asio::deadline_timer probeTimer_;
+  bool closed_;
+  std::thread thread_;
+
+  void run(int cpu);
+
+  /**
+   * \brief every kProbeInterval posts a handler to the worker's queue and
+   * records how long it waits there
+   */
+  void scheduleQueueProbe();
+};
+
+/**
+ * What the workers of a pool serve and share. The sharded objects need a
+ * shard per worker, worker i takes shard i; every pointer may be nullptr,
+ * then nothing is recorded there.
+ */
+struct WorkerPoolOptions {
+  // number of workers, each of them gets its own core
+  size_t threads = 1;
+  // TCP port shared by all the workers, 0 means "any free port"
+  uint16_t port = 0;
+  // falls back to asio if io_uring is not supported by the kernel or the
+  // first worker fails to set it up
+  Backend backend = Backend::Asio;
+  // UDP port shared by all the workers, 0 for TCP only; asio backend only
+  uint16_t udpPort = 0;
+  // Unix domain socket the first worker accepts on as well, empty for
+  // none; asio backend only
+  std::string unixPath;
+  // serial lines the first worker reads as well; asio backend only
+  std::vector<SerialOptions> serialLines;
+  // anything but ResyncMode::Off needs the asio backend
+  ResyncMode resync = ResyncMode::Off;
+  ByteOrderMode byteOrder = ByteOrderMode::Native;
+
+  // sharded
+  Instrumentation *instrumentation = nullptr;
+  MeasurementStats *measurements = nullptr;
+  Journal *journal = nullptr;
+  // asio backend only
+  Capture *capture = nullptr;
+  TagSketches *sketches = nullptr;
+  SourceErrors *sourceErrors = nullptr;
+  // shared
+  // asio backend only
+  AdmissionControl *admission = nullptr;
+};
+
+class WorkerPool {
+ public:
+  /**
+   * \param counter message counter with a shard per worker, worker i counts
+   * into shard i
+   */
+  WorkerPool(MsgCounter &counter,
+             const WorkerPoolOptions &options = WorkerPoolOptions());
+  ~WorkerPool();
+
+  /**
+   * \brief binds all the workers to the same port, throws
+   * boost::system::system_error on failure
+   */
+  void listen();
+  /**
+   * \brief starts the workers, pinned round-robin to the CPUs the process
+   * may run on
+   */
+  void start();
+  void stop();
+  void join();
+
+  uint16_t port() const { return options_.port; }
+  uint16_t udpPort() const { return options_.udpPort; }
+  size_t size() const { return workers_.size(); }
+  Backend backend() const { return options_.backend; }
+
+ protected:
+  MsgCounter &counter_;
+  // the ports resolved by the first worker, the backend fallen back to
+  WorkerPoolOptions options_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  /**
+   * \brief the shards of worker i and what the workers share
+   */
+  WorkerContext makeContext(size_t i) const;
+};
+
+}  // namespace DeviceListener
+
+#endif
@@ -1,17 +1,39 @@
-#define BOOST_ASIO_DISABLE_THREADS
 #include <getopt.h>
 #include <unistd.h>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
 
+#include "AdmissionControl.h"
+#include "Capture.h"
+#include "DeviceRegistry.h"
+#include "FileWatcher.h"
+#include "FrameResync.h"
+#include "Instrumentation.h"
+#include "Journal.h"
+#include "MeasurementStats.h"
+#include "MetricsServer.h"
 #include "MsgCounter.h"
+#include "RateTracker.h"
 #include "RfcTransport.h"
+#include "SerialLine.h"
+#include "SourceErrors.h"
+#include "StatsRenderer.h"
+#include "TagSketches.h"
 #include "TcpServer.h"
+#include "WorkerPool.h"
 
 boost::asio::io_service ioService;
 
+// how often the counters are synced to the state file
+static const uint16_t kCheckpointInterval = 10;
+
 /**
  * \brief prints usage information to stdout
  */
@@ -20,30 +42,187 @@ void printUsage() {
   std::cout << "-f <filename> - path to the file with devices descriptions"
             << std::endl;
   std::cout << "-p <port> - TCP port to run server on" << std::endl;
+  std::cout << "-d <port> - UDP port to receive datagrams on as well, "
+               "disabled if not set (asio backend only)"
+            << std::endl;
   std::cout
       << "-i <interval> - interval (in seconds) to print statistics to stdout"
       << std::endl;
+  std::cout << "-t <threads> - number of ingestion threads, each pinned to its "
+               "own core"
+            << std::endl;
+  std::cout << "-u - receive with io_uring instead of asio (Linux 6.0+)"
+            << std::endl;
+  std::cout << "-m <port> - TCP port to serve Prometheus metrics on "
+               "(http://host:port/metrics), disabled if not set"
+            << std::endl;
+  std::cout << "-s <filename> - file to keep the counters in across restarts, "
+               "counters are kept in memory only if not set"
+            << std::endl;
+  std::cout << "-w - reload the devices file as soon as it changes, it is "
+               "reloaded on SIGHUP anyway"
+            << std::endl;
+  std::cout << "-c <filename> - compile the devices file given with `-f` into "
+               "a binary registry, which loads faster, and exit"
+            << std::endl;
+  std::cout << "-l <connections> - maximal number of connections, further "
+               "ones are closed right away; unlimited if not set"
+            << std::endl;
+  std::cout << "-L <connections> - maximal number of connections from one "
+               "address; unlimited if not set"
+            << std::endl;
+  std::cout << "-b <bytes> - bytes per second read from one connection, a "
+               "faster device is paused; unlimited if not set"
+            << std::endl;
+  std::cout << "-r <frames> - frames per second read from one connection, a "
+               "faster device is paused; unlimited if not set"
+            << std::endl;
+  std::cout << "-y <header|confirmed> - skip to the next valid header after "
+               "an invalid one instead of closing the connection; "
+               "`confirmed` also requires the header after it to be valid "
+               "(asio backend only)"
+            << std::endl;
+  std::cout << "-a - aggregate messages by device and measurement type "
+               "(count, timestamps, data bytes), exported on the metrics "
+               "endpoint"
+            << std::endl;
+  std::cout << "-j <filename> - append every message (device, measurement, "
+               "timestamps, length) to this journal, query it with "
+               "journal_query; no journal if not set"
+            << std::endl;
+  std::cout << "-C <prefix> - write the raw stream of every connection to "
+               "capture segments starting with this prefix, replay them with "
+               "capture_replay (asio backend only, not with `-y`)"
+            << std::endl;
+  std::cout << "-v <all|top|changed> - devices the statistics show: all of "
+               "them, the busiest ones or the ones that received messages "
+               "since the last statistics; all if not set"
+            << std::endl;
+  std::cout << "-n <devices> - show at most this many devices in the "
+               "statistics; all of them if not set, 10 with `-v top`"
+            << std::endl;
+  std::cout << "-M - print the statistics as `key=value` lines without "
+               "colors, for scripts and logs"
+            << std::endl;
+  std::cout << "-k <KiB> - estimate messages by device and measurement tag, "
+               "distinct tags by device and the busiest pairs in sketches of "
+               "this size per worker, exported on the metrics endpoint; none "
+               "if not set"
+            << std::endl;
+  std::cout << "-e <little|big|detect> - byte order of the devices' frames; "
+               "`detect` picks it for every connection by its first frame; "
+               "the order of this machine if not set"
+            << std::endl;
+  std::cout << "-U <path> - Unix domain socket to accept local connections "
+               "on as well, disabled if not set (asio backend only)"
+            << std::endl;
+  std::cout << "-S <device[:baud]> - serial line to read frames from as "
+               "well, 115200 baud if not given; may be repeated (asio "
+               "backend only)"
+            << std::endl;
 }
 
 /**
- * \brief parses app command line arguments
- * \return tuple of parsed params: { device file path, listening port,
- * statistics print interval }
+ * \brief parses a limit given on the command line
+ * \return the limit, 0 (unlimited) if it isn't a positive number
  */
-std::tuple<std::string, uint16_t, uint16_t> parseParams(int argc,
-                                                        char *argv[]) {
+uint64_t parseLimit(const char *value, const char *option) {
+  char *end = nullptr;
+  const uint64_t limit = value ? std::strtoull(value, &end, 10) : 0;
+  if (!limit || *end || value[0] == '-') {
+    std::cerr << "Incorrect limit in `" << option << "`" << std::endl;
+    return 0;
+  }
+  return limit;
+}
+
+/**
+ * Command line of the listener, with the defaults of the options not given.
+ */
+struct ListenerOptions {
+  std::string deviceFilePath = "./devices.conf";
+  uint16_t port = 5555;
+  // seconds between the statistics
+  uint16_t interval = 5;
+  // ingestion threads
+  uint16_t threads = 1;
+  DeviceListener::Backend backend = DeviceListener::Backend::Asio;
+  // 0 for no metrics endpoint
+  uint16_t metricsPort = 0;
+  // empty to keep the counters in memory only
+  std::string stateFilePath;
+  bool watchDevices = false;
+  // registry to compile the devices file into and exit, empty to listen
+  std::string compiledPath;
+  // 0 for no datagrams
+  uint16_t udpPort = 0;
+  DeviceListener::AdmissionLimits limits;
+  DeviceListener::ResyncMode resync = DeviceListener::ResyncMode::Off;
+  bool aggregate = false;
+  // empty for no journal
+  std::string journalPath;
+  // empty for no capture
+  std::string capturePrefix;
+  DeviceListener::StatsOptions statsOptions;
+  // bytes of the sketches of a worker, 0 for none
+  size_t sketchMemory = 0;
+  DeviceListener::ByteOrderMode byteOrder =
+      DeviceListener::ByteOrderMode::Native;
+  // empty for no Unix socket
+  std::string unixPath;
+  std::vector<DeviceListener::SerialOptions> serialLines;
+};
+
+/**
+ * \brief parses app command line arguments, an incorrect one is reported
+ * and left at its default
+ */
+ListenerOptions parseParams(int argc, char *argv[]) {
   static struct option longOpts[] = {{"file", required_argument, NULL, 'f'},
                                      {"port", required_argument, NULL, 'p'},
                                      {"interval", required_argument, NULL, 'i'},
+                                     {"threads", required_argument, NULL, 't'},
+                                     {"io-uring", no_argument, NULL, 'u'},
+                                     {"metrics-port", required_argument, NULL,
+                                      'm'},
+                                     {"state-file", required_argument, NULL,
+                                      's'},
+                                     {"watch", no_argument, NULL, 'w'},
+                                     {"compile", required_argument, NULL, 'c'},
+                                     {"udp-port", required_argument, NULL,
+                                      'd'},
+                                     {"max-connections", required_argument,
+                                      NULL, 'l'},
+                                     {"max-connections-per-source",
+                                      required_argument, NULL, 'L'},
+                                     {"max-bytes-per-second",
+                                      required_argument, NULL, 'b'},
+                                     {"max-frames-per-second",
+                                      required_argument, NULL, 'r'},
+                                     {"resync", required_argument, NULL, 'y'},
+                                     {"aggregate", no_argument, NULL, 'a'},
+                                     {"journal", required_argument, NULL,
+                                      'j'},
+                                     {"capture", required_argument, NULL,
+                                      'C'},
+                                     {"view", required_argument, NULL, 'v'},
+                                     {"limit", required_argument, NULL, 'n'},
+                                     {"machine", no_argument, NULL, 'M'},
+                                     {"sketches", required_argument, NULL,
+                                      'k'},
+                                     {"byte-order", required_argument, NULL,
+                                      'e'},
+                                     {"unix-socket", required_argument, NULL,
+                                      'U'},
+                                     {"serial", required_argument, NULL, 'S'},
                                      {NULL, no_argument, NULL, 0}};
 
-  static char const *optString = "?f:p:i:";
+  static char const *optString =
+      "?f:p:i:t:um:s:wc:d:l:L:b:r:y:aj:C:v:n:Mk:e:U:S:";
   int opt = 0;
   int longIndex = 0;
 
-  uint16_t port = 5555;
-  uint16_t interval = 5;
-  std::string deviceFilePath = "./devices.conf";
+  ListenerOptions options;
 
   opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
   while (opt != -1) {
@@ -54,7 +233,7 @@ std::tuple<std::string, uint16_t, uint16_t> parseParams(int argc,
         break;
       case 'f':
         if (optarg) {
-          deviceFilePath = optarg;
+          options.deviceFilePath = optarg;
         } else {
           std::cerr << "Incorrect device descrtiption file path in `-f`"
                     << std::endl;
@@ -63,7 +242,7 @@ std::tuple<std::string, uint16_t, uint16_t> parseParams(int argc,
       case 'p':
         int parsedPort;
         if (optarg && (parsedPort = atoi(optarg))) {
-          port = parsedPort;
+          options.port = parsedPort;
         } else {
           std::cerr << "Incorrect device descrtiption file path in `-f`"
                     << std::endl;
@@ -72,59 +251,346 @@ std::tuple<std::string, uint16_t, uint16_t> parseParams(int argc,
       case 'i':
         int parsedInterval;
         if (optarg && (parsedInterval = atoi(optarg))) {
-          interval = parsedInterval;
+          options.interval = parsedInterval;
         } else {
           std::cerr << "Incorrect statistics print interval in `-f`"
                     << std::endl;
         }
         break;
+      case 't':
+        int parsedThreads;
+        if (optarg && (parsedThreads = atoi(optarg)) > 0) {
+          options.threads = parsedThreads;
+        } else {
+          std::cerr << "Incorrect number of threads in `-t`" << std::endl;
+        }
+        break;
+      case 'u':
+        options.backend = DeviceListener::Backend::IoUring;
+        break;
+      case 'm':
+        int parsedMetricsPort;
+        if (optarg && (parsedMetricsPort = atoi(optarg)) > 0) {
+          options.metricsPort = parsedMetricsPort;
+        } else {
+          std::cerr << "Incorrect metrics port in `-m`" << std::endl;
+        }
+        break;
+      case 's':
+        if (optarg) options.stateFilePath = optarg;
+        break;
+      case 'w':
+        options.watchDevices = true;
+        break;
+      case 'c':
+        if (optarg) options.compiledPath = optarg;
+        break;
+      case 'd':
+        int parsedUdpPort;
+        if (optarg && (parsedUdpPort = atoi(optarg)) > 0) {
+          options.udpPort = parsedUdpPort;
+        } else {
+          std::cerr << "Incorrect UDP port in `-d`" << std::endl;
+        }
+        break;
+      case 'l':
+        options.limits.maxConnections = parseLimit(optarg, "-l");
+        break;
+      case 'L':
+        options.limits.maxConnectionsPerSource = parseLimit(optarg, "-L");
+        break;
+      case 'b':
+        options.limits.bytesPerSecond = parseLimit(optarg, "-b");
+        break;
+      case 'r':
+        options.limits.framesPerSecond = parseLimit(optarg, "-r");
+        break;
+      case 'y':
+        if (optarg && std::string(optarg) == "header") {
+          options.resync = DeviceListener::ResyncMode::Header;
+        } else if (optarg && std::string(optarg) == "confirmed") {
+          options.resync = DeviceListener::ResyncMode::Confirmed;
+        } else {
+          std::cerr << "Incorrect resync mode in `-y`" << std::endl;
+        }
+        break;
+      case 'a':
+        options.aggregate = true;
+        break;
+      case 'j':
+        if (optarg) options.journalPath = optarg;
+        break;
+      case 'C':
+        if (optarg) options.capturePrefix = optarg;
+        break;
+      case 'v':
+        if (optarg && std::string(optarg) == "all") {
+          options.statsOptions.view = DeviceListener::StatsView::All;
+        } else if (optarg && std::string(optarg) == "top") {
+          options.statsOptions.view = DeviceListener::StatsView::Top;
+        } else if (optarg && std::string(optarg) == "changed") {
+          options.statsOptions.view = DeviceListener::StatsView::Changed;
+        } else {
+          std::cerr << "Incorrect statistics view in `-v`" << std::endl;
+        }
+        break;
+      case 'n':
+        options.statsOptions.limit = parseLimit(optarg, "-n");
+        break;
+      case 'M':
+        options.statsOptions.machine = true;
+        break;
+      case 'k':
+        options.sketchMemory = parseLimit(optarg, "-k") * 1024;
+        break;
+      case 'e':
+        if (optarg && std::string(optarg) == "little") {
+          options.byteOrder = DeviceListener::ByteOrderMode::Little;
+        } else if (optarg && std::string(optarg) == "big") {
+          options.byteOrder = DeviceListener::ByteOrderMode::Big;
+        } else if (optarg && std::string(optarg) == "detect") {
+          options.byteOrder = DeviceListener::ByteOrderMode::Detect;
+        } else {
+          std::cerr << "Incorrect byte order in `-e`" << std::endl;
+        }
+        break;
+      case 'U':
+        if (optarg) options.unixPath = optarg;
+        break;
+      case 'S':
+        try {
+          options.serialLines.push_back(
+              DeviceListener::SerialOptions::parse(optarg ? optarg : ""));
+        } catch (std::invalid_argument &e) {
+          std::cerr << "Incorrect serial line in `-S`: " << e.what()
+                    << std::endl;
+        }
+        break;
       default:
         break;
     }
     opt = getopt_long(argc, argv, optString, longOpts, &longIndex);
   }
-  return {deviceFilePath, port, interval};
+  return options;
 }
 
 /**
- * \brief invokes MsgCounters' printStatistics() and schedules the next timer
- * tick for the same
+ * \brief has the statistics rendered and schedules the next timer tick for
+ * the same
  */
 void printStats(const boost::system::error_code &error,
-                boost::asio::deadline_timer &timer, uint16_t interval) {
+                boost::asio::deadline_timer &timer, uint16_t interval,
+                DeviceListener::StatsRenderer &renderer) {
   if (!error) {
-    DeviceListener::MsgCounter::get().printStatistics();
+    // the renderer's thread walks the counters, not the event loop
+    renderer.tick();
     timer.expires_from_now(boost::posix_time::seconds(interval));
     timer.async_wait(boost::bind(printStats, boost::asio::placeholders::error,
-                                 boost::ref(timer), interval));
+                                 boost::ref(timer), interval,
+                                 boost::ref(renderer)));
+  }
+}
+
+/**
+ * \brief reloads the devices file on SIGHUP and waits for the next one
+ */
+void reloadDevices(const boost::system::error_code &error,
+                   boost::asio::signal_set &signals,
+                   DeviceListener::MsgCounter &counter,
+                   const std::string &deviceFilePath) {
+  if (!error) {
+    counter.readDevicesFromFile(deviceFilePath);
+    signals.async_wait(boost::bind(reloadDevices,
+                                   boost::asio::placeholders::error,
+                                   boost::ref(signals), boost::ref(counter),
+                                   boost::cref(deviceFilePath)));
+  }
+}
+
+/**
+ * \brief compiles the devices file into a binary registry
+ * \return exit code of the app
+ */
+int compileDevices(const std::string &deviceFilePath,
+                   const std::string &compiledPath) {
+  auto registry = DeviceListener::DeviceRegistry::load(deviceFilePath);
+  if (!registry || !registry->save(compiledPath)) {
+    std::cerr << "Failed to compile " << deviceFilePath << " into "
+              << compiledPath << std::endl;
+    return 1;
+  }
+  std::cout << "Compiled " << registry->size() << " devices into "
+            << compiledPath << std::endl;
+  return 0;
+}
+
+/**
+ * \brief invokes MsgCounter's checkpoint() and schedules the next timer tick
+ * for the same
+ */
+void checkpointCounters(const boost::system::error_code &error,
+                        boost::asio::deadline_timer &timer,
+                        DeviceListener::MsgCounter &counter) {
+  if (!error) {
+    counter.checkpoint();
+    timer.expires_from_now(boost::posix_time::seconds(kCheckpointInterval));
+    timer.async_wait(boost::bind(checkpointCounters,
+                                 boost::asio::placeholders::error,
+                                 boost::ref(timer), boost::ref(counter)));
+  }
+}
+
+/**
+ * \brief feeds RateTracker every second and schedules the next timer tick
+ * for the same
+ */
+void sampleRates(const boost::system::error_code &error,
+                 boost::asio::deadline_timer &timer,
+                 DeviceListener::RateTracker &rates) {
+  if (!error) {
+    rates.sample(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now().time_since_epoch())
+                     .count());
+    timer.expires_at(timer.expires_at() + boost::posix_time::seconds(1));
+    timer.async_wait(boost::bind(sampleRates, boost::asio::placeholders::error,
+                                 boost::ref(timer), boost::ref(rates)));
   }
 }
 
 int main(int argc, char **argv) {
-  uint16_t port;
-  uint16_t interval;
-  std::string deviceFilePath;
-  std::tie(deviceFilePath, port, interval) = parseParams(argc, argv);
+  const ListenerOptions options = parseParams(argc, argv);
+
+  if (!options.compiledPath.empty())
+    return compileDevices(options.deviceFilePath, options.compiledPath);
+
+  // capture_replay ends a stream at an invalid header, a capture of
+  // resynced streams would not replay to what the listener counted
+  if (!options.capturePrefix.empty() &&
+      options.resync != DeviceListener::ResyncMode::Off) {
+    std::cerr << "`-C` can't be combined with `-y`, a capture is replayed "
+                 "without resync"
+              << std::endl;
+    return 1;
+  }
 
   pid_t currentPid = getpid();
   std::cout << "Started DeviceListener with pid " << currentPid << std::endl;
   std::cout << "Add command line key '-?' if you want to see usage information"
             << std::endl;
 
-  DeviceListener::MsgCounter::get().readDevicesFromFile(deviceFilePath);
+  try {
+    // one counter shard per worker, merged by the readers
+    DeviceListener::MsgCounter counter(options.threads, options.stateFilePath);
+    counter.readDevicesFromFile(options.deviceFilePath);
+    DeviceListener::Instrumentation instrumentation(options.threads);
+    DeviceListener::RateTracker rates(counter);
+    // only datagrams have their errors counted per sender
+    std::unique_ptr<DeviceListener::SourceErrors> sourceErrors(
+        options.udpPort ? new DeviceListener::SourceErrors(options.threads)
+                        : nullptr);
+    // all the statistics go out in the single write() of a render
+    DeviceListener::StatsSections sections;
+    sections.rates = &rates;
+    sections.sourceErrors = sourceErrors.get();
+    sections.instrumentation = &instrumentation;
+    DeviceListener::StatsRenderer renderer(counter, options.statsOptions,
+                                           STDOUT_FILENO, sections);
+    renderer.start();
+    DeviceListener::AdmissionControl admission(options.limits);
+    // the tables take about 800 KiB per worker, so only if asked for
+    std::unique_ptr<DeviceListener::MeasurementStats> measurements(
+        options.aggregate
+            ? new DeviceListener::MeasurementStats(options.threads)
+            : nullptr);
+    std::unique_ptr<DeviceListener::TagSketches> sketches(
+        options.sketchMemory
+            ? new DeviceListener::TagSketches(
+                  options.threads, DeviceListener::TagSketches::getOptionsFor(
+                                       options.sketchMemory))
+            : nullptr);
+    // declared before the workers, so it is written out after they stop
+    std::unique_ptr<DeviceListener::Journal> journal;
+    if (!options.journalPath.empty()) {
+      journal.reset(
+          new DeviceListener::Journal(options.journalPath, options.threads));
+      journal->start();
+    }
+    std::unique_ptr<DeviceListener::Capture> capture;
+    if (!options.capturePrefix.empty()) {
+      capture.reset(
+          new DeviceListener::Capture(options.capturePrefix, options.threads));
+      capture->start();
+    }
+
+    // ioService of the main thread only drives the timers and the metrics
+    // endpoint, all the connections and datagrams are served by the workers
+    DeviceListener::WorkerPoolOptions poolOptions;
+    poolOptions.threads = options.threads;
+    poolOptions.port = options.port;
+    poolOptions.backend = options.backend;
+    poolOptions.udpPort = options.udpPort;
+    poolOptions.unixPath = options.unixPath;
+    poolOptions.serialLines = options.serialLines;
+    poolOptions.resync = options.resync;
+    poolOptions.byteOrder = options.byteOrder;
+    poolOptions.instrumentation = &instrumentation;
+    poolOptions.measurements = measurements.get();
+    poolOptions.journal = journal.get();
+    poolOptions.capture = capture.get();
+    poolOptions.sketches = sketches.get();
+    poolOptions.sourceErrors = sourceErrors.get();
+    if (options.limits.limitsConnections() || options.limits.limitsRate())
+      poolOptions.admission = &admission;
+    DeviceListener::WorkerPool workers(counter, poolOptions);
+    DeviceListener::MetricsServer metrics(
+        options.metricsPort, ioService, counter,
+        sourceErrors.get(), measurements.get(),
+        journal.get(), sketches.get());
 
-  DeviceListener::RfcTransport transport(ioService);
-  DeviceListener::TcpServer server(port, ioService, transport);
+    boost::asio::deadline_timer timer(ioService);
+    timer.expires_from_now(boost::posix_time::seconds(options.interval));
+    timer.async_wait(boost::bind(printStats, boost::asio::placeholders::error,
+                                 boost::ref(timer), options.interval,
+                                 boost::ref(renderer)));
 
-  boost::asio::deadline_timer timer(ioService);
-  timer.expires_from_now(boost::posix_time::seconds(interval));
-  timer.async_wait(boost::bind(printStats, boost::asio::placeholders::error,
-                               boost::ref(timer), interval));
+    boost::asio::deadline_timer rateTimer(ioService);
+    rateTimer.expires_from_now(boost::posix_time::seconds(0));
+    rateTimer.async_wait(boost::bind(sampleRates,
+                                     boost::asio::placeholders::error,
+                                     boost::ref(rateTimer), boost::ref(rates)));
 
-  try {
-    server.listen();
+    boost::asio::deadline_timer checkpointTimer(ioService);
+    if (!options.stateFilePath.empty()) {
+      checkpointTimer.expires_from_now(
+          boost::posix_time::seconds(kCheckpointInterval));
+      checkpointTimer.async_wait(boost::bind(
+          checkpointCounters, boost::asio::placeholders::error,
+          boost::ref(checkpointTimer), boost::ref(counter)));
+    }
+
+    // stop gracefully, so the workers are joined and the state file is
+    // closed clean
+    boost::asio::signal_set signals(ioService, SIGINT, SIGTERM);
+    signals.async_wait(boost::bind(&boost::asio::io_service::stop,
+                                   boost::ref(ioService)));
+
+    // new registries are published while the workers keep counting
+    boost::asio::signal_set reloadSignals(ioService, SIGHUP);
+    reloadSignals.async_wait(boost::bind(
+        reloadDevices, boost::asio::placeholders::error,
+        boost::ref(reloadSignals), boost::ref(counter),
+        boost::cref(options.deviceFilePath)));
+    DeviceListener::FileWatcher devicesWatcher(
+        ioService, options.deviceFilePath, [&counter, &options]() {
+          counter.readDevicesFromFile(options.deviceFilePath);
+        });
+    if (options.watchDevices) devicesWatcher.start();
+
+    workers.listen();
+    if (options.metricsPort) metrics.listen();
+    workers.start();
     ioService.run();
-  } catch (boost::system::system_error &e) {
+  } catch (std::exception &e) {
     std::cerr << "\033[31mSomething went wrong: " << e.what() << "\033[0m"
               << std::endl;
     return 1;
@@ -0,0 +1,141 @@
+#include <getopt.h>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "Journal.h"
+
+using DeviceListener::JournalReader;
+
+/**
+ * \brief prints usage information to stdout
+ */
+void printUsage() {
+  std::cout << "Usage: journal_query -j <journal> [options]" << std::endl;
+  std::cout << "Counts the messages of a device listener journal by device."
+            << std::endl;
+  std::cout << "-j <filename> - path to the journal" << std::endl;
+  std::cout << "-D <device> - count the messages of this device only"
+            << std::endl;
+  std::cout << "-f <time> - only messages received at or after this Unix "
+               "time, in seconds"
+            << std::endl;
+  std::cout << "-t <time> - only messages received at or before this Unix "
+               "time, in seconds"
+            << std::endl;
+  std::cout << "-T - take `-f` and `-t` as timestamps the devices sent "
+               "instead of the arrival times"
+            << std::endl;
+  std::cout << "-p - print the messages instead of counting them"
+            << std::endl;
+}
+
+/**
+ * \brief parses a number given on the command line
+ * \return false if it isn't one
+ */
+bool parseNumber(const char *value, uint64_t &number) {
+  char *end = nullptr;
+  if (!value || value[0] == '-') return false;
+  number = std::strtoull(value, &end, 10);
+  return end != value && !*end;
+}
+
+int main(int argc, char **argv) {
+  static struct option longOpts[] = {{"journal", required_argument, NULL, 'j'},
+                                     {"device", required_argument, NULL, 'D'},
+                                     {"from", required_argument, NULL, 'f'},
+                                     {"to", required_argument, NULL, 't'},
+                                     {"timestamps", no_argument, NULL, 'T'},
+                                     {"print", no_argument, NULL, 'p'},
+                                     {NULL, no_argument, NULL, 0}};
+  static char const *optString = "?j:D:f:t:Tp";
+
+  std::string path;
+  JournalReader::Query query;
+  bool fromSet = false, toSet = false, print = false;
+  uint64_t from = 0, to = 0, device = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, optString, longOpts, NULL)) != -1) {
+    switch (opt) {
+      case 'j':
+        path = optarg;
+        break;
+      case 'D':
+        if (!parseNumber(optarg, device) || device > UINT16_MAX) {
+          std::cerr << "Incorrect device ID in `-D`" << std::endl;
+          return 1;
+        }
+        query.oneDevice = true;
+        query.deviceId = static_cast<uint16_t>(device);
+        break;
+      case 'f':
+        if (!(fromSet = parseNumber(optarg, from))) {
+          std::cerr << "Incorrect time in `-f`" << std::endl;
+          return 1;
+        }
+        break;
+      case 't':
+        if (!(toSet = parseNumber(optarg, to))) {
+          std::cerr << "Incorrect time in `-t`" << std::endl;
+          return 1;
+        }
+        break;
+      case 'T':
+        query.field = JournalReader::TimeField::Timestamp;
+        break;
+      case 'p':
+        print = true;
+        break;
+      default:
+        printUsage();
+        return 0;
+    }
+  }
+  if (path.empty()) {
+    printUsage();
+    return 1;
+  }
+
+  // arrival times are kept in microseconds
+  const bool arrival = query.field == JournalReader::TimeField::Arrival;
+  if (fromSet) query.from = arrival ? from * 1000000 : from;
+  if (toSet) query.to = arrival ? to * 1000000 + 999999 : to;
+
+  try {
+    JournalReader reader(path);
+    JournalReader::Stats stats;
+    uint64_t total = 0;
+    if (print) {
+      std::cout << "arrival_us device_id measurement_tag measurement_type "
+                   "timestamp frame_length"
+                << std::endl;
+      reader.forEach(
+          query,
+          [&total](const JournalReader::Row &row) {
+            std::cout << row.arrival << ' ' << row.deviceId << ' '
+                      << row.measurementTag << ' ' << row.measurementType
+                      << ' ' << row.timestamp << ' ' << row.frameLength
+                      << '\n';
+            total++;
+          },
+          &stats);
+    } else {
+      for (const auto &pair : reader.count(query, &stats)) {
+        std::cout << "device " << pair.first << ": " << pair.second
+                  << std::endl;
+        total += pair.second;
+      }
+    }
+    std::cout << "Total: " << total << " messages" << std::endl;
+    std::cerr << "Blocks: " << stats.blocks
+              << ", skipped on their headers: " << stats.skipped
+              << ", columns decoded: " << stats.columnsDecoded
+              << ", damaged: " << stats.damaged << std::endl;
+  } catch (std::exception &e) {
+    std::cerr << "Failed to read the journal: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
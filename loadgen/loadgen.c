@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROTOCOL_VERSION 0x0
+#define MAX_DATA_SIZE 4084
+#define POOL_SIZE 4096
+#define MAX_BATCH 1024
+
+struct Rfc1006Header {
+  uint8_t version;
+  uint8_t reserved;
+  uint16_t length;
+} __attribute__((packed));
+
+struct PayloadHeader {
+  uint16_t deviceId;
+  uint16_t measurementTag;
+  uint32_t timestamp;
+  uint16_t measurementType;
+  uint16_t dataLength;
+} __attribute__((packed));
+
+struct config {
+  in_addr_t serverIp;
+  uint16_t port;
+  unsigned connections;
+  unsigned threads;
+  double rate;
+  double duration;
+  uint64_t seed;
+  uint16_t firstDeviceId;
+  unsigned deviceCount;
+  unsigned maxDataSize;
+  unsigned batch;
+  double malformed;
+};
+
+/* frames are generated once per thread and then sent over and over */
+struct framePool {
+  uint8_t *data;
+  size_t offsets[POOL_SIZE];
+  uint16_t lengths[POOL_SIZE];
+  uint8_t malformed[POOL_SIZE];
+};
+
+struct connection {
+  int fd;
+  size_t poolPos;
+  /* frames of the current writev batch, the first one may be partially
+   * sent already */
+  struct iovec iov[MAX_BATCH];
+  unsigned iovFirst;
+  unsigned iovCount;
+};
+
+struct worker {
+  pthread_t thread;
+  const struct config *conf;
+  unsigned index;
+  unsigned connectionCount;
+  struct connection *connections;
+  struct framePool pool;
+  uint64_t msgsSent;
+  uint64_t bytesSent;
+  uint64_t malformedSent;
+  uint64_t reconnects;
+  uint64_t errors;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleSignal(int sig) {
+  (void)sig;
+  stopRequested = 1;
+}
+
+/* splitmix64: tiny, fast and fully determined by the seed */
+static uint64_t nextRandom(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static double nowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int buildPool(struct framePool *pool, const struct config *conf,
+                     unsigned workerIndex) {
+  uint64_t rng = conf->seed * 1000003 + workerIndex;
+  const size_t prefix =
+      sizeof(struct Rfc1006Header) + sizeof(struct PayloadHeader);
+
+  pool->data = malloc(POOL_SIZE * (prefix + conf->maxDataSize));
+  if (!pool->data) return -1;
+
+  size_t offset = 0;
+  for (unsigned i = 0; i < POOL_SIZE; i++) {
+    const uint16_t dataSize = nextRandom(&rng) % (conf->maxDataSize + 1);
+    struct Rfc1006Header rfcHeader;
+    struct PayloadHeader payloadHeader;
+
+    pool->malformed[i] =
+        (nextRandom(&rng) >> 11) * (1.0 / 9007199254740992.0) <
+        conf->malformed;
+    rfcHeader.version = pool->malformed[i] ? PROTOCOL_VERSION + 1 + i % 250
+                                           : PROTOCOL_VERSION;
+    rfcHeader.reserved = 0;
+    rfcHeader.length = sizeof(struct PayloadHeader) + dataSize;
+    memset(&payloadHeader, 0, sizeof(payloadHeader));
+    payloadHeader.deviceId =
+        conf->firstDeviceId + nextRandom(&rng) % conf->deviceCount;
+    payloadHeader.measurementTag = nextRandom(&rng);
+    payloadHeader.timestamp = time(NULL);
+    payloadHeader.dataLength = dataSize;
+
+    pool->offsets[i] = offset;
+    pool->lengths[i] = prefix + dataSize;
+    memcpy(pool->data + offset, &rfcHeader, sizeof(rfcHeader));
+    memcpy(pool->data + offset + sizeof(rfcHeader), &payloadHeader,
+           sizeof(payloadHeader));
+    memset(pool->data + offset + prefix, 0, dataSize);
+    offset += prefix + dataSize;
+  }
+  return 0;
+}
+
+static int openConnection(const struct config *conf) {
+  struct sockaddr_in servaddr;
+  int sockFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockFd == -1) return -1;
+
+  memset(&servaddr, 0, sizeof(servaddr));
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_addr.s_addr = conf->serverIp;
+  servaddr.sin_port = htons(conf->port);
+  if (connect(sockFd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
+    close(sockFd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(sockFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(sockFd, F_SETFL, fcntl(sockFd, F_GETFL) | O_NONBLOCK);
+  return sockFd;
+}
+
+static int addToEpoll(int epollFd, struct connection *con) {
+  struct epoll_event event;
+  event.events = EPOLLOUT;
+  event.data.ptr = con;
+  return epoll_ctl(epollFd, EPOLL_CTL_ADD, con->fd, &event);
+}
+
+/* the listener drops a connection after a malformed frame, so come back
+ * with a fresh one and a clean batch */
+static void reconnect(struct worker *w, int epollFd, struct connection *con) {
+  close(con->fd);
+  con->iovFirst = con->iovCount = 0;
+  con->fd = openConnection(w->conf);
+  if (con->fd < 0 || addToEpoll(epollFd, con) != 0) {
+    fprintf(stderr, "Failed to reconnect: %s\n", strerror(errno));
+    stopRequested = 1;
+    return;
+  }
+  w->reconnects++;
+}
+
+static void fillBatch(struct worker *w, struct connection *con,
+                      uint64_t budget) {
+  unsigned count = w->conf->batch;
+  if (budget < count) count = budget;
+  for (unsigned i = 0; i < count; i++) {
+    size_t idx = con->poolPos++ % POOL_SIZE;
+    con->iov[i].iov_base = w->pool.data + w->pool.offsets[idx];
+    con->iov[i].iov_len = w->pool.lengths[idx];
+  }
+  con->iovFirst = 0;
+  con->iovCount = count;
+}
+
+/* sends as much of the current batch as the socket takes, returns the
+ * number of frames completed */
+static unsigned sendBatch(struct worker *w, int epollFd,
+                          struct connection *con) {
+  unsigned completed = 0;
+  ssize_t res = writev(con->fd, con->iov + con->iovFirst,
+                       con->iovCount - con->iovFirst);
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+    w->errors++;
+    reconnect(w, epollFd, con);
+    return 0;
+  }
+
+  w->bytesSent += res;
+  while (res > 0) {
+    struct iovec *iov = &con->iov[con->iovFirst];
+    if ((size_t)res < iov->iov_len) {
+      iov->iov_base = (uint8_t *)iov->iov_base + res;
+      iov->iov_len -= res;
+      break;
+    }
+    res -= iov->iov_len;
+    con->iovFirst++;
+    completed++;
+  }
+  return completed;
+}
+
+static void *runWorker(void *arg) {
+  struct worker *w = arg;
+  const struct config *conf = w->conf;
+  const double rate = conf->rate / conf->threads;
+  struct epoll_event events[256];
+
+  int epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+    return NULL;
+  }
+  for (unsigned i = 0; i < w->connectionCount; i++)
+    addToEpoll(epollFd, &w->connections[i]);
+
+  const double start = nowSeconds();
+  while (!stopRequested) {
+    uint64_t budget = UINT64_MAX;
+    if (rate > 0) {
+      const double allowed = (nowSeconds() - start) * rate;
+      if (allowed < w->msgsSent + 1) {
+        struct timespec pause = {0, 100000};
+        nanosleep(&pause, NULL);
+        continue;
+      }
+      budget = (uint64_t)allowed - w->msgsSent;
+    }
+
+    int ready = epoll_wait(epollFd, events, 256, 100);
+    for (int i = 0; i < ready && budget > 0; i++) {
+      struct connection *con = events[i].data.ptr;
+      if (con->iovFirst == con->iovCount) fillBatch(w, con, budget);
+      const size_t first = con->poolPos - con->iovCount;
+      const unsigned doneBefore = con->iovFirst;
+      unsigned completed = sendBatch(w, epollFd, con);
+      for (unsigned j = 0; j < completed; j++)
+        w->malformedSent +=
+            w->pool.malformed[(first + doneBefore + j) % POOL_SIZE];
+      w->msgsSent += completed;
+      budget = completed < budget ? budget - completed : 0;
+    }
+  }
+  close(epollFd);
+  return NULL;
+}
+
+static void printUsage(void) {
+  fprintf(stderr,
+          "Usage: ./loadgen [options]\n"
+          "-a <ip> - server IP address (127.0.0.1)\n"
+          "-p <port> - server TCP port (5555)\n"
+          "-c <connections> - number of connections in total (1)\n"
+          "-t <threads> - number of sending threads (1)\n"
+          "-r <rate> - target rate in msgs/s over all connections, "
+          "0 for unlimited (0)\n"
+          "-d <seconds> - duration of the run, 0 for until Ctrl-C (10)\n"
+          "-s <seed> - seed of the frame size/device mix (1)\n"
+          "-i <device_id> - first device ID (1)\n"
+          "-n <count> - number of distinct device IDs (1)\n"
+          "-l <bytes> - max data size after the payload header (64)\n"
+          "-b <frames> - frames per writev call (64)\n"
+          "-m <fraction> - fraction of malformed frames, [0..1] (0)\n");
+}
+
+static int parseConfig(int argc, char **argv, struct config *conf) {
+  int opt;
+  conf->serverIp = inet_addr("127.0.0.1");
+  conf->port = 5555;
+  conf->connections = 1;
+  conf->threads = 1;
+  conf->rate = 0;
+  conf->duration = 10;
+  conf->seed = 1;
+  conf->firstDeviceId = 1;
+  conf->deviceCount = 1;
+  conf->maxDataSize = 64;
+  conf->batch = 64;
+  conf->malformed = 0;
+
+  while ((opt = getopt(argc, argv, "?a:p:c:t:r:d:s:i:n:l:b:m:")) != -1) {
+    switch (opt) {
+      case 'a':
+        conf->serverIp = inet_addr(optarg);
+        if (conf->serverIp == INADDR_NONE) {
+          fprintf(stderr, "Wrong server IP address: %s \n", optarg);
+          return 2;
+        }
+        break;
+      case 'p':
+        conf->port = atoi(optarg);
+        break;
+      case 'c':
+        conf->connections = atoi(optarg);
+        break;
+      case 't':
+        conf->threads = atoi(optarg);
+        break;
+      case 'r':
+        conf->rate = atof(optarg);
+        break;
+      case 'd':
+        conf->duration = atof(optarg);
+        break;
+      case 's':
+        conf->seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'i':
+        conf->firstDeviceId = atoi(optarg);
+        break;
+      case 'n':
+        conf->deviceCount = atoi(optarg);
+        break;
+      case 'l':
+        conf->maxDataSize = atoi(optarg);
+        break;
+      case 'b':
+        conf->batch = atoi(optarg);
+        break;
+      case 'm':
+        conf->malformed = atof(optarg);
+        break;
+      default:
+        printUsage();
+        return 2;
+    }
+  }
+
+  if (conf->port == 0) {
+    fprintf(stderr, "Wrong port number! \n");
+    return 2;
+  }
+  if (conf->threads == 0 || conf->connections < conf->threads) {
+    fprintf(stderr, "Need at least one connection per thread! \n");
+    return 2;
+  }
+  if (conf->deviceCount == 0 || conf->deviceCount > 65536) {
+    fprintf(stderr, "Wrong number of devices, must be [1..65536]! \n");
+    return 2;
+  }
+  if (conf->maxDataSize > MAX_DATA_SIZE) {
+    fprintf(stderr, "Wrong max data size, must be [0..%d]! \n",
+            MAX_DATA_SIZE);
+    return 2;
+  }
+  if (conf->batch == 0 || conf->batch > MAX_BATCH) {
+    fprintf(stderr, "Wrong batch size, must be [1..%d]! \n", MAX_BATCH);
+    return 2;
+  }
+  if (conf->malformed < 0 || conf->malformed > 1 || conf->rate < 0) {
+    fprintf(stderr, "Wrong malformed fraction or rate! \n");
+    return 2;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct config conf;
+  int confErr = parseConfig(argc, argv, &conf);
+  if (confErr) return confErr;
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, handleSignal);
+  signal(SIGTERM, handleSignal);
+
+  struct worker *workers = calloc(conf.threads, sizeof(struct worker));
+  if (!workers) return 1;
+
+  unsigned opened = 0;
+  for (unsigned t = 0; t < conf.threads; t++) {
+    struct worker *w = &workers[t];
+    w->conf = &conf;
+    w->index = t;
+    w->connectionCount = conf.connections / conf.threads +
+                         (t < conf.connections % conf.threads);
+    w->connections = calloc(w->connectionCount, sizeof(struct connection));
+    if (!w->connections || buildPool(&w->pool, &conf, t) != 0) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+    for (unsigned c = 0; c < w->connectionCount; c++) {
+      struct connection *con = &w->connections[c];
+      /* different connections walk the pool from different places */
+      con->poolPos = (opened * 7919) % POOL_SIZE;
+      con->fd = openConnection(&conf);
+      if (con->fd < 0) {
+        fprintf(stderr, "Failed to open connection #%u: %s\n", opened,
+                strerror(errno));
+        return 1;
+      }
+      opened++;
+    }
+  }
+  printf("Opened %u connections, sending from %u threads...\n", opened,
+         conf.threads);
+
+  const double start = nowSeconds();
+  for (unsigned t = 0; t < conf.threads; t++)
+    pthread_create(&workers[t].thread, NULL, runWorker, &workers[t]);
+
+  while (!stopRequested &&
+         (conf.duration <= 0 || nowSeconds() - start < conf.duration)) {
+    struct timespec pause = {0, 10000000};
+    nanosleep(&pause, NULL);
+  }
+  stopRequested = 1;
+
+  uint64_t msgs = 0, bytes = 0, malformed = 0, reconnects = 0, errors = 0;
+  for (unsigned t = 0; t < conf.threads; t++) {
+    pthread_join(workers[t].thread, NULL);
+    msgs += workers[t].msgsSent;
+    bytes += workers[t].bytesSent;
+    malformed += workers[t].malformedSent;
+    reconnects += workers[t].reconnects;
+    errors += workers[t].errors;
+  }
+  const double elapsed = nowSeconds() - start;
+
+  printf("Sent %llu messages (%llu malformed) and %llu bytes in %.2f s\n",
+         (unsigned long long)msgs, (unsigned long long)malformed,
+         (unsigned long long)bytes, elapsed);
+  printf("Achieved rate: %.0f msgs/s, %.0f bytes/s\n", msgs / elapsed,
+         bytes / elapsed);
+  printf("Write errors: %llu, reconnects: %llu\n", (unsigned long long)errors,
+         (unsigned long long)reconnects);
+
+  for (unsigned t = 0; t < conf.threads; t++) {
+    for (unsigned c = 0; c < workers[t].connectionCount; c++)
+      if (workers[t].connections[c].fd >= 0)
+        close(workers[t].connections[c].fd);
+    free(workers[t].connections);
+    free(workers[t].pool.data);
+  }
+  free(workers);
+  return 0;
+}
@@ -0,0 +1,213 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <vector>
+
+#include "AdmissionControl.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+#include "TestUtils.h"
+#include "TokenBucket.h"
+
+using DeviceListener::AdmissionControl;
+using DeviceListener::AdmissionLimits;
+using DeviceListener::ClosingGuard;
+using DeviceListener::MsgCounter;
+using DeviceListener::RfcTransport;
+using DeviceListener::TcpServer;
+using DeviceListener::Testing::getEndpoint;
+using DeviceListener::Testing::makeFrames;
+using DeviceListener::Testing::pollUntil;
+using DeviceListener::TokenBucket;
+using DeviceListener::WorkerContext;
+
+class TestAdmission : public ::testing::Test {
+ public:
+  TestAdmission() {}
+  ~TestAdmission() {}
+};
+
+TEST_F(TestAdmission, TokenBucketRefillsUpToBurstAndCarriesDebt) {
+  TokenBucket bucket;
+  bucket.reset(10, 0);
+  EXPECT_EQ(bucket.getAvailable(), 10u);
+
+  bucket.consume(25);
+  EXPECT_EQ(bucket.getAvailable(), 0u);
+  // 100 tokens a second: the debt of 15 is paid off after 150 ms
+  bucket.refill(100, 10, 100000000);
+  EXPECT_EQ(bucket.getAvailable(), 0u);
+  bucket.refill(100, 10, 160000000);
+  EXPECT_EQ(bucket.getAvailable(), 1u);
+  bucket.refill(100, 10, 10000000000);
+  EXPECT_EQ(bucket.getAvailable(), 10u);
+}
+
+TEST_F(TestAdmission, LimitsConnectionsInTotalAndPerSource) {
+  AdmissionLimits limits;
+  limits.maxConnections = 3;
+  limits.maxConnectionsPerSource = 2;
+  AdmissionControl admission(limits);
+  const auto first = boost::asio::ip::address_v4(0x0A000001);
+  const auto second = boost::asio::ip::address_v4(0x0A000002);
+
+  EXPECT_TRUE(admission.tryAdmit(first));
+  EXPECT_TRUE(admission.tryAdmit(first));
+  EXPECT_FALSE(admission.tryAdmit(first));
+  EXPECT_TRUE(admission.tryAdmit(second));
+  EXPECT_FALSE(admission.tryAdmit(second));
+  EXPECT_EQ(admission.getConnectionCount(), 3u);
+
+  admission.release(first);
+  EXPECT_TRUE(admission.tryAdmit(second));
+  EXPECT_FALSE(admission.tryAdmit(first));
+  EXPECT_EQ(admission.getConnectionCount(), 3u);
+}
+
+TEST_F(TestAdmission, LimitsLocalConnectionsInTotalOnly) {
+  AdmissionLimits limits;
+  limits.maxConnections = 3;
+  limits.maxConnectionsPerSource = 1;
+  AdmissionControl admission(limits);
+  const auto unspecified = boost::asio::ip::address();
+
+  // local connections have no source, the unspecified one is a source
+  EXPECT_TRUE(admission.tryAdmitLocal());
+  EXPECT_TRUE(admission.tryAdmitLocal());
+  EXPECT_TRUE(admission.tryAdmit(unspecified));
+  EXPECT_FALSE(admission.tryAdmitLocal());
+  EXPECT_EQ(admission.getConnectionCount(), 3u);
+
+  admission.releaseLocal();
+  EXPECT_FALSE(admission.tryAdmit(unspecified));
+  EXPECT_TRUE(admission.tryAdmitLocal());
+  EXPECT_EQ(admission.getConnectionCount(), 3u);
+}
+
+TEST_F(TestAdmission, ClosesConnectionsOverTheLimit) {
+  AdmissionLimits limits;
+  limits.maxConnectionsPerSource = 2;
+  AdmissionControl admission(limits);
+  MsgCounter counter;
+  const auto &stats = counter.getShard(0).transport;
+  boost::asio::io_service ioService;
+  std::vector<boost::asio::ip::tcp::socket> clients;
+  WorkerContext context(counter.getShard(0));
+  context.admission = &admission;
+  RfcTransport transport(ioService, context);
+  TcpServer server(0, ioService, transport);
+  ClosingGuard closing(ioService, server, transport);
+  server.listen();
+
+  for (int i = 0; i < 3; i++) {
+    clients.emplace_back(ioService);
+    clients.back().connect(getEndpoint(server.port()));
+  }
+  ASSERT_TRUE(pollUntil(ioService, [&]() {
+    return stats.connectionsOpened.load() + stats.connectionsRejected.load() ==
+           3;
+  }));
+  EXPECT_EQ(stats.connectionsOpened.load(), 2u);
+  EXPECT_EQ(stats.connectionsRejected.load(), 1u);
+  EXPECT_EQ(admission.getConnectionCount(), 2u);
+
+  // the rejected client finds the connection closed
+  uint8_t byte;
+  boost::system::error_code err;
+  clients.back().read_some(boost::asio::buffer(&byte, 1), err);
+  EXPECT_EQ(err, boost::asio::error::eof);
+
+  // a closed connection gives its place back
+  clients.front().close();
+  ASSERT_TRUE(pollUntil(ioService,
+                        [&]() { return stats.connectionsClosed.load() == 1; }));
+  EXPECT_EQ(admission.getConnectionCount(), 1u);
+  clients.emplace_back(ioService);
+  clients.back().connect(getEndpoint(server.port()));
+  EXPECT_TRUE(pollUntil(ioService,
+                        [&]() { return stats.connectionsOpened.load() == 3; }));
+  EXPECT_EQ(stats.connectionsRejected.load(), 1u);
+}
+
+TEST_F(TestAdmission, ReleasesAnIpv6SourceAsAdmitted) {
+  AdmissionLimits limits;
+  limits.maxConnectionsPerSource = 1;
+  AdmissionControl admission(limits);
+  MsgCounter counter;
+  const auto &stats = counter.getShard(0).transport;
+  boost::asio::io_service ioService;
+  WorkerContext context(counter.getShard(0));
+  context.admission = &admission;
+  RfcTransport transport(ioService, context);
+  ClosingGuard closing(ioService, transport);
+  // TcpServer listens on IPv4 only, so accept as it does by hand
+  boost::asio::ip::tcp::acceptor acceptor(ioService);
+  const boost::asio::ip::tcp::endpoint loopback(
+      boost::asio::ip::address_v6::loopback(), 0);
+  boost::system::error_code err;
+  acceptor.open(loopback.protocol(), err);
+  if (!err) acceptor.bind(loopback, err);
+  if (err) GTEST_SKIP() << "no IPv6 loopback";
+  acceptor.listen();
+
+  boost::asio::ip::tcp::socket client(ioService);
+  client.connect(acceptor.local_endpoint());
+  auto conHandle = transport.allocateConnection();
+  acceptor.accept(conHandle->socket);
+  acceptor.close();
+  ASSERT_TRUE(transport.admitConnection(
+      conHandle, conHandle->socket.remote_endpoint().address()));
+  transport.startConnection(conHandle);
+  EXPECT_EQ(admission.getConnectionCount(), 1u);
+
+  // ::1 gets its place back, not 0.0.0.0
+  client.close();
+  ASSERT_TRUE(pollUntil(ioService,
+                        [&]() { return stats.connectionsClosed.load() == 1; }));
+  EXPECT_EQ(admission.getConnectionCount(), 0u);
+  EXPECT_TRUE(admission.tryAdmit(boost::asio::ip::address_v6::loopback()));
+}
+
+TEST_F(TestAdmission, PausesConnectionsOverTheirRateWithoutDroppingFrames) {
+  AdmissionLimits limits;
+  limits.framesPerSecond = 1000;
+  AdmissionControl admission(limits);
+  MsgCounter counter;
+  const auto &stats = counter.getShard(0).transport;
+  boost::asio::io_service ioService;
+  boost::asio::ip::tcp::socket flooding(ioService), quiet(ioService);
+  WorkerContext context(counter.getShard(0));
+  context.admission = &admission;
+  RfcTransport transport(ioService, context);
+  TcpServer server(0, ioService, transport);
+  ClosingGuard closing(ioService, server, transport);
+  server.listen();
+  flooding.connect(getEndpoint(server.port()));
+  quiet.connect(getEndpoint(server.port()));
+  ASSERT_TRUE(pollUntil(ioService,
+                        [&]() { return stats.connectionsOpened.load() == 2; }));
+
+  // a budget holds 100 ms worth of frames, the rest waits in the socket
+  const size_t flood = 500;
+  boost::asio::write(flooding, boost::asio::buffer(makeFrames(1, flood)));
+  const auto started = std::chrono::steady_clock::now();
+  ASSERT_TRUE(pollUntil(ioService,
+                        [&]() { return stats.connectionsThrottled.load(); }));
+  EXPECT_LT(counter.getStatForDevice(1).first, flood);
+  EXPECT_GE(stats.throttlePauses.load(), 1u);
+
+  // the other connection has a budget of its own
+  boost::asio::write(quiet, boost::asio::buffer(makeFrames(2, 10)));
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return counter.getStatForDevice(2).first == 10; }));
+
+  // nothing is lost, it only takes the time the rate allows
+  ASSERT_TRUE(pollUntil(
+      ioService, [&]() { return counter.getStatForDevice(1).first == flood; },
+      5000));
+  const auto elapsed = std::chrono::steady_clock::now() - started;
+  EXPECT_GE(elapsed, std::chrono::milliseconds(300));
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return !stats.connectionsThrottled.load(); }));
+}
@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+#include "TestUtils.h"
+
+using DeviceListener::ClosingGuard;
+using DeviceListener::MsgCounter;
+using DeviceListener::RfcMessage;
+using DeviceListener::RfcTransport;
+using DeviceListener::TcpServer;
+using DeviceListener::Testing::connectTo;
+using DeviceListener::Testing::makeFrame;
+using DeviceListener::Testing::waitFor;
+
+namespace {
+
+// operator new of the whole test binary is replaced, it only counts on the
+// threads a test marks, and only while it asks for it
+std::atomic<bool> countAllocations(false);
+std::atomic<size_t> allocations(0);
+thread_local bool countedThread = false;
+
+void *allocate(size_t size) {
+  if (countedThread && countAllocations.load(std::memory_order_relaxed))
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size ? size : 1);
+}
+
+}  // namespace
+
+void *operator new(size_t size) {
+  void *pointer = allocate(size);
+  if (!pointer) throw std::bad_alloc();
+  return pointer;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+void operator delete[](void *pointer) noexcept { std::free(pointer); }
+void operator delete(void *pointer, size_t) noexcept { std::free(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { std::free(pointer); }
+
+class TestAllocations : public ::testing::Test {
+ public:
+  static const size_t kConnections = 4;
+  static const size_t kSmallFrames = 100;
+
+  TestAllocations() {}
+  ~TestAllocations() {}
+};
+
+const size_t TestAllocations::kConnections;
+const size_t TestAllocations::kSmallFrames;
+
+TEST_F(TestAllocations, SteadyStateIngestionDoesNotAllocate) {
+  MsgCounter counter;
+  const auto &stats = counter.getShard(0).transport;
+  boost::asio::io_service ioService;
+  RfcTransport transport(ioService, counter.getShard(0));
+  TcpServer server(0, ioService, transport);
+  ClosingGuard closing(ioService, server, transport);
+  server.listen();
+  // only the ingestion thread, the log is written by a thread of its own
+  std::thread thread([&ioService]() {
+    countedThread = true;
+    ioService.run();
+  });
+
+  // small frames split in the middle of one, so the partial frame is kept
+  // inline, then a frame of the maximal length in two halves, so it is kept
+  // in a borrowed block
+  std::vector<uint8_t> small;
+  for (size_t i = 0; i < kSmallFrames; i++) {
+    auto frame = makeFrame(1, 8);
+    small.insert(small.end(), frame.begin(), frame.end());
+  }
+  auto large = makeFrame(2, RfcMessage::kMaxPayloadLength -
+                                sizeof(RfcMessage::PayloadHeader));
+  const size_t half = small.size() / 2 + 3;
+  std::vector<int> fds(kConnections);
+
+  // accept, read and count, then close, several times over
+  auto runCycle = [&]() {
+    const uint64_t countBefore = counter.getTotalCount();
+    const uint64_t opened = stats.connectionsOpened.load();
+    for (int &fd : fds) fd = connectTo(server.port());
+    if (!waitFor([&]() {
+          return stats.connectionsOpened.load() == opened + kConnections;
+        }))
+      return false;
+    for (int fd : fds) send(fd, small.data(), half, 0);
+    for (int fd : fds) send(fd, small.data() + half, small.size() - half, 0);
+    for (int fd : fds) send(fd, large.data(), large.size() / 2, 0);
+    for (int fd : fds)
+      send(fd, large.data() + large.size() / 2,
+           large.size() - large.size() / 2, 0);
+    if (!waitFor([&]() {
+          return counter.getTotalCount() ==
+                 countBefore + kConnections * (kSmallFrames + 1);
+        }))
+      return false;
+    for (int fd : fds) close(fd);
+    return waitFor([&]() {
+      return stats.connectionsClosed.load() == stats.connectionsOpened.load();
+    });
+  };
+
+  // pools, the reactor and the streams grow to what they need
+  ASSERT_TRUE(runCycle());
+  ASSERT_TRUE(runCycle());
+
+  allocations = 0;
+  countAllocations = true;
+  const bool counted = runCycle();
+  countAllocations = false;
+
+  ioService.stop();
+  thread.join();
+  ASSERT_TRUE(counted);
+  EXPECT_EQ(allocations.load(), 0u);
+}
@@ -0,0 +1,235 @@
+#include <glob.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/system/system_error.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "Capture.h"
+#include "MsgCounter.h"
+#include "Replay.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+#include "TestUtils.h"
+
+using DeviceListener::Capture;
+using DeviceListener::CaptureShard;
+using DeviceListener::ClosingGuard;
+using DeviceListener::MsgCounter;
+using DeviceListener::Replay;
+using DeviceListener::RfcMessage;
+using DeviceListener::RfcTransport;
+using DeviceListener::TcpServer;
+using DeviceListener::Testing::getEndpoint;
+using DeviceListener::Testing::pollFor;
+using DeviceListener::Testing::pollUntil;
+using DeviceListener::WorkerContext;
+
+class TestCapture : public ::testing::Test {
+ public:
+  TestCapture() {
+    char path[] = "/tmp/captureXXXXXX";
+    directory_ = mkdtemp(path);
+    prefix_ = directory_ + "/capture";
+  }
+  ~TestCapture() {
+    for (const auto &path : getSegments()) std::remove(path.c_str());
+    rmdir(directory_.c_str());
+  }
+
+  static void appendFrame(std::vector<uint8_t> &stream, uint16_t devId,
+                          size_t dataLength) {
+    RfcMessage::Rfc1006Header header = {
+        RfcMessage::kProtocolVersion, 0,
+        static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) + dataLength)};
+    RfcMessage::PayloadHeader payload = {};
+    payload.deviceId = devId;
+    size_t offset = stream.size();
+    stream.resize(offset + sizeof(header) + header.length);
+    std::memcpy(&stream[offset], &header, sizeof(header));
+    std::memcpy(&stream[offset + sizeof(header)], &payload, sizeof(payload));
+  }
+
+  static std::vector<uint8_t> makeStream(uint16_t devId, size_t frames) {
+    std::vector<uint8_t> stream;
+    for (size_t i = 0; i < frames; i++) appendFrame(stream, devId, i % 32);
+    return stream;
+  }
+
+  std::vector<std::string> getSegments() const {
+    std::vector<std::string> paths;
+    glob_t found;
+    if (!glob((prefix_ + ".*").c_str(), 0, nullptr, &found))
+      for (size_t i = 0; i < found.gl_pathc; i++)
+        paths.push_back(found.gl_pathv[i]);
+    globfree(&found);
+    return paths;
+  }
+
+ protected:
+  std::string directory_;
+  std::string prefix_;
+};
+
+TEST_F(TestCapture, ReplayCountsWhatTheTransportCounted) {
+  MsgCounter live;
+  auto first = makeStream(1, 300);
+  auto second = makeStream(2, 200);
+  {
+    Capture capture(prefix_, 1);
+    capture.start();
+    boost::asio::io_service ioService;
+    WorkerContext context(live.getShard(0));
+    context.capture = &capture.getShard(0);
+    RfcTransport transport(ioService, context);
+    TcpServer server(0, ioService, transport);
+    ClosingGuard closing(ioService, server, transport);
+    server.listen();
+    boost::asio::ip::tcp::socket a(ioService), b(ioService);
+    a.connect(getEndpoint(server.port()));
+    b.connect(getEndpoint(server.port()));
+
+    // chunks cutting the frames anywhere, the two streams interleaved
+    const auto garbage = std::vector<uint8_t>(8, 0xFF);
+    second.insert(second.end(), garbage.begin(), garbage.end());
+    auto send = [](boost::asio::ip::tcp::socket &socket,
+                   const std::vector<uint8_t> &stream, size_t pos) {
+      if (pos >= stream.size()) return;
+      boost::asio::write(socket,
+                         boost::asio::buffer(&stream[pos],
+                                             std::min<size_t>(
+                                                 777, stream.size() - pos)));
+    };
+    for (size_t pos = 0; pos < first.size() || pos < second.size();
+         pos += 777) {
+      send(a, first, pos);
+      send(b, second, pos);
+      pollFor(ioService, 5);
+    }
+    pollUntil(ioService, [&]() {
+      return live.getStatForDevice(1).first >= 300 &&
+             live.getStatForDevice(2).first >= 200;
+    });
+    ASSERT_EQ(live.getTotalCount(), 500u);
+    capture.stop();
+    EXPECT_EQ(capture.getDroppedCount(), 0u);
+    EXPECT_GT(capture.getBytesWritten(), first.size() + second.size());
+  }
+
+  Replay replay(prefix_);
+  // twice, the replay is repeatable
+  for (int round = 0; round < 2; round++) {
+    MsgCounter replayed;
+    auto stats = replay.run(replayed.getShard(0));
+    EXPECT_EQ(stats.connections, 2u);
+    EXPECT_EQ(stats.frames, 500u);
+    EXPECT_EQ(stats.bytes, first.size() + second.size());
+    EXPECT_EQ(stats.invalidHeaders, 1u);
+    EXPECT_EQ(stats.gaps, 0u);
+    EXPECT_EQ(replayed.getStatForDevice(1).first, 300u);
+    EXPECT_EQ(replayed.getStatForDevice(2).first, 200u);
+    EXPECT_EQ(replayed.getBytesForDevice(1), live.getBytesForDevice(1));
+    EXPECT_EQ(replayed.getBytesForDevice(2), live.getBytesForDevice(2));
+  }
+}
+
+TEST_F(TestCapture, StartsNewSegmentsAtRecordBoundaries) {
+  const auto stream = makeStream(4, 1000);
+  {
+    Capture capture(prefix_, 2, 4096);
+    for (int worker = 0; worker < 2; worker++) {
+      CaptureShard &shard = capture.getShard(worker);
+      const uint32_t connection = shard.addOpen("127.0.0.1");
+      for (size_t pos = 0; pos < stream.size(); pos += 1000)
+        shard.addData(connection, pos, &stream[pos],
+                      std::min<size_t>(1000, stream.size() - pos));
+      shard.addClose(connection, stream.size());
+    }
+  }
+
+  const auto segments = getSegments();
+  EXPECT_GT(segments.size(), 2 * stream.size() / 4096);
+  for (const auto &path : segments) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    EXPECT_LE(static_cast<size_t>(file.tellg()), 4096u);
+  }
+
+  Replay replay(prefix_);
+  EXPECT_EQ(replay.getSegmentCount(), segments.size());
+  MsgCounter counter;
+  auto stats = replay.run(counter.getShard(0));
+  EXPECT_EQ(stats.connections, 2u);
+  EXPECT_EQ(stats.gaps, 0u);
+  EXPECT_EQ(counter.getStatForDevice(4).first, 2000u);
+}
+
+TEST_F(TestCapture, ReplaysAConnectionUpToARecordLost) {
+  // a few chunks fill the ring, the thread isn't started
+  const auto chunk = makeStream(5, 20000);
+  const size_t fitting = CaptureShard::kRingSize / (chunk.size() + 64);
+  const auto tail = makeStream(5, 1);
+  {
+    Capture capture(prefix_, 1);
+    CaptureShard &shard = capture.getShard(0);
+    const uint32_t lossy = shard.addOpen("10.0.0.1");
+    uint64_t offset = 0;
+    for (size_t i = 0; i <= fitting; i++, offset += chunk.size())
+      shard.addData(lossy, offset, chunk.data(), chunk.size());
+    EXPECT_EQ(shard.getDroppedCount(), 1u);
+    capture.stop();
+
+    // the ring has room again, and the next record shows the gap
+    shard.addData(lossy, offset, tail.data(), tail.size());
+    const uint32_t whole = shard.addOpen("10.0.0.2");
+    shard.addData(whole, 0, tail.data(), tail.size());
+  }
+
+  Replay replay(prefix_);
+  MsgCounter counter;
+  auto stats = replay.run(counter.getShard(0));
+  EXPECT_EQ(stats.gaps, 1u);
+  EXPECT_EQ(counter.getStatForDevice(5).first, fitting * 20000 + 1);
+}
+
+TEST_F(TestCapture, PacesTheReplayLikeTheCapture) {
+  const auto stream = makeStream(6, 10);
+  {
+    Capture capture(prefix_, 1);
+    CaptureShard &shard = capture.getShard(0);
+    const uint32_t connection = shard.addOpen("127.0.0.1");
+    shard.addData(connection, 0, stream.data(), stream.size());
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    shard.addData(connection, stream.size(), stream.data(), stream.size());
+  }
+
+  Replay replay(prefix_);
+  MsgCounter counter;
+  const auto start = std::chrono::steady_clock::now();
+  auto stats = replay.run(counter.getShard(0), 1);
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_GE(stats.span, 50000000u);
+  EXPECT_GE(elapsed, std::chrono::milliseconds(50));
+  EXPECT_EQ(stats.frames, 20u);
+
+  // twice as fast
+  const auto faster = std::chrono::steady_clock::now();
+  replay.run(counter.getShard(0), 2);
+  EXPECT_GE(std::chrono::steady_clock::now() - faster,
+            std::chrono::milliseconds(25));
+  EXPECT_EQ(counter.getStatForDevice(6).first, 40u);
+}
+
+TEST_F(TestCapture, NeverOverwritesACapture) {
+  { Capture capture(prefix_, 1); }
+  EXPECT_THROW(Capture(prefix_, 1), boost::system::system_error);
+  EXPECT_THROW(Replay(prefix_ + "x"), std::invalid_argument);
+
+  std::ofstream(prefix_ + ".1.000000") << "1,device\n";
+  EXPECT_THROW(Replay replay(prefix_), std::invalid_argument);
+}
@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "Logger.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+
+using DeviceListener::ClosingGuard;
+using DeviceListener::Logger;
+using DeviceListener::MsgCounter;
+using DeviceListener::RfcTransport;
+using DeviceListener::TcpServer;
+
+/**
+ * Resident memory the listener needs per idle device connection. The
+ * devices are connected from a child process, so the descriptors and memory
+ * of the client side don't count.
+ */
+class TestConnectionMemory : public ::testing::TestWithParam<size_t> {
+ public:
+  // descriptors of everything but the connections
+  static const size_t kSpareDescriptors = 64;
+  // ephemeral ports are per source address, so the clients spread over
+  // 127.0.0.2, 127.0.0.3, ...
+  static const size_t kConnectionsPerSource = 20000;
+  // what an idle connection may take at most, it was 64 KiB of receive
+  // buffer alone
+  static const size_t kMaxBytesPerConnection = 1024;
+
+  TestConnectionMemory() {}
+  ~TestConnectionMemory() {}
+
+  static size_t getResidentBytes() {
+    size_t totalPages = 0, residentPages = 0;
+    std::ifstream("/proc/self/statm") >> totalPages >> residentPages;
+    return residentPages * sysconf(_SC_PAGESIZE);
+  }
+
+  /**
+   * \brief body of the child process: opens the connections, reports over
+   * ready and keeps them until release is closed
+   */
+  static void runClients(uint16_t port, size_t connections, int ready,
+                         int release) {
+    sockaddr_in server = {};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (size_t i = 0; i < connections; i++) {
+      sockaddr_in source = {};
+      source.sin_family = AF_INET;
+      source.sin_addr.s_addr =
+          htonl(INADDR_LOOPBACK + 1 + i / kConnectionsPerSource);
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (fd < 0 ||
+          bind(fd, reinterpret_cast<sockaddr *>(&source), sizeof(source)) ||
+          connect(fd, reinterpret_cast<sockaddr *>(&server), sizeof(server)))
+        _exit(1);
+    }
+    char byte = 0;
+    if (write(ready, &byte, 1) != 1) _exit(1);
+    // returns 0 once the parent closes its end
+    if (read(release, &byte, 1) < 0) _exit(1);
+    _exit(0);
+  }
+};
+
+const size_t TestConnectionMemory::kSpareDescriptors;
+const size_t TestConnectionMemory::kConnectionsPerSource;
+const size_t TestConnectionMemory::kMaxBytesPerConnection;
+
+TEST_P(TestConnectionMemory, ResidentBytesPerIdleConnection) {
+  const size_t connections = GetParam();
+  rlimit limit;
+  ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < connections + kSpareDescriptors)
+    GTEST_SKIP() << connections << " connections need a descriptor limit of "
+                 << connections + kSpareDescriptors << ", the hard limit is "
+                 << limit.rlim_cur;
+
+  // every connection and disconnection is logged, keep the output readable
+  // and the log's formatting out of the measurement
+  Logger::instance().setEnabled(false);
+
+  MsgCounter counter;
+  const auto &stats = counter.getShard(0).transport;
+  size_t residentBefore, residentAfter;
+  int ready[2], release[2];
+  ASSERT_EQ(pipe(ready), 0);
+  ASSERT_EQ(pipe(release), 0);
+  pid_t child;
+  {
+    boost::asio::io_service ioService;
+    RfcTransport transport(ioService, counter.getShard(0));
+    TcpServer server(0, ioService, transport);
+    ClosingGuard closing(ioService, server, transport);
+    server.listen();
+    std::thread thread([&ioService]() { ioService.run(); });
+
+    malloc_trim(0);
+    residentBefore = getResidentBytes();
+    child = fork();
+    if (!child) {
+      close(ready[0]);
+      close(release[1]);
+      runClients(server.port(), connections, ready[1], release[0]);
+    }
+    close(ready[1]);
+    close(release[0]);
+
+    char byte;
+    EXPECT_EQ(read(ready[0], &byte, 1), 1);
+    for (int i = 0; i < 1000 && stats.connectionsOpened.load() < connections;
+         i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    residentAfter = getResidentBytes();
+
+    ioService.stop();
+    thread.join();
+  }
+  close(release[1]);
+  close(ready[0]);
+  int status;
+  waitpid(child, &status, 0);
+  Logger::instance().setEnabled(true);
+
+  ASSERT_EQ(stats.connectionsOpened.load(), connections);
+  const size_t perConnection = (residentAfter - residentBefore) / connections;
+  std::cout << connections << " idle connections take " << perConnection
+            << " resident bytes each" << std::endl;
+  RecordProperty("resident_bytes_per_connection", perConnection);
+  EXPECT_LT(perConnection, kMaxBytesPerConnection);
+}
+
+INSTANTIATE_TEST_SUITE_P(IdleConnections, TestConnectionMemory,
+                         ::testing::Values(10000, 50000, 100000));
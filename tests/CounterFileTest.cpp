@@ -0,0 +1,150 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#include "CounterFile.h"
+#include "MsgCounter.h"
+
+using DeviceListener::CounterFile;
+using DeviceListener::CounterShard;
+using DeviceListener::MsgCounter;
+
+class TestCounterFile : public ::testing::Test {
+ public:
+  static const size_t kHeaderSize = 4096;
+
+  TestCounterFile() {
+    char path[] = "/tmp/countersXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    path_ = path;
+    // a brand new state file is an empty one
+    truncate(path, 0);
+  }
+  ~TestCounterFile() { unlink(path_.c_str()); }
+
+  /**
+   * \brief counts in a child process which then dies without closing the
+   * file, checkpoint is taken after `beforeCheckpoint` messages
+   */
+  void countAndCrash(uint16_t devId, int beforeCheckpoint, int total) {
+    pid_t pid = fork();
+    if (!pid) {
+      CounterFile file(path_, 1);
+      for (int i = 0; i < total; i++) {
+        if (i == beforeCheckpoint) file.checkpoint();
+        file.getShards()[0].incrementCounter(devId, 16);
+      }
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+  }
+
+  void overwrite(size_t offset, uint64_t value) {
+    int fd = open(path_.c_str(), O_WRONLY);
+    ASSERT_EQ(pwrite(fd, &value, sizeof(value), offset),
+              static_cast<ssize_t>(sizeof(value)));
+    close(fd);
+  }
+
+  // offset of a counter of the first shard of the live region
+  static size_t liveCounterOffset(uint16_t devId) {
+    return kHeaderSize + offsetof(CounterShard, counters) +
+           devId * sizeof(uint64_t);
+  }
+
+ protected:
+  std::string path_;
+};
+
+TEST_F(TestCounterFile, PersistsAcrossRestarts) {
+  {
+    MsgCounter counter(2, path_);
+    counter.getShard(0).incrementCounter(5, 16);
+    counter.getShard(1).incrementCounter(5, 20);
+    counter.getShard(1).transport.connectionsOpened = 3;
+  }
+  MsgCounter counter(2, path_);
+  ASSERT_EQ(counter.getStatForDevice(5),
+            std::make_pair(static_cast<uint64_t>(2), false));
+  ASSERT_EQ(counter.getBytesForDevice(5), 36u);
+  // transport statistics describe a single run
+  ASSERT_EQ(counter.getShard(1).transport.connectionsOpened, 0u);
+}
+
+TEST_F(TestCounterFile, KeepsLiveCountersAfterCrash) {
+  countAndCrash(7, 10, 25);
+
+  CounterFile file(path_, 1);
+  ASSERT_EQ(file.getShards()[0].counters[7], 25u);
+  ASSERT_EQ(file.getGeneration(), 1u);
+}
+
+TEST_F(TestCounterFile, RestoresCheckpointIfLiveIsBehind) {
+  countAndCrash(7, 10, 25);
+  // a page of the live region didn't make it to the disk
+  overwrite(liveCounterOffset(7), 3);
+
+  CounterFile file(path_, 1);
+  ASSERT_EQ(file.getShards()[0].counters[7], 10u);
+}
+
+TEST_F(TestCounterFile, TornCheckpointFallsBackToOlderOne) {
+  {
+    CounterFile file(path_, 1);
+    file.getShards()[0].incrementCounter(7);
+  }
+  // the clean close above took checkpoint 1, this one takes checkpoint 2 and
+  // crashes
+  countAndCrash(7, 4, 5);
+  const size_t regionSize = sizeof(CounterShard);
+  // damage checkpoint 2 (slot 0) and the live region
+  overwrite(kHeaderSize + regionSize + offsetof(CounterShard, counters), 42);
+  overwrite(liveCounterOffset(7), 0);
+
+  CounterFile file(path_, 1);
+  ASSERT_EQ(file.getShards()[0].counters[7], 1u);
+}
+
+TEST_F(TestCounterFile, CorruptedHeaderGivesZeroedCounters) {
+  {
+    CounterFile file(path_, 1);
+    file.getShards()[0].incrementCounter(7);
+  }
+  overwrite(offsetof(CounterShard, counters), 0xDEADBEEF);
+
+  CounterFile file(path_, 1);
+  ASSERT_EQ(file.getShards()[0].counters[7], 0u);
+  ASSERT_EQ(file.getGeneration(), 0u);
+}
+
+TEST_F(TestCounterFile, CorruptedCleanFileGivesCheckpoint) {
+  {
+    CounterFile file(path_, 1);
+    file.getShards()[0].incrementCounter(7);
+    file.checkpoint();
+    file.getShards()[0].incrementCounter(7);
+  }
+  overwrite(liveCounterOffset(8), 100);
+
+  CounterFile file(path_, 1);
+  ASSERT_EQ(file.getShards()[0].counters[7], 2u);
+  ASSERT_EQ(file.getShards()[0].counters[8], 0u);
+}
+
+TEST_F(TestCounterFile, ShardCountMismatchLeavesFileAlone) {
+  {
+    CounterFile file(path_, 2);
+    file.getShards()[1].incrementCounter(7);
+  }
+  ASSERT_THROW(CounterFile(path_, 3), std::invalid_argument);
+
+  CounterFile file(path_, 2);
+  ASSERT_EQ(file.getShards()[1].counters[7], 1u);
+}
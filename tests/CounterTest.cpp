@@ -9,12 +9,13 @@ class TestMsgCounter : public ::testing::Test {
 
 class MsgCounterTestFixture : public DeviceListener::MsgCounter {
  public:
-  std::pair<uint64_t, bool> getStatForDevice(uint16_t id) {
-    return stats_[id];
-  };
+  explicit MsgCounterTestFixture(size_t shardCount = 1)
+      : DeviceListener::MsgCounter(shardCount) {}
 
-  void forceSetCounterForDevice(uint16_t id, uint64_t value, bool overflow) {
-    stats_[id] = std::make_pair(value, overflow);
+  void forceSetCounterForDevice(uint16_t id, uint64_t value, bool overflow,
+                                size_t shard = 0) {
+    shards_[shard].counters[id] = value;
+    shards_[shard].overflow[id] = overflow;
   }
 };
 
@@ -58,4 +59,64 @@ TEST_F(TestMsgCounter, CountOverflow) {
   counter.incrementCounter(testDevId1);
   ASSERT_EQ(counter.getStatForDevice(testDevId1),
             std::make_pair(countLimit, true));
+}
+
+TEST_F(TestMsgCounter, ShardsAreMerged) {
+  MsgCounterTestFixture counter(3);
+
+  const uint16_t testDevId1 = 7;
+  const uint16_t testDevId2 = 65535;
+
+  counter.getShard(0).incrementCounter(testDevId1);
+  counter.getShard(1).incrementCounter(testDevId1);
+  counter.getShard(2).incrementCounter(testDevId1);
+  counter.getShard(2).incrementCounter(testDevId2);
+
+  ASSERT_EQ(counter.getStatForDevice(testDevId1),
+            std::make_pair(static_cast<uint64_t>(3), false));
+  ASSERT_EQ(counter.getStatForDevice(testDevId2),
+            std::make_pair(static_cast<uint64_t>(1), false));
+  ASSERT_EQ(counter.getTotalCount(), 4u);
+}
+
+TEST_F(TestMsgCounter, BytesAreMerged) {
+  MsgCounterTestFixture counter(2);
+
+  const uint16_t testDevId1 = 7;
+  const uint16_t devIds[] = {testDevId1, testDevId1, 8};
+  const uint16_t frameLengths[] = {16, 100, 4100};
+
+  counter.getShard(0).incrementCounters(devIds, frameLengths, 3);
+  counter.getShard(1).incrementCounter(testDevId1, 20);
+
+  ASSERT_EQ(counter.getBytesForDevice(testDevId1), 136u);
+  ASSERT_EQ(counter.getBytesForDevice(8), 4100u);
+  ASSERT_EQ(counter.getStatForDevice(testDevId1),
+            std::make_pair(static_cast<uint64_t>(3), false));
+}
+
+TEST_F(TestMsgCounter, MergedCountOverflow) {
+  MsgCounterTestFixture counter(2);
+
+  const uint16_t testDevId1 = 0;
+
+  uint64_t countLimit = std::numeric_limits<uint64_t>::max();
+
+  counter.forceSetCounterForDevice(testDevId1, countLimit - 1, false, 0);
+  counter.forceSetCounterForDevice(testDevId1, 1, false, 1);
+  ASSERT_EQ(counter.getStatForDevice(testDevId1),
+            std::make_pair(countLimit, false));
+
+  counter.getShard(1).incrementCounter(testDevId1);
+  ASSERT_EQ(counter.getStatForDevice(testDevId1),
+            std::make_pair(countLimit, true));
+}
+
+TEST_F(TestMsgCounter, ShardsAreCacheLineAligned) {
+  MsgCounterTestFixture counter(4);
+
+  for (size_t i = 0; i < counter.getShardCount(); i++)
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(&counter.getShard(i)) %
+                  DeviceListener::kCacheLineSize,
+              0u);
 }
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+
+#include "DeviceRegistry.h"
+#include "MsgCounter.h"
+
+using DeviceListener::DeviceRegistry;
+using DeviceListener::MsgCounter;
+
+class TestDeviceRegistry : public ::testing::Test {
+ public:
+  TestDeviceRegistry() {
+    char path[] = "/tmp/registryXXXXXX";
+    close(mkstemp(path));
+    path_ = path;
+  }
+  ~TestDeviceRegistry() { unlink(path_.c_str()); }
+
+  void write(const std::string &contents) {
+    std::ofstream(path_, std::ios::binary | std::ios::trunc) << contents;
+  }
+
+  static std::shared_ptr<const DeviceRegistry> parse(const std::string &text) {
+    return DeviceRegistry::parse(text.data(), text.size());
+  }
+
+ protected:
+  std::string path_;
+};
+
+TEST_F(TestDeviceRegistry, ParsesDescriptions) {
+  auto registry = parse("1:SomeDevice\n65535:Last\r\n7:Seven:extra\n");
+  ASSERT_EQ(registry->size(), 3u);
+  ASSERT_TRUE(registry->isKnown(1));
+  ASSERT_EQ(registry->getName(1), "SomeDevice");
+  ASSERT_EQ(registry->getName(65535), "Last");
+  ASSERT_EQ(registry->getName(7), "Seven");
+  ASSERT_FALSE(registry->isKnown(2));
+  ASSERT_EQ(registry->getName(2), "Unknown device");
+}
+
+TEST_F(TestDeviceRegistry, SkipsWrongLines) {
+  auto registry = parse("no separator\n\n70000:TooBig\nx1:Bad\n5:Good");
+  ASSERT_EQ(registry->size(), 1u);
+  ASSERT_EQ(registry->getName(5), "Good");
+}
+
+TEST_F(TestDeviceRegistry, LastDescriptionWins) {
+  auto registry = parse("3:Old\n3:New\n3:\n4:Four\n");
+  ASSERT_EQ(registry->size(), 2u);
+  ASSERT_TRUE(registry->isKnown(3));
+  ASSERT_EQ(registry->getName(3), "");
+  ASSERT_EQ(registry->getName(4), "Four");
+}
+
+TEST_F(TestDeviceRegistry, BinaryRoundTrip) {
+  std::string text;
+  for (uint32_t id = 0; id < DeviceRegistry::kDeviceCount; id += 3)
+    text += std::to_string(id) + ":Device" + std::to_string(id) + "\n";
+  auto registry = parse(text);
+  ASSERT_TRUE(registry->save(path_));
+
+  auto loaded = DeviceRegistry::load(path_);
+  ASSERT_TRUE(loaded);
+  ASSERT_EQ(loaded->size(), registry->size());
+  for (uint32_t id = 0; id < DeviceRegistry::kDeviceCount; id++) {
+    ASSERT_EQ(loaded->isKnown(id), id % 3 == 0);
+    ASSERT_EQ(loaded->getName(id), registry->getName(id));
+  }
+}
+
+TEST_F(TestDeviceRegistry, DamagedBinaryIsRejected) {
+  ASSERT_TRUE(parse("1:One\n2:Two\n")->save(path_));
+  // cut off the end of the last name
+  std::ifstream file(path_, std::ios::binary | std::ios::ate);
+  const off_t length = file.tellg();
+  ASSERT_EQ(truncate(path_.c_str(), length - 1), 0);
+  ASSERT_FALSE(DeviceRegistry::load(path_));
+}
+
+TEST_F(TestDeviceRegistry, SavingOverALoadedImageKeepsItValid) {
+  ASSERT_TRUE(parse("1:One\n2:Two\n")->save(path_));
+  auto loaded = DeviceRegistry::load(path_);
+  ASSERT_TRUE(loaded);
+
+  ASSERT_TRUE(parse("1:Replaced\n")->save(path_));
+  ASSERT_EQ(loaded->size(), 2u);
+  ASSERT_EQ(loaded->getName(2), "Two");
+  auto reloaded = DeviceRegistry::load(path_);
+  ASSERT_TRUE(reloaded);
+  ASSERT_EQ(reloaded->getName(1), "Replaced");
+
+  // even a file cut short under it doesn't touch a loaded registry
+  ASSERT_EQ(truncate(path_.c_str(), 0), 0);
+  ASSERT_EQ(reloaded->getName(1), "Replaced");
+  ASSERT_EQ(loaded->getName(1), "One");
+}
+
+TEST_F(TestDeviceRegistry, MissingFileIsRejected) {
+  ASSERT_FALSE(DeviceRegistry::load(path_ + ".missing"));
+}
+
+TEST_F(TestDeviceRegistry, ReloadKeepsOldSnapshotsValid) {
+  MsgCounter counter;
+  write("1:First\n");
+  ASSERT_TRUE(counter.readDevicesFromFile(path_));
+  auto before = counter.getRegistry();
+
+  write("1:Renamed\n2:Second\n");
+  ASSERT_TRUE(counter.readDevicesFromFile(path_));
+  ASSERT_EQ(before->getName(1), "First");
+  ASSERT_EQ(counter.getDeviceNameById(1), "Renamed");
+  ASSERT_TRUE(counter.isKnownDevice(2));
+
+  // a file that can't be read keeps the registry in use
+  ASSERT_FALSE(counter.readDevicesFromFile(path_ + ".missing"));
+  ASSERT_EQ(counter.getDeviceNameById(2), "Second");
+}
@@ -0,0 +1,131 @@
+#include <gtest/gtest.h>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "FrameBatch.h"
+#include "RfcTransport.h"
+
+using DeviceListener::FrameBatch;
+using DeviceListener::RfcMessage;
+
+class TestFrameBatch : public ::testing::TestWithParam<FrameBatch::SimdLevel> {
+ public:
+  TestFrameBatch() {}
+  ~TestFrameBatch() {}
+
+  /**
+   * \brief random stream of frames with valid lengths, every 7th frame on
+   * average has a wrong version byte
+   */
+  static std::vector<uint8_t> makeStream(size_t frames, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> stream;
+    for (size_t i = 0; i < frames; i++) {
+      RfcMessage::Rfc1006Header header = {
+          static_cast<uint8_t>(rng() % 7 ? RfcMessage::kProtocolVersion
+                                         : rng() % 256),
+          static_cast<uint8_t>(rng()),
+          static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) +
+                                rng() % 65)};
+      size_t offset = stream.size();
+      stream.resize(offset + sizeof(header) + header.length);
+      std::memcpy(&stream[offset], &header, sizeof(header));
+      for (size_t j = offset + sizeof(header); j < stream.size(); j++)
+        stream[j] = static_cast<uint8_t>(rng());
+    }
+    return stream;
+  }
+
+  static bool isSupported(FrameBatch::SimdLevel level) {
+    return static_cast<int>(level) <=
+           static_cast<int>(FrameBatch::getSimdLevel());
+  }
+};
+
+TEST_P(TestFrameBatch, MatchesScalarFunctions) {
+  if (!isSupported(GetParam())) GTEST_SKIP() << "not supported by the CPU";
+
+  for (uint32_t seed = 0; seed < 20; seed++) {
+    auto stream = makeStream(FrameBatch::kCapacity - seed, seed);
+    FrameBatch batch;
+    batch.locate(stream.data(), stream.size());
+    batch.validate(stream.data(), GetParam());
+
+    ASSERT_EQ(batch.count, FrameBatch::kCapacity - seed);
+    ASSERT_EQ(batch.length, stream.size());
+    ASSERT_EQ(batch.stop, FrameBatch::Stop::Incomplete);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < batch.count; i++) {
+      ASSERT_EQ(batch.offsets[i], offset);
+
+      RfcMessage message;
+      std::memcpy(&message.headerBuffer, &stream[offset],
+                  sizeof(message.headerBuffer));
+      auto length = message.validateHeaderAndGetLength();
+      ASSERT_EQ(batch.valid[i], length.is_initialized());
+
+      message.payloadBuffer.assign(
+          stream.begin() + offset + sizeof(message.headerBuffer),
+          stream.begin() + offset + sizeof(message.headerBuffer) +
+              message.headerBuffer.length);
+      if (batch.valid[i]) {
+        ASSERT_EQ(batch.deviceIds[i], message.getDevIdFromBuffer().get());
+      }
+
+      ASSERT_EQ(batch.frameLengths[i],
+                sizeof(message.headerBuffer) + message.headerBuffer.length);
+      offset += sizeof(message.headerBuffer) + message.headerBuffer.length;
+    }
+  }
+}
+
+TEST_P(TestFrameBatch, StopsAtPartialFrame) {
+  if (!isSupported(GetParam())) GTEST_SKIP() << "not supported by the CPU";
+
+  auto stream = makeStream(10, 1);
+  FrameBatch batch;
+  batch.locate(stream.data(), stream.size() - 1);
+  batch.validate(stream.data(), GetParam());
+
+  ASSERT_EQ(batch.count, 9u);
+  ASSERT_EQ(batch.stop, FrameBatch::Stop::Incomplete);
+  ASSERT_LT(batch.length, stream.size());
+}
+
+TEST_P(TestFrameBatch, StopsAtInvalidLength) {
+  if (!isSupported(GetParam())) GTEST_SKIP() << "not supported by the CPU";
+
+  auto stream = makeStream(10, 2);
+  RfcMessage::Rfc1006Header badHeader = {RfcMessage::kProtocolVersion, 0,
+                                         RfcMessage::kMaxPayloadLength + 1};
+  const size_t validLength = stream.size();
+  stream.resize(validLength + sizeof(badHeader));
+  std::memcpy(&stream[validLength], &badHeader, sizeof(badHeader));
+
+  FrameBatch batch;
+  batch.locate(stream.data(), stream.size());
+  batch.validate(stream.data(), GetParam());
+
+  ASSERT_EQ(batch.count, 10u);
+  ASSERT_EQ(batch.length, validLength);
+  ASSERT_EQ(batch.stop, FrameBatch::Stop::InvalidLength);
+}
+
+TEST_P(TestFrameBatch, StopsWhenFull) {
+  if (!isSupported(GetParam())) GTEST_SKIP() << "not supported by the CPU";
+
+  auto stream = makeStream(FrameBatch::kCapacity + 1, 3);
+  FrameBatch batch;
+  batch.locate(stream.data(), stream.size());
+  batch.validate(stream.data(), GetParam());
+
+  ASSERT_EQ(batch.count, FrameBatch::kCapacity);
+  ASSERT_EQ(batch.stop, FrameBatch::Stop::Full);
+}
+
+INSTANTIATE_TEST_SUITE_P(SimdLevels, TestFrameBatch,
+                         ::testing::Values(FrameBatch::SimdLevel::Scalar,
+                                           FrameBatch::SimdLevel::Sse2,
+                                           FrameBatch::SimdLevel::Avx2));
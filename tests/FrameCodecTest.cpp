@@ -0,0 +1,417 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <random>
+#include <vector>
+
+#include "FrameCodec.h"
+#include "FrameParser.h"
+#include "FrameResync.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "StreamReassembler.h"
+#include "TcpServer.h"
+#include "TestUtils.h"
+
+using DeviceListener::ByteOrder;
+using DeviceListener::ByteOrderMode;
+using DeviceListener::FrameBatch;
+using DeviceListener::FrameCodec;
+using DeviceListener::FrameFormat;
+using DeviceListener::FrameLayout;
+using DeviceListener::FrameParser;
+using DeviceListener::FrameResync;
+using DeviceListener::NativeFrameCodec;
+using DeviceListener::RfcMessage;
+using DeviceListener::StreamReassembler;
+using DeviceListener::Testing::getEndpoint;
+using DeviceListener::Testing::pollFor;
+using DeviceListener::Testing::pollUntil;
+
+using Little = FrameCodec<0, ByteOrder::Little>;
+using Big = FrameCodec<0, ByteOrder::Big>;
+
+// the layout is computed at compile time and is the one of RfcMessage
+static_assert(FrameLayout<0>::kLengthOffset == 2, "length after version");
+static_assert(FrameLayout<0>::kDeviceIdOffset == 4, "deviceId first");
+static_assert(FrameLayout<0>::kTimestampOffset == 8, "timestamp at 8");
+static_assert(FrameLayout<0>::kDataLengthOffset == 14, "dataLength last");
+static_assert(Little::kSwapped != Big::kSwapped, "one of them is native");
+static_assert(!NativeFrameCodec::kSwapped, "the native codec doesn't swap");
+
+namespace {
+
+/**
+ * \brief a frame the way a device of the codec's byte order writes it
+ */
+struct Frame {
+  uint8_t version;
+  uint16_t deviceId;
+  uint16_t measurementTag;
+  uint32_t timestamp;
+  uint16_t measurementType;
+  uint16_t dataLength;
+};
+
+template <typename Codec>
+void appendFrame(std::vector<uint8_t> &stream, const Frame &frame,
+                 uint16_t length) {
+  using Layout = typename Codec::Layout;
+  const size_t offset = stream.size();
+  stream.resize(offset + Layout::kHeaderLength + length, 0xFF);
+  uint8_t *data = &stream[offset];
+  data[Layout::kVersionOffset] = frame.version;
+  data[Layout::kVersionOffset + 1] = 0;
+  Codec::store(data + Layout::kLengthOffset, length);
+  Codec::store(data + Layout::kDeviceIdOffset, frame.deviceId);
+  Codec::store(data + Layout::kTagOffset, frame.measurementTag);
+  Codec::store(data + Layout::kTimestampOffset, frame.timestamp);
+  Codec::store(data + Layout::kTypeOffset, frame.measurementType);
+  Codec::store(data + Layout::kDataLengthOffset, frame.dataLength);
+}
+
+template <typename Codec>
+FrameFormat getFormat() {
+  return Codec::kByteOrder == ByteOrder::Little ? FrameFormat::Version0Little
+                                                : FrameFormat::Version0Big;
+}
+
+template <typename Codec>
+ByteOrderMode getMode() {
+  return Codec::kByteOrder == ByteOrder::Little ? ByteOrderMode::Little
+                                                : ByteOrderMode::Big;
+}
+
+}  // namespace
+
+template <typename Codec>
+class TestFrameCodec : public ::testing::Test {
+ public:
+  /**
+   * \brief random frames with consistent data lengths, every 7th frame on
+   * average has a wrong version byte
+   */
+  void makeStream(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    stream_.clear();
+    frames_.clear();
+    for (size_t i = 0; i < count; i++) {
+      const auto dataLength = static_cast<uint16_t>(rng() % 65);
+      Frame frame = {
+          static_cast<uint8_t>(rng() % 7 ? 0 : 1 + rng() % 255),
+          static_cast<uint16_t>(rng()),
+          static_cast<uint16_t>(rng()),
+          static_cast<uint32_t>(rng()),
+          static_cast<uint16_t>(rng()),
+          dataLength};
+      appendFrame<Codec>(
+          stream_, frame,
+          static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) +
+                                dataLength));
+      frames_.push_back(frame);
+    }
+  }
+
+  static std::vector<FrameBatch::SimdLevel> getLevels() {
+    std::vector<FrameBatch::SimdLevel> levels;
+    for (auto level :
+         {FrameBatch::SimdLevel::Scalar, FrameBatch::SimdLevel::Sse2,
+          FrameBatch::SimdLevel::Avx2})
+      if (static_cast<int>(level) <=
+          static_cast<int>(FrameBatch::getSimdLevel()))
+        levels.push_back(level);
+    return levels;
+  }
+
+ protected:
+  std::vector<uint8_t> stream_;
+  std::vector<Frame> frames_;
+};
+
+// every specialization of FrameFormat
+using Codecs = ::testing::Types<Little, Big>;
+TYPED_TEST_SUITE(TestFrameCodec, Codecs);
+
+TYPED_TEST(TestFrameCodec, ReadsTheFieldsAsWritten) {
+  this->makeStream(1, 1);
+  const Frame &frame = this->frames_[0];
+  const uint8_t *data = this->stream_.data();
+  EXPECT_EQ(TypeParam::isValidHeader(data), frame.version == 0);
+  EXPECT_EQ(TypeParam::getLength(data), this->stream_.size() - 4);
+  EXPECT_EQ(TypeParam::getDeviceId(data), frame.deviceId);
+  EXPECT_EQ(TypeParam::getMeasurementTag(data), frame.measurementTag);
+  EXPECT_EQ(TypeParam::getTimestamp(data), frame.timestamp);
+  EXPECT_EQ(TypeParam::getMeasurementType(data), frame.measurementType);
+  EXPECT_TRUE(TypeParam::isConsistent(data));
+
+  // the most significant byte first or last, whatever the machine
+  uint8_t bytes[4];
+  TypeParam::store(bytes, uint32_t(0x01020304));
+  EXPECT_EQ(bytes[0], TypeParam::kByteOrder == ByteOrder::Big ? 1 : 4);
+  EXPECT_EQ(TypeParam::template load<uint32_t>(bytes), 0x01020304u);
+}
+
+TYPED_TEST(TestFrameCodec, ScansTheSameAtEveryLevel) {
+  for (auto level : this->getLevels()) {
+    for (uint32_t seed = 0; seed < 10; seed++) {
+      this->makeStream(FrameBatch::kCapacity - seed, seed);
+      FrameBatch batch;
+      batch.locate<TypeParam>(this->stream_.data(), this->stream_.size());
+      batch.validate<TypeParam>(this->stream_.data(), level);
+      batch.decode<TypeParam>(this->stream_.data());
+
+      ASSERT_EQ(batch.count, this->frames_.size());
+      ASSERT_EQ(batch.length, this->stream_.size());
+      for (size_t i = 0; i < batch.count; i++) {
+        const Frame &frame = this->frames_[i];
+        ASSERT_EQ(batch.valid[i], frame.version == 0) << i;
+        if (batch.valid[i]) {
+          ASSERT_EQ(batch.deviceIds[i], frame.deviceId);
+        }
+        ASSERT_EQ(batch.frameLengths[i], 16u + frame.dataLength);
+        ASSERT_EQ(batch.measurementTags[i], frame.measurementTag);
+        ASSERT_EQ(batch.measurementTypes[i], frame.measurementType);
+        ASSERT_EQ(batch.timestamps[i], frame.timestamp);
+      }
+    }
+  }
+}
+
+TYPED_TEST(TestFrameCodec, StopsAtALengthOutOfBounds) {
+  this->makeStream(10, 2);
+  const size_t validLength = this->stream_.size();
+  appendFrame<TypeParam>(this->stream_, Frame(),
+                         RfcMessage::kMaxPayloadLength + 1);
+
+  FrameBatch batch;
+  batch.locate<TypeParam>(this->stream_.data(), this->stream_.size());
+  EXPECT_EQ(batch.count, 10u);
+  EXPECT_EQ(batch.length, validLength);
+  EXPECT_EQ(batch.stop, FrameBatch::Stop::InvalidLength);
+}
+
+TYPED_TEST(TestFrameCodec, ReassemblesChunksInTheDetectedOrder) {
+  this->makeStream(300, 3);
+  for (auto &frame : this->frames_) frame.version = 0;
+  this->stream_.clear();
+  for (const auto &frame : this->frames_)
+    appendFrame<TypeParam>(
+        this->stream_, frame,
+        static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) +
+                              frame.dataLength));
+
+  for (auto mode : {getMode<TypeParam>(), ByteOrderMode::Detect}) {
+    // chunks of 1 to 40 bytes, so the first frame comes in pieces too
+    std::mt19937 rng(4);
+    StreamReassembler stream(mode);
+    FrameBatch batch;
+    size_t frames = 0;
+    for (size_t pos = 0; pos < this->stream_.size();) {
+      const size_t chunk =
+          std::min<size_t>(1 + rng() % 40, this->stream_.size() - pos);
+      auto result = stream.feed(
+          &this->stream_[pos], chunk, batch,
+          [this, &frames](const uint16_t *devIds, const uint16_t *,
+                          size_t count) {
+            for (size_t i = 0; i < count; i++)
+              ASSERT_EQ(devIds[i], this->frames_[frames + i].deviceId);
+            frames += count;
+          });
+      ASSERT_FALSE(result.invalidHeader);
+      ASSERT_EQ(result.consumed, chunk);
+      pos += chunk;
+    }
+    EXPECT_EQ(frames, this->frames_.size());
+    EXPECT_EQ(stream.getFormat(), getFormat<TypeParam>());
+    EXPECT_EQ(stream.pending(), 0u);
+  }
+}
+
+TYPED_TEST(TestFrameCodec, ResyncsAtEveryLevel) {
+  std::vector<uint8_t> stream(100, 0xFF);
+  // a version byte with a length too long in this order, and in the other
+  stream[50] = 0;
+  stream[51] = 0;
+  stream[52] = 0x20;
+  stream[53] = 0x20;
+  const size_t header = stream.size();
+  appendFrame<TypeParam>(stream, {0, 7, 0, 0, 0, 4}, 16);
+  appendFrame<TypeParam>(stream, {0, 8, 0, 0, 0, 4}, 16);
+
+  for (auto level : this->getLevels()) {
+    for (bool confirm : {false, true}) {
+      auto result = FrameResync::find<TypeParam>(stream.data(), stream.size(),
+                                                 0, confirm, level);
+      EXPECT_TRUE(result.found);
+      EXPECT_EQ(result.skipped, header);
+    }
+  }
+  for (bool confirm : {false, true}) {
+    auto result = FrameResync::findInAnyFormat(stream.data(), stream.size(),
+                                               0, confirm);
+    EXPECT_TRUE(result.found);
+    EXPECT_EQ(result.skipped, header);
+    EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data() + header,
+                                                stream.size() - header,
+                                                ByteOrderMode::Detect),
+              getFormat<TypeParam>());
+  }
+}
+
+TYPED_TEST(TestFrameCodec, ReassemblerRejectsLeadingGarbage) {
+  std::vector<uint8_t> stream(6, 0xFF);
+  appendFrame<TypeParam>(stream, {0, 7, 0, 0, 0, 4}, 16);
+  FrameBatch batch;
+  auto ignore = [](const uint16_t *, const uint16_t *, size_t) {};
+
+  StreamReassembler given(getMode<TypeParam>());
+  EXPECT_TRUE(given.feed(stream.data(), stream.size(), batch, ignore)
+                  .invalidHeader);
+  EXPECT_EQ(given.getFormat(), getFormat<TypeParam>());
+
+  // the garbage may come in pieces as well
+  StreamReassembler detected(ByteOrderMode::Detect);
+  auto result = detected.feed(stream.data(), 2, batch, ignore);
+  EXPECT_FALSE(result.invalidHeader);
+  EXPECT_EQ(result.consumed, 2u);
+  EXPECT_TRUE(detected.feed(stream.data() + 2, stream.size() - 2, batch,
+                            ignore)
+                  .invalidHeader);
+  EXPECT_EQ(detected.getFormat(), FrameFormat::Undetected);
+}
+
+TYPED_TEST(TestFrameCodec, DetectsTheOrderOfTheFirstFrame) {
+  // 16 bytes read 0x1000 the other way round, within bounds as well; the
+  // data length tells them apart
+  std::vector<uint8_t> stream;
+  appendFrame<TypeParam>(stream, {0, 1, 0, 0, 0, 4}, 16);
+  for (size_t length = 0; length < 4; length++)
+    EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), length,
+                                                ByteOrderMode::Detect),
+              FrameFormat::Undetected);
+  // the header alone isn't enough
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), 15,
+                                              ByteOrderMode::Detect),
+            FrameFormat::Undetected);
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), stream.size(),
+                                              ByteOrderMode::Detect),
+            getFormat<TypeParam>());
+
+  // a length within bounds in one order only needs no more than the header
+  stream.clear();
+  appendFrame<TypeParam>(stream, {0, 1, 0, 0, 0, 0}, 300);
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), 4,
+                                              ByteOrderMode::Detect),
+            getFormat<TypeParam>());
+
+  // the mode wins over what the frame looks like
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), 4,
+                                              getMode<TypeParam>()),
+            getFormat<TypeParam>());
+}
+
+TEST(TestFrameFormat, FallsBackToTheNativeCodec) {
+  const FrameFormat native = getFormat<NativeFrameCodec>();
+  std::vector<uint8_t> stream;
+  appendFrame<Big>(stream, {0, 1, 0, 0, 0, 0}, 300);
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), stream.size(),
+                                              ByteOrderMode::Native),
+            native);
+
+  // a version nobody speaks tells no format
+  stream[0] = 5;
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), stream.size(),
+                                              ByteOrderMode::Detect),
+            FrameFormat::Undetected);
+  EXPECT_FALSE(DeviceListener::isValidInAnyFormat(stream.data()));
+  // a given order is kept whatever the stream begins with
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), stream.size(),
+                                              ByteOrderMode::Big),
+            FrameFormat::Version0Big);
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), 0,
+                                              ByteOrderMode::Little),
+            FrameFormat::Version0Little);
+
+  // within bounds both ways and no data length to tell
+  stream.clear();
+  appendFrame<Little>(stream, {0, 1, 0, 0, 0, 0}, 16);
+  EXPECT_EQ(DeviceListener::detectFrameFormat(stream.data(), stream.size(),
+                                              ByteOrderMode::Detect),
+            native);
+
+  const bool visited = DeviceListener::visitFrameFormat(
+      FrameFormat::Version0Big,
+      [](auto codec) { return decltype(codec)::kByteOrder == ByteOrder::Big; });
+  EXPECT_TRUE(visited);
+}
+
+TEST(TestFrameFormat, TransportReadsEveryConnectionInItsOwnOrder) {
+  DeviceListener::MsgCounter counter;
+  boost::asio::io_service ioService;
+  DeviceListener::WorkerContext context(counter.getShard(0));
+  context.byteOrder = ByteOrderMode::Detect;
+  DeviceListener::RfcTransport transport(ioService, context);
+  DeviceListener::TcpServer server(0, ioService, transport);
+  DeviceListener::ClosingGuard closing(ioService, server, transport);
+  server.listen();
+
+  std::vector<uint8_t> little, big;
+  for (int i = 0; i < 10; i++) {
+    appendFrame<Little>(little, {0, 0x0102, 0, 0, 0, 4}, 16);
+    appendFrame<Big>(big, {0, 0x0304, 0, 0, 0, 4}, 16);
+  }
+  boost::asio::ip::tcp::socket first(ioService), second(ioService);
+  first.connect(getEndpoint(server.port()));
+  second.connect(getEndpoint(server.port()));
+  boost::asio::write(first, boost::asio::buffer(little));
+  // the first frame of a connection may come in pieces as well
+  boost::asio::write(second, boost::asio::buffer(big.data(), 6));
+
+  auto countedAll = [&counter](uint16_t devId) {
+    return [&counter, devId]() {
+      return counter.getStatForDevice(devId).first >= 10;
+    };
+  };
+  pollUntil(ioService, countedAll(0x0102));
+  boost::asio::write(second,
+                     boost::asio::buffer(big.data() + 6, big.size() - 6));
+  pollUntil(ioService, countedAll(0x0304));
+  EXPECT_EQ(counter.getStatForDevice(0x0102).first, 10u);
+  EXPECT_EQ(counter.getStatForDevice(0x0304).first, 10u);
+  EXPECT_EQ(counter.getShard(0).transport.invalidHeaders.load(), 0u);
+}
+
+TEST(TestFrameFormat, ResyncsAStreamThatBeginsWithGarbage) {
+  std::vector<uint8_t> stream(7, 0xFF);
+  const size_t garbage = stream.size();
+  // 12 bytes of payload read 3072 the other way round, within bounds too
+  for (int i = 0; i < 10; i++)
+    appendFrame<Big>(stream, {0, 0x0304, 0, 0, 0, 0}, 12);
+
+  for (auto mode : {ByteOrderMode::Big, ByteOrderMode::Detect}) {
+    DeviceListener::MsgCounter counter;
+    boost::asio::io_service ioService;
+    DeviceListener::WorkerContext context(counter.getShard(0));
+    context.resync = DeviceListener::ResyncMode::Header;
+    context.byteOrder = mode;
+    DeviceListener::RfcTransport transport(ioService, context);
+    DeviceListener::TcpServer server(0, ioService, transport);
+    DeviceListener::ClosingGuard closing(ioService, server, transport);
+    server.listen();
+
+    boost::asio::ip::tcp::socket client(ioService);
+    client.connect(getEndpoint(server.port()));
+    // the garbage alone first, so the format waits for the resync
+    boost::asio::write(client, boost::asio::buffer(stream.data(), garbage));
+    pollFor(ioService, 100);
+    boost::asio::write(client, boost::asio::buffer(stream.data() + garbage,
+                                                   stream.size() - garbage));
+    const auto &stats = counter.getShard(0).transport;
+    pollUntil(ioService,
+              [&]() { return counter.getStatForDevice(0x0304).first >= 10; });
+    EXPECT_EQ(counter.getStatForDevice(0x0304).first, 10u);
+    EXPECT_EQ(counter.getStatForDevice(0x0403).first, 0u);
+    EXPECT_EQ(stats.resyncs.load(), 1u);
+    EXPECT_EQ(stats.bytesSkipped.load(), garbage);
+    EXPECT_EQ(stats.connectionsClosed.load(), 0u);
+  }
+}
@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "FrameParser.h"
+#include "RecvBuffer.h"
+#include "StreamReassembler.h"
+
+using DeviceListener::FrameParser;
+using DeviceListener::RecvBuffer;
+using DeviceListener::RfcMessage;
+
+class TestFrameParser : public ::testing::Test {
+ public:
+  TestFrameParser() {}
+  ~TestFrameParser() {}
+
+  static void appendFrame(std::vector<uint8_t> &stream, uint16_t devId,
+                          size_t dataLength,
+                          uint8_t version = RfcMessage::kProtocolVersion) {
+    RfcMessage::Rfc1006Header header = {
+        version, 0,
+        static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) + dataLength)};
+    RfcMessage::PayloadHeader payload = {};
+    payload.deviceId = devId;
+
+    size_t offset = stream.size();
+    stream.resize(offset + sizeof(header) + header.length);
+    std::memcpy(&stream[offset], &header, sizeof(header));
+    std::memcpy(&stream[offset + sizeof(header)], &payload, sizeof(payload));
+  }
+};
+
+TEST_F(TestFrameParser, SeveralCompleteFrames) {
+  std::vector<uint8_t> stream;
+  appendFrame(stream, 1, 0);
+  appendFrame(stream, 2, 64);
+  appendFrame(stream, 3, 10);
+
+  std::vector<uint16_t> devIds;
+  auto result = FrameParser::parse(
+      stream.data(), stream.size(),
+      [&devIds](uint16_t devId) { devIds.push_back(devId); });
+
+  ASSERT_EQ(result.frames, 3u);
+  ASSERT_EQ(result.consumed, stream.size());
+  ASSERT_FALSE(result.invalidHeader);
+  ASSERT_EQ(devIds, std::vector<uint16_t>({1, 2, 3}));
+}
+
+TEST_F(TestFrameParser, PartialFrameIsKept) {
+  std::vector<uint8_t> stream;
+  appendFrame(stream, 1, 5);
+  const size_t firstFrameLength = stream.size();
+  appendFrame(stream, 2, 5);
+
+  size_t frames = 0;
+  auto result = FrameParser::parse(stream.data(), stream.size() - 1,
+                                   [&frames](uint16_t) { frames++; });
+
+  ASSERT_EQ(frames, 1u);
+  ASSERT_EQ(result.consumed, firstFrameLength);
+  ASSERT_FALSE(result.invalidHeader);
+}
+
+TEST_F(TestFrameParser, InvalidHeaderStopsParsing) {
+  std::vector<uint8_t> stream;
+  appendFrame(stream, 1, 5);
+  const size_t firstFrameLength = stream.size();
+  appendFrame(stream, 2, 5, RfcMessage::kProtocolVersion + 1);
+  appendFrame(stream, 3, 5);
+
+  size_t frames = 0;
+  auto result = FrameParser::parse(stream.data(), stream.size(),
+                                   [&frames](uint16_t) { frames++; });
+
+  ASSERT_EQ(frames, 1u);
+  ASSERT_EQ(result.consumed, firstFrameLength);
+  ASSERT_TRUE(result.invalidHeader);
+}
+
+TEST_F(TestFrameParser, ByteByByteThroughRecvBuffer) {
+  std::vector<uint8_t> stream;
+  for (uint16_t i = 0; i < 100; i++) appendFrame(stream, i, i % 65);
+
+  RecvBuffer buffer(RecvBuffer::kDefaultCapacity);
+  std::vector<uint16_t> devIds;
+  for (uint8_t byte : stream) {
+    *buffer.writePtr() = byte;
+    buffer.commit(1);
+    auto result = FrameParser::parse(
+        buffer.data(), buffer.size(),
+        [&devIds](uint16_t devId) { devIds.push_back(devId); });
+    ASSERT_FALSE(result.invalidHeader);
+    buffer.consume(result.consumed);
+  }
+
+  ASSERT_EQ(devIds.size(), 100u);
+  for (uint16_t i = 0; i < 100; i++) ASSERT_EQ(devIds[i], i);
+  ASSERT_EQ(buffer.size(), 0u);
+}
+
+TEST_F(TestFrameParser, ReassemblerAtEverySplitPoint) {
+  std::vector<uint8_t> stream;
+  for (uint16_t i = 0; i < 20; i++) appendFrame(stream, i, i * 3 % 65);
+
+  for (size_t chunk = 1; chunk < stream.size(); chunk++) {
+    DeviceListener::StreamReassembler reassembler;
+    DeviceListener::FrameBatch batch;
+    std::vector<uint16_t> devIds;
+    for (size_t offset = 0; offset < stream.size(); offset += chunk) {
+      const size_t length = std::min(chunk, stream.size() - offset);
+      auto result = reassembler.feed(
+          &stream[offset], length, batch,
+          [&devIds](const uint16_t *ids, const uint16_t *, size_t count) {
+            devIds.insert(devIds.end(), ids, ids + count);
+          });
+      ASSERT_FALSE(result.invalidHeader);
+      ASSERT_EQ(result.consumed, length);
+    }
+    ASSERT_EQ(devIds.size(), 20u);
+    for (uint16_t i = 0; i < 20; i++) ASSERT_EQ(devIds[i], i);
+    ASSERT_EQ(reassembler.pending(), 0u);
+  }
+}
+
+TEST_F(TestFrameParser, ReassemblerInvalidHeaderInCarry) {
+  std::vector<uint8_t> stream;
+  appendFrame(stream, 1, 5);
+  appendFrame(stream, 2, 5, RfcMessage::kProtocolVersion + 1);
+
+  DeviceListener::StreamReassembler reassembler;
+  DeviceListener::FrameBatch batch;
+  size_t frames = 0;
+  auto onBatch = [&frames](const uint16_t *, const uint16_t *,
+                           size_t count) {
+    frames += count;
+  };
+  // the second header is split between the chunks
+  const size_t split =
+      stream.size() - 5 - sizeof(RfcMessage::PayloadHeader) - 2;
+  auto result = reassembler.feed(stream.data(), split, batch, onBatch);
+  ASSERT_FALSE(result.invalidHeader);
+  result = reassembler.feed(stream.data() + split, stream.size() - split,
+                            batch, onBatch);
+  ASSERT_TRUE(result.invalidHeader);
+  ASSERT_EQ(frames, 1u);
+}
@@ -0,0 +1,293 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "FrameResync.h"
+#include "Logger.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+#include "TestUtils.h"
+
+using DeviceListener::ClosingGuard;
+using DeviceListener::CounterShard;
+using DeviceListener::FrameBatch;
+using DeviceListener::FrameResync;
+using DeviceListener::Logger;
+using DeviceListener::MsgCounter;
+using DeviceListener::ResyncMode;
+using DeviceListener::RfcMessage;
+using DeviceListener::RfcTransport;
+using DeviceListener::TcpServer;
+using DeviceListener::Testing::getEndpoint;
+using DeviceListener::Testing::pollUntil;
+using DeviceListener::WorkerContext;
+
+class TestFrameResync : public ::testing::TestWithParam<FrameBatch::SimdLevel> {
+ public:
+  TestFrameResync() {}
+  ~TestFrameResync() {}
+
+  static void appendFrame(std::vector<uint8_t> &stream, uint16_t devId,
+                          size_t dataLength) {
+    RfcMessage::Rfc1006Header header = {
+        RfcMessage::kProtocolVersion, 0,
+        static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) + dataLength)};
+    RfcMessage::PayloadHeader payload = {};
+    payload.deviceId = devId;
+    size_t offset = stream.size();
+    // 0xFF can't start a header, so the payload can't fake one
+    stream.resize(offset + sizeof(header) + header.length, 0xFF);
+    std::memcpy(&stream[offset], &header, sizeof(header));
+    std::memcpy(&stream[offset + sizeof(header)], &payload, sizeof(payload));
+  }
+
+  /**
+   * \brief random bytes, mostly small values, so plausible headers are
+   * common and the confirmation gets to work
+   */
+  static std::vector<uint8_t> makeNoise(size_t length, std::mt19937 &rng) {
+    std::vector<uint8_t> noise(length);
+    for (auto &byte : noise)
+      byte = static_cast<uint8_t>(rng() % 4 ? rng() % 20 : rng());
+    return noise;
+  }
+
+  /**
+   * \brief FrameResync::find() the obvious way
+   */
+  static FrameResync::Result findSlowly(const std::vector<uint8_t> &data,
+                                        size_t from, bool confirm) {
+    const size_t kHeaderLength = sizeof(RfcMessage::Rfc1006Header);
+    for (size_t pos = from; pos + kHeaderLength <= data.size(); pos++) {
+      RfcMessage::Rfc1006Header header;
+      std::memcpy(&header, &data[pos], kHeaderLength);
+      auto length = RfcMessage::validateHeaderAndGetLength(header);
+      if (!length) continue;
+      if (!confirm) return {pos, true};
+      const size_t next = pos + kHeaderLength + length.get();
+      if (next + kHeaderLength > data.size()) return {pos, false};
+      std::memcpy(&header, &data[next], kHeaderLength);
+      if (RfcMessage::validateHeaderAndGetLength(header)) return {pos, true};
+    }
+    const size_t limit =
+        data.size() >= kHeaderLength ? data.size() - kHeaderLength + 1 : 0;
+    return {std::max(from, limit), false};
+  }
+
+  static bool isSupported(FrameBatch::SimdLevel level) {
+    return static_cast<int>(level) <=
+           static_cast<int>(FrameBatch::getSimdLevel());
+  }
+
+  /**
+   * \brief writes the stream in chunks of random length
+   */
+  static void writeInChunks(boost::asio::ip::tcp::socket &socket,
+                            const std::vector<uint8_t> &stream,
+                            std::mt19937 &rng) {
+    for (size_t offset = 0; offset < stream.size();) {
+      const size_t chunk =
+          std::min<size_t>(1 + rng() % 700, stream.size() - offset);
+      boost::asio::write(socket, boost::asio::buffer(&stream[offset], chunk));
+      offset += chunk;
+    }
+  }
+};
+
+TEST_P(TestFrameResync, FindsTheHeaderBehindGarbage) {
+  if (!isSupported(GetParam())) GTEST_SKIP() << "not supported by the CPU";
+
+  std::vector<uint8_t> stream(100, 0xFF);
+  appendFrame(stream, 1, 8);
+  appendFrame(stream, 2, 8);
+  for (bool confirm : {false, true}) {
+    auto result = FrameResync::find(stream.data(), stream.size(), 0, confirm,
+                                    GetParam());
+    EXPECT_TRUE(result.found);
+    EXPECT_EQ(result.skipped, 100u);
+  }
+
+  // nothing but garbage: the last 3 bytes may still be the start of a header
+  std::vector<uint8_t> garbage(100, 0xFF);
+  auto result = FrameResync::find(garbage.data(), garbage.size(), 0, false,
+                                  GetParam());
+  EXPECT_FALSE(result.found);
+  EXPECT_EQ(result.skipped, 97u);
+}
+
+TEST_P(TestFrameResync, ConfirmationWaitsForTheNextHeader) {
+  if (!isSupported(GetParam())) GTEST_SKIP() << "not supported by the CPU";
+
+  std::vector<uint8_t> stream(40, 0xFF);
+  appendFrame(stream, 1, 8);
+  const size_t firstEnd = stream.size();
+  appendFrame(stream, 2, 8);
+
+  // the header after the frame isn't complete yet
+  auto result = FrameResync::find(stream.data(), firstEnd + 3, 0, true,
+                                  GetParam());
+  EXPECT_FALSE(result.found);
+  EXPECT_EQ(result.skipped, 40u);
+
+  // a header followed by garbage is not the way back
+  std::vector<uint8_t> lone(40, 0xFF);
+  RfcMessage::Rfc1006Header header = {
+      RfcMessage::kProtocolVersion, 0, sizeof(RfcMessage::PayloadHeader)};
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&header);
+  lone.insert(lone.end(), bytes, bytes + sizeof(header));
+  lone.insert(lone.end(), header.length + 20, 0xFF);
+  result = FrameResync::find(lone.data(), lone.size(), 0, true, GetParam());
+  EXPECT_FALSE(result.found);
+  EXPECT_EQ(result.skipped, lone.size() - sizeof(header) + 1);
+  result = FrameResync::find(lone.data(), lone.size(), 0, false, GetParam());
+  EXPECT_TRUE(result.found);
+  EXPECT_EQ(result.skipped, 40u);
+}
+
+TEST_P(TestFrameResync, MatchesTheObviousSearchOnRandomData) {
+  if (!isSupported(GetParam())) GTEST_SKIP() << "not supported by the CPU";
+
+  std::mt19937 rng(7);
+  for (int round = 0; round < 20000; round++) {
+    const size_t length = rng() % 200;
+    auto data = makeNoise(length, rng);
+    std::unique_ptr<uint8_t[]> exact(new uint8_t[length]);
+    if (length) std::memcpy(exact.get(), data.data(), length);
+    const size_t from = length ? rng() % (length + 1) : 0;
+    const bool confirm = rng() % 2;
+
+    auto expected = findSlowly(data, from, confirm);
+    auto result =
+        FrameResync::find(exact.get(), length, from, confirm, GetParam());
+    ASSERT_EQ(result.found, expected.found) << "round " << round;
+    ASSERT_EQ(result.skipped, expected.skipped) << "round " << round;
+    ASSERT_LE(result.skipped, length);
+    ASSERT_GE(result.skipped, from);
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(SimdLevels, TestFrameResync,
+                         ::testing::Values(FrameBatch::SimdLevel::Scalar,
+                                           FrameBatch::SimdLevel::Sse2,
+                                           FrameBatch::SimdLevel::Avx2));
+
+class TestResyncingTransport : public TestFrameResync {
+ public:
+  // every resync is logged
+  TestResyncingTransport() { Logger::instance().setEnabled(false); }
+  ~TestResyncingTransport() { Logger::instance().setEnabled(true); }
+};
+
+TEST_F(TestResyncingTransport, InvalidHeaderClosesTheConnectionByDefault) {
+  MsgCounter counter;
+  const auto &stats = counter.getShard(0).transport;
+  boost::asio::io_service ioService;
+  boost::asio::ip::tcp::socket client(ioService);
+  RfcTransport transport(ioService, counter.getShard(0));
+  TcpServer server(0, ioService, transport);
+  ClosingGuard closing(ioService, server, transport);
+  server.listen();
+  client.connect(getEndpoint(server.port()));
+
+  std::vector<uint8_t> stream;
+  appendFrame(stream, 1, 8);
+  stream.insert(stream.end(), 10, 0xFF);
+  appendFrame(stream, 1, 8);
+  boost::asio::write(client, boost::asio::buffer(stream));
+  ASSERT_TRUE(pollUntil(
+      ioService, [&]() { return stats.connectionsClosed.load() == 1; }));
+  EXPECT_EQ(stats.invalidHeaders.load(), 1u);
+  EXPECT_EQ(stats.resyncs.load(), 0u);
+  EXPECT_EQ(counter.getStatForDevice(1).first, 1u);
+}
+
+TEST_F(TestResyncingTransport, SkipsGarbageBetweenFrames) {
+  for (auto mode : {ResyncMode::Header, ResyncMode::Confirmed}) {
+    MsgCounter counter;
+    const auto &stats = counter.getShard(0).transport;
+    boost::asio::io_service ioService;
+    boost::asio::ip::tcp::socket client(ioService);
+    WorkerContext context(counter.getShard(0));
+    context.resync = mode;
+    RfcTransport transport(ioService, context);
+    TcpServer server(0, ioService, transport);
+    ClosingGuard closing(ioService, server, transport);
+    server.listen();
+    client.connect(getEndpoint(server.port()));
+
+    // a confirmed resync needs a second frame behind the garbage, and the
+    // longest frames make it wait in a borrowed block
+    std::mt19937 rng(3);
+    std::vector<uint8_t> stream;
+    size_t frames = 0, garbage = 0;
+    const size_t runs = 50;
+    for (size_t run = 0; run < runs; run++) {
+      const size_t before = stream.size();
+      stream.insert(stream.end(), 1 + rng() % 300, 0xFF);
+      garbage += stream.size() - before;
+      for (size_t i = 0; i < 2 + run % 3; i++, frames++)
+        appendFrame(stream, 1,
+                    run % 5 ? rng() % 64
+                            : RfcMessage::kMaxPayloadLength -
+                                  sizeof(RfcMessage::PayloadHeader));
+    }
+    writeInChunks(client, stream, rng);
+
+    ASSERT_TRUE(pollUntil(ioService, [&]() {
+      return counter.getStatForDevice(1).first == frames;
+    }));
+    EXPECT_EQ(stats.resyncs.load(), runs);
+    EXPECT_EQ(stats.bytesSkipped.load(), garbage);
+    EXPECT_EQ(stats.invalidHeaders.load(), 0u);
+    EXPECT_EQ(stats.connectionsClosed.load(), 0u);
+  }
+}
+
+TEST_F(TestResyncingTransport, SurvivesRandomStreams) {
+  // whatever arrives, every byte is either counted in a frame, skipped or
+  // waits for the rest of its frame; the connection stays open
+  for (uint32_t seed = 0; seed < 4; seed++) {
+    for (auto mode : {ResyncMode::Header, ResyncMode::Confirmed}) {
+      MsgCounter counter;
+      const CounterShard &shard = counter.getShard(0);
+      boost::asio::io_service ioService;
+      boost::asio::ip::tcp::socket client(ioService);
+      WorkerContext context(counter.getShard(0));
+      context.resync = mode;
+      RfcTransport transport(ioService, context);
+      TcpServer server(0, ioService, transport);
+      ClosingGuard closing(ioService, server, transport);
+      server.listen();
+      client.connect(getEndpoint(server.port()));
+
+      std::mt19937 rng(seed);
+      std::vector<uint8_t> stream;
+      appendFrame(stream, 1, 8);
+      for (int i = 0; i < 200; i++) {
+        auto noise = makeNoise(rng() % 500, rng);
+        stream.insert(stream.end(), noise.begin(), noise.end());
+        appendFrame(stream, 1, rng() % 100);
+      }
+      writeInChunks(client, stream, rng);
+      ASSERT_TRUE(pollUntil(ioService, [&]() {
+        return shard.transport.bytesReceived.load() == stream.size();
+      }));
+      ioService.poll();
+
+      uint64_t counted = 0;
+      for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++)
+        counted += shard.bytes[devId].load();
+      const uint64_t skipped = shard.transport.bytesSkipped.load();
+      EXPECT_LE(counted + skipped, stream.size());
+      EXPECT_LT(stream.size() - counted - skipped,
+                sizeof(RfcMessage::Rfc1006Header) * 2 +
+                    RfcMessage::kMaxPayloadLength);
+      EXPECT_GE(counter.getStatForDevice(1).first, 1u);
+      EXPECT_EQ(shard.transport.connectionsClosed.load(), 0u);
+    }
+  }
+}
@@ -0,0 +1,73 @@
+#include <gtest/gtest.h>
+#include <limits>
+
+#include "Histogram.h"
+
+using DeviceListener::Histogram;
+
+class TestHistogram : public ::testing::Test {
+ public:
+  TestHistogram() {}
+  ~TestHistogram() {}
+};
+
+TEST_F(TestHistogram, BucketsAreContiguous) {
+  for (size_t bucket = 1; bucket < Histogram::kBucketCount; bucket++) {
+    const uint64_t lower = Histogram::getBucketLowerBound(bucket);
+    ASSERT_GT(lower, Histogram::getBucketLowerBound(bucket - 1));
+    ASSERT_EQ(Histogram::getBucket(lower), bucket);
+    ASSERT_EQ(Histogram::getBucket(lower - 1), bucket - 1);
+  }
+  ASSERT_EQ(Histogram::getBucket(std::numeric_limits<uint64_t>::max()),
+            Histogram::kBucketCount - 1);
+}
+
+TEST_F(TestHistogram, RelativeErrorIsBounded) {
+  for (uint64_t value = 1; value < (1ull << 40); value = value * 3 + 1) {
+    const uint64_t lower =
+        Histogram::getBucketLowerBound(Histogram::getBucket(value));
+    ASSERT_LE(lower, value);
+    ASSERT_LE(static_cast<double>(value - lower) / value,
+              1.0 / Histogram::kSubBucketCount);
+  }
+}
+
+TEST_F(TestHistogram, Percentiles) {
+  Histogram histogram;
+  ASSERT_EQ(histogram.getValueAtPercentile(50), 0u);
+  ASSERT_EQ(histogram.getMax(), 0u);
+
+  for (uint64_t value = 1; value <= 1000; value++) histogram.record(value);
+
+  ASSERT_EQ(histogram.getCount(), 1000u);
+  const uint64_t p50 = histogram.getValueAtPercentile(50);
+  const uint64_t p99 = histogram.getValueAtPercentile(99);
+  ASSERT_NEAR(p50, 500, 500 / Histogram::kSubBucketCount);
+  ASSERT_NEAR(p99, 990, 990 / Histogram::kSubBucketCount);
+  ASSERT_NEAR(histogram.getMax(), 1000, 1000 / Histogram::kSubBucketCount);
+}
+
+TEST_F(TestHistogram, Add) {
+  Histogram first;
+  Histogram second;
+  first.record(10);
+  second.record(10);
+  second.record(1000000);
+
+  first.add(second);
+  ASSERT_EQ(first.getCount(), 3u);
+  ASSERT_EQ(first.getValueAtPercentile(50), 10u);
+  ASSERT_EQ(second.getCount(), 2u);
+}
+
+TEST_F(TestHistogram, Reset) {
+  Histogram histogram;
+  histogram.record(10);
+  histogram.record(1000000);
+
+  histogram.reset();
+  ASSERT_EQ(histogram.getCount(), 0u);
+  ASSERT_EQ(histogram.getMax(), 0u);
+  histogram.record(20);
+  ASSERT_EQ(histogram.getValueAtPercentile(50), 20u);
+}
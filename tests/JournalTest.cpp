@@ -0,0 +1,309 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "FrameParser.h"
+#include "Journal.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+#include "TestUtils.h"
+
+using DeviceListener::ClosingGuard;
+using DeviceListener::FrameBatch;
+using DeviceListener::FrameParser;
+using DeviceListener::Journal;
+using DeviceListener::JournalReader;
+using DeviceListener::JournalShard;
+using DeviceListener::MsgCounter;
+using DeviceListener::RfcMessage;
+using DeviceListener::RfcTransport;
+using DeviceListener::TcpServer;
+using DeviceListener::Testing::getEndpoint;
+using DeviceListener::Testing::pollUntil;
+using DeviceListener::WorkerContext;
+
+class TestJournal : public ::testing::Test {
+ public:
+  TestJournal() {
+    char path[] = "/tmp/journalXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    path_ = path;
+  }
+  ~TestJournal() { unlink(path_.c_str()); }
+
+  static void appendFrame(std::vector<uint8_t> &stream,
+                          const JournalReader::Row &row) {
+    RfcMessage::Rfc1006Header header = {
+        RfcMessage::kProtocolVersion, 0,
+        static_cast<uint16_t>(row.frameLength -
+                              sizeof(RfcMessage::Rfc1006Header))};
+    RfcMessage::PayloadHeader payload = {};
+    payload.deviceId = row.deviceId;
+    payload.measurementTag = row.measurementTag;
+    payload.measurementType = row.measurementType;
+    payload.timestamp = row.timestamp;
+    size_t offset = stream.size();
+    stream.resize(offset + row.frameLength);
+    std::memcpy(&stream[offset], &header, sizeof(header));
+    std::memcpy(&stream[offset + sizeof(header)], &payload, sizeof(payload));
+  }
+
+  static JournalReader::Row makeRow(uint16_t devId, uint32_t timestamp) {
+    return {devId, 0, 0, timestamp, RfcTransport::kMinFrameSize, 0};
+  }
+
+  /**
+   * \brief parses the rows into the shard the way the transports do
+   */
+  static void add(JournalShard &shard,
+                  const std::vector<JournalReader::Row> &rows) {
+    std::vector<uint8_t> stream;
+    for (const auto &row : rows) appendFrame(stream, row);
+    FrameBatch batch;
+    batch.withMetadata = true;
+    auto result = FrameParser::parseBatches(
+        stream.data(), stream.size(), batch,
+        [&shard, &batch](const uint16_t *, const uint16_t *, size_t count) {
+          shard.add(batch, count);
+        });
+    ASSERT_EQ(result.consumed, stream.size());
+  }
+
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  std::vector<JournalReader::Row> readAll() const {
+    std::vector<JournalReader::Row> rows;
+    JournalReader(path_).forEach(
+        JournalReader::Query(),
+        [&rows](const JournalReader::Row &row) { rows.push_back(row); });
+    return rows;
+  }
+
+  void truncateBy(size_t bytes) const {
+    std::ifstream file(path_, std::ios::binary | std::ios::ate);
+    const auto size = static_cast<size_t>(file.tellg());
+    ASSERT_EQ(truncate(path_.c_str(), size - bytes), 0);
+  }
+
+ protected:
+  std::string path_;
+};
+
+TEST_F(TestJournal, WritesEveryRowOfEveryThread) {
+  std::mt19937 rng(5);
+  std::vector<JournalReader::Row> first, second;
+  // more than a block, with values jumping across their whole range
+  for (size_t i = 0; i < JournalShard::kBlockRows + 1000; i++)
+    first.push_back({static_cast<uint16_t>(rng() | 1),
+                     static_cast<uint16_t>(rng()),
+                     static_cast<uint16_t>(rng()), static_cast<uint32_t>(rng()),
+                     static_cast<uint16_t>(RfcTransport::kMinFrameSize +
+                                           rng() % 100),
+                     0});
+  for (uint32_t i = 0; i < 10; i++) second.push_back(makeRow(8, i));
+
+  const uint64_t before = now();
+  {
+    Journal journal(path_, 2);
+    journal.start();
+    add(journal.getShard(0), first);
+    add(journal.getShard(1), second);
+    journal.stop();
+    EXPECT_EQ(journal.getRowCount(), first.size() + second.size());
+    EXPECT_EQ(journal.getDroppedCount(), 0u);
+  }
+  const uint64_t after = now();
+
+  // the rows of a thread stay in their order, the first one sends odd IDs
+  auto rows = readAll();
+  ASSERT_EQ(rows.size(), first.size() + second.size());
+  size_t fromFirst = 0, fromSecond = 0;
+  for (const auto &row : rows) {
+    EXPECT_GE(row.arrival, before);
+    EXPECT_LE(row.arrival, after);
+    const auto &expected =
+        row.deviceId & 1 ? first[fromFirst++] : second[fromSecond++];
+    ASSERT_EQ(row.deviceId, expected.deviceId);
+    ASSERT_EQ(row.measurementTag, expected.measurementTag);
+    ASSERT_EQ(row.measurementType, expected.measurementType);
+    ASSERT_EQ(row.timestamp, expected.timestamp);
+    ASSERT_EQ(row.frameLength, expected.frameLength);
+  }
+}
+
+TEST_F(TestJournal, QueriesSkipTheBlocksOutOfRange) {
+  {
+    // one block per round: stop() seals the open one
+    Journal journal(path_, 1);
+    for (uint32_t round = 1; round <= 3; round++) {
+      std::vector<JournalReader::Row> rows;
+      for (uint32_t i = 0; i < 100; i++)
+        rows.push_back(makeRow(round * 10 + i % 2, round * 1000 + i));
+      add(journal.getShard(0), rows);
+      journal.stop();
+    }
+  }
+
+  JournalReader reader(path_);
+  JournalReader::Query query;
+  query.field = JournalReader::TimeField::Timestamp;
+  query.from = 2000;
+  query.to = 2999;
+  JournalReader::Stats stats;
+  auto counts = reader.count(query, &stats);
+  ASSERT_EQ(counts.size(), 2u);
+  EXPECT_EQ(counts[20], 50u);
+  EXPECT_EQ(counts[21], 50u);
+  EXPECT_EQ(stats.blocks, 3u);
+  EXPECT_EQ(stats.skipped, 2u);
+  // the block lies within the range, the devices are enough
+  EXPECT_EQ(stats.columnsDecoded, 1u);
+
+  // the range cuts the block, its timestamps are decoded too
+  query.from = 3000;
+  query.to = 3009;
+  stats = JournalReader::Stats();
+  counts = reader.count(query, &stats);
+  EXPECT_EQ(counts[30], 5u);
+  EXPECT_EQ(counts[31], 5u);
+  EXPECT_EQ(stats.columnsDecoded, 2u);
+
+  // the device filter of the other blocks rules them out
+  JournalReader::Query device;
+  device.oneDevice = true;
+  device.deviceId = 11;
+  stats = JournalReader::Stats();
+  counts = reader.count(device, &stats);
+  ASSERT_EQ(counts.size(), 1u);
+  EXPECT_EQ(counts[11], 50u);
+  EXPECT_EQ(stats.skipped, 2u);
+
+  size_t printed = 0;
+  reader.forEach(query, [&printed](const JournalReader::Row &row) {
+    EXPECT_GE(row.timestamp, 3000u);
+    EXPECT_LE(row.timestamp, 3009u);
+    printed++;
+  });
+  EXPECT_EQ(printed, 10u);
+}
+
+TEST_F(TestJournal, CutsOffTheTornTailAndAppendsAfterIt) {
+  {
+    Journal journal(path_, 1);
+    add(journal.getShard(0), {makeRow(1, 1), makeRow(1, 2)});
+    journal.stop();
+    add(journal.getShard(0), {makeRow(2, 3)});
+  }
+  // a crash in the middle of the second append
+  truncateBy(3);
+  EXPECT_EQ(readAll().size(), 2u);
+
+  {
+    Journal journal(path_, 1);
+    add(journal.getShard(0), {makeRow(3, 4)});
+  }
+  auto rows = readAll();
+  ASSERT_EQ(rows.size(), 3u);
+  EXPECT_EQ(rows[1].timestamp, 2u);
+  EXPECT_EQ(rows[2].deviceId, 3);
+}
+
+TEST_F(TestJournal, SkipsDamagedBlocks) {
+  {
+    Journal journal(path_, 1);
+    add(journal.getShard(0), {makeRow(1, 1)});
+    journal.stop();
+    add(journal.getShard(0), {makeRow(2, 2)});
+  }
+  // damage the last column of the second block, the padding after it is 0
+  std::ifstream in(path_, std::ios::binary);
+  std::vector<char> bytes((std::istreambuf_iterator<char>(in)),
+                          std::istreambuf_iterator<char>());
+  in.close();
+  size_t pos = bytes.size() - 1;
+  while (!bytes[pos]) pos--;
+  bytes[pos] ^= 0x40;
+  std::ofstream(path_, std::ios::binary).write(bytes.data(), bytes.size());
+
+  JournalReader reader(path_);
+  JournalReader::Stats stats;
+  auto counts = reader.count(JournalReader::Query(), &stats);
+  EXPECT_EQ(stats.blocks, 2u);
+  EXPECT_EQ(counts[1], 1u);
+  // the damage is in the arrival column, counting by device doesn't need it
+  EXPECT_EQ(counts[2], 1u);
+
+  stats = JournalReader::Stats();
+  size_t rows = 0;
+  reader.forEach(JournalReader::Query(),
+                 [&rows](const JournalReader::Row &) { rows++; }, &stats);
+  EXPECT_EQ(rows, 1u);
+  EXPECT_EQ(stats.damaged, 1u);
+}
+
+TEST_F(TestJournal, DropsRowsWhileTheWriterIsBehind) {
+  Journal journal(path_, 1);
+  std::vector<JournalReader::Row> rows(FrameBatch::kCapacity, makeRow(1, 1));
+  // the thread isn't started, nothing is written until stop()
+  const size_t held = JournalShard::kBlocks * JournalShard::kBlockRows;
+  for (size_t i = 0; i < held / rows.size() + 1; i++)
+    add(journal.getShard(0), rows);
+  EXPECT_EQ(journal.getDroppedCount(), rows.size());
+  EXPECT_EQ(journal.getRowCount(), 0u);
+
+  journal.stop();
+  EXPECT_EQ(journal.getRowCount(), held);
+  EXPECT_GT(journal.getBytesWritten(), 0u);
+}
+
+TEST_F(TestJournal, RejectsAFileThatIsNotAJournal) {
+  std::ofstream(path_) << "1,device\n";
+  EXPECT_THROW(Journal(path_, 1), std::invalid_argument);
+  EXPECT_THROW(JournalReader reader(path_), std::invalid_argument);
+  std::string contents;
+  std::getline(std::ifstream(path_), contents);
+  EXPECT_EQ(contents, "1,device");
+}
+
+TEST_F(TestJournal, TransportJournalsTheFramesItCounts) {
+  MsgCounter counter;
+  {
+    Journal journal(path_, 1);
+    boost::asio::io_service ioService;
+    boost::asio::ip::tcp::socket client(ioService);
+    WorkerContext context(counter.getShard(0));
+    context.journal = &journal.getShard(0);
+    RfcTransport transport(ioService, context);
+    TcpServer server(0, ioService, transport);
+    ClosingGuard closing(ioService, server, transport);
+    server.listen();
+    client.connect(getEndpoint(server.port()));
+
+    std::vector<uint8_t> stream;
+    for (uint32_t i = 0; i < 100; i++) appendFrame(stream, makeRow(3, i));
+    boost::asio::write(client, boost::asio::buffer(stream));
+    pollUntil(ioService,
+              [&]() { return counter.getStatForDevice(3).first >= 100; });
+  }
+
+  auto rows = readAll();
+  ASSERT_EQ(rows.size(), 100u);
+  for (uint32_t i = 0; i < 100; i++) {
+    EXPECT_EQ(rows[i].deviceId, 3);
+    EXPECT_EQ(rows[i].timestamp, i);
+  }
+}
@@ -0,0 +1,132 @@
+#include <gtest/gtest.h>
+#include <boost/asio/error.hpp>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Logger.h"
+
+using DeviceListener::Logger;
+
+class TestLogger : public ::testing::Test {
+ public:
+  TestLogger() {}
+  ~TestLogger() {}
+
+  static boost::asio::ip::address makeAddress(uint32_t i) {
+    return boost::asio::ip::address_v4(0x0A000000 + i);
+  }
+
+  static size_t countLines(const std::string &text, const std::string &start) {
+    size_t count = 0;
+    std::istringstream lines(text);
+    for (std::string line; std::getline(lines, line);)
+      if (line.compare(0, start.size(), start) == 0) count++;
+    return count;
+  }
+};
+
+TEST_F(TestLogger, FormatsRecordsIntoTheirStreams) {
+  std::ostringstream out, err;
+  Logger logger(out, err);
+  logger.log(Logger::Event::DeviceConnected, makeAddress(1));
+  logger.log(Logger::Event::ReadFailed, makeAddress(3),
+             boost::asio::error::eof);
+  logger.log(Logger::Event::WaitFailed, boost::asio::ip::address(),
+             boost::asio::error::connection_reset);
+  logger.log(Logger::Event::InvalidHeader);
+  logger.log(Logger::Event::StreamResynced, makeAddress(2),
+             boost::system::error_code(), 37);
+  logger.stop();
+
+  EXPECT_EQ(out.str(), "Device connected: 10.0.0.1\n");
+  EXPECT_EQ(err.str(),
+            "Error occured during 'read' call from 10.0.0.3: End of file\n"
+            "Error occured during 'wait' call from unknown: "
+            "Connection reset by peer\n"
+            "Error occured: invalid header from unknown\n"
+            "Resynchronized stream from 10.0.0.2, bytes skipped: 37\n");
+}
+
+TEST_F(TestLogger, CollapsesRepeatedRecords) {
+  std::ostringstream out, err;
+  Logger logger(out, err);
+  for (int i = 0; i < 1000; i++)
+    logger.log(Logger::Event::DeviceConnected, makeAddress(1));
+  logger.log(Logger::Event::DeviceDisconnected, makeAddress(1));
+  logger.stop();
+
+  EXPECT_EQ(out.str(),
+            "Device connected: 10.0.0.1\n"
+            "Last message repeated 999 times\n"
+            "Disconnected device: 10.0.0.1\n");
+  EXPECT_EQ(logger.getSuppressedCount(), 0u);
+}
+
+TEST_F(TestLogger, LimitsLinesOfEachEventPerSecond) {
+  std::ostringstream out, err;
+  Logger logger(out, err);
+  const unsigned extra = 50;
+  for (unsigned i = 0; i < Logger::kMaxLinesPerSecond + extra; i++)
+    logger.log(Logger::Event::DeviceConnected, makeAddress(i));
+  // another event has a budget of its own
+  logger.log(Logger::Event::DeviceDisconnected, makeAddress(1));
+  logger.stop();
+
+  EXPECT_EQ(countLines(out.str(), "Device connected: "),
+            Logger::kMaxLinesPerSecond);
+  EXPECT_EQ(countLines(out.str(), "Disconnected device: "), 1u);
+  EXPECT_NE(out.str().find("Suppressed 50 'device connected' messages"),
+            std::string::npos);
+  EXPECT_EQ(logger.getSuppressedCount(), extra);
+}
+
+TEST_F(TestLogger, DropsRecordsIfTheRingIsFull) {
+  std::ostringstream out, err;
+  Logger logger(out, err);
+  // nothing writes the records out until stop()
+  for (size_t i = 0; i < Logger::kCapacity + 10; i++)
+    logger.log(Logger::Event::AcceptFailed, boost::asio::ip::address(),
+               boost::asio::error::no_descriptors);
+  EXPECT_EQ(logger.getDroppedCount(), 10u);
+  logger.stop();
+
+  EXPECT_EQ(countLines(err.str(), "Error occured during 'accept' call: "), 1u);
+  EXPECT_NE(err.str().find("Last message repeated 4095 times"),
+            std::string::npos);
+}
+
+TEST_F(TestLogger, AccountsForRecordsOfConcurrentThreads) {
+  std::ostringstream out, err;
+  Logger logger(out, err);
+  logger.start();
+  const unsigned threads = 4, records = 5000;
+  std::vector<std::thread> producers;
+  for (unsigned t = 0; t < threads; t++)
+    producers.emplace_back([&logger, t]() {
+      for (unsigned i = 0; i < records; i++)
+        logger.log(Logger::Event::DeviceConnected,
+                   makeAddress(t * records + i));
+    });
+  for (auto &producer : producers) producer.join();
+  logger.stop();
+
+  // every address is different, so nothing is collapsed
+  EXPECT_EQ(countLines(out.str(), "Device connected: ") +
+                logger.getSuppressedCount() + logger.getDroppedCount(),
+            threads * records);
+}
+
+TEST_F(TestLogger, DiscardsRecordsWhileDisabled) {
+  std::ostringstream out, err;
+  Logger logger(out, err);
+  logger.setEnabled(false);
+  logger.log(Logger::Event::DeviceConnected, makeAddress(1));
+  logger.setEnabled(true);
+  logger.log(Logger::Event::DeviceConnected, makeAddress(2));
+  logger.stop();
+
+  EXPECT_EQ(out.str(), "Device connected: 10.0.0.2\n");
+  EXPECT_EQ(logger.getDroppedCount(), 0u);
+}
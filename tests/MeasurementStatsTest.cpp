@@ -0,0 +1,217 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <cstring>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "FrameParser.h"
+#include "MeasurementStats.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TcpServer.h"
+#include "TestUtils.h"
+
+using DeviceListener::ClosingGuard;
+using DeviceListener::FrameBatch;
+using DeviceListener::FrameParser;
+using DeviceListener::MeasurementShard;
+using DeviceListener::MeasurementStats;
+using DeviceListener::MsgCounter;
+using DeviceListener::RfcMessage;
+using DeviceListener::RfcTransport;
+using DeviceListener::TcpServer;
+using DeviceListener::Testing::getEndpoint;
+using DeviceListener::Testing::pollUntil;
+using DeviceListener::WorkerContext;
+
+class TestMeasurementStats : public ::testing::Test {
+ public:
+  TestMeasurementStats() {}
+  ~TestMeasurementStats() {}
+
+  static void appendFrame(std::vector<uint8_t> &stream, uint16_t devId,
+                          uint16_t type, uint32_t timestamp,
+                          size_t dataLength) {
+    RfcMessage::Rfc1006Header header = {
+        RfcMessage::kProtocolVersion, 0,
+        static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) + dataLength)};
+    RfcMessage::PayloadHeader payload = {};
+    payload.deviceId = devId;
+    payload.measurementType = type;
+    payload.timestamp = timestamp;
+    payload.dataLength = static_cast<uint16_t>(dataLength);
+    size_t offset = stream.size();
+    stream.resize(offset + sizeof(header) + header.length);
+    std::memcpy(&stream[offset], &header, sizeof(header));
+    std::memcpy(&stream[offset + sizeof(header)], &payload, sizeof(payload));
+  }
+
+  /**
+   * \brief parses the stream into the shard the way the transports do
+   */
+  static void aggregate(MeasurementShard &shard,
+                        const std::vector<uint8_t> &stream) {
+    FrameBatch batch;
+    batch.withMetadata = true;
+    auto result = FrameParser::parseBatches(
+        stream.data(), stream.size(), batch,
+        [&shard, &batch](const uint16_t *, const uint16_t *, size_t count) {
+          shard.add(batch, count);
+        });
+    ASSERT_EQ(result.consumed, stream.size());
+  }
+
+  using Key = std::pair<uint16_t, uint16_t>;
+
+  static std::map<Key, MeasurementStats::Entry> byKey(
+      const std::vector<MeasurementStats::Entry> &entries) {
+    std::map<Key, MeasurementStats::Entry> map;
+    for (const auto &entry : entries)
+      map[Key(entry.deviceId, entry.measurementType)] = entry;
+    return map;
+  }
+};
+
+TEST_F(TestMeasurementStats, AggregatesEveryPairOfDeviceAndType) {
+  MeasurementStats stats(1);
+  std::vector<uint8_t> stream;
+  appendFrame(stream, 1, 7, 100, 10);
+  appendFrame(stream, 1, 7, 105, 20);
+  appendFrame(stream, 1, 8, 50, 0);
+  appendFrame(stream, 1, 7, 103, 30);
+  appendFrame(stream, 2, 7, 1, 5);
+  aggregate(stats.getShard(0), stream);
+
+  // the pair goes on in the next batch, out of order right away
+  stream.clear();
+  appendFrame(stream, 1, 7, 90, 1);
+  aggregate(stats.getShard(0), stream);
+
+  auto entries = stats.getEntries();
+  ASSERT_EQ(entries.size(), 3u);
+  // ordered by device, then type
+  EXPECT_EQ(entries[0].deviceId, 1);
+  EXPECT_EQ(entries[0].measurementType, 7);
+  EXPECT_EQ(entries[1].measurementType, 8);
+  EXPECT_EQ(entries[2].deviceId, 2);
+
+  const auto &pair = entries[0];
+  EXPECT_EQ(pair.count, 4u);
+  EXPECT_EQ(pair.dataBytes, 61u);
+  EXPECT_EQ(pair.outOfOrder, 2u);
+  EXPECT_EQ(pair.minTimestamp, 90u);
+  EXPECT_EQ(pair.maxTimestamp, 105u);
+  EXPECT_EQ(pair.lastTimestamp, 90u);
+  EXPECT_EQ(entries[1].count, 1u);
+  EXPECT_EQ(entries[1].outOfOrder, 0u);
+  EXPECT_EQ(stats.getDroppedCount(), 0u);
+}
+
+TEST_F(TestMeasurementStats, MatchesPerFrameAggregation) {
+  MeasurementStats stats(1);
+  std::map<Key, MeasurementStats::Entry> expected;
+  std::mt19937 rng(11);
+  for (int round = 0; round < 50; round++) {
+    // runs of one pair mixed with single frames of other pairs
+    std::vector<uint8_t> stream;
+    for (size_t frames = 0; frames < 1000;) {
+      const uint16_t devId = rng() % 50, type = rng() % 4;
+      const size_t run = rng() % 3 ? 1 + rng() % 40 : 1;
+      for (size_t i = 0; i < run; i++, frames++) {
+        const uint32_t timestamp = rng() % 1000000;
+        const size_t dataLength = rng() % 64;
+        appendFrame(stream, devId, type, timestamp, dataLength);
+
+        auto inserted = expected.emplace(
+            Key(devId, type), MeasurementStats::Entry{
+                                  devId, type, 0, 0, 0, timestamp, timestamp,
+                                  timestamp});
+        auto &entry = inserted.first->second;
+        if (entry.count && timestamp < entry.lastTimestamp) entry.outOfOrder++;
+        entry.count++;
+        entry.dataBytes += dataLength;
+        entry.minTimestamp = std::min(entry.minTimestamp, timestamp);
+        entry.maxTimestamp = std::max(entry.maxTimestamp, timestamp);
+        entry.lastTimestamp = timestamp;
+      }
+    }
+    aggregate(stats.getShard(0), stream);
+  }
+
+  auto actual = byKey(stats.getEntries());
+  ASSERT_EQ(actual.size(), expected.size());
+  for (const auto &pair : expected) {
+    const auto &a = actual[pair.first];
+    const auto &e = pair.second;
+    ASSERT_EQ(std::tie(a.count, a.dataBytes, a.outOfOrder, a.minTimestamp,
+                       a.maxTimestamp, a.lastTimestamp),
+              std::tie(e.count, e.dataBytes, e.outOfOrder, e.minTimestamp,
+                       e.maxTimestamp, e.lastTimestamp))
+        << "device " << e.deviceId << " type " << e.measurementType;
+  }
+}
+
+TEST_F(TestMeasurementStats, MergesTheThreads) {
+  MeasurementStats stats(2);
+  std::vector<uint8_t> first, second;
+  appendFrame(first, 1, 1, 200, 4);
+  appendFrame(first, 1, 1, 150, 4);
+  appendFrame(second, 1, 1, 100, 6);
+  aggregate(stats.getShard(0), first);
+  aggregate(stats.getShard(1), second);
+
+  auto entries = stats.getEntries();
+  ASSERT_EQ(entries.size(), 1u);
+  EXPECT_EQ(entries[0].count, 3u);
+  EXPECT_EQ(entries[0].dataBytes, 14u);
+  EXPECT_EQ(entries[0].outOfOrder, 1u);
+  EXPECT_EQ(entries[0].minTimestamp, 100u);
+  EXPECT_EQ(entries[0].maxTimestamp, 200u);
+  // of the thread with the highest timestamp
+  EXPECT_EQ(entries[0].lastTimestamp, 150u);
+}
+
+TEST_F(TestMeasurementStats, CountsWhatDoesNotFitTheTable) {
+  MeasurementStats stats(1);
+  const size_t pairs = MeasurementShard::kCapacity + 1000;
+  for (size_t i = 0; i < pairs; i += FrameBatch::kCapacity) {
+    std::vector<uint8_t> stream;
+    for (size_t j = i; j < i + FrameBatch::kCapacity && j < pairs; j++)
+      appendFrame(stream, static_cast<uint16_t>(j), static_cast<uint16_t>(j),
+                  1, 0);
+    aggregate(stats.getShard(0), stream);
+  }
+
+  const auto entries = stats.getEntries();
+  EXPECT_LE(entries.size(), MeasurementShard::kCapacity);
+  EXPECT_EQ(entries.size() + stats.getDroppedCount(), pairs);
+}
+
+TEST_F(TestMeasurementStats, TransportAggregatesTheFramesItCounts) {
+  MsgCounter counter;
+  MeasurementStats stats(1);
+  boost::asio::io_service ioService;
+  boost::asio::ip::tcp::socket client(ioService);
+  WorkerContext context(counter.getShard(0));
+  context.measurements = &stats.getShard(0);
+  RfcTransport transport(ioService, context);
+  TcpServer server(0, ioService, transport);
+  ClosingGuard closing(ioService, server, transport);
+  server.listen();
+  client.connect(getEndpoint(server.port()));
+
+  std::vector<uint8_t> stream;
+  for (uint32_t i = 0; i < 100; i++) appendFrame(stream, 3, i % 2, i, 8);
+  boost::asio::write(client, boost::asio::buffer(stream));
+  pollUntil(ioService,
+            [&]() { return counter.getStatForDevice(3).first >= 100; });
+
+  auto entries = stats.getEntries();
+  ASSERT_EQ(entries.size(), 2u);
+  EXPECT_EQ(entries[0].count + entries[1].count, 100u);
+  EXPECT_EQ(entries[0].dataBytes, 50u * 8);
+  EXPECT_EQ(entries[0].outOfOrder + entries[1].outOfOrder, 0u);
+  EXPECT_EQ(entries[1].lastTimestamp, 99u);
+}
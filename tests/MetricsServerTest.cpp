@@ -0,0 +1,262 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "Journal.h"
+#include "MeasurementStats.h"
+#include "MetricsServer.h"
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TagSketches.h"
+#include "TestUtils.h"
+
+using DeviceListener::CounterShard;
+using DeviceListener::MetricsServer;
+using DeviceListener::MsgCounter;
+using DeviceListener::Testing::getEndpoint;
+
+class TestMetricsServer : public ::testing::Test {
+ public:
+  TestMetricsServer() {}
+  ~TestMetricsServer() {}
+
+  static void loadDevices(MsgCounter &counter, const std::string &contents) {
+    char path[] = "/tmp/devicesXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    std::ofstream(path) << contents;
+    counter.readDevicesFromFile(path);
+    unlink(path);
+  }
+
+  static std::string scrape(uint16_t port, const std::string &target) {
+    boost::asio::io_service ioService;
+    boost::asio::ip::tcp::socket socket(ioService);
+    socket.connect(getEndpoint(port));
+    std::string request =
+        "GET " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    boost::asio::write(socket, boost::asio::buffer(request));
+    std::string response;
+    boost::system::error_code err;
+    char chunk[4096];
+    size_t length;
+    while ((length = socket.read_some(boost::asio::buffer(chunk), err)))
+      response.append(chunk, length);
+    return response;
+  }
+};
+
+TEST_F(TestMetricsServer, RendersDeviceCountersWithNames) {
+  MsgCounter counter;
+  loadDevices(counter, "5:Pump \"A\"\n9:Idle\n");
+  counter.incrementCounter(5);
+  counter.incrementCounter(5);
+  counter.incrementCounter(7);
+
+  boost::asio::io_service ioService;
+  MetricsServer metrics(0, ioService, counter);
+  std::string out;
+  metrics.render(out);
+
+  EXPECT_NE(out.find("# TYPE device_listener_device_messages_total counter"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_device_messages_total{device_id=\"5\","
+                     "device_name=\"Pump \\\"A\\\"\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_device_messages_total{device_id=\"7\"} "
+                     "1\n"),
+            std::string::npos);
+  // known devices are exported even if silent, unknown silent ones aren't
+  EXPECT_NE(out.find("device_listener_device_messages_total{device_id=\"9\","
+                     "device_name=\"Idle\"} 0\n"),
+            std::string::npos);
+  EXPECT_EQ(out.find("device_id=\"8\""), std::string::npos);
+}
+
+TEST_F(TestMetricsServer, RendersTransportStatsPerWorker) {
+  MsgCounter counter(2);
+  const uint16_t devIds[] = {1, 2, 3};
+  const uint16_t frameLengths[] = {16, 16, 16};
+  counter.getShard(1).incrementCounters(devIds, frameLengths, 3);
+  DeviceListener::addRelaxed(counter.getShard(1).transport.bytesReceived, 48);
+  DeviceListener::addRelaxed(counter.getShard(0).transport.connectionsOpened,
+                             3);
+  DeviceListener::addRelaxed(counter.getShard(0).transport.connectionsClosed,
+                             1);
+
+  boost::asio::io_service ioService;
+  MetricsServer metrics(0, ioService, counter);
+  std::string out;
+  metrics.render(out);
+
+  EXPECT_NE(out.find("device_listener_messages_total{worker=\"1\"} 3\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_received_bytes_total{worker=\"1\"} 48\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_connections_active{worker=\"0\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_invalid_headers_total{worker=\"0\"} 0\n"),
+            std::string::npos);
+}
+
+TEST_F(TestMetricsServer, RendersSourceErrorsIfGiven) {
+  MsgCounter counter;
+  DeviceListener::SourceErrors sourceErrors;
+  auto source = boost::asio::ip::address::from_string("10.0.0.7");
+  auto &shard = sourceErrors.getShard(0);
+  shard.record(source, DeviceListener::SourceErrors::Reason::Truncated);
+  shard.record(source, DeviceListener::SourceErrors::Reason::Truncated);
+
+  boost::asio::io_service ioService;
+  std::string out;
+  MetricsServer(0, ioService, counter).render(out);
+  EXPECT_EQ(out.find("device_listener_source_errors_total"), std::string::npos);
+
+  out.clear();
+  MetricsServer(0, ioService, counter, &sourceErrors).render(out);
+  EXPECT_NE(out.find("device_listener_source_errors_total{source=\"10.0.0.7\","
+                     "reason=\"truncated\"} 2\n"),
+            std::string::npos);
+  EXPECT_EQ(out.find("reason=\"invalid_header\""), std::string::npos);
+}
+
+TEST_F(TestMetricsServer, RendersMeasurementsIfGiven) {
+  MsgCounter counter;
+  DeviceListener::MeasurementStats measurements(1);
+  DeviceListener::FrameBatch batch;
+  batch.deviceIds[0] = 4;
+  batch.measurementTypes[0] = 2;
+  batch.timestamps[0] = 77;
+  batch.frameLengths[0] = DeviceListener::RfcTransport::kMinFrameSize + 5;
+  measurements.getShard(0).add(batch, 1);
+
+  boost::asio::io_service ioService;
+  std::string out;
+  MetricsServer(0, ioService, counter).render(out);
+  EXPECT_EQ(out.find("device_listener_measurements_total"), std::string::npos);
+
+  out.clear();
+  MetricsServer(0, ioService, counter, nullptr, &measurements).render(out);
+  EXPECT_NE(out.find("device_listener_measurements_total{device_id=\"4\","
+                     "measurement_type=\"2\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_measurement_data_bytes_total{device_id="
+                     "\"4\",measurement_type=\"2\"} 5\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_measurement_last_timestamp{device_id="
+                     "\"4\",measurement_type=\"2\"} 77\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_measurements_dropped_total 0\n"),
+            std::string::npos);
+}
+
+TEST_F(TestMetricsServer, RendersJournalIfGiven) {
+  MsgCounter counter;
+  char path[] = "/tmp/journalXXXXXX";
+  close(mkstemp(path));
+  {
+    DeviceListener::Journal journal(path, 1);
+    DeviceListener::FrameBatch batch;
+    batch.deviceIds[0] = 4;
+    batch.frameLengths[0] = DeviceListener::RfcTransport::kMinFrameSize;
+    journal.getShard(0).add(batch, 1);
+    journal.stop();
+
+    boost::asio::io_service ioService;
+    std::string out;
+    MetricsServer(0, ioService, counter).render(out);
+    EXPECT_EQ(out.find("device_listener_journal"), std::string::npos);
+
+    out.clear();
+    MetricsServer(0, ioService, counter, nullptr, nullptr, &journal)
+        .render(out);
+    EXPECT_NE(out.find("device_listener_journal_messages_total 1\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("device_listener_journal_dropped_total 0\n"),
+              std::string::npos);
+  }
+  unlink(path);
+}
+
+TEST_F(TestMetricsServer, RendersSketchesIfGiven) {
+  MsgCounter counter;
+  DeviceListener::TagSketches sketches(1);
+  DeviceListener::FrameBatch batch;
+  for (size_t i = 0; i < 3; i++) {
+    batch.deviceIds[i] = 4;
+    batch.measurementTags[i] = static_cast<uint16_t>(i ? 9 : 8);
+  }
+  sketches.getShard(0).add(batch, 3);
+
+  boost::asio::io_service ioService;
+  std::string out;
+  MetricsServer(0, ioService, counter).render(out);
+  EXPECT_EQ(out.find("device_listener_tag_"), std::string::npos);
+
+  out.clear();
+  MetricsServer(0, ioService, counter, nullptr, nullptr, nullptr, &sketches)
+      .render(out);
+  EXPECT_NE(out.find("device_listener_tag_heavy_hitter_messages{device_id="
+                     "\"4\",measurement_tag=\"9\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_tag_heavy_hitter_error{device_id="
+                     "\"4\",measurement_tag=\"8\"} 0\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_distinct_measurement_tags{device_id="
+                     "\"4\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(out.find("device_listener_tag_sketch_dropped_total 0\n"),
+            std::string::npos);
+}
+
+TEST_F(TestMetricsServer, RendersAllDevicesIntoReservedBuffer) {
+  MsgCounter counter;
+  for (size_t devId = 0; devId < CounterShard::kDeviceCount; devId++)
+    counter.incrementCounter(devId);
+
+  boost::asio::io_service ioService;
+  MetricsServer metrics(0, ioService, counter);
+  std::string out;
+  metrics.render(out);
+  EXPECT_EQ(std::count(out.begin(), out.end(), '\n'),
+            static_cast<long>(CounterShard::kDeviceCount) + 2 + 2 + 12 * 3 + 3 +
+                                3 + 2 * 3);
+
+  // once the capacity is known a scrape doesn't grow the buffer
+  std::string next;
+  next.reserve(out.size());
+  const size_t capacity = next.capacity();
+  metrics.render(next);
+  EXPECT_EQ(next, out);
+  EXPECT_EQ(next.capacity(), capacity);
+}
+
+TEST_F(TestMetricsServer, ServesScrapeOverHttp) {
+  MsgCounter counter;
+  counter.incrementCounter(42);
+
+  boost::asio::io_service ioService;
+  MetricsServer metrics(0, ioService, counter);
+  metrics.listen();
+  ASSERT_NE(metrics.port(), 0);
+  std::thread server([&ioService]() { ioService.run(); });
+
+  std::string response = scrape(metrics.port(), "/metrics");
+  std::string missing = scrape(metrics.port(), "/");
+  ioService.stop();
+  server.join();
+
+  EXPECT_EQ(response.compare(0, 17, "HTTP/1.1 200 OK\r\n"), 0);
+  EXPECT_NE(response.find("Content-Type: text/plain; version=0.0.4"),
+            std::string::npos);
+  EXPECT_NE(response.find("device_listener_device_messages_total{device_id="
+                          "\"42\"} 1\n"),
+            std::string::npos);
+  EXPECT_EQ(missing.compare(0, 24, "HTTP/1.1 404 Not Found\r\n"), 0);
+}
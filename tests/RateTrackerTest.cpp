@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+
+#include "MsgCounter.h"
+#include "RateTracker.h"
+
+using DeviceListener::MsgCounter;
+using DeviceListener::RateTracker;
+
+class TestRateTracker : public ::testing::Test {
+ public:
+  static const uint64_t kSecond = 1000000000;
+  static const uint16_t kFrameLength = 16;
+
+  TestRateTracker() : rates_(counter_), now_(kSecond) {
+    rates_.sample(now_);
+  }
+  ~TestRateTracker() {}
+
+  // every second devId sends perSecond messages, then a sample is taken
+  void run(uint16_t devId, uint32_t perSecond, uint32_t seconds) {
+    for (uint32_t s = 0; s < seconds; s++) {
+      for (uint32_t i = 0; i < perSecond; i++)
+        counter_.getShard(0).incrementCounter(devId, kFrameLength);
+      now_ += kSecond;
+      rates_.sample(now_);
+    }
+  }
+
+ protected:
+  MsgCounter counter_;
+  RateTracker rates_;
+  uint64_t now_;
+};
+
+TEST_F(TestRateTracker, SteadyRateConverges) {
+  run(1, 100, 300);
+
+  for (auto window : {RateTracker::kWindow1s, RateTracker::kWindow10s,
+                      RateTracker::kWindow60s}) {
+    EXPECT_NEAR(rates_.getMessageRate(1, window), 100, 1);
+    EXPECT_NEAR(rates_.getByteRate(1, window), 100 * kFrameLength, 16);
+  }
+  EXPECT_EQ(rates_.getHealth(1), RateTracker::Health::Ok);
+  EXPECT_EQ(rates_.getHealth(2), RateTracker::Health::Unseen);
+}
+
+TEST_F(TestRateTracker, ShortWindowsReactFaster) {
+  run(1, 10, 300);
+  run(1, 50, 3);
+
+  EXPECT_GT(rates_.getMessageRate(1, RateTracker::kWindow1s), 45);
+  EXPECT_LT(rates_.getMessageRate(1, RateTracker::kWindow10s), 30);
+  EXPECT_LT(rates_.getMessageRate(1, RateTracker::kWindow60s), 15);
+}
+
+TEST_F(TestRateTracker, FloodingDevice) {
+  run(1, 10, 300);
+  run(1, 100, 10);
+  EXPECT_EQ(rates_.getHealth(1), RateTracker::Health::Flooding);
+}
+
+TEST_F(TestRateTracker, QuietDevice) {
+  run(1, 100, 300);
+  run(1, 5, 10);
+  EXPECT_EQ(rates_.getHealth(1), RateTracker::Health::Quiet);
+}
+
+TEST_F(TestRateTracker, StaleDevice) {
+  run(1, 10, 100);
+  run(1, 0, 10);
+  EXPECT_NE(rates_.getHealth(1), RateTracker::Health::Stale);
+  run(1, 0, 1);
+  EXPECT_EQ(rates_.getHealth(1), RateTracker::Health::Stale);
+}
+
+TEST_F(TestRateTracker, NoBaselineDuringWarmUp) {
+  // a device appearing at a high rate isn't flooding before 60 s of history
+  run(1, 1000, 30);
+  EXPECT_EQ(rates_.getHealth(1), RateTracker::Health::Ok);
+}
+
+TEST_F(TestRateTracker, CountsBeforeFirstSampleAreNotARate) {
+  MsgCounter counter;
+  for (int i = 0; i < 1000; i++) counter.incrementCounter(7, kFrameLength);
+  RateTracker rates(counter);
+  rates.sample(kSecond);
+  rates.sample(2 * kSecond);
+  EXPECT_EQ(rates.getMessageRate(7, RateTracker::kWindow1s), 0);
+  EXPECT_EQ(rates.getByteRate(7, RateTracker::kWindow1s), 0);
+}
@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+#include <set>
+
+#include "SlabPool.h"
+
+using DeviceListener::SlabPool;
+
+class TestSlabPool : public ::testing::Test {
+ public:
+  TestSlabPool() {}
+  ~TestSlabPool() {}
+
+  struct Record {
+    int &live;
+    int value;
+    Record(int &liveCounter, int v) : live(liveCounter), value(v) { live++; }
+    ~Record() { live--; }
+  };
+};
+
+TEST_F(TestSlabPool, ReusesReleasedRecordsFirst) {
+  int live = 0;
+  SlabPool<Record, 4> pool;
+  Record *a = pool.allocate(live, 1);
+  Record *b = pool.allocate(live, 2);
+  EXPECT_EQ(pool.size(), 2u);
+  EXPECT_EQ(pool.capacity(), 4u);
+
+  pool.release(a);
+  EXPECT_EQ(live, 1);
+  EXPECT_EQ(pool.allocate(live, 3), a);
+  EXPECT_EQ(a->value, 3);
+  EXPECT_EQ(b->value, 2);
+  EXPECT_EQ(pool.size(), 2u);
+}
+
+TEST_F(TestSlabPool, GrowsBySlabsAndKeepsRecordsInPlace) {
+  int live = 0;
+  SlabPool<Record, 4> pool;
+  std::set<Record *> records;
+  for (int i = 0; i < 10; i++) records.insert(pool.allocate(live, i));
+  EXPECT_EQ(records.size(), 10u);
+  EXPECT_EQ(pool.capacity(), 12u);
+
+  // a churn of connections doesn't grow the pool
+  for (int round = 0; round < 100; round++) {
+    Record *record = *records.begin();
+    records.erase(records.begin());
+    pool.release(record);
+    records.insert(pool.allocate(live, round));
+  }
+  EXPECT_EQ(pool.capacity(), 12u);
+  EXPECT_EQ(live, 10);
+}
+
+TEST_F(TestSlabPool, DestroysRecordsStillInUse) {
+  int live = 0;
+  {
+    SlabPool<Record, 4> pool;
+    Record *records[6];
+    for (auto &record : records) record = pool.allocate(live, 0);
+    pool.release(records[1]);
+    pool.release(records[4]);
+    EXPECT_EQ(live, 4);
+  }
+  EXPECT_EQ(live, 0);
+}
@@ -0,0 +1,235 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+#include "MsgCounter.h"
+#include "StatsRenderer.h"
+#include "TestUtils.h"
+
+using DeviceListener::Instrumentation;
+using DeviceListener::MsgCounter;
+using DeviceListener::RateTracker;
+using DeviceListener::SourceErrors;
+using DeviceListener::StatsOptions;
+using DeviceListener::StatsRenderer;
+using DeviceListener::StatsSections;
+using DeviceListener::StatsView;
+using DeviceListener::Testing::waitFor;
+
+class TestStatsRenderer : public ::testing::Test {
+ public:
+  TestStatsRenderer() : counter_(2) {
+    char path[] = "/tmp/statsXXXXXX";
+    fd_ = mkstemp(path);
+    path_ = path;
+  }
+  ~TestStatsRenderer() {
+    close(fd_);
+    unlink(path_.c_str());
+  }
+
+  void loadDevices(const std::string &contents) {
+    char path[] = "/tmp/devicesXXXXXX";
+    close(mkstemp(path));
+    std::ofstream(path) << contents;
+    counter_.readDevicesFromFile(path);
+    unlink(path);
+  }
+
+  void count(uint16_t devId, size_t times, size_t shard = 0) {
+    for (size_t i = 0; i < times; i++)
+      counter_.getShard(shard).incrementCounter(devId);
+  }
+
+  std::string getWritten() const {
+    std::ifstream file(path_);
+    return std::string(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+  }
+
+  static StatsOptions makeOptions(StatsView view, size_t limit = 0) {
+    StatsOptions options;
+    options.view = view;
+    options.limit = limit;
+    options.machine = true;
+    return options;
+  }
+
+ protected:
+  MsgCounter counter_;
+  int fd_;
+  std::string path_;
+};
+
+TEST_F(TestStatsRenderer, ShowsAllDevicesInIdOrder) {
+  loadDevices("1:First\n3:Say \"hi\"\n");
+  count(5, 2, 0);
+  count(5, 3, 1);
+  count(1, 1, 1);
+  StatsRenderer renderer(counter_, makeOptions(StatsView::All), fd_);
+
+  const std::string &text = renderer.render();
+  EXPECT_EQ(text,
+            "statistics view=all devices=3 total=6\n"
+            "device=1 name=\"First\" messages=1 new=1\n"
+            "device=3 name=\"Say \\\"hi\\\"\" messages=0 new=0\n"
+            "device=5 name=\"Unknown device\" messages=5 new=5\n"
+            "transport connections_rejected=0 connections_throttled=0 "
+            "throttle_pauses=0 resyncs=0 skipped_bytes=0\n");
+  EXPECT_EQ(getWritten(), text);
+  EXPECT_EQ(renderer.getRenderCount(), 1u);
+
+  StatsRenderer limited(counter_, makeOptions(StatsView::All, 1), fd_);
+  EXPECT_NE(limited.render().find("devices=1 "), std::string::npos);
+}
+
+TEST_F(TestStatsRenderer, ShowsTheBusiestDevices) {
+  for (uint16_t devId = 1; devId <= 20; devId++) count(devId * 100, devId);
+  // a tie is broken by the device ID
+  count(7, 20);
+
+  StatsRenderer top(counter_, makeOptions(StatsView::Top), fd_);
+  std::istringstream lines(top.render());
+  std::string line;
+  std::getline(lines, line);
+  EXPECT_EQ(line, "statistics view=top devices=10 total=230");
+  const uint16_t expected[] = {7,    2000, 1900, 1800, 1700,
+                               1600, 1500, 1400, 1300, 1200};
+  for (uint16_t devId : expected) {
+    std::getline(lines, line);
+    EXPECT_EQ(line.substr(0, line.find(' ')),
+              "device=" + std::to_string(devId));
+  }
+
+  StatsRenderer three(counter_, makeOptions(StatsView::Top, 3), fd_);
+  EXPECT_NE(three.render().find("devices=3 "), std::string::npos);
+}
+
+TEST_F(TestStatsRenderer, ShowsWhatChangedSinceTheLastRender) {
+  count(1, 10);
+  count(2, 10);
+  count(3, 10);
+  StatsRenderer renderer(counter_, makeOptions(StatsView::Changed), fd_);
+  EXPECT_NE(renderer.render().find("devices=3 "), std::string::npos);
+
+  count(3, 1);
+  count(1, 5, 1);
+  EXPECT_EQ(renderer.render(),
+            "statistics view=changed devices=2 total=36\n"
+            "device=1 name=\"Unknown device\" messages=15 new=5\n"
+            "device=3 name=\"Unknown device\" messages=11 new=1\n"
+            "transport connections_rejected=0 connections_throttled=0 "
+            "throttle_pauses=0 resyncs=0 skipped_bytes=0\n");
+
+  // nothing new
+  EXPECT_NE(renderer.render().find("devices=0 "), std::string::npos);
+}
+
+TEST_F(TestStatsRenderer, ColorsOnlyTheHumanOutput) {
+  loadDevices("4:Four\n");
+  count(4, 3);
+  StatsRenderer machine(counter_, makeOptions(StatsView::All), fd_);
+  EXPECT_EQ(machine.render().find('\033'), std::string::npos);
+
+  StatsRenderer human(counter_, StatsOptions(), fd_);
+  const std::string &text = human.render();
+  EXPECT_EQ(text.find("\033[32m"), 0u);
+  EXPECT_NE(text.find("\nFour - 3\n"), std::string::npos);
+  EXPECT_EQ(text.find("Rejected connections"), std::string::npos);
+
+  StatsOptions changed;
+  changed.view = StatsView::Changed;
+  StatsRenderer delta(counter_, changed, fd_);
+  EXPECT_NE(delta.render().find("\nFour - 3 (+3)\n"), std::string::npos);
+}
+
+TEST_F(TestStatsRenderer, RendersTheSectionsInTheSameWrite) {
+  const uint64_t kSecond = 1000000000;
+  loadDevices("5:Five\n");
+  RateTracker rates(counter_);
+  rates.sample(kSecond);
+  count(5, 10);
+  rates.sample(2 * kSecond);
+  SourceErrors sourceErrors;
+  sourceErrors.getShard(0).record(boost::asio::ip::address_v4({10, 0, 0, 1}),
+                                  SourceErrors::Reason::InvalidHeader);
+  Instrumentation instrumentation(1);
+  instrumentation.getShard(0).readToCount.record(100);
+  StatsSections sections;
+  sections.rates = &rates;
+  sections.sourceErrors = &sourceErrors;
+  sections.instrumentation = &instrumentation;
+
+  StatsRenderer machine(counter_, makeOptions(StatsView::All), fd_,
+                        sections);
+  const std::string &text = machine.render();
+  EXPECT_EQ(getWritten(), text);
+  EXPECT_NE(text.find("\nrates device=5 name=\"Five\" msgs_1s=6.3 "
+                      "msgs_10s=1.0 msgs_60s=0.2 "),
+            std::string::npos);
+  EXPECT_NE(text.find(" health=ok\n"), std::string::npos);
+  EXPECT_NE(text.find("\nsource_errors source=\"10.0.0.1\" "
+                      "invalid_header=1 truncated=0\n"),
+            std::string::npos);
+  EXPECT_EQ(text.find("histogram name=read_to_count_ns count=1 ") !=
+                std::string::npos,
+            DeviceListener::kInstrumentationEnabled);
+  EXPECT_EQ(text.find('\033'), std::string::npos);
+  // merged anew, not on top of the previous render
+  EXPECT_EQ(machine.render().find("histogram name=read_to_count_ns count=1 ") !=
+                std::string::npos,
+            DeviceListener::kInstrumentationEnabled);
+
+  StatsRenderer human(counter_, StatsOptions(), fd_, sections);
+  const std::string &colored = human.render();
+  EXPECT_NE(colored.find("\nFive (5) - 6.3/1.0/0.2 "), std::string::npos);
+  EXPECT_NE(colored.find("\n10.0.0.1 - 1 0\n"), std::string::npos);
+  EXPECT_EQ(colored.find("Hot path histograms") != std::string::npos,
+            DeviceListener::kInstrumentationEnabled);
+}
+
+TEST_F(TestStatsRenderer, ShowsTheRatesOfTheShownDevicesOnly) {
+  const uint64_t kSecond = 1000000000;
+  RateTracker rates(counter_);
+  rates.sample(kSecond);
+  count(7, 1);
+  rates.sample(2 * kSecond);
+  // long enough for the rates of device 7 to show as zero
+  rates.sample(300 * kSecond);
+  count(5, 10);
+  count(6, 2);
+  rates.sample(301 * kSecond);
+  StatsSections sections;
+  sections.rates = &rates;
+
+  StatsRenderer all(counter_, makeOptions(StatsView::All), fd_, sections);
+  const std::string &text = all.render();
+  EXPECT_NE(text.find("\ndevice=7 "), std::string::npos);
+  EXPECT_NE(text.find("\nrates device=5 "), std::string::npos);
+  EXPECT_NE(text.find("\nrates device=6 "), std::string::npos);
+  EXPECT_EQ(text.find("rates device=7 "), std::string::npos);
+
+  StatsRenderer top(counter_, makeOptions(StatsView::Top, 1), fd_, sections);
+  const std::string &busiest = top.render();
+  EXPECT_NE(busiest.find("\nrates device=5 "), std::string::npos);
+  EXPECT_EQ(busiest.find("rates device=6 "), std::string::npos);
+}
+
+TEST_F(TestStatsRenderer, RendersOnTickInTheBackground) {
+  count(9, 4);
+  StatsRenderer renderer(counter_, makeOptions(StatsView::All), fd_);
+  renderer.start();
+  renderer.tick();
+  waitFor([&]() { return renderer.getRenderCount() > 0; });
+  EXPECT_EQ(renderer.getRenderCount(), 1u);
+  EXPECT_NE(getWritten().find("device=9 "), std::string::npos);
+
+  // a tick still due when stopping is rendered by stop()
+  renderer.stop();
+  renderer.tick();
+  renderer.stop();
+  EXPECT_EQ(renderer.getRenderCount(), 2u);
+}
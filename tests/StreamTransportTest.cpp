@@ -0,0 +1,171 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <string>
+#include <vector>
+
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "SerialLine.h"
+#include "TestUtils.h"
+#include "UnixServer.h"
+
+using DeviceListener::ClosingGuard;
+using DeviceListener::MsgCounter;
+using DeviceListener::SerialLine;
+using DeviceListener::SerialOptions;
+using DeviceListener::SerialTransport;
+using DeviceListener::Testing::makeFrames;
+using DeviceListener::Testing::pollUntil;
+using DeviceListener::UnixServer;
+using DeviceListener::UnixTransport;
+using DeviceListener::WorkerContext;
+
+class TestStreamTransport : public ::testing::Test {
+ public:
+  /**
+   * \brief writes the bytes in chunks of up to 7, so frames are split
+   * between reads; the chunks are read as they go, a socket buffer fills up
+   * with small writes long before it holds their bytes
+   */
+  static void writeChunked(boost::asio::io_service &ioService, int fd,
+                           const std::vector<uint8_t> &bytes) {
+    for (size_t offset = 0; offset < bytes.size(); offset += 7) {
+      const size_t length = std::min<size_t>(7, bytes.size() - offset);
+      ASSERT_EQ(::write(fd, &bytes[offset], length),
+                static_cast<ssize_t>(length));
+      ioService.poll();
+    }
+  }
+};
+
+TEST_F(TestStreamTransport, CountsFramesFromASocketPair) {
+  MsgCounter counter;
+  boost::asio::io_service ioService;
+  UnixTransport transport(ioService, counter.getShard(0));
+  ClosingGuard closing(ioService, transport);
+  const auto &stats = counter.getShard(0).transport;
+
+  DeviceListener::UnixSocket client(ioService);
+  auto conHandle = transport.allocateConnection();
+  boost::asio::local::connect_pair(conHandle->socket, client);
+  ASSERT_TRUE(transport.admitConnection(conHandle));
+  transport.startConnection(conHandle);
+
+  writeChunked(ioService, client.native_handle(), makeFrames(7, 100, 40));
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return counter.getStatForDevice(7).first == 100; }));
+  EXPECT_EQ(stats.bytesReceived.load(), makeFrames(7, 100, 40).size());
+
+  // an invalid header closes it like a TCP connection
+  const uint8_t garbage[] = {0xFF, 0xFF, 0xFF, 0xFF};
+  ASSERT_EQ(::write(client.native_handle(), garbage, sizeof(garbage)), 4);
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return stats.connectionsClosed.load() == 1; }));
+  EXPECT_EQ(stats.invalidHeaders.load(), 1u);
+  EXPECT_EQ(transport.getConnectionCount(), 0u);
+}
+
+TEST_F(TestStreamTransport, UnixServerAcceptsAndCleansUp) {
+  char directory[] = "/tmp/unixserverXXXXXX";
+  ASSERT_NE(mkdtemp(directory), nullptr);
+  const std::string path = std::string(directory) + "/listener.sock";
+
+  // a socket left behind by a previous run
+  {
+    boost::asio::io_service ioService;
+    boost::asio::local::stream_protocol::acceptor stale(
+        ioService, boost::asio::local::stream_protocol::endpoint(path));
+  }
+  struct stat status;
+  ASSERT_EQ(::stat(path.c_str(), &status), 0);
+
+  // one connection per source doesn't limit local ones
+  DeviceListener::AdmissionLimits limits;
+  limits.maxConnectionsPerSource = 1;
+  DeviceListener::AdmissionControl admission(limits);
+  MsgCounter counter;
+  boost::asio::io_service ioService;
+  WorkerContext context(counter.getShard(0));
+  context.admission = &admission;
+  UnixTransport transport(ioService, context);
+  {
+    UnixServer server(path, ioService, transport);
+    ClosingGuard closing(ioService, server, transport);
+    server.listen();
+
+    std::vector<DeviceListener::UnixSocket> clients;
+    for (uint16_t devId = 1; devId <= 3; devId++) {
+      clients.emplace_back(ioService);
+      clients.back().connect(
+          boost::asio::local::stream_protocol::endpoint(path));
+      boost::asio::write(clients.back(),
+                         boost::asio::buffer(makeFrames(devId, 50, 40)));
+    }
+    EXPECT_TRUE(pollUntil(ioService, [&]() {
+      return counter.getStatForDevice(1).first == 50 &&
+             counter.getStatForDevice(2).first == 50 &&
+             counter.getStatForDevice(3).first == 50;
+    }));
+    EXPECT_EQ(counter.getShard(0).transport.connectionsOpened.load(), 3u);
+    EXPECT_EQ(counter.getShard(0).transport.connectionsRejected.load(), 0u);
+
+    clients.clear();
+    EXPECT_TRUE(pollUntil(
+        ioService, [&]() { return admission.getConnectionCount() == 0; }));
+  }
+  EXPECT_NE(::stat(path.c_str(), &status), 0);
+  ::rmdir(directory);
+}
+
+TEST_F(TestStreamTransport, ReadsAndReopensASerialLine) {
+  const int master = ::posix_openpt(O_RDWR | O_NOCTTY);
+  ASSERT_GE(master, 0);
+  ASSERT_EQ(::grantpt(master), 0);
+  ASSERT_EQ(::unlockpt(master), 0);
+  SerialOptions options = SerialOptions::parse(
+      std::string(::ptsname(master)) + ":9600");
+  EXPECT_EQ(options.baudRate, 9600u);
+
+  MsgCounter counter;
+  boost::asio::io_service ioService;
+  SerialTransport transport(ioService, counter.getShard(0));
+  const auto &stats = counter.getShard(0).transport;
+  SerialLine line(options, ioService, transport);
+  ClosingGuard closing(ioService, line, transport);
+  line.open();
+  EXPECT_EQ(stats.connectionsOpened.load(), 1u);
+
+  writeChunked(ioService, master, makeFrames(9, 100, 40));
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return counter.getStatForDevice(9).first == 100; }));
+
+  // closed by an invalid header, the line is opened again
+  const uint8_t garbage[] = {0xFF, 0xFF, 0xFF, 0xFF};
+  ASSERT_EQ(::write(master, garbage, sizeof(garbage)), 4);
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return stats.connectionsClosed.load() == 1; }));
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return stats.connectionsOpened.load() == 2; },
+      3 * SerialLine::kReopenIntervalMs));
+
+  writeChunked(ioService, master, makeFrames(9, 10, 40));
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return counter.getStatForDevice(9).first == 110; }));
+  ::close(master);
+}
+
+TEST(TestSerialOptions, ParsesDeviceAndBaudRate) {
+  auto options = SerialOptions::parse("/dev/ttyS0");
+  EXPECT_EQ(options.device, "/dev/ttyS0");
+  EXPECT_EQ(options.baudRate, 115200u);
+  options = SerialOptions::parse("/dev/ttyUSB1:57600");
+  EXPECT_EQ(options.device, "/dev/ttyUSB1");
+  EXPECT_EQ(options.baudRate, 57600u);
+  EXPECT_THROW(SerialOptions::parse("/dev/ttyS0:fast"), std::invalid_argument);
+  EXPECT_THROW(SerialOptions::parse("/dev/ttyS0:0"), std::invalid_argument);
+  EXPECT_THROW(SerialOptions::parse(":9600"), std::invalid_argument);
+}
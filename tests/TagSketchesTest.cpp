@@ -0,0 +1,257 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "TagSketches.h"
+
+using DeviceListener::CountMinSketch;
+using DeviceListener::FrameBatch;
+using DeviceListener::HyperLogLogTable;
+using DeviceListener::SketchOptions;
+using DeviceListener::SpaceSaving;
+using DeviceListener::TagSketches;
+
+class TestTagSketches : public ::testing::Test {
+ public:
+  /**
+   * \brief a skewed stream of (device, tag) keys: a few pairs take most of
+   * the messages, like a handful of chatty sensors among many quiet ones
+   */
+  static std::vector<uint32_t> makeKeys(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<uint32_t> keys(count);
+    for (auto &key : keys) {
+      const auto rank =
+          static_cast<uint32_t>(std::pow(uniform(rng), 4) * 50000);
+      key = TagSketches::getKey(static_cast<uint16_t>(rank % 500),
+                                static_cast<uint16_t>(rank / 500 * 7));
+    }
+    return keys;
+  }
+
+  static std::map<uint32_t, uint64_t> countExactly(
+      const std::vector<uint32_t> &keys) {
+    std::map<uint32_t, uint64_t> counts;
+    for (uint32_t key : keys) counts[key]++;
+    return counts;
+  }
+
+  /**
+   * \brief adds the keys to the shard in batches, as the transports do
+   */
+  void addBatches(DeviceListener::TagSketchShard &shard,
+                  const std::vector<uint32_t> &keys) {
+    for (size_t begin = 0; begin < keys.size();
+         begin += FrameBatch::kCapacity) {
+      const size_t count =
+          std::min(FrameBatch::kCapacity, keys.size() - begin);
+      for (size_t i = 0; i < count; i++) {
+        batch_.deviceIds[i] = static_cast<uint16_t>(keys[begin + i] >> 16);
+        batch_.measurementTags[i] =
+            static_cast<uint16_t>(keys[begin + i] & 0xFFFF);
+      }
+      shard.add(batch_, count);
+    }
+  }
+
+  static SketchOptions makeOptions() {
+    SketchOptions options;
+    options.width = 1024;
+    options.precision = 10;
+    options.seed = 42;
+    return options;
+  }
+
+ protected:
+  FrameBatch batch_;
+};
+
+TEST_F(TestTagSketches, CountMinStaysWithinItsBound) {
+  const auto keys = makeKeys(200000, 1);
+  const auto exact = countExactly(keys);
+  CountMinSketch sketch(1024, 4, 7);
+  for (uint32_t key : keys) sketch.add(key, 1);
+  EXPECT_EQ(sketch.getTotal(), keys.size());
+
+  // e / width of all the messages, missed by e^-4 (1.8%) of the keys at most
+  const double bound = std::exp(1.0) / 1024 * keys.size();
+  size_t over = 0;
+  for (const auto &pair : exact) {
+    const uint64_t estimate = sketch.estimate(pair.first);
+    ASSERT_GE(estimate, pair.second);
+    over += estimate - pair.second > bound;
+  }
+  EXPECT_LE(over, exact.size() * std::exp(-4.0) * 2);
+}
+
+TEST_F(TestTagSketches, MergesTheThreadsExactly) {
+  const auto keys = makeKeys(50000, 2);
+  const auto exact = countExactly(keys);
+  TagSketches one(1, makeOptions());
+  TagSketches three(3, makeOptions());
+  addBatches(one.getShard(0), keys);
+  for (size_t i = 0; i < 3; i++) {
+    std::vector<uint32_t> part;
+    for (size_t j = i; j < keys.size(); j += 3) part.push_back(keys[j]);
+    addBatches(three.getShard(i), part);
+  }
+
+  // the counters and the registers merge into what one thread would have
+  for (const auto &pair : exact) {
+    const auto devId = static_cast<uint16_t>(pair.first >> 16);
+    const auto tag = static_cast<uint16_t>(pair.first & 0xFFFF);
+    ASSERT_EQ(three.estimateCount(devId, tag), one.estimateCount(devId, tag));
+    ASSERT_GE(three.estimateCount(devId, tag), pair.second);
+  }
+  const auto merged = three.getDistinctTags();
+  const auto single = one.getDistinctTags();
+  ASSERT_EQ(merged.size(), single.size());
+  for (size_t i = 0; i < merged.size(); i++) {
+    EXPECT_EQ(merged[i].deviceId, single[i].deviceId);
+    EXPECT_DOUBLE_EQ(merged[i].estimate, single[i].estimate);
+  }
+}
+
+TEST_F(TestTagSketches, CountsDistinctTagsWithinTheStandardError) {
+  const unsigned precision = 10;
+  const double standardError = 1.04 / std::sqrt(1 << precision);
+  HyperLogLogTable table(16, precision, 3);
+  const size_t cardinalities[] = {1, 10, 100, 1000, 10000, 65536};
+  for (uint16_t devId = 0; devId < 6; devId++) {
+    // every tag many times over, duplicates must not count
+    for (int round = 0; round < 3; round++)
+      for (size_t tag = 0; tag < cardinalities[devId]; tag++)
+        table.add(devId, static_cast<uint16_t>(tag));
+    const double expected = static_cast<double>(cardinalities[devId]);
+    EXPECT_NEAR(table.estimate(devId), expected,
+                std::max(3 * standardError * expected, 0.5))
+        << cardinalities[devId] << " tags";
+  }
+  EXPECT_EQ(table.estimate(100), 0);
+  EXPECT_EQ(table.getDroppedCount(), 0u);
+}
+
+TEST_F(TestTagSketches, LeavesOutDevicesBeyondTheTable) {
+  HyperLogLogTable table(16, 4, 3);
+  for (uint16_t devId = 0; devId < 100; devId++) table.add(devId, 1);
+  std::set<uint16_t> devices;
+  table.forEach([&devices](uint16_t devId) { devices.insert(devId); });
+  EXPECT_EQ(devices.size(), 16u);
+  EXPECT_EQ(table.getDroppedCount(), 84u);
+  for (uint16_t devId : devices) EXPECT_NEAR(table.estimate(devId), 1, 0.1);
+}
+
+TEST_F(TestTagSketches, KeepsTheHeavyHittersWithinTheirErrors) {
+  const size_t capacity = 64;
+  const auto keys = makeKeys(200000, 4);
+  const auto exact = countExactly(keys);
+  SpaceSaving heavyHitters(capacity);
+  for (uint32_t key : keys) heavyHitters.add(key, 1);
+
+  const auto entries = heavyHitters.getEntries();
+  ASSERT_EQ(entries.size(), capacity);
+  std::set<uint32_t> listed;
+  uint64_t sum = 0;
+  for (const auto &entry : entries) {
+    const uint64_t count = exact.at(entry.key);
+    EXPECT_GE(entry.count, count);
+    EXPECT_LE(entry.count - entry.error, count);
+    EXPECT_LE(entry.error, keys.size() / capacity);
+    listed.insert(entry.key);
+    sum += entry.count;
+  }
+  EXPECT_EQ(sum, keys.size());
+  for (size_t i = 1; i < entries.size(); i++)
+    EXPECT_GE(entries[i - 1].count, entries[i].count);
+  // every pair above 1 / capacity of the messages is in the list
+  for (const auto &pair : exact) {
+    if (pair.second > keys.size() / capacity) {
+      EXPECT_TRUE(listed.count(pair.first)) << pair.first;
+    }
+  }
+}
+
+TEST_F(TestTagSketches, MergesTheHeavyHittersOfTheThreads) {
+  const size_t threads = 3;
+  const auto keys = makeKeys(150000, 5);
+  const auto exact = countExactly(keys);
+  SketchOptions options = makeOptions();
+  options.heavyHitters = 32;
+  TagSketches sketches(threads, options);
+  for (size_t i = 0; i < threads; i++) {
+    // a slice each, so the lists of the threads differ
+    std::vector<uint32_t> part(keys.begin() + i * keys.size() / threads,
+                               keys.begin() + (i + 1) * keys.size() / threads);
+    addBatches(sketches.getShard(i), part);
+  }
+
+  const auto hitters = sketches.getHeavyHitters();
+  ASSERT_EQ(hitters.size(), options.heavyHitters);
+  std::set<uint32_t> listed;
+  for (const auto &hitter : hitters) {
+    const uint32_t key =
+        TagSketches::getKey(hitter.deviceId, hitter.measurementTag);
+    const uint64_t count = exact.at(key);
+    EXPECT_GE(hitter.count, count);
+    EXPECT_LE(hitter.count - hitter.error, count);
+    EXPECT_LE(hitter.count,
+              sketches.estimateCount(hitter.deviceId, hitter.measurementTag));
+    listed.insert(key);
+  }
+  for (const auto &pair : exact) {
+    if (pair.second > keys.size() / options.heavyHitters) {
+      EXPECT_TRUE(listed.count(pair.first)) << pair.first;
+    }
+  }
+}
+
+TEST_F(TestTagSketches, ReadsConsistentHeavyHittersWhileCounting) {
+  SpaceSaving heavyHitters(16);
+  const auto keys = makeKeys(300000, 6);
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    const std::vector<uint64_t> counts(FrameBatch::kCapacity, 1);
+    for (size_t begin = 0; begin + FrameBatch::kCapacity <= keys.size();
+         begin += FrameBatch::kCapacity)
+      heavyHitters.add(&keys[begin], counts.data(), FrameBatch::kCapacity);
+    done = true;
+  });
+
+  // the counts of a list sum up to the keys added, a torn copy wouldn't
+  uint64_t previous = 0;
+  while (!done) {
+    uint64_t sum = 0;
+    for (const auto &entry : heavyHitters.getEntries()) sum += entry.count;
+    ASSERT_EQ(sum % FrameBatch::kCapacity, 0u);
+    ASSERT_GE(sum, previous);
+    previous = sum;
+  }
+  writer.join();
+}
+
+TEST_F(TestTagSketches, FitsTheMemoryGiven) {
+  for (size_t kib : {64, 1024, 16384}) {
+    const auto options = TagSketches::getOptionsFor(kib * 1024);
+    EXPECT_LE(TagSketches::getMemorySize(options), kib * 1024) << kib;
+    EXPECT_GE(TagSketches::getMemorySize(options), kib * 1024 / 3) << kib;
+    TagSketches sketches(1, options);
+    EXPECT_EQ(sketches.getOptions().width, options.width);
+  }
+
+  SketchOptions options;
+  options.width = 1000;
+  EXPECT_THROW(TagSketches(1, options), std::invalid_argument);
+  options = SketchOptions();
+  options.precision = 20;
+  EXPECT_THROW(TagSketches(1, options), std::invalid_argument);
+  options = SketchOptions();
+  options.heavyHitters = 0;
+  EXPECT_THROW(TagSketches(1, options), std::invalid_argument);
+}
@@ -0,0 +1,111 @@
+#ifndef TestUtils_H
+#define TestUtils_H
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "RfcMessage.h"
+
+namespace DeviceListener {
+namespace Testing {
+
+/**
+ * \brief builds a valid frame: RFC1006 header, payload header and dataLength
+ * zero bytes of data
+ * \param version protocol version in the header, another one than
+ * RfcMessage::kProtocolVersion makes the header invalid
+ */
+inline std::vector<uint8_t> makeFrame(
+    uint16_t devId, size_t dataLength = 0,
+    uint8_t version = RfcMessage::kProtocolVersion) {
+  RfcMessage::Rfc1006Header header = {
+      version, 0,
+      static_cast<uint16_t>(sizeof(RfcMessage::PayloadHeader) + dataLength)};
+  RfcMessage::PayloadHeader payload = {};
+  payload.deviceId = devId;
+  std::vector<uint8_t> frame(sizeof(header) + header.length);
+  std::memcpy(&frame[0], &header, sizeof(header));
+  std::memcpy(&frame[sizeof(header)], &payload, sizeof(payload));
+  return frame;
+}
+
+/**
+ * \brief builds a block of back-to-back valid frames of the device
+ * \param dataLengths the i-th frame has i % dataLengths bytes of data, 1 for
+ * none at all
+ */
+inline std::vector<uint8_t> makeFrames(uint16_t devId, size_t count,
+                                       size_t dataLengths = 1) {
+  std::vector<uint8_t> frames;
+  for (size_t i = 0; i < count; i++) {
+    const auto frame = makeFrame(devId, i % dataLengths);
+    frames.insert(frames.end(), frame.begin(), frame.end());
+  }
+  return frames;
+}
+
+inline boost::asio::ip::tcp::endpoint getEndpoint(uint16_t port) {
+  return boost::asio::ip::tcp::endpoint(
+      boost::asio::ip::address_v4::loopback(), port);
+}
+
+/**
+ * \brief connects a blocking TCP socket to the port on loopback
+ * \return socket descriptor, -1 on failure
+ */
+inline int connectTo(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * \brief runs ready handlers until the condition holds
+ * \return false if it still doesn't after timeoutMs
+ */
+template <typename Condition>
+bool pollUntil(boost::asio::io_service &ioService, Condition &&condition,
+               int timeoutMs = 2000) {
+  for (int i = 0; i < timeoutMs && !condition(); i++) {
+    ioService.poll();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return condition();
+}
+
+/**
+ * \brief runs ready handlers for about timeMs, to let what is in flight
+ * arrive when there is nothing to wait for
+ */
+inline void pollFor(boost::asio::io_service &ioService, int timeMs) {
+  pollUntil(ioService, []() { return false; }, timeMs);
+}
+
+/**
+ * \brief waits for the condition to hold, set by another thread
+ * \return false if it still doesn't after timeoutMs
+ */
+template <typename Condition>
+bool waitFor(Condition &&condition, int timeoutMs = 2000) {
+  for (int i = 0; i < timeoutMs && !condition(); i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  return condition();
+}
+
+}  // namespace Testing
+}  // namespace DeviceListener
+
+#endif
@@ -1,5 +1,14 @@
 #include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <boost/optional/optional_io.hpp>
+#include <vector>
+#include "MsgCounter.h"
 #include "RfcTransport.h"
+#include "TcpServer.h"
+#include "TestUtils.h"
+
+using DeviceListener::Testing::makeFrame;
+using DeviceListener::Testing::pollUntil;
 
 class TestRfcTransport : public ::testing::Test {
  public:
@@ -57,4 +66,111 @@ TEST_F(TestRfcTransport, PayloadTooSmall) {
   message.payloadBuffer[0] = testDevId;
   auto result = message.getDevIdFromBuffer();
   ASSERT_EQ(result, boost::none);
-}
\ No newline at end of file
+}
+TEST_F(TestRfcTransport, PartialFramesAreCarriedBetweenReads) {
+  DeviceListener::MsgCounter counter;
+  boost::asio::io_service ioService;
+  DeviceListener::RfcTransport transport(ioService, counter.getShard(0));
+  DeviceListener::TcpServer server(0, ioService, transport);
+  DeviceListener::ClosingGuard closing(ioService, server, transport);
+  server.listen();
+  const auto &stats = counter.getShard(0).transport;
+
+  boost::asio::ip::tcp::socket client(ioService);
+  client.connect(boost::asio::ip::tcp::endpoint(
+      boost::asio::ip::address_v4::loopback(), server.port()));
+  ASSERT_TRUE(pollUntil(
+      ioService, [&]() { return stats.connectionsOpened.load() == 1; }));
+
+  // a frame longer than the inline buffer waits in a borrowed block
+  using DeviceListener::RfcMessage;
+  auto large = makeFrame(1, RfcMessage::kMaxPayloadLength -
+                                sizeof(RfcMessage::PayloadHeader));
+  auto small = makeFrame(2, 8);
+  boost::asio::write(client, boost::asio::buffer(large.data(), 1000));
+  ASSERT_TRUE(pollUntil(
+      ioService, [&]() { return stats.bytesReceived.load() == 1000; }));
+  EXPECT_EQ(transport.getSpilledCount(), 1u);
+
+  // the block is returned once the rest fits inline
+  std::vector<uint8_t> rest(large.begin() + 1000, large.end());
+  rest.insert(rest.end(), small.begin(), small.end());
+  rest.insert(rest.end(), small.begin(), small.begin() + 5);
+  boost::asio::write(client, boost::asio::buffer(rest));
+  ASSERT_TRUE(pollUntil(ioService, [&]() {
+    return counter.getStatForDevice(2).first == 1;
+  }));
+  EXPECT_EQ(counter.getStatForDevice(1).first, 1u);
+  EXPECT_EQ(transport.getSpilledCount(), 0u);
+
+  boost::asio::write(client,
+                     boost::asio::buffer(small.data() + 5, small.size() - 5));
+  EXPECT_TRUE(pollUntil(ioService, [&]() {
+    return counter.getStatForDevice(2).first == 2;
+  }));
+
+  // the record goes back to the pool, only the pending accept keeps one
+  client.close();
+  EXPECT_TRUE(pollUntil(
+      ioService, [&]() { return stats.connectionsClosed.load() == 1; }));
+  EXPECT_EQ(transport.getConnectionCount(), 1u);
+}
+
+TEST_F(TestRfcTransport, ClosingStartsNothingNew) {
+  // pending operations live in the server and in the connection records, so
+  // they are completed once everything is closed and before those go
+  DeviceListener::MsgCounter counter;
+  boost::asio::io_service ioService;
+  boost::asio::ip::tcp::socket client(ioService);
+  DeviceListener::RfcTransport transport(ioService, counter.getShard(0));
+  {
+    DeviceListener::TcpServer server(0, ioService, transport);
+    DeviceListener::ClosingGuard closing(ioService, server, transport);
+    server.listen();
+    client.connect(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address_v4::loopback(), server.port()));
+    ASSERT_TRUE(pollUntil(ioService, [&]() {
+      return counter.getShard(0).transport.connectionsOpened.load() == 1;
+    }));
+    EXPECT_EQ(transport.getConnectionCount(), 2u);
+
+    // readable when the transport is closed, but not read any more
+    auto frame = makeFrame(1, 8);
+    boost::asio::write(client, boost::asio::buffer(frame));
+  }
+  EXPECT_EQ(counter.getStatForDevice(1).first, 0u);
+  EXPECT_EQ(counter.getShard(0).transport.connectionsOpened.load(), 1u);
+  // the record of the aborted accept is back in the pool, the closed
+  // connection stays there until the transport goes
+  EXPECT_EQ(transport.getConnectionCount(), 1u);
+}
+
+TEST_F(TestRfcTransport, RecordsHistogramsUnlessCompiledOut) {
+  DeviceListener::MsgCounter counter;
+  DeviceListener::StageHistograms histograms;
+  boost::asio::io_service ioService;
+  DeviceListener::WorkerContext context(counter.getShard(0));
+  context.histograms = &histograms;
+  DeviceListener::RfcTransport transport(ioService, context);
+  DeviceListener::TcpServer server(0, ioService, transport);
+  DeviceListener::ClosingGuard closing(ioService, server, transport);
+  server.listen();
+
+  boost::asio::ip::tcp::socket client(ioService);
+  client.connect(boost::asio::ip::tcp::endpoint(
+      boost::asio::ip::address_v4::loopback(), server.port()));
+  auto frame = makeFrame(1, 8);
+  boost::asio::write(client, boost::asio::buffer(frame));
+  ASSERT_TRUE(pollUntil(ioService, [&]() {
+    return counter.getStatForDevice(1).first == 1;
+  }));
+
+  // the build configures the tests the way it configures the listener
+  const uint64_t reads = DeviceListener::kInstrumentationEnabled ? 1 : 0;
+  EXPECT_EQ(histograms.bytesPerRead.getCount(), reads);
+  EXPECT_EQ(histograms.framesPerRead.getCount(), reads);
+  EXPECT_EQ(histograms.readToCount.getCount(), reads);
+  if (reads) {
+    EXPECT_EQ(histograms.bytesPerRead.getMax(), frame.size());
+  }
+}
@@ -0,0 +1,171 @@
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <thread>
+#include <vector>
+
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "SourceErrors.h"
+#include "TestUtils.h"
+#include "UdpServer.h"
+
+using DeviceListener::ClosingGuard;
+using DeviceListener::MsgCounter;
+using DeviceListener::RfcMessage;
+using DeviceListener::SourceErrors;
+using DeviceListener::Testing::makeFrame;
+using DeviceListener::Testing::waitFor;
+using DeviceListener::UdpServer;
+using DeviceListener::WorkerContext;
+
+class TestUdpServer : public ::testing::Test {
+ public:
+  TestUdpServer() {}
+  ~TestUdpServer() {}
+
+  static void append(std::vector<uint8_t> &datagram,
+                     const std::vector<uint8_t> &frame) {
+    datagram.insert(datagram.end(), frame.begin(), frame.end());
+  }
+
+  static void sendTo(int fd, uint16_t port,
+                     const std::vector<uint8_t> &datagram) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(sendto(fd, datagram.data(), datagram.size(), 0,
+                     reinterpret_cast<sockaddr *>(&addr), sizeof(addr)),
+              static_cast<ssize_t>(datagram.size()));
+  }
+};
+
+TEST_F(TestUdpServer, CountsAllFramesOfEveryDatagram) {
+  MsgCounter counter;
+  boost::asio::io_service ioService;
+  UdpServer server(0, ioService, counter.getShard(0));
+  ClosingGuard closing(ioService, server);
+  server.listen();
+  std::thread thread([&ioService]() { ioService.run(); });
+
+  // more datagrams than one recvmmsg batch takes
+  const size_t kDatagrams = UdpServer::kBatchSize * 3;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  ASSERT_GE(fd, 0);
+  for (size_t i = 0; i < kDatagrams; i++) {
+    std::vector<uint8_t> datagram;
+    for (uint16_t devId = 1; devId <= 3; devId++)
+      append(datagram, makeFrame(devId));
+    sendTo(fd, server.port(), datagram);
+  }
+
+  const auto &transport = counter.getShard(0).transport;
+  EXPECT_TRUE(waitFor([&]() {
+    return transport.datagramsReceived.load() == kDatagrams;
+  }));
+  ioService.stop();
+  thread.join();
+  close(fd);
+
+  for (uint16_t devId = 1; devId <= 3; devId++)
+    EXPECT_EQ(counter.getStatForDevice(devId).first, kDatagrams);
+  EXPECT_EQ(counter.getBytesForDevice(1),
+            kDatagrams * makeFrame(1).size());
+  EXPECT_EQ(transport.messagesReceived.load(), kDatagrams * 3);
+  EXPECT_EQ(transport.invalidHeaders.load(), 0u);
+  EXPECT_EQ(transport.truncatedDatagrams.load(), 0u);
+}
+
+TEST_F(TestUdpServer, MalformedDatagramsCountAgainstSender) {
+  MsgCounter counter;
+  SourceErrors errors;
+  boost::asio::io_service ioService;
+  WorkerContext context(counter.getShard(0));
+  context.sourceErrors = &errors.getShard(0);
+  UdpServer server(0, ioService, context);
+  ClosingGuard closing(ioService, server);
+  server.listen();
+  std::thread thread([&ioService]() { ioService.run(); });
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  ASSERT_GE(fd, 0);
+  // the valid frame before the invalid header is still counted
+  std::vector<uint8_t> badHeader;
+  append(badHeader, makeFrame(1));
+  append(badHeader, makeFrame(2, 0, RfcMessage::kProtocolVersion + 1));
+  sendTo(fd, server.port(), badHeader);
+  // a datagram can't continue in the next one
+  std::vector<uint8_t> truncated;
+  append(truncated, makeFrame(3));
+  append(truncated, makeFrame(4));
+  truncated.resize(truncated.size() - 1);
+  sendTo(fd, server.port(), truncated);
+  sendTo(fd, server.port(), std::vector<uint8_t>());
+
+  const auto &transport = counter.getShard(0).transport;
+  EXPECT_TRUE(waitFor(
+      [&]() { return transport.datagramsReceived.load() == 3; }));
+  ioService.stop();
+  thread.join();
+  close(fd);
+
+  EXPECT_EQ(counter.getStatForDevice(1).first, 1u);
+  EXPECT_EQ(counter.getStatForDevice(2).first, 0u);
+  EXPECT_EQ(counter.getStatForDevice(3).first, 1u);
+  EXPECT_EQ(counter.getStatForDevice(4).first, 0u);
+  EXPECT_EQ(transport.invalidHeaders.load(), 1u);
+  EXPECT_EQ(transport.truncatedDatagrams.load(), 2u);
+
+  auto entries = errors.getEntries();
+  ASSERT_EQ(entries.size(), 1u);
+  EXPECT_EQ(entries[0].source, "127.0.0.1");
+  EXPECT_EQ(entries[0].counts[static_cast<size_t>(
+                SourceErrors::Reason::InvalidHeader)],
+            1u);
+  EXPECT_EQ(
+      entries[0].counts[static_cast<size_t>(SourceErrors::Reason::Truncated)],
+      2u);
+}
+
+TEST_F(TestUdpServer, SourceErrorsTableIsBounded) {
+  SourceErrors errors;
+  const size_t kSources = SourceErrors::kMaxSources + 10;
+  for (uint32_t i = 0; i < kSources; i++)
+    errors.getShard(0).record(boost::asio::ip::address_v4(0x0a000000 + i),
+                              SourceErrors::Reason::Truncated);
+  // the worst senders come first
+  auto worst = boost::asio::ip::address_v4(0x0a000000 + 5);
+  errors.getShard(0).record(worst, SourceErrors::Reason::InvalidHeader);
+
+  auto entries = errors.getEntries();
+  ASSERT_EQ(entries.size(), SourceErrors::kMaxSources + 1);
+  EXPECT_EQ(entries[0].source, "other");
+  EXPECT_EQ(entries[0].total(), 10u);
+  EXPECT_EQ(entries[1].source, "10.0.0.5");
+  EXPECT_EQ(entries[1].total(), 2u);
+}
+
+TEST_F(TestUdpServer, SourceErrorsMergeTheShards) {
+  SourceErrors errors(2);
+  auto both = boost::asio::ip::address::from_string("10.0.0.1");
+  auto v6 = boost::asio::ip::address::from_string("fd00::1");
+  errors.getShard(0).record(both, SourceErrors::Reason::Truncated);
+  errors.getShard(1).record(both, SourceErrors::Reason::InvalidHeader);
+  errors.getShard(1).record(both, SourceErrors::Reason::Truncated);
+  errors.getShard(1).record(v6, SourceErrors::Reason::Truncated);
+
+  auto entries = errors.getEntries();
+  ASSERT_EQ(entries.size(), 2u);
+  EXPECT_EQ(entries[0].source, "10.0.0.1");
+  EXPECT_EQ(entries[0].counts[static_cast<size_t>(
+                SourceErrors::Reason::InvalidHeader)],
+            1u);
+  EXPECT_EQ(
+      entries[0].counts[static_cast<size_t>(SourceErrors::Reason::Truncated)],
+      2u);
+  EXPECT_EQ(entries[1].source, "fd00::1");
+  EXPECT_EQ(entries[1].total(), 1u);
+}
@@ -0,0 +1,62 @@
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "MsgCounter.h"
+#include "RfcTransport.h"
+#include "TestUtils.h"
+#include "UringServer.h"
+
+using DeviceListener::MsgCounter;
+using DeviceListener::RfcMessage;
+using DeviceListener::Testing::connectTo;
+using DeviceListener::Testing::makeFrame;
+using DeviceListener::Testing::makeFrames;
+using DeviceListener::Testing::waitFor;
+using DeviceListener::UringServer;
+
+class TestUringServer : public ::testing::Test {
+ public:
+  TestUringServer() {}
+  ~TestUringServer() {}
+};
+
+TEST_F(TestUringServer, CountsFramesFromSeveralConnections) {
+  if (!UringServer::isSupported()) GTEST_SKIP() << "no io_uring support";
+
+  MsgCounter counter;
+  UringServer server(0, counter.getShard(0));
+  server.listen();
+  std::thread thread(&UringServer::run, &server);
+
+  std::vector<int> fds;
+  for (uint16_t devId = 1; devId <= 10; devId++) {
+    int fd = connectTo(server.port());
+    ASSERT_GE(fd, 0);
+    fds.push_back(fd);
+    const auto frames = makeFrames(devId, 100);
+    // split in the middle of a frame to exercise the carry buffer
+    ASSERT_EQ(send(fd, frames.data(), 7, 0), 7);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ASSERT_EQ(send(fd, frames.data() + 7, frames.size() - 7, 0),
+              static_cast<ssize_t>(frames.size() - 7));
+  }
+  for (uint16_t devId = 1; devId <= 10; devId++)
+    EXPECT_TRUE(waitFor(
+        [&]() { return counter.getStatForDevice(devId).first == 100; }));
+
+  // an invalid header makes the server drop the connection
+  auto bad = makeFrame(1, 0, RfcMessage::kProtocolVersion + 1);
+  ASSERT_EQ(send(fds[0], bad.data(), bad.size(), 0),
+            static_cast<ssize_t>(bad.size()));
+  char byte;
+  EXPECT_EQ(recv(fds[0], &byte, 1, 0), 0);
+
+  server.stop();
+  thread.join();
+  for (int fd : fds) close(fd);
+  EXPECT_EQ(counter.getTotalCount(), 1000u);
+}